@@ -0,0 +1,1166 @@
+#include <asyncftp.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define ASYNC_BUFSIZE       65536   // Data channel chunk
+
+/* FEAT flags the async session cares about */
+#define ASYNC_FEAT_MLST     0x01
+#define ASYNC_FEAT_EPSV     0x02
+
+typedef std::function<void(int)> replyhandler;
+
+struct asyncop
+{
+    unsigned long long          id;
+    std::function<void(void)>   start;      // Runs once the op reaches the head of the queue
+    std::function<void(int)>    fail;       // Completes the op's result with an error
+    reactor::timerid            timer;
+    bool                        running;
+};
+
+/** The session state machine, only ever touched on the loop thread */
+struct asyncsession : public std::enable_shared_from_this<asyncsession>
+{
+    asyncsession(reactor& r);
+    ~asyncsession(void);
+
+    /// QUEUE ///
+    void    Submit(int timeout, std::function<void(void)> start, std::function<void(int)> fail,
+                   std::function<void(void)>& cancel);
+    void    Enqueue(const asyncop& op, int timeout);
+    void    Next(void);
+    void    Finish(void);
+    void    FailOp(int err);
+    void    Abandon(unsigned long long id, int err);
+    void    Shutdown(int err);
+
+    /// CONTROL CHANNEL ///
+    void    Reset(void);
+    void    Drop(int err);
+    bool    Exchange(const char* verb, const TSTR& arg, replyhandler h);
+    void    Again(void);
+    void    Flush(void);
+    void    CtrlEvent(unsigned events);
+    void    ParseReplies(void);
+
+    /// DATA CHANNEL ///
+    void    OpenData(std::function<void(void)> ready);
+    bool    ConnectData(int port);
+    void    DataEvent(unsigned events);
+    void    CloseData(void);
+
+    /// OPERATIONS ///
+    void    Connect(std::shared_ptr<async_state<int> > st, TSTR host, TSTR user, TSTR pwd, int port);
+    void    Login(std::shared_ptr<async_state<int> > st, TSTR user, TSTR pwd);
+    void    Disconnect(std::shared_ptr<async_state<int> > st);
+    void    Command(std::shared_ptr<async_state<int> > st, TSTR cmd);
+    void    Size(std::shared_ptr<async_state<long long> > st, TSTR path);
+    void    Download(std::shared_ptr<async_state<long long> > st, TSTR remote, TSTR local);
+    void    Upload(std::shared_ptr<async_state<long long> > st, TSTR local, TSTR remote);
+    void    List(std::shared_ptr<async_state<DirList> > st, TSTR dir);
+
+    reactor&                    loop;
+    int                         ctrl;
+    int                         data;
+    bool                        ctrlConnecting;
+    bool                        dataConnecting;
+    bool                        loggedIn;
+    unsigned                    feat;
+    bool                        noEpsv;
+    struct sockaddr_storage     peer;
+    socklen_t                   peerlen;
+    unsigned                    epoch;          // Bumped by every Reset
+
+    std::string                 rbuf;
+    size_t                      rpos;
+    std::string                 wbuf;
+    int                         code;           // Multi-line reply being assembled, 0 for none
+    std::string                 text;
+    replyhandler                onReply;
+    bool                        again;          // The running handler wants the next reply too
+
+    std::function<void(void)>       onDataReady;
+    std::function<void(unsigned)>   onData;
+    std::vector<char>               buf;
+
+    std::deque<asyncop>             ops;
+    bool                            advancing;
+    std::atomic<unsigned long long> nextId;
+    std::atomic<size_t>             pending;
+    std::atomic<bool>               connected;
+};
+
+asyncsession::asyncsession(reactor& r)
+    : loop(r)
+{
+    ctrl            = -1;
+    data            = -1;
+    ctrlConnecting  = false;
+    dataConnecting  = false;
+    loggedIn        = false;
+    feat            = 0;
+    noEpsv          = false;
+    peerlen         = 0;
+    epoch           = 0;
+    rpos            = 0;
+    code            = 0;
+    again           = false;
+    advancing       = false;
+    nextId          = 0;
+    pending         = 0;
+    connected       = false;
+}
+
+asyncsession::~asyncsession()
+{
+    // The reactor may be going down too, only the descriptors are ours to close
+    if(ctrl >= 0)
+        close(ctrl);
+    if(data >= 0)
+        close(data);
+}
+
+static int NonBlockingSocket(int family)
+{
+    int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd >= 0)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+
+/// QUEUE ///
+
+void asyncsession::Submit(int timeout,
+                          std::function<void(void)> start,
+                          std::function<void(int)> fail,
+                          std::function<void(void)>& cancel)
+{
+    asyncop op;
+    op.id       = ++nextId;
+    op.start    = start;
+    op.fail     = fail;
+    op.timer    = 0;
+    op.running  = false;
+    pending++;
+
+    std::weak_ptr<asyncsession> weak = shared_from_this();
+    reactor* r = &loop;
+    unsigned long long id = op.id;
+    cancel = [weak, r, id]()
+    {
+        r->Post([weak, id]()
+        {
+            std::shared_ptr<asyncsession> s = weak.lock();
+            if(s)
+                s->Abandon(id, ECANCELED);
+        });
+    };
+
+    std::shared_ptr<asyncsession> self = shared_from_this();
+    loop.Post([self, op, timeout]() { self->Enqueue(op, timeout); });
+}
+
+void asyncsession::Enqueue(const asyncop& op, int timeout)
+{
+    ops.push_back(op);
+    if(timeout >= 0)
+    {
+        std::weak_ptr<asyncsession> weak = shared_from_this();
+        unsigned long long id = op.id;
+        ops.back().timer = loop.After(timeout, [weak, id]()
+        {
+            std::shared_ptr<asyncsession> s = weak.lock();
+            if(s)
+                s->Abandon(id, ETIMEDOUT);
+        });
+    }
+    Next();
+}
+
+void asyncsession::Next()
+{
+    // An op that finishes inside start() lands back here, the loop picks up the next one
+    if(advancing)
+        return;
+    advancing = true;
+    while(!ops.empty() && !ops.front().running)
+    {
+        ops.front().running = true;
+        std::function<void(void)> start = ops.front().start;
+        start();
+    }
+    advancing = false;
+}
+
+void asyncsession::Finish()
+{
+    if(ops.empty())
+        return;
+    if(ops.front().timer)
+        loop.CancelTimer(ops.front().timer);
+    ops.pop_front();
+    pending--;
+    connected = loggedIn;
+    Next();
+}
+
+void asyncsession::FailOp(int err)
+{
+    if(ops.empty() || !ops.front().running)
+        return;
+    std::function<void(int)> fail = ops.front().fail;
+    fail(err);
+    Finish();
+}
+
+void asyncsession::Abandon(unsigned long long id, int err)
+{
+    for(std::deque<asyncop>::iterator it = ops.begin(); it != ops.end(); ++it)
+    {
+        if(it->id != id)
+            continue;
+
+        // On the wire: nothing tells its replies from the next op's, start over
+        if(it->running)
+        {
+            Drop(err);
+            return;
+        }
+
+        asyncop op = *it;
+        ops.erase(it);
+        pending--;
+        if(op.timer)
+            loop.CancelTimer(op.timer);
+        op.fail(err);
+        return;
+    }
+}
+
+void asyncsession::Shutdown(int err)
+{
+    Reset();
+    std::deque<asyncop> dead;
+    dead.swap(ops);
+    for(size_t i = 0; i < dead.size(); i++)
+    {
+        if(dead[i].timer)
+            loop.CancelTimer(dead[i].timer);
+        dead[i].fail(err);
+    }
+    pending = 0;
+}
+
+
+/// CONTROL CHANNEL ///
+
+void asyncsession::Reset()
+{
+    CloseData();
+    if(ctrl >= 0)
+    {
+        loop.Remove(ctrl);
+        close(ctrl);
+        ctrl = -1;
+    }
+    ctrlConnecting  = false;
+    loggedIn        = false;
+    connected       = false;
+    rbuf.clear();
+    rpos            = 0;
+    wbuf.clear();
+    code            = 0;
+    text.clear();
+    onReply         = replyhandler();
+    epoch++;
+}
+
+void asyncsession::Drop(int err)
+{
+    Reset();
+    FailOp(err ? err : EIO);
+}
+
+bool asyncsession::Exchange(const char* verb, const TSTR& arg, replyhandler h)
+{
+    if(ctrl < 0)
+    {
+        FailOp(ENOTCONN);
+        return false;
+    }
+    if(arg.find_first_of("\r\n") != TSTR::npos)
+    {
+        FailOp(EINVAL);
+        return false;
+    }
+
+    wbuf += verb;
+    if(!arg.empty())
+    {
+        wbuf += ' ';
+        wbuf += arg;
+    }
+    wbuf += "\r\n";
+    onReply = h;
+    Flush();
+    return true;
+}
+
+void asyncsession::Again()
+{
+    again = true;
+}
+
+void asyncsession::Flush()
+{
+    while(!wbuf.empty())
+    {
+        ssize_t n = send(ctrl, wbuf.data(), wbuf.size(), MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            Drop(errno);
+            return;
+        }
+        wbuf.erase(0, (size_t)n);
+    }
+    loop.Modify(ctrl, wbuf.empty() ? REACTOR_READ : REACTOR_READ | REACTOR_WRITE);
+}
+
+void asyncsession::CtrlEvent(unsigned events)
+{
+    if(ctrlConnecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(ctrl, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err)
+        {
+            Drop(err);
+            return;
+        }
+        ctrlConnecting = false;
+        loop.Modify(ctrl, REACTOR_READ);
+        return;
+    }
+
+    if(events & REACTOR_WRITE)
+    {
+        Flush();
+        if(ctrl < 0)
+            return;
+    }
+
+    if(events & (REACTOR_READ | REACTOR_ERROR | REACTOR_HANGUP))
+    {
+        char chunk[4096];
+        for(;;)
+        {
+            ssize_t n = recv(ctrl, chunk, sizeof(chunk), 0);
+            if(n > 0)
+            {
+                rbuf.append(chunk, (size_t)n);
+                continue;
+            }
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            // Whatever arrived before the close still counts, QUIT's 221 for one
+            int err = n == 0 ? ECONNRESET : errno;
+            unsigned at = epoch;
+            ParseReplies();
+            if(epoch == at)
+                Drop(err);
+            return;
+        }
+        ParseReplies();
+    }
+}
+
+void asyncsession::ParseReplies()
+{
+    unsigned at = epoch;
+
+    for(;;)
+    {
+        size_t nl = rbuf.find('\n', rpos);
+        if(nl == std::string::npos)
+            break;
+
+        size_t start = rpos, len = nl - rpos;
+        rpos = nl + 1;
+        if(len && rbuf[start + len - 1] == '\r')
+            len--;
+        const char* line = rbuf.c_str() + start;
+
+        int c = -1;
+        if(len >= 3 && line[0] >= '1' && line[0] <= '5' && isdigit((unsigned char)line[1])
+            && isdigit((unsigned char)line[2]))
+            c = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+
+        if(!code)
+        {
+            if(c < 0)
+            {
+                Drop(EPROTO);
+                return;
+            }
+            text.assign(line + (len > 3 ? 4 : len), len > 3 ? len - 4 : 0);
+            if(len > 3 && line[3] == '-')
+            {
+                code = c;
+                continue;
+            }
+        }
+        else
+        {
+            bool last = c == code && len > 3 && line[3] == ' ';
+            text += '\n';
+            if(c == code)
+                text.append(line + (len > 3 ? 4 : len), len > 3 ? len - 4 : 0);
+            else
+                text.append(line, len);
+            if(!last)
+                continue;
+        }
+
+        code = 0;
+        replyhandler h;
+        h.swap(onReply);
+        again = false;
+        if(h)
+            h(c);
+        else if(c == 421)
+        {
+            Drop(421);
+            return;
+        }
+        if(epoch != at)
+            return;
+        if(again && !onReply)
+            onReply.swap(h);
+        again = false;
+    }
+
+    rbuf.erase(0, rpos);
+    rpos = 0;
+}
+
+
+/// DATA CHANNEL ///
+
+void asyncsession::OpenData(std::function<void(void)> ready)
+{
+    onDataReady = ready;
+
+    // EPSV first, servers that don't know it get PASV from then on
+    replyhandler pasv = [this](int c)
+    {
+        if(c != 227)
+        {
+            FailOp(c);
+            return;
+        }
+        unsigned v[6];
+        const char* p = text.c_str();
+        while(*p && !isdigit((unsigned char)*p))
+            p++;
+        if(sscanf(p, "%u,%u,%u,%u,%u,%u", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) != 6)
+        {
+            FailOp(EPROTO);
+            return;
+        }
+        ConnectData((int)(v[4] * 256 + v[5]));
+    };
+
+    if(noEpsv)
+    {
+        Exchange("PASV", TSTR(), pasv);
+        return;
+    }
+
+    Exchange("EPSV", TSTR(), [this, pasv](int c)
+    {
+        if(c == 229)
+        {
+            const char* p = strchr(text.c_str(), '(');
+            char d;
+            unsigned port;
+            if(!p || sscanf(p + 1, "%c%*c%*c%u", &d, &port) != 2)
+            {
+                FailOp(EPROTO);
+                return;
+            }
+            ConnectData((int)port);
+            return;
+        }
+        if(c >= 500 && c != 522 && peer.ss_family == AF_INET)
+        {
+            noEpsv = true;
+            Exchange("PASV", TSTR(), pasv);
+            return;
+        }
+        FailOp(c);
+    });
+}
+
+bool asyncsession::ConnectData(int port)
+{
+    // The data connection always goes to the control peer, whatever address PASV named
+    struct sockaddr_storage addr;
+    memcpy(&addr, &peer, peerlen);
+    if(addr.ss_family == AF_INET)
+        ((struct sockaddr_in*)&addr)->sin_port = htons((unsigned short)port);
+    else
+        ((struct sockaddr_in6*)&addr)->sin6_port = htons((unsigned short)port);
+
+    data = NonBlockingSocket(addr.ss_family);
+    if(data < 0)
+    {
+        FailOp(errno);
+        return false;
+    }
+    if(connect(data, (struct sockaddr*)&addr, peerlen) < 0 && errno != EINPROGRESS)
+    {
+        int err = errno;
+        CloseData();
+        FailOp(err);
+        return false;
+    }
+
+    dataConnecting = true;
+    if(!loop.Add(data, REACTOR_WRITE, [this](unsigned events) { DataEvent(events); }))
+    {
+        CloseData();
+        FailOp(loop.GetLastError());
+        return false;
+    }
+    return true;
+}
+
+void asyncsession::DataEvent(unsigned events)
+{
+    if(dataConnecting)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(data, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err)
+        {
+            CloseData();
+            FailOp(err);
+            return;
+        }
+        dataConnecting = false;
+        loop.Modify(data, 0);
+
+        std::function<void(void)> ready;
+        ready.swap(onDataReady);
+        if(ready)
+            ready();
+        return;
+    }
+
+    if(onData)
+    {
+        // Hold a copy, the handler may close the data connection under itself
+        std::function<void(unsigned)> h = onData;
+        h(events);
+    }
+}
+
+void asyncsession::CloseData()
+{
+    if(data >= 0)
+    {
+        loop.Remove(data);
+        close(data);
+        data = -1;
+    }
+    dataConnecting  = false;
+    onDataReady     = std::function<void(void)>();
+    onData          = std::function<void(unsigned)>();
+}
+
+
+/// OPERATIONS ///
+
+void asyncsession::Connect(std::shared_ptr<async_state<int> > st, TSTR host, TSTR user, TSTR pwd, int port)
+{
+    Reset();
+    feat    = 0;
+    noEpsv  = false;
+
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family     = AF_UNSPEC;
+    hints.ai_socktype   = SOCK_STREAM;
+
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port ? port : 21);
+
+    int gai = getaddrinfo(host.c_str(), service, &hints, &res);
+    if(gai != 0 || !res)
+    {
+        FailOp(gai == EAI_SYSTEM ? errno : EHOSTUNREACH);
+        return;
+    }
+
+    memcpy(&peer, res->ai_addr, res->ai_addrlen);
+    peerlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    ctrl = NonBlockingSocket(peer.ss_family);
+    if(ctrl < 0)
+    {
+        FailOp(errno);
+        return;
+    }
+    if(connect(ctrl, (struct sockaddr*)&peer, peerlen) < 0 && errno != EINPROGRESS)
+    {
+        Drop(errno);
+        return;
+    }
+
+    ctrlConnecting = true;
+    if(!loop.Add(ctrl, REACTOR_WRITE, [this](unsigned events) { CtrlEvent(events); }))
+    {
+        Drop(loop.GetLastError());
+        return;
+    }
+
+    // 120 means wait for the 220
+    onReply = [this, st, user, pwd](int c)
+    {
+        if(c == 120)
+        {
+            Again();
+            return;
+        }
+        if(c != 220)
+        {
+            Drop(c);
+            return;
+        }
+        Login(st, user, pwd);
+    };
+}
+
+void asyncsession::Login(std::shared_ptr<async_state<int> > st, TSTR user, TSTR pwd)
+{
+    replyhandler type = [this, st](int login)
+    {
+        Exchange("TYPE", _T("I"), [this, st, login](int c)
+        {
+            if(c != 200)
+            {
+                Drop(c);
+                return;
+            }
+            loggedIn    = true;
+            connected   = true;
+            st->Complete(0, login);
+            Finish();
+        });
+    };
+
+    replyhandler features = [this, type](int login)
+    {
+        Exchange("FEAT", TSTR(), [this, type, login](int c)
+        {
+            if(c == 211)
+            {
+                for(size_t pos = 0; pos < text.size(); )
+                {
+                    size_t eol = text.find('\n', pos);
+                    if(eol == std::string::npos)
+                        eol = text.size();
+                    size_t s = text.find_first_not_of(' ', pos);
+                    if(s < eol && !strncasecmp(text.c_str() + s, "MLST", 4))
+                        feat |= ASYNC_FEAT_MLST;
+                    else if(s < eol && !strncasecmp(text.c_str() + s, "EPSV", 4))
+                        feat |= ASYNC_FEAT_EPSV;
+                    pos = eol + 1;
+                }
+            }
+            type(login);
+        });
+    };
+
+    Exchange("USER", user.empty() ? TSTR(_T("anonymous")) : user, [this, pwd, features](int c)
+    {
+        if(c == 331)
+        {
+            Exchange("PASS", pwd, [this, features](int c)
+            {
+                if(c != 230 && c != 202)
+                    Drop(c);
+                else
+                    features(c);
+            });
+            return;
+        }
+        if(c != 230 && c != 202)
+            Drop(c);
+        else
+            features(c);
+    });
+}
+
+void asyncsession::Disconnect(std::shared_ptr<async_state<int> > st)
+{
+    if(ctrl < 0)
+    {
+        FailOp(ENOTCONN);
+        return;
+    }
+    Exchange("QUIT", TSTR(), [this, st](int c)
+    {
+        Reset();
+        st->Complete(0, c);
+        Finish();
+    });
+}
+
+void asyncsession::Command(std::shared_ptr<async_state<int> > st, TSTR cmd)
+{
+    if(!loggedIn)
+    {
+        FailOp(ENOTCONN);
+        return;
+    }
+
+    Exchange(cmd.c_str(), TSTR(), [this, st](int c)
+    {
+        if(c < 200)
+        {
+            Again();
+            return;
+        }
+        st->Complete(c >= 400 ? c : 0, c);
+        Finish();
+    });
+}
+
+void asyncsession::Size(std::shared_ptr<async_state<long long> > st, TSTR path)
+{
+    if(!loggedIn)
+    {
+        FailOp(ENOTCONN);
+        return;
+    }
+    Exchange("SIZE", path, [this, st](int c)
+    {
+        if(c != 213)
+        {
+            FailOp(c);
+            return;
+        }
+        char* end;
+        long long size = strtoll(text.c_str(), &end, 10);
+        if(end == text.c_str() || size < 0)
+        {
+            FailOp(EPROTO);
+            return;
+        }
+        st->Complete(0, size);
+        Finish();
+    });
+}
+
+/** Progress of one transfer, shared by its data and reply handlers */
+struct asyncxfer
+{
+    int         fd;
+    long long   bytes;
+    bool        dataDone;
+    bool        replyDone;
+    size_t      head;           // Upload: unsent bytes are buf[head, tail)
+    size_t      tail;
+    std::string partial;        // List: an incomplete line
+    DirList     entries;
+    bool        mlsd;
+    long long   now;
+
+    asyncxfer() : fd(-1), bytes(0), dataDone(false), replyDone(false), head(0), tail(0),
+                  mlsd(false), now(0) {}
+    ~asyncxfer()
+    {
+        if(fd >= 0)
+            close(fd);
+    }
+};
+
+/* RETR/STOR/MLSD share the reply side: 1xx waits on, 2xx marks the
+   transfer's reply done and anything else fails the op */
+static replyhandler TransferReply(asyncsession* s, std::shared_ptr<asyncxfer> x,
+                                  unsigned events, std::function<void(void)> done)
+{
+    return [s, x, events, done](int c)
+    {
+        if(c >= 300)
+        {
+            s->CloseData();
+            s->FailOp(c);
+            return;
+        }
+        // The data connection is only serviced once the server has accepted the command
+        if(s->data >= 0 && !x->dataDone)
+            s->loop.Modify(s->data, events);
+        if(c < 200)
+        {
+            s->Again();
+            return;
+        }
+        x->replyDone = true;
+        if(x->dataDone)
+            done();
+    };
+}
+
+void asyncsession::Download(std::shared_ptr<async_state<long long> > st, TSTR remote, TSTR local)
+{
+    if(!loggedIn)
+    {
+        FailOp(ENOTCONN);
+        return;
+    }
+
+    std::shared_ptr<asyncxfer> x(new asyncxfer);
+    x->fd = open(local.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(x->fd < 0)
+    {
+        FailOp(errno);
+        return;
+    }
+
+    std::function<void(void)> done = [this, st, x]()
+    {
+        int err = close(x->fd) < 0 ? errno : 0;
+        x->fd = -1;
+        if(err)
+        {
+            FailOp(err);
+            return;
+        }
+        st->Complete(0, x->bytes);
+        Finish();
+    };
+
+    OpenData([this, x, remote, done]()
+    {
+        onData = [this, x, done](unsigned)
+        {
+            if(buf.size() < ASYNC_BUFSIZE)
+                buf.resize(ASYNC_BUFSIZE);
+            for(;;)
+            {
+                ssize_t n = recv(data, &buf[0], buf.size(), 0);
+                if(n > 0)
+                {
+                    for(ssize_t off = 0; off < n; )
+                    {
+                        ssize_t w = write(x->fd, &buf[off], (size_t)(n - off));
+                        if(w < 0 && errno == EINTR)
+                            continue;
+                        if(w < 0)
+                        {
+                            Drop(errno);
+                            return;
+                        }
+                        off += w;
+                    }
+                    x->bytes += n;
+                    continue;
+                }
+                if(n < 0 && errno == EINTR)
+                    continue;
+                if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    return;
+                if(n < 0)
+                {
+                    Drop(errno);
+                    return;
+                }
+                CloseData();
+                x->dataDone = true;
+                if(x->replyDone)
+                    done();
+                return;
+            }
+        };
+        Exchange("RETR", remote, TransferReply(this, x, REACTOR_READ, done));
+    });
+}
+
+void asyncsession::Upload(std::shared_ptr<async_state<long long> > st, TSTR local, TSTR remote)
+{
+    if(!loggedIn)
+    {
+        FailOp(ENOTCONN);
+        return;
+    }
+
+    std::shared_ptr<asyncxfer> x(new asyncxfer);
+    x->fd = open(local.c_str(), O_RDONLY | O_CLOEXEC);
+    if(x->fd < 0)
+    {
+        FailOp(errno);
+        return;
+    }
+
+    std::function<void(void)> done = [this, st, x]()
+    {
+        st->Complete(0, x->bytes);
+        Finish();
+    };
+
+    OpenData([this, x, remote, done]()
+    {
+        onData = [this, x, done](unsigned)
+        {
+            if(buf.size() < ASYNC_BUFSIZE)
+                buf.resize(ASYNC_BUFSIZE);
+            for(;;)
+            {
+                if(x->head == x->tail)
+                {
+                    ssize_t n = read(x->fd, &buf[0], buf.size());
+                    if(n < 0 && errno == EINTR)
+                        continue;
+                    if(n < 0)
+                    {
+                        Drop(errno);
+                        return;
+                    }
+                    if(n == 0)
+                    {
+                        // Closing the data connection is the end of file marker
+                        CloseData();
+                        x->dataDone = true;
+                        if(x->replyDone)
+                            done();
+                        return;
+                    }
+                    x->head = 0;
+                    x->tail = (size_t)n;
+                }
+
+                ssize_t n = send(data, &buf[x->head], x->tail - x->head, MSG_NOSIGNAL);
+                if(n < 0 && errno == EINTR)
+                    continue;
+                if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    return;
+                if(n < 0)
+                {
+                    Drop(errno);
+                    return;
+                }
+                x->head  += (size_t)n;
+                x->bytes += n;
+            }
+        };
+        Exchange("STOR", remote, TransferReply(this, x, REACTOR_WRITE, done));
+    });
+}
+
+void asyncsession::List(std::shared_ptr<async_state<DirList> > st, TSTR dir)
+{
+    if(!loggedIn)
+    {
+        FailOp(ENOTCONN);
+        return;
+    }
+
+    std::shared_ptr<asyncxfer> x(new asyncxfer);
+    x->mlsd = (feat & ASYNC_FEAT_MLST) != 0;
+    x->now  = (long long)time(NULL);
+
+    std::function<void(void)> done = [this, st, x]()
+    {
+        st->Complete(0, x->entries);
+        Finish();
+    };
+
+    OpenData([this, x, dir, done]()
+    {
+        onData = [this, x, done](unsigned)
+        {
+            if(buf.size() < ASYNC_BUFSIZE)
+                buf.resize(ASYNC_BUFSIZE);
+            for(;;)
+            {
+                ssize_t n = recv(data, &buf[0], buf.size(), 0);
+                if(n < 0 && errno == EINTR)
+                    continue;
+                if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    return;
+                if(n < 0)
+                {
+                    Drop(errno);
+                    return;
+                }
+                if(n > 0)
+                    x->partial.append(&buf[0], (size_t)n);
+                else if(!x->partial.empty() && x->partial[x->partial.size() - 1] != '\n')
+                    x->partial += '\n';
+
+                size_t pos = 0;
+                for(size_t nl; (nl = x->partial.find('\n', pos)) != std::string::npos; pos = nl + 1)
+                {
+                    size_t len = nl - pos;
+                    if(len && x->partial[pos + len - 1] == '\r')
+                        len--;
+                    DirEntry e;
+                    const char* line = x->partial.c_str() + pos;
+                    if(!(x->mlsd ? ParseMLSD(line, len, e) : ParseUnixList(line, len, e, x->now)))
+                        continue;
+                    if((e.namelen == 1 && e.name[0] == '.')
+                        || (e.namelen == 2 && e.name[0] == '.' && e.name[1] == '.'))
+                        continue;
+                    x->entries.Add(e);
+                }
+                x->partial.erase(0, pos);
+
+                if(n == 0)
+                {
+                    CloseData();
+                    x->dataDone = true;
+                    if(x->replyDone)
+                        done();
+                    return;
+                }
+            }
+        };
+        Exchange(x->mlsd ? "MLSD" : "LIST", dir, TransferReply(this, x, REACTOR_READ, done));
+    });
+}
+
+
+/// ASYNCFTP ///
+
+AsyncFTP::AsyncFTP(reactor& loop)
+    : m_session(new asyncsession(loop))
+{
+}
+
+AsyncFTP::~AsyncFTP()
+{
+    std::shared_ptr<asyncsession> s = m_session;
+    s->loop.Post([s]() { s->Shutdown(ECANCELED); });
+}
+
+template<typename T>
+static async_result<T> Start(std::shared_ptr<asyncsession> s,
+                             std::shared_ptr<async_state<T> > st,
+                             int timeout,
+                             std::function<void(void)> start)
+{
+    std::function<void(void)> cancel;
+    s->Submit(timeout, start, [st](int err) { st->Complete(err, T()); }, cancel);
+    {
+        std::lock_guard<std::mutex> g(st->lock);
+        st->cancel = cancel;
+    }
+    return async_result<T>(st);
+}
+
+async_result<int> AsyncFTP::async_connect(TSTR lpszServerName,
+                                          TSTR lpszUser,
+                                          TSTR lpszPassword,
+                                          int port,
+                                          int timeout)
+{
+    std::shared_ptr<async_state<int> > st(new async_state<int>);
+    asyncsession* s = m_session.get();
+    return Start<int>(m_session, st, timeout, [s, st, lpszServerName, lpszUser, lpszPassword, port]()
+    {
+        s->Connect(st, lpszServerName, lpszUser, lpszPassword, port);
+    });
+}
+
+async_result<int> AsyncFTP::async_disconnect(int timeout)
+{
+    std::shared_ptr<async_state<int> > st(new async_state<int>);
+    asyncsession* s = m_session.get();
+    return Start<int>(m_session, st, timeout, [s, st]() { s->Disconnect(st); });
+}
+
+async_result<int> AsyncFTP::async_command(TSTR lpszCommand, int timeout)
+{
+    std::shared_ptr<async_state<int> > st(new async_state<int>);
+    asyncsession* s = m_session.get();
+    return Start<int>(m_session, st, timeout, [s, st, lpszCommand]() { s->Command(st, lpszCommand); });
+}
+
+async_result<long long> AsyncFTP::async_size(TSTR lpszFileName, int timeout)
+{
+    std::shared_ptr<async_state<long long> > st(new async_state<long long>);
+    asyncsession* s = m_session.get();
+    return Start<long long>(m_session, st, timeout, [s, st, lpszFileName]() { s->Size(st, lpszFileName); });
+}
+
+async_result<long long> AsyncFTP::async_download(TSTR lpszLocation, TSTR lpszLocalName, int timeout)
+{
+    std::shared_ptr<async_state<long long> > st(new async_state<long long>);
+    asyncsession* s = m_session.get();
+    TSTR local = lpszLocalName.empty() ? lpszLocation : lpszLocalName;
+    return Start<long long>(m_session, st, timeout, [s, st, lpszLocation, local]()
+    {
+        s->Download(st, lpszLocation, local);
+    });
+}
+
+async_result<long long> AsyncFTP::async_upload(TSTR lpszLocation, TSTR lpszRemFile, int timeout)
+{
+    std::shared_ptr<async_state<long long> > st(new async_state<long long>);
+    asyncsession* s = m_session.get();
+    TSTR remote = lpszRemFile.empty() ? lpszLocation : lpszRemFile;
+    return Start<long long>(m_session, st, timeout, [s, st, lpszLocation, remote]()
+    {
+        s->Upload(st, lpszLocation, remote);
+    });
+}
+
+async_result<DirList> AsyncFTP::async_list(TSTR lpszDirectory, int timeout)
+{
+    std::shared_ptr<async_state<DirList> > st(new async_state<DirList>);
+    asyncsession* s = m_session.get();
+    return Start<DirList>(m_session, st, timeout, [s, st, lpszDirectory]() { s->List(st, lpszDirectory); });
+}
+
+bool AsyncFTP::IsConnected()
+{
+    return m_session->connected;
+}
+
+size_t AsyncFTP::Pending()
+{
+    return m_session->pending;
+}
@@ -0,0 +1,326 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Asynchronous FTP
+  *
+  * The blocking connstream methods cost one thread per session. AsyncFTP
+  * speaks the same protocol as PosixFTP as a non-blocking state machine
+  * on a reactor, so one loop thread can keep thousands of sessions busy.
+  *
+  * Every async_* call returns an async_result straight away. The result
+  * can be waited on, given a completion callback (run on the loop thread),
+  * cancelled, and with C++20 coroutines co_await'ed. Operations on one
+  * session run in the order they were issued. Each has a deadline, when it
+  * passes the operation fails with ETIMEDOUT.
+  *
+  * Cancelling or timing out an operation that is already on the wire
+  * closes the session, FTP has no way to tell which replies belong to
+  * an abandoned command. Later operations then fail with ENOTCONN until
+  * the next async_connect. Queued operations are simply dropped.
+  *
+  * async_* may be called from any thread. Completion callbacks and
+  * coroutine resumption run on the loop thread and must not Wait().
+  * The reactor must outlive its sessions.
+  *
+  * E.G. Usage:
+  *     reactor loop;
+  *     std::thread t([&]() { loop.Run(); });
+  *
+  *     AsyncFTP ftp(loop);
+  *     ftp.async_connect(_T("host"), _T("uid"), _T("pwd"));
+  *     ftp.async_download(_T("/pub/a.bin"), _T("a.bin"))
+  *        .Then([](int err, const long long& bytes) { ... });
+  *
+  *     // C++20
+  *     async_task fetch(AsyncFTP& ftp)
+  *     {
+  *         async_result<long long> r = co_await ftp.async_size(_T("/pub/a.bin"));
+  *         if(!r.GetLastError())
+  *             ... r.Get() ...
+  *     }
+  */
+
+#ifndef _ASYNCFTP_H_
+#define _ASYNCFTP_H_
+
+#if defined(_MSC_VER)
+#error asyncftp.h needs the epoll reactor, it is not supported by MSVC
+#endif
+
+#include <errno.h>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include "connstream.h"
+#include "dirlist.h"
+#include "reactor.h"
+
+#if defined(__cpp_impl_coroutine) && __cplusplus >= 202002L
+#define ASYNCFTP_COROUTINES
+#include <coroutine>
+#include <exception>
+#endif
+
+#define ASYNC_TIMEOUT       30000   // Default deadline per operation in milliseconds, -1 for none
+
+/** Completion state shared by an async_result and the operation behind it */
+template<typename T>
+struct async_state
+{
+    std::mutex                              lock;
+    std::condition_variable                 finished;
+    bool                                    done;
+    int                                     err;
+    T                                       value;
+    std::function<void(int, const T&)>      then;
+    std::function<void(void)>               cancel;
+#ifdef ASYNCFTP_COROUTINES
+    std::coroutine_handle<>                 waiter;
+#endif
+
+    async_state() : done(false), err(0), value() {}
+
+    /** Completes once, later calls are ignored. Runs the callback (or resumes
+     *  the awaiting coroutine) on the calling thread. */
+    void Complete(int error, const T& result)
+    {
+        std::function<void(int, const T&)> cb;
+#ifdef ASYNCFTP_COROUTINES
+        std::coroutine_handle<> h;
+#endif
+        {
+            std::lock_guard<std::mutex> g(lock);
+            if(done)
+                return;
+            done    = true;
+            err     = error;
+            value   = result;
+            cb.swap(then);
+            cancel  = std::function<void(void)>();
+#ifdef ASYNCFTP_COROUTINES
+            h       = waiter;
+            waiter  = nullptr;
+#endif
+        }
+        finished.notify_all();
+
+        if(cb)
+            cb(err, value);
+#ifdef ASYNCFTP_COROUTINES
+        if(h)
+            h.resume();
+#endif
+    }
+};
+
+template<typename T>
+class async_result
+{
+    public:
+        async_result(void) {}
+        explicit async_result(std::shared_ptr<async_state<T> > state) : m_state(state) {}
+
+        /** bool Done(void)
+         *  Returns : @true once the operation has succeeded or failed
+         */
+        bool Done(void) const
+        {
+            if(!m_state)
+                return true;
+            std::lock_guard<std::mutex> g(m_state->lock);
+            return m_state->done;
+        }
+
+        /** bool Wait(int)
+         *  Blocks up to @ms milliseconds (-1 forever) for completion, never
+         *  call it on the loop thread.
+         *  Returns : @true if the operation completed
+         */
+        bool Wait(int ms = -1) const
+        {
+            if(!m_state)
+                return true;
+            std::unique_lock<std::mutex> g(m_state->lock);
+            if(ms < 0)
+                m_state->finished.wait(g, [this]() { return m_state->done; });
+            else
+                m_state->finished.wait_for(g, std::chrono::milliseconds(ms),
+                                           [this]() { return m_state->done; });
+            return m_state->done;
+        }
+
+        /** T Get(void)
+         *  Waits, then returns the value. Check GetLastError() first, a failed
+         *  operation leaves it default constructed.
+         */
+        T Get(void) const
+        {
+            if(!m_state)
+                return T();
+            Wait();
+            return m_state->value;
+        }
+
+        /** int GetLastError(void)
+         *  Returns : 0 on success, the FTP reply code (400+) or errno value
+         *            that failed it, EINPROGRESS while still running
+         */
+        int GetLastError(void) const
+        {
+            if(!m_state)
+                return EINVAL;
+            std::lock_guard<std::mutex> g(m_state->lock);
+            return m_state->done ? m_state->err : EINPROGRESS;
+        }
+
+        /** async_result& Then(std::function<void(int, const T&)>)
+         *  Calls @cb with (GetLastError(), value) on completion, straight away
+         *  on this thread when already done. Replaces an earlier callback.
+         */
+        const async_result& Then(std::function<void(int, const T&)> cb) const
+        {
+            if(!m_state)
+                return *this;
+            {
+                std::lock_guard<std::mutex> g(m_state->lock);
+                if(!m_state->done)
+                {
+                    m_state->then = cb;
+                    return *this;
+                }
+            }
+            cb(m_state->err, m_state->value);
+            return *this;
+        }
+
+        /** void Cancel(void)
+         *  Fails the operation with ECANCELED if it hasn't completed, see the
+         *  module notes for what that does to the session.
+         */
+        void Cancel(void) const
+        {
+            if(!m_state)
+                return;
+            std::function<void(void)> c;
+            {
+                std::lock_guard<std::mutex> g(m_state->lock);
+                if(m_state->done)
+                    return;
+                c = m_state->cancel;
+            }
+            if(c)
+                c();
+        }
+
+#ifdef ASYNCFTP_COROUTINES
+        bool await_ready(void) const
+        {
+            return Done();
+        }
+        bool await_suspend(std::coroutine_handle<> h) const
+        {
+            std::lock_guard<std::mutex> g(m_state->lock);
+            if(m_state->done)
+                return false;
+            m_state->waiter = h;
+            return true;
+        }
+        async_result await_resume(void) const
+        {
+            return *this;
+        }
+#endif
+
+    private:
+        std::shared_ptr<async_state<T> > m_state;
+};
+
+#ifdef ASYNCFTP_COROUTINES
+/** Fire and forget coroutine type for code that co_awaits async_results,
+ *  it starts eagerly and frees itself when it returns */
+struct async_task
+{
+    struct promise_type
+    {
+        async_task get_return_object(void)          { return async_task(); }
+        std::suspend_never initial_suspend(void)    { return {}; }
+        std::suspend_never final_suspend(void) noexcept { return {}; }
+        void return_void(void)                      {}
+        void unhandled_exception(void)              { std::terminate(); }
+    };
+};
+#endif
+
+struct asyncsession;
+
+class AsyncFTP
+{
+    public:
+        /** AsyncFTP(reactor&)
+         *  The session lives on @loop, no socket is opened until async_connect.
+         */
+        AsyncFTP(reactor& loop);
+        /** Closes the session, operations still pending fail with ECANCELED */
+        virtual ~AsyncFTP(void);
+
+        /** async_result<int> async_connect(TSTR, TSTR, TSTR, int, int)
+         *  Connects and logs in, the value is the server's login reply code.
+         *  Host names are resolved on the loop thread with getaddrinfo(3),
+         *  give an IP address when the loop must never block.
+         */
+        /** async_result<int> async_disconnect(int)
+         *  Sends QUIT once the operations ahead of it finish, then closes.
+         */
+        async_result<int>   async_connect(TSTR lpszServerName,
+                                          TSTR lpszUser,
+                                          TSTR lpszPassword,
+                                          int port = 21,
+                                          int timeout = ASYNC_TIMEOUT);
+        async_result<int>   async_disconnect(int timeout = ASYNC_TIMEOUT);
+
+        /** async_result<int> async_command(TSTR, int)
+         *  Sends a raw command, the value is the reply code. Replies of 400 and
+         *  over also fail the operation with that code.
+         */
+        /** async_result<long long> async_size(TSTR, int)  - SIZE
+         */
+        async_result<int>       async_command(TSTR lpszCommand, int timeout = ASYNC_TIMEOUT);
+        async_result<long long> async_size(TSTR lpszFileName, int timeout = ASYNC_TIMEOUT);
+
+        /** async_result<long long> async_download(TSTR, TSTR, int)
+         *  RETR @lpszLocation into @lpszLocalName, the value is the byte count.
+         */
+        /** async_result<long long> async_upload(TSTR, TSTR, int)
+         *  STOR @lpszLocation as @lpszRemFile (blank for the same name).
+         */
+        /** async_result<DirList> async_list(TSTR, int)
+         *  MLSD, or LIST parsed as UNIX ls output when the server lacks MLST.
+         */
+        async_result<long long> async_download(TSTR lpszLocation,
+                                               TSTR lpszLocalName,
+                                               int timeout = ASYNC_TIMEOUT);
+        async_result<long long> async_upload(TSTR lpszLocation,
+                                             TSTR lpszRemFile = _T(""),
+                                             int timeout = ASYNC_TIMEOUT);
+        async_result<DirList>   async_list(TSTR lpszDirectory, int timeout = ASYNC_TIMEOUT);
+
+        /** bool IsConnected(void)
+         *  Logged in with nothing failed since, as of the last completed operation.
+         */
+        bool    IsConnected(void);
+        /** size_t Pending(void) - Operations queued or running */
+        size_t  Pending(void);
+
+    private:
+        AsyncFTP(const AsyncFTP&);
+        AsyncFTP& operator=(const AsyncFTP&);
+
+        std::shared_ptr<asyncsession>   m_session;
+};
+
+#endif // _ASYNCFTP_H_
@@ -0,0 +1,21 @@
+# Writes bench_commit.h with the commit the tree is at. The bench_commit
+# target runs this on every build, the header is only rewritten when the
+# commit changed so the bench rebuilds after a checkout and not otherwise.
+#   cmake -DSOURCE_DIR=<tree> -DOUTPUT=<header> -P commit.cmake
+execute_process(COMMAND git rev-parse --short HEAD
+                WORKING_DIRECTORY ${SOURCE_DIR}
+                OUTPUT_VARIABLE BENCH_COMMIT
+                OUTPUT_STRIP_TRAILING_WHITESPACE
+                ERROR_QUIET)
+if(NOT BENCH_COMMIT)
+    set(BENCH_COMMIT unknown)
+endif()
+
+set(TEXT "#define BENCH_COMMIT \"${BENCH_COMMIT}\"\n")
+set(OLD "")
+if(EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} OLD)
+endif()
+if(NOT "${OLD}" STREQUAL "${TEXT}")
+    file(WRITE ${OUTPUT} "${TEXT}")
+endif()
@@ -0,0 +1,1603 @@
+#include <posixftp.h>
+#include <asyncftp.h>
+#include <checksum.h>
+#include <compress.h>
+#include <contentcache.h>
+#include <ftpserver.h>
+#include <localfs.h>
+#include <memstream.h>
+#include <reactor.h>
+#include <scheduler.h>
+#include <staticconn.h>
+#include <tls.h>
+#include <uring.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(BENCH_COMMIT_HEADER)
+#include "bench_commit.h"       // Written at build time, see commit.cmake
+#endif
+#ifndef BENCH_COMMIT
+#define BENCH_COMMIT "unknown"
+#endif
+
+#define BENCH_KB            1024LL
+#define BENCH_MB            (1024LL * BENCH_KB)
+#define BENCH_GB            (1024LL * BENCH_MB)
+#define BENCH_BLOCK         (1 << 20)       // Fill and hashing granularity
+#define BENCH_BATCH         64              // dispatch: call pairs per timed op
+
+static const char* g_standard   = "tiny,large,tree,meta";
+static const char* g_extra      = "sessions,checksum,compress,delta,uring,paths,tls,sched,content,dispatch,zerocopy,resume";
+TLS_ONLY(static std::string g_tlsPem;)        // The server's certificate, for clients to trust
+
+
+/// ALLOCATIONS ///
+
+// Every operator new in the process, C mallocs (zlib's, the kernel's
+// buffers) aren't seen
+static std::atomic<unsigned long long> g_allocs(0);
+static std::atomic<unsigned long long> g_allocBytes(0);
+
+static void* Allocate(size_t n)
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    g_allocBytes.fetch_add(n, std::memory_order_relaxed);
+    return malloc(n ? n : 1);
+}
+
+// Kept out of line: with free() inlined into the deletes GCC pairs them
+// with the new expressions and warns (-Wmismatched-new-delete), though
+// every new here is Allocate's malloc
+__attribute__((noinline)) static void Release(void* p)
+{
+    free(p);
+}
+
+void* operator new(size_t n)
+{
+    void* p = Allocate(n);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t n)                                  { return operator new(n); }
+void* operator new(size_t n, const std::nothrow_t&) noexcept    { return Allocate(n); }
+void* operator new[](size_t n, const std::nothrow_t&) noexcept  { return Allocate(n); }
+void operator delete(void* p) noexcept                          { Release(p); }
+void operator delete[](void* p) noexcept                        { Release(p); }
+void operator delete(void* p, size_t) noexcept                  { Release(p); }
+void operator delete[](void* p, size_t) noexcept                { Release(p); }
+
+
+/// OPTIONS ///
+
+struct options
+{
+    std::vector<std::string>    backends;
+    std::vector<std::string>    scenarios;
+    long long   files;          // tiny
+    long long   tinySize;
+    long long   largeSize;      // large
+    int         depth;          // tree
+    int         fanout;
+    int         treeFiles;
+    long long   metaFiles;      // meta
+    long long   metaOps;
+    int         sessions;       // sessions
+    long long   bufferSize;     // checksum, compress
+    long long   deltaSize;      // delta, uring
+    std::vector<int>    deltaChanges;   // Percent of blocks changed, a run each
+    long long   schedRate;      // sched
+    int         latency;        // Server shaping
+    long long   bandwidth;
+    std::map<std::string, int>  delays;
+    std::string out;
+    std::string label;
+    std::string dir;
+    bool        keep;
+};
+
+static std::vector<std::string> Split(const std::string& text)
+{
+    std::vector<std::string> parts;
+    size_t from = 0;
+    while(from <= text.size())
+    {
+        size_t comma = text.find(',', from);
+        if(comma == std::string::npos)
+            comma = text.size();
+        if(comma > from)
+            parts.push_back(text.substr(from, comma - from));
+        from = comma + 1;
+    }
+    return parts;
+}
+
+// "4G", "512K", "1500"
+static long long Bytes(const char* text)
+{
+    char* end = NULL;
+    double v = strtod(text, &end);
+    switch(end ? *end : 0)
+    {
+        case 'k': case 'K': v *= BENCH_KB; break;
+        case 'm': case 'M': v *= BENCH_MB; break;
+        case 'g': case 'G': v *= BENCH_GB; break;
+    }
+    return (long long)v;
+}
+
+static void Usage(void)
+{
+    fprintf(stderr,
+        "usage: connstream_bench [options]\n"
+        "  --backend LIST      ftp,localfs,memory or all (ftp)\n"
+        "  --scenario LIST     %s,\n"
+        "                      %s or all (the first four)\n"
+        "  --files N           tiny: files moved each way (10000)\n"
+        "  --tiny-size BYTES   tiny: size of each (1K)\n"
+        "  --large-size BYTES  large: the single file (4G, held in RAM by memory)\n"
+        "  --depth N           tree: directory levels (5)\n"
+        "  --fanout N          tree: subdirectories per directory (4)\n"
+        "  --tree-files N      tree: files per directory (8)\n"
+        "  --meta-files N      meta, dispatch: files the storm runs over (1000)\n"
+        "  --meta-ops N        meta, paths: Exists and GetFileSize calls each (50000),\n"
+        "                      dispatch: timed batches of 64 call pairs\n"
+        "  --sessions N        sessions: concurrent AsyncFTP sessions on one reactor (1000)\n"
+        "  --buffer-size BYTES checksum, compress: data hashed/compressed (256M),\n"
+        "                      checksum: hashed once each in 4K, 64K and 1M Update calls\n"
+        "  --delta-size BYTES  delta, uring, tls, sched, content, zerocopy,\n"
+        "                      resume: file size (1G)\n"
+        "  --delta-change LIST delta: percents of blocks changed between versions,\n"
+        "                      a run each (0,1,10,50)\n"
+        "  --sched-rate BYTES  sched: the scheduler's cap, per second (100M)\n"
+        "  --latency MS        server: round trip added to each command and data connection\n"
+        "  --bandwidth BYTES   server: cap per data connection, per second\n"
+        "  --reply-delay V=MS  server: extra delay before verb V is answered, repeatable\n"
+        "  --out FILE          JSON report, stdout when not given\n"
+        "  --label TEXT        free text stored in the report\n"
+        "  --dir PATH          scratch space (/tmp)\n"
+        "  --keep              leave the scratch files behind\n",
+        g_standard, g_extra);
+}
+
+static bool Parse(int argc, char** argv, options& o)
+{
+    o.backends      = Split("ftp");
+    o.scenarios     = Split(g_standard);
+    o.files         = 10000;
+    o.tinySize      = BENCH_KB;
+    o.largeSize     = 4 * BENCH_GB;
+    o.depth         = 5;
+    o.fanout        = 4;
+    o.treeFiles     = 8;
+    o.metaFiles     = 1000;
+    o.metaOps       = 50000;
+    o.sessions      = 1000;
+    o.bufferSize    = 256 * BENCH_MB;
+    o.deltaSize     = BENCH_GB;
+    o.deltaChanges  = { 0, 1, 10, 50 };
+    o.schedRate     = 100 * BENCH_MB;
+    o.latency       = 0;
+    o.bandwidth     = 0;
+    o.dir           = "/tmp";
+    o.keep          = false;
+
+    for(int i = 1; i < argc; i++)
+    {
+        std::string a = argv[i];
+        if(a == "--keep")
+        {
+            o.keep = true;
+            continue;
+        }
+        if(a == "-h" || a == "--help" || i + 1 >= argc)
+            return false;
+
+        const char* v = argv[++i];
+        if(a == "--backend")
+            o.backends = Split(!strcmp(v, "all") ? "ftp,localfs,memory" : v);
+        else if(a == "--scenario")
+            o.scenarios = Split(!strcmp(v, "all") ? std::string(g_standard) + "," + g_extra : v);
+        else if(a == "--files")         o.files         = atoll(v);
+        else if(a == "--tiny-size")     o.tinySize      = Bytes(v);
+        else if(a == "--large-size")    o.largeSize     = Bytes(v);
+        else if(a == "--depth")         o.depth         = atoi(v);
+        else if(a == "--fanout")        o.fanout        = atoi(v);
+        else if(a == "--tree-files")    o.treeFiles     = atoi(v);
+        else if(a == "--meta-files")    o.metaFiles     = atoll(v);
+        else if(a == "--meta-ops")      o.metaOps       = atoll(v);
+        else if(a == "--sessions")      o.sessions      = atoi(v);
+        else if(a == "--buffer-size")   o.bufferSize    = Bytes(v);
+        else if(a == "--delta-size")    o.deltaSize     = Bytes(v);
+        else if(a == "--sched-rate")    o.schedRate     = Bytes(v);
+        else if(a == "--latency")       o.latency       = atoi(v);
+        else if(a == "--bandwidth")     o.bandwidth     = Bytes(v);
+        else if(a == "--out")           o.out           = v;
+        else if(a == "--label")         o.label         = v;
+        else if(a == "--dir")           o.dir           = v;
+        else if(a == "--delta-change")
+        {
+            std::vector<std::string> pcts = Split(v);
+            o.deltaChanges.clear();
+            for(size_t p = 0; p < pcts.size(); p++)
+            {
+                int pct = atoi(pcts[p].c_str());
+                if(pct < 0 || pct > 100)
+                    return false;
+                o.deltaChanges.push_back(pct);
+            }
+        }
+        else if(a == "--reply-delay")
+        {
+            const char* eq = strchr(v, '=');
+            if(!eq)
+                return false;
+            std::string verb(v, eq);
+            for(size_t c = 0; c < verb.size(); c++)
+                verb[c] = (char)toupper((unsigned char)verb[c]);
+            o.delays[verb] = atoi(eq + 1);
+        }
+        else
+            return false;
+    }
+
+    return o.files > 0 && o.tinySize >= 0 && o.largeSize > 0 && o.depth >= 0 && o.fanout > 0
+        && o.metaFiles > 0 && o.sessions > 0 && o.bufferSize > 0 && o.deltaSize > 0
+        && !o.deltaChanges.empty() && o.schedRate > 0;
+}
+
+
+/// MEASUREMENT ///
+
+struct measure
+{
+    std::string scenario;
+    std::string backend;
+    long long   ops;
+    long long   bytes;
+    long long   errors;
+    double      seconds;
+    double      cpu;
+    unsigned long long  allocs;
+    unsigned long long  allocBytes;
+    std::vector<double> latency;        // Seconds, one per op
+    std::map<std::string, double> extra;
+
+    measure(const std::string& s, const std::string& b)
+        : scenario(s), backend(b), ops(0), bytes(0), errors(0), seconds(0), cpu(0), allocs(0), allocBytes(0) {}
+};
+
+static double Now(void)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// User and system time of every thread in this process, the server runs in its own
+static double Cpu(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (double)ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+         + (double)ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/** Brackets the measured part of a scenario */
+class sampler
+{
+    public:
+        sampler(measure& m) : m_m(m)
+        {
+            m_allocs    = g_allocs.load();
+            m_bytes     = g_allocBytes.load();
+            m_cpu       = Cpu();
+            m_start     = Now();
+        }
+        ~sampler(void)
+        {
+            m_m.seconds     += Now() - m_start;
+            m_m.cpu         += Cpu() - m_cpu;
+            m_m.allocs      += g_allocs.load() - m_allocs;
+            m_m.allocBytes  += g_allocBytes.load() - m_bytes;
+        }
+
+    private:
+        measure&            m_m;
+        double              m_start;
+        double              m_cpu;
+        unsigned long long  m_allocs;
+        unsigned long long  m_bytes;
+};
+
+// Runs one op, keeping its latency and whether it failed
+template<class F>
+static void Op(measure& m, long long bytes, F op)
+{
+    double t = Now();
+    bool ok = op();
+    m.latency.push_back(Now() - t);
+    m.ops++;
+    if(ok)
+        m.bytes += bytes;
+    else
+        m.errors++;
+}
+
+static double Percentile(std::vector<double>& sorted, double q)
+{
+    if(sorted.empty())
+        return 0;
+    size_t i = (size_t)(q * (double)(sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+
+/// REPORT ///
+
+static std::string Quote(const std::string& text)
+{
+    std::string out = "\"";
+    for(size_t i = 0; i < text.size(); i++)
+    {
+        unsigned char c = (unsigned char)text[i];
+        if(c == '"' || c == '\\')
+            out += '\\';
+        if(c < 0x20)
+        {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+            continue;
+        }
+        out += (char)c;
+    }
+    return out + "\"";
+}
+
+static std::string Number(double v)
+{
+    // Counts and sizes print whole, %g would round a 4G file
+    char buf[64];
+    if(v == (double)(long long)v && v < 1e18 && v > -1e18)
+        snprintf(buf, sizeof(buf), "%lld", (long long)v);
+    else
+        snprintf(buf, sizeof(buf), "%.9g", v);
+    return buf;
+}
+
+static std::string Json(measure& m)
+{
+    std::sort(m.latency.begin(), m.latency.end());
+    double per = m.ops ? 1.0 / (double)m.ops : 0;
+
+    std::string j = "    {";
+    j += "\"scenario\": " + Quote(m.scenario);
+    j += ", \"backend\": " + Quote(m.backend);
+    j += ", \"ops\": " + Number((double)m.ops);
+    j += ", \"errors\": " + Number((double)m.errors);
+    j += ", \"bytes\": " + Number((double)m.bytes);
+    j += ", \"seconds\": " + Number(m.seconds);
+    j += ", \"ops_per_sec\": " + Number(m.seconds > 0 ? (double)m.ops / m.seconds : 0);
+    j += ", \"bytes_per_sec\": " + Number(m.seconds > 0 ? (double)m.bytes / m.seconds : 0);
+    j += ", \"p50_us\": " + Number(Percentile(m.latency, 0.50) * 1e6);
+    j += ", \"p99_us\": " + Number(Percentile(m.latency, 0.99) * 1e6);
+    j += ", \"max_us\": " + Number(m.latency.empty() ? 0 : m.latency.back() * 1e6);
+    j += ", \"cpu_seconds\": " + Number(m.cpu);
+    j += ", \"cpu_us_per_op\": " + Number(m.cpu * per * 1e6);
+    if(m.bytes > 0)
+        j += ", \"cpu_seconds_per_gb\": " + Number(m.cpu * (double)BENCH_GB / (double)m.bytes);
+    j += ", \"allocs_per_op\": " + Number((double)m.allocs * per);
+    j += ", \"alloc_bytes_per_op\": " + Number((double)m.allocBytes * per);
+    for(std::map<std::string, double>::const_iterator it = m.extra.begin(); it != m.extra.end(); ++it)
+        j += ", " + Quote(it->first) + ": " + Number(it->second);
+    return j + "}";
+}
+
+static std::string Report(const options& o, std::vector<measure>& results)
+{
+    char stamp[32];
+    time_t t = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+
+    std::string j = "{\n";
+    j += "  \"commit\": " + Quote(BENCH_COMMIT) + ",\n";
+    j += "  \"label\": " + Quote(o.label) + ",\n";
+    j += "  \"timestamp\": " + Quote(stamp) + ",\n";
+    j += "  \"cpus\": " + Number((double)std::thread::hardware_concurrency()) + ",\n";
+    j += "  \"config\": {";
+    j += "\"files\": " + Number((double)o.files);
+    j += ", \"tiny_size\": " + Number((double)o.tinySize);
+    j += ", \"large_size\": " + Number((double)o.largeSize);
+    j += ", \"depth\": " + Number(o.depth);
+    j += ", \"fanout\": " + Number(o.fanout);
+    j += ", \"tree_files\": " + Number(o.treeFiles);
+    j += ", \"meta_files\": " + Number((double)o.metaFiles);
+    j += ", \"meta_ops\": " + Number((double)o.metaOps);
+    j += ", \"sessions\": " + Number(o.sessions);
+    j += ", \"buffer_size\": " + Number((double)o.bufferSize);
+    j += ", \"delta_size\": " + Number((double)o.deltaSize);
+    j += ", \"delta_change\": [";
+    for(size_t i = 0; i < o.deltaChanges.size(); i++)
+        j += (i ? ", " : "") + Number(o.deltaChanges[i]);
+    j += "]";
+    j += ", \"sched_rate\": " + Number((double)o.schedRate);
+    j += ", \"latency_ms\": " + Number(o.latency);
+    j += ", \"bandwidth\": " + Number((double)o.bandwidth);
+    j += ", \"reply_delays_ms\": {";
+    for(std::map<std::string, int>::const_iterator it = o.delays.begin(); it != o.delays.end(); ++it)
+        j += (it == o.delays.begin() ? "" : ", ") + Quote(it->first) + ": " + Number(it->second);
+    j += "}},\n";
+    j += "  \"results\": [\n";
+    for(size_t i = 0; i < results.size(); i++)
+        j += Json(results[i]) + (i + 1 < results.size() ? ",\n" : "\n");
+    return j + "  ]\n}\n";
+}
+
+
+/// FILES ///
+
+static bool MakeDirs(const std::string& path)
+{
+    for(size_t i = 1; i <= path.size(); i++)
+    {
+        if(i < path.size() && path[i] != '/')
+            continue;
+        if(mkdir(path.substr(0, i).c_str(), 0755) < 0 && errno != EEXIST)
+            return false;
+    }
+    return true;
+}
+
+static int Unlink(const char* path, const struct stat*, int, struct FTW*)
+{
+    return remove(path) < 0 ? -1 : 0;
+}
+
+// @size bytes of @pattern, repeated
+static bool WriteFile(const std::string& path, long long size, const std::string& pattern)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return false;
+    bool ok = true;
+    while(ok && size > 0)
+    {
+        size_t n = (size_t)std::min<long long>(size, (long long)pattern.size());
+        ok = write(fd, pattern.data(), n) == (ssize_t)n;
+        size -= (long long)n;
+    }
+    return close(fd) == 0 && ok;
+}
+
+// Whether @a and @b hold the same bytes
+static bool Same(const std::string& a, const std::string& b)
+{
+    FILE* fa = fopen(a.c_str(), "rb");
+    FILE* fb = fopen(b.c_str(), "rb");
+    bool same = fa && fb;
+    std::string ba(BENCH_BLOCK, '\0'), bb(BENCH_BLOCK, '\0');
+    while(same)
+    {
+        size_t na = fread(&ba[0], 1, ba.size(), fa);
+        size_t nb = fread(&bb[0], 1, bb.size(), fb);
+        same = na == nb && !memcmp(ba.data(), bb.data(), na);
+        if(na < ba.size())
+            break;
+    }
+    if(fa)
+        fclose(fa);
+    if(fb)
+        fclose(fb);
+    return same;
+}
+
+static std::string Random(size_t len, unsigned seed)
+{
+    std::mt19937_64 rng(seed);
+    std::string s(len, '\0');
+    for(size_t i = 0; i + 8 <= len; i += 8)
+    {
+        unsigned long long v = rng();
+        memcpy(&s[i], &v, 8);
+    }
+    return s;
+}
+
+// Words from a small vocabulary, compresses about the way logs and text do
+static std::string Text(size_t len, unsigned seed)
+{
+    static const char* words[] = { "connect ", "stream ", "upload ", "download ", "directory ",
+                                   "file ", "transfer ", "session ", "reply ", "226 ", "150 ",
+                                   "\n", "error ", "bytes ", "0x1f ", "ok " };
+    std::mt19937 rng(seed);
+    std::string s;
+    s.reserve(len + 16);
+    while(s.size() < len)
+        s += words[rng() % (sizeof(words) / sizeof(words[0]))];
+    s.resize(len);
+    return s;
+}
+
+static std::string Name(const char* prefix, long long i)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s%06lld", prefix, i);
+    return buf;
+}
+
+
+/// BACKENDS ///
+
+struct backend
+{
+    std::string                 name;
+    std::string                 disk;       // Where its "/" is on disk, empty for memory
+    std::unique_ptr<connstream> conn;
+    PosixFTP*                   ftp;        // When it is one
+};
+
+// Puts a file straight where the backend keeps it, setup isn't measured
+static bool Seed(backend& b, const std::string& path, long long size, const std::string& pattern)
+{
+    if(!b.disk.empty())
+        return WriteFile(b.disk + path, size, pattern);
+
+    datastream s = b.conn->OpenWrite(path, false);
+    while(s.IsOpen() && size > 0)
+    {
+        size_t n = (size_t)std::min<long long>(size, (long long)pattern.size());
+        if(s.Write(pattern.data(), n) != (long long)n)
+            return false;
+        size -= (long long)n;
+    }
+    return s.IsOpen() && s.Close();
+}
+
+static bool SeedDir(backend& b, const std::string& path)
+{
+    if(!b.disk.empty())
+        return MakeDirs(b.disk + path);
+    return b.conn->MakeDir(path) || b.conn->Exists(path);
+}
+
+static bool Connect(backend& b, const std::string& scratch, int port)
+{
+    if(b.name == "ftp")
+    {
+        b.ftp   = new PosixFTP();
+        b.disk  = scratch + "/ftp";
+        b.conn.reset(b.ftp);
+        return b.ftp->Connect("127.0.0.1", "bench", "bench", port);
+    }
+
+    b.ftp = NULL;
+    if(b.name == "localfs")
+    {
+        b.disk = scratch + "/localfs";
+        b.conn.reset(new LocalFS());
+        return MakeDirs(b.disk) && b.conn->Connect(b.disk);
+    }
+    if(b.name == "memory")
+    {
+        b.conn.reset(new InMemoryStream());
+        return b.conn->Connect("connstream_bench");
+    }
+    return false;
+}
+
+
+/// SCENARIOS ///
+
+struct context
+{
+    const options&      o;
+    std::string         local;      // Client side files
+    int                 port;
+    std::vector<measure>& results;
+};
+
+static void Progress(const measure& m)
+{
+    fprintf(stderr, "  %-24s %-10s %8lld ops %6lld errors %10.3fs\n",
+            m.scenario.c_str(), m.backend.c_str(), m.ops, m.errors, m.seconds);
+}
+
+static void Keep(context& c, measure& m)
+{
+    Progress(m);
+    c.results.push_back(m);
+}
+
+// 10k tiny files up then back down, per file latency
+static void Tiny(context& c, backend& b)
+{
+    std::string src = c.local + "/tiny", dst = c.local + "/tiny." + b.name;
+    std::string body = Text((size_t)c.o.tinySize, 1);
+    MakeDirs(src);
+    MakeDirs(dst);
+    for(long long i = 0; i < c.o.files; i++)
+    {
+        std::string f = src + "/" + Name("f", i);
+        if(access(f.c_str(), F_OK) < 0)
+            WriteFile(f, c.o.tinySize, body);
+    }
+    SeedDir(b, "/tiny");
+
+    measure up("tiny.upload", b.name), down("tiny.download", b.name);
+    {
+        sampler s(up);
+        for(long long i = 0; i < c.o.files; i++)
+            Op(up, c.o.tinySize, [&]() { return b.conn->Upload(src + "/" + Name("f", i), "/tiny/" + Name("f", i)); });
+    }
+    Keep(c, up);
+    {
+        sampler s(down);
+        for(long long i = 0; i < c.o.files; i++)
+            Op(down, c.o.tinySize, [&]() { return b.conn->Download("/tiny/" + Name("f", i), dst + "/" + Name("f", i)); });
+    }
+    Keep(c, down);
+}
+
+// One big file each way
+static void Large(context& c, backend& b)
+{
+    std::string src = c.local + "/large.bin", dst = c.local + "/large." + b.name;
+    struct stat st;
+    if(stat(src.c_str(), &st) < 0 || st.st_size != c.o.largeSize)
+        WriteFile(src, c.o.largeSize, Random(BENCH_BLOCK, 2));
+
+    measure up("large.upload", b.name), down("large.download", b.name);
+    {
+        sampler s(up);
+        Op(up, c.o.largeSize, [&]() { return b.conn->Upload(src, "/large.bin"); });
+    }
+    Keep(c, up);
+    {
+        sampler s(down);
+        Op(down, c.o.largeSize, [&]() { return b.conn->Download("/large.bin", dst); });
+    }
+    Keep(c, down);
+
+    // Neither copy is needed again, don't leave gigabytes about
+    unlink(dst.c_str());
+    b.conn->Remove("/large.bin");
+}
+
+static void SeedTree(backend& b, const std::string& dir, int depth, const options& o)
+{
+    SeedDir(b, dir);
+    for(int i = 0; i < o.treeFiles; i++)
+        Seed(b, dir + "/" + Name("f", i), 0, std::string());
+    if(depth > 0)
+        for(int i = 0; i < o.fanout; i++)
+            SeedTree(b, dir + "/" + Name("d", i), depth - 1, o);
+}
+
+static void Walk(measure& m, backend& b, const std::string& dir)
+{
+    LIST names;
+    Op(m, 0, [&]() { names = b.conn->SearchDir(dir + "/*"); return !names.empty(); });
+    m.extra["entries"] += (double)names.size();
+    for(size_t i = 0; i < names.size(); i++)
+        if(names[i][0] == 'd')
+            Walk(m, b, dir + "/" + names[i]);
+}
+
+// SearchDir down every directory of a deep tree
+static void Tree(context& c, backend& b)
+{
+    SeedTree(b, "/tree", c.o.depth, c.o);
+
+    measure m("tree.searchdir", b.name);
+    m.extra["entries"] = 0;
+    {
+        sampler s(m);
+        Walk(m, b, "/tree");
+    }
+    Keep(c, m);
+}
+
+// Exists and GetFileSize, round and round a directory of files
+static void Meta(context& c, backend& b)
+{
+    std::string body = Text((size_t)c.o.tinySize, 3);
+    SeedDir(b, "/meta");
+    for(long long i = 0; i < c.o.metaFiles; i++)
+        Seed(b, "/meta/" + Name("f", i), c.o.tinySize, body);
+
+    measure exists("meta.exists", b.name), size("meta.getfilesize", b.name);
+    {
+        sampler s(exists);
+        for(long long i = 0; i < c.o.metaOps; i++)
+            Op(exists, 0, [&]() { return b.conn->Exists("/meta/" + Name("f", i % c.o.metaFiles)); });
+    }
+    Keep(c, exists);
+    {
+        sampler s(size);
+        for(long long i = 0; i < c.o.metaOps; i++)
+            Op(size, 0, [&]() { return b.conn->GetFileSize("/meta/" + Name("f", i % c.o.metaFiles)) == c.o.tinySize; });
+    }
+    Keep(c, size);
+}
+
+// The TSTRVIEW calls on relative names from a warm session, names built
+// up front so the allocations counted are the backend's own
+static void Paths(context& c, backend& b)
+{
+    std::string body = Text((size_t)c.o.tinySize, 4);
+    SeedDir(b, "/paths");
+    std::vector<std::string> names;
+    for(long long i = 0; i < c.o.metaFiles; i++)
+    {
+        names.push_back(Name("f", i));
+        Seed(b, "/paths/" + names.back(), c.o.tinySize, body);
+    }
+    if(!b.conn->ChangeDirView("/paths"))
+        return;
+    for(size_t i = 0; i < names.size(); i++)
+    {
+        b.conn->ExistsView(names[i]);
+        b.conn->GetFileSizeView(names[i]);
+    }
+
+    measure exists("paths.exists", b.name), size("paths.getfilesize", b.name), cwd("paths.currentdir", b.name);
+    exists.latency.reserve((size_t)c.o.metaOps);
+    size.latency.reserve((size_t)c.o.metaOps);
+    cwd.latency.reserve((size_t)c.o.metaOps);
+    {
+        sampler s(exists);
+        for(long long i = 0; i < c.o.metaOps; i++)
+            Op(exists, 0, [&]() { return b.conn->ExistsView(names[(size_t)(i % c.o.metaFiles)]); });
+    }
+    Keep(c, exists);
+    {
+        sampler s(size);
+        for(long long i = 0; i < c.o.metaOps; i++)
+            Op(size, 0, [&]() { return b.conn->GetFileSizeView(names[(size_t)(i % c.o.metaFiles)]) == c.o.tinySize; });
+    }
+    Keep(c, size);
+    {
+        sampler s(cwd);
+        for(long long i = 0; i < c.o.metaOps; i++)
+            Op(cwd, 0, [&]() { return b.conn->CurrentDirView().size() == 6; });
+    }
+    Keep(c, cwd);
+    b.conn->ChangeDirView("/");
+}
+
+// Issues @issue on every session at once, each op's latency runs from
+// there to its completion on the loop thread
+template<class T, class F>
+static void Burst(measure& m, size_t count, F issue)
+{
+    std::vector<double> done(count, 0);
+    std::atomic<size_t> left(count);
+    std::vector<async_result<T> > r;
+
+    sampler s(m);
+    double start = Now();
+    for(size_t i = 0; i < count; i++)
+    {
+        double* at = &done[i];
+        r.push_back(issue(i));
+        r.back().Then([at, &left](int, const T&) { *at = Now(); left.fetch_sub(1); });
+    }
+    while(left.load() > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+
+    for(size_t i = 0; i < count; i++)
+    {
+        m.ops++;
+        m.errors += r[i].GetLastError() != 0;
+        m.latency.push_back(done[i] - start);
+    }
+}
+
+// Thousands of AsyncFTP sessions on one reactor thread
+static void Sessions(context& c, backend& b)
+{
+    if(!b.ftp)
+        return;
+    Seed(b, "/sessions.bin", c.o.tinySize, Text((size_t)c.o.tinySize, 4));
+
+    reactor loop;
+    std::thread t([&]() { loop.Run(); });
+    {
+        std::vector<std::unique_ptr<AsyncFTP> > ftp;
+        for(int i = 0; i < c.o.sessions; i++)
+            ftp.push_back(std::unique_ptr<AsyncFTP>(new AsyncFTP(loop)));
+
+        measure conn("sessions.connect", b.name), size("sessions.size", b.name);
+        Burst<int>(conn, ftp.size(), [&](size_t i) { return ftp[i]->async_connect("127.0.0.1", "bench", "bench", c.port); });
+        Keep(c, conn);
+        Burst<long long>(size, ftp.size(), [&](size_t i) { return ftp[i]->async_size("/sessions.bin"); });
+        Keep(c, size);
+
+        std::vector<async_result<int> > bye;
+        for(size_t i = 0; i < ftp.size(); i++)
+            bye.push_back(ftp[i]->async_disconnect());
+        for(size_t i = 0; i < bye.size(); i++)
+            bye[i].Wait();
+    }
+    loop.Stop();
+    t.join();
+}
+
+// Every algorithm on its accelerated kernel and on the portable one, fed
+// in 4K, 64K and 1M Update calls. An op is a 1M block whatever the call
+// size, so the timing around it weighs the same in each.
+static void Checksums(context& c)
+{
+    std::string data = Random(BENCH_BLOCK, 5);
+    long long blocks = std::max<long long>(1, c.o.bufferSize / BENCH_BLOCK);
+    const int algs[] = { CHECKSUM_CRC32C, CHECKSUM_XXH64, CHECKSUM_SHA256, CHECKSUM_CRC32, CHECKSUM_MD5 };
+    const size_t sizes[] = { 4 * BENCH_KB, 64 * BENCH_KB, BENCH_MB };
+    const char* labels[] = { "4K", "64K", "1M" };
+
+    for(size_t a = 0; a < sizeof(algs) / sizeof(algs[0]); a++)
+    {
+        std::string seen;
+        for(int accel = 1; accel >= 0; accel--)
+        {
+            checksum::SetAccelerated(accel != 0);
+            std::string kernel = checksum::Kernel(algs[a]);
+            if(kernel == seen)
+                continue;
+            seen = kernel;
+
+            for(size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++)
+            {
+                measure m(std::string("checksum.") + checksum::Name(algs[a]) + "." + labels[z], kernel);
+                checksum sum(algs[a]);
+                {
+                    sampler s(m);
+                    for(long long i = 0; i < blocks; i++)
+                        Op(m, BENCH_BLOCK, [&]() {
+                            for(size_t at = 0; at < data.size(); at += sizes[z])
+                                sum.Update(data.data() + at, sizes[z]);
+                            return true;
+                        });
+                    sum.Hex();
+                }
+                m.extra["update_size"] = (double)sizes[z];
+                Keep(c, m);
+            }
+        }
+    }
+    checksum::SetAccelerated(true);
+}
+
+// Each codec each way over text-like data, a chunk per op
+static void Codecs(context& c)
+{
+    std::string data = Text((size_t)c.o.bufferSize, 6);
+    const int kinds[] = { CODEC_DEFLATE, CODEC_ZSTD, CODEC_LZ4 };
+
+    for(size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++)
+    {
+        if(!codec::Available(kinds[k]))
+            continue;
+
+        std::string packed, unpacked, out;
+        measure zip(std::string("compress.") + codec::Name(kinds[k]), "codec");
+        measure unzip(std::string("decompress.") + codec::Name(kinds[k]), "codec");
+        {
+            std::unique_ptr<codec> z(codec::Create(kinds[k], true));
+            sampler s(zip);
+            for(size_t at = 0; at < data.size(); at += CODEC_CHUNK)
+            {
+                size_t n = std::min((size_t)CODEC_CHUNK, data.size() - at);
+                Op(zip, (long long)n, [&]() {
+                    out.clear();
+                    bool ok = z->Process(data.data() + at, n, out, at + n == data.size());
+                    packed += out;
+                    return ok;
+                });
+            }
+        }
+        zip.extra["ratio"] = (double)packed.size() / (double)data.size();
+        Keep(c, zip);
+        {
+            std::unique_ptr<codec> z(codec::Create(kinds[k], false));
+            sampler s(unzip);
+            for(size_t at = 0; at < packed.size(); at += CODEC_CHUNK)
+            {
+                size_t n = std::min((size_t)CODEC_CHUNK, packed.size() - at);
+                Op(unzip, 0, [&]() {
+                    out.clear();
+                    bool ok = z->Process(packed.data() + at, n, out, at + n == packed.size());
+                    unpacked += out;
+                    unzip.bytes += (long long)out.size();
+                    return ok;
+                });
+            }
+        }
+        unzip.errors += unpacked != data;
+        Keep(c, unzip);
+    }
+}
+
+// Rewrites @percent of the blocks of @path in place
+static void Scribble(const std::string& path, long long size, int percent, unsigned seed)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if(fd < 0)
+        return;
+    unsigned block  = deltasig::BlockFor(size);
+    long long count = (size + block - 1) / block;
+    long long dirty = percent > 0 ? std::max<long long>(1, count * percent / 100) : 0;
+    std::string junk = Random(block, seed);
+    std::mt19937_64 rng(seed);
+    for(long long i = 0; i < dirty; i++)
+    {
+        long long at = (long long)(rng() % (unsigned long long)count) * block;
+        size_t n = (size_t)std::min<long long>(block, size - at);
+        if(pwrite(fd, junk.data(), n, (off_t)at) < 0)
+            break;
+    }
+    close(fd);
+}
+
+// A large file that changed a little, fetched and pushed as deltas, once
+// for each --delta-change rate. Both copies start over from the same
+// bytes each time and the signatures of the last rate go with them.
+static void Delta(context& c, backend& b)
+{
+    if(!b.ftp)
+        return;
+
+    std::string local = c.local + "/delta.bin", full = c.local + "/delta.full";
+    std::string remote = b.disk + "/delta.bin";
+    std::string pattern = Random(BENCH_BLOCK, 7);
+    WriteFile(remote, c.o.deltaSize, pattern);
+
+    measure whole("delta.full", b.name);
+    {
+        sampler s(whole);
+        Op(whole, c.o.deltaSize, [&]() { return b.ftp->Download("/delta.bin", full); });
+    }
+    unlink(full.c_str());
+    Keep(c, whole);
+
+    for(size_t r = 0; r < c.o.deltaChanges.size(); r++)
+    {
+        int pct = c.o.deltaChanges[r];
+        WriteFile(local, c.o.deltaSize, pattern);
+        WriteFile(remote, c.o.deltaSize, pattern);
+        unlink((local + ".connsig").c_str());
+        b.conn->Remove("/delta.bin.connsig");
+        Scribble(remote, c.o.deltaSize, pct, 8);
+
+        std::string rate = "." + std::to_string(pct) + "pct";
+        measure down("delta.download" + rate, b.name), up("delta.upload" + rate, b.name);
+        b.ftp->SetDelta(true);
+        {
+            sampler s(down);
+            Op(down, c.o.deltaSize, [&]() { return b.ftp->Download("/delta.bin", local); });
+        }
+        delta_stats ds = b.ftp->GetDeltaStats();
+        down.extra["change_pct"]    = pct;
+        down.extra["sent_bytes"]    = (double)ds.sent;
+        down.extra["reused_bytes"]  = (double)ds.reused;
+        Keep(c, down);
+
+        Scribble(local, c.o.deltaSize, pct, 9);
+        {
+            sampler s(up);
+            Op(up, c.o.deltaSize, [&]() { return b.ftp->Upload(local, "/delta.bin"); });
+        }
+        ds = b.ftp->GetDeltaStats();
+        up.extra["change_pct"]      = pct;
+        up.extra["sent_bytes"]      = (double)ds.sent;
+        up.extra["reused_bytes"]    = (double)ds.reused;
+        Keep(c, up);
+        b.ftp->SetDelta(false);
+    }
+
+    unlink(local.c_str());
+    unlink((local + ".connsig").c_str());
+    b.conn->Remove("/delta.bin");
+    b.conn->Remove("/delta.bin.connsig");
+}
+
+// The same transfers on sendfile/splice and on io_uring, CPU per GB is the point
+static void Uring(context& c, backend& b)
+{
+    if(!b.ftp || !uringengine::Supported())
+        return;
+
+    std::string src = c.local + "/uring.bin", dst = c.local + "/uring.back";
+    WriteFile(src, c.o.deltaSize, Random(BENCH_BLOCK, 10));
+
+    std::shared_ptr<uringengine> io = uringengine::Create();
+    const char* paths[] = { "splice", "uring" };
+    for(int p = 0; p < 2; p++)
+    {
+        b.ftp->SetEngine(p ? io : std::shared_ptr<uringengine>());
+        measure up(std::string("uring.upload.") + paths[p], b.name);
+        measure down(std::string("uring.download.") + paths[p], b.name);
+        {
+            sampler s(up);
+            Op(up, c.o.deltaSize, [&]() { return b.ftp->Upload(src, "/uring.bin"); });
+        }
+        Keep(c, up);
+        {
+            sampler s(down);
+            Op(down, c.o.deltaSize, [&]() { return b.ftp->Download("/uring.bin", dst); });
+        }
+        Keep(c, down);
+    }
+    b.ftp->SetEngine(std::shared_ptr<uringengine>());
+
+    unlink(src.c_str());
+    unlink(dst.c_str());
+    b.conn->Remove("/uring.bin");
+}
+
+// The same transfers on sendfile/splice and through a user space buffer,
+// throughput and CPU per GB for each
+static void ZeroCopy(context& c, backend& b)
+{
+    if(!b.ftp)
+        return;
+
+    std::string src = c.local + "/zerocopy.bin", dst = c.local + "/zerocopy.back";
+    WriteFile(src, c.o.deltaSize, Random(BENCH_BLOCK, 15));
+
+    const char* modes[] = { "zerocopy", "buffered" };
+    for(int m = 0; m < 2; m++)
+    {
+        b.ftp->SetZeroCopy(m == 0);
+        measure up(std::string("zerocopy.upload.") + modes[m], b.name);
+        measure down(std::string("zerocopy.download.") + modes[m], b.name);
+        {
+            sampler s(up);
+            Op(up, c.o.deltaSize, [&]() { return b.ftp->Upload(src, "/zerocopy.bin"); });
+        }
+        Keep(c, up);
+        {
+            sampler s(down);
+            Op(down, c.o.deltaSize, [&]() { return b.ftp->Download("/zerocopy.bin", dst); });
+        }
+        Keep(c, down);
+    }
+    b.ftp->SetZeroCopy(true);
+
+    unlink(src.c_str());
+    unlink(dst.c_str());
+    b.conn->Remove("/zerocopy.bin");
+}
+
+// Transfers the server cuts half way, carried on by SetResume and checked
+// byte for byte: "session" drops the control connection with the data one,
+// "data" only fails the transfer. The fault is armed on the server object,
+// so this runs one of its own in process. The pattern's length is a prime
+// so a resume at the wrong offset can't line up with a repeat of it.
+static void Resume(context& c, backend& b)
+{
+    if(!b.ftp)
+        return;
+
+    std::string root = c.local + "/resume.srv";
+    std::string src = c.local + "/resume.bin", dst = c.local + "/resume.back";
+    FTPServer srv;
+    if(!MakeDirs(root) || !srv.Start(root))
+    {
+        fprintf(stderr, "  resume: the FTP server didn't start\n");
+        return;
+    }
+    std::string pattern = Random(999983, 16);
+    WriteFile(src, c.o.deltaSize, pattern);
+    WriteFile(root + "/resume.bin", c.o.deltaSize, pattern);
+
+    const char* modes[] = { "session", "data" };
+    for(int m = 0; m < 2; m++)
+    {
+        PosixFTP ftp;
+        ftp.SetResume(3);
+        if(!ftp.Connect("127.0.0.1", "bench", "bench", srv.GetPort()))
+        {
+            fprintf(stderr, "  resume.%s: can't connect, error %d\n", modes[m], ftp.GetLastError());
+            continue;
+        }
+
+        measure down(std::string("resume.download.") + modes[m], b.name);
+        measure up(std::string("resume.upload.") + modes[m], b.name);
+        srv.InjectDisconnect(c.o.deltaSize / 2, 1, m == 0);
+        {
+            sampler s(down);
+            Op(down, c.o.deltaSize, [&]() { return ftp.Download("/resume.bin", dst) && Same(src, dst); });
+        }
+        Keep(c, down);
+        srv.InjectDisconnect(c.o.deltaSize / 2, 1, m == 0);
+        {
+            sampler s(up);
+            Op(up, c.o.deltaSize, [&]() { return ftp.Upload(src, "/resume.up") && Same(src, root + "/resume.up"); });
+        }
+        Keep(c, up);
+        srv.InjectDisconnect(0, 0);
+        ftp.Disconnect();
+        unlink(dst.c_str());
+        unlink((root + "/resume.up").c_str());
+    }
+
+    srv.Stop();
+    unlink(src.c_str());
+    nftw(root.c_str(), Unlink, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// The same transfers in cleartext, under TLS in user space and with kernel
+// TLS, each on a session of its own. Whether the kernel took the keys is
+// in the kernel_send/kernel_recv extras, without its "tls" module the
+// ktls run is user space TLS again.
+static void Tls(context& c, backend& b)
+{
+#if defined(CONNSTREAM_TLS)
+    if(!b.ftp)
+        return;
+
+    std::string src = c.local + "/tls.bin", dst = c.local + "/tls.back";
+    WriteFile(src, c.o.deltaSize, Random(BENCH_BLOCK, 11));
+
+    const char* modes[] = { "clear", "user", "ktls" };
+    for(int m = 0; m < 3; m++)
+    {
+        PosixFTP ftp;
+        if(m)
+        {
+            std::shared_ptr<tlscontext> tls = tlscontext::Client();
+            tls->Trust(g_tlsPem);
+            tls->SetKTLS(m == 2);
+            ftp.SetTLS(tls);
+        }
+        if(!ftp.Connect("127.0.0.1", "bench", "bench", c.port))
+        {
+            fprintf(stderr, "  tls.%s: can't connect, error %d\n", modes[m], ftp.GetLastError());
+            continue;
+        }
+
+        measure up(std::string("tls.upload.") + modes[m], b.name);
+        measure down(std::string("tls.download.") + modes[m], b.name);
+        {
+            sampler s(up);
+            Op(up, c.o.deltaSize, [&]() { return ftp.Upload(src, "/tls.bin"); });
+        }
+        tls_stats st = ftp.GetTLSStats();
+        up.extra["kernel_send"] = (double)st.kernelSend;
+        up.extra["resumed"]     = (double)st.resumed;
+        Keep(c, up);
+        {
+            sampler s(down);
+            Op(down, c.o.deltaSize, [&]() { return ftp.Download("/tls.bin", dst); });
+        }
+        tls_stats after = ftp.GetTLSStats();
+        down.extra["kernel_recv"] = (double)(after.kernelRecv - st.kernelRecv);
+        down.extra["resumed"]     = (double)(after.resumed - st.resumed);
+        Keep(c, down);
+        ftp.Disconnect();
+    }
+
+    unlink(src.c_str());
+    unlink(dst.c_str());
+    b.conn->Remove("/tls.bin");
+#else
+    (void)b;
+    (void)c;
+    fprintf(stderr, "  tls: built without CONNSTREAM_TLS\n");
+#endif
+}
+
+// A bulk upload of --delta-size on a session of its own with small
+// downloads cutting in, the pair capped at --sched-rate. First the
+// downloads share the bulk class, then they go interactive and should
+// take most of the link while they run. CPU covers both threads,
+// queue_wait is the mean time a chunk of the class waited for a grant.
+static void Sched(context& c, backend& b)
+{
+    if(!b.ftp)
+        return;
+
+    long long small = std::max(c.o.deltaSize / 64, BENCH_MB);
+    std::string src = c.local + "/sched.bin", dst = c.local + "/sched.back";
+    WriteFile(src, c.o.deltaSize, Random(BENCH_BLOCK, 12));
+    Seed(b, "/sched.small", small, Random(BENCH_BLOCK, 13));
+
+    const char* modes[] = { "fair", "priority" };
+    for(int m = 0; m < 2; m++)
+    {
+        PosixFTP bulk;
+        if(!bulk.Connect("127.0.0.1", "bench", "bench", c.port))
+        {
+            fprintf(stderr, "  sched.%s: can't connect, error %d\n", modes[m], bulk.GetLastError());
+            continue;
+        }
+
+        std::shared_ptr<transferscheduler> sched(new transferscheduler());
+        sched->SetRate(c.o.schedRate);
+        bulk.SetScheduler(sched, SCHED_BULK);
+        int cls = m ? SCHED_INTERACTIVE : SCHED_BULK;
+        b.ftp->SetScheduler(sched, cls);
+
+        measure up(std::string("sched.bulk.") + modes[m], b.name);
+        measure down(std::string("sched.interactive.") + modes[m], b.name);
+        std::thread t([&]()
+        {
+            sampler s(up);
+            Op(up, c.o.deltaSize, [&]() { return bulk.Upload(src, "/sched.bin"); });
+        });
+        {
+            // Once the upload has the link to itself
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            sampler s(down);
+            for(int i = 0; i < 8; i++)
+                Op(down, small, [&]() { return b.ftp->Download("/sched.small", dst); });
+        }
+        down.extra["queue_wait"] = sched->GetStats(cls).MeanWait();
+        t.join();
+        up.extra["queue_wait"]   = sched->GetStats(SCHED_BULK).MeanWait();
+        Keep(c, up);
+        Keep(c, down);
+
+        b.ftp->SetScheduler(std::shared_ptr<transferscheduler>());
+        bulk.Disconnect();
+    }
+
+    unlink(src.c_str());
+    unlink(dst.c_str());
+    b.conn->Remove("/sched.bin");
+    b.conn->Remove("/sched.small");
+}
+
+// One file downloaded eight times through a fresh content cache, the
+// first from the host and the rest from the cache, once materialized by
+// reflink (a copy where the filesystem can't) and once by hard link
+static void Content(context& c, backend& b)
+{
+    std::string dst = c.local + "/content.back", dir = c.local + "/content.cache";
+    Seed(b, "/content.bin", c.o.deltaSize, Random(BENCH_BLOCK, 14));
+
+    const char* modes[] = { "reflink", "hardlink" };
+    for(int m = 0; m < 2; m++)
+    {
+        nftw(dir.c_str(), Unlink, 64, FTW_DEPTH | FTW_PHYS);
+        contentcache cache(dir, CONTENT_MAX_BYTES, m ? CONTENT_HARDLINK : CONTENT_REFLINK);
+
+        measure cold(std::string("content.cold.") + modes[m], b.name);
+        measure warm(std::string("content.warm.") + modes[m], b.name);
+        {
+            sampler s(cold);
+            Op(cold, c.o.deltaSize, [&]() { return cache.Download(*b.conn, b.name, "/content.bin", dst).ok; });
+        }
+        Keep(c, cold);
+        {
+            sampler s(warm);
+            for(int i = 0; i < 7; i++)
+                Op(warm, c.o.deltaSize, [&]() { return cache.Download(*b.conn, b.name, "/content.bin", dst).ok; });
+        }
+        contentcache_stats st = cache.GetStats();
+        warm.extra["hits"]          = (double)st.hits;
+        warm.extra["bytes_saved"]   = (double)st.bytesSaved;
+        warm.extra["reflinks"]      = (double)st.reflinks;
+        warm.extra["hardlinks"]     = (double)st.hardlinks;
+        warm.extra["copies"]        = (double)st.copies;
+        Keep(c, warm);
+    }
+
+    nftw(dir.c_str(), Unlink, 64, FTW_DEPTH | FTW_PHYS);
+    unlink(dst.c_str());
+    b.conn->Remove("/content.bin");
+}
+
+// Does nothing, all of it where the compiler can see it: the most static
+// dispatch can save, once the call itself inlines
+class inlinestream : public connstream
+{
+    public:
+        bool        Connect(TSTR, TSTR, TSTR, int)          { return true; }
+        bool        Disconnect(void)                        { return true; }
+        bool        Upload(TSTR, TSTR)                      { return false; }
+        bool        Download(TSTR, TSTR)                    { return false; }
+        bool        ChangeDir(TSTR)                         { return true; }
+        bool        MakeDir(TSTR)                           { return false; }
+        bool        RemoveDir(TSTR)                         { return false; }
+        TSTR        CurrentDir(void)                        { return "/"; }
+        LIST        SearchDir(TSTR)                         { return LIST(); }
+        bool        Remove(TSTR)                            { return false; }
+        bool        Rename(TSTR, TSTR)                      { return false; }
+        bool        Exists(TSTR filename)                   { return !filename.empty(); }
+        long long   GetFileSize(TSTR filename)              { return (long long)filename.size(); }
+        bool        Command(TSTR)                           { return false; }
+        int         GetLastError(void)                      { return 0; }
+        bool        ChangeDirView(TSTRVIEW)                 { return true; }
+        bool        ExistsView(TSTRVIEW filename)           { return !filename.empty(); }
+        long long   GetFileSizeView(TSTRVIEW filename)      { return (long long)filename.size(); }
+};
+
+static volatile long long g_sink;
+
+// Hides where @p came from, so calls through it stay virtual
+static connstream* Opaque(connstream* p)
+{
+    asm volatile("" : "+r"(p));
+    return p;
+}
+
+// ExistsView and GetFileSizeView over @names, BENCH_BATCH pairs
+// to a timed op since a clock read costs more than a call
+template<class S>
+static double Pairs(context& c, measure& m, S& s, const std::vector<TSTRVIEW>& names)
+{
+    size_t at = 0;
+    m.latency.reserve((size_t)c.o.metaOps);
+    {
+        sampler t(m);
+        for(long long i = 0; i < c.o.metaOps; i++)
+            Op(m, 0, [&]()
+            {
+                long long sum = 0;
+                for(int k = 0; k < BENCH_BATCH; k++, at = at + 1 < names.size() ? at + 1 : 0)
+                    sum += s.ExistsView(names[at]) + s.GetFileSizeView(names[at]);
+                g_sink = g_sink + sum;
+                return sum > 0;
+            });
+    }
+    double ns = m.seconds * 1e9 / (double)(m.ops * BENCH_BATCH * 2);
+    m.extra["calls"]        = (double)(m.ops * BENCH_BATCH * 2);
+    m.extra["ns_per_call"]  = ns;
+    return ns;
+}
+
+// The same calls on @B through connstream*, through basic_connstream bare
+// and with instrument_counters, and through connstream_adapter
+template<class B>
+static void DispatchOn(context& c, const char* name, const char* volume, const std::vector<TSTRVIEW>& names)
+{
+    typedef basic_connstream<B>                         bare_t;
+    typedef basic_connstream<B, instrument_counters>    counted_t;
+
+    B dyn;
+    bare_t bare;
+    counted_t counted;
+    connstream_adapter<bare_t> adapter;
+    connstream* virt = Opaque(&dyn);
+    connstream* adapted = Opaque(&adapter);
+
+    if(!virt->Connect(volume) || !bare.Connect(volume) || !counted.Connect(volume) || !adapted->Connect(volume) ||
+       !virt->ChangeDirView("/dispatch") || !bare.ChangeDirView("/dispatch") ||
+       !counted.ChangeDirView("/dispatch") || !adapted->ChangeDirView("/dispatch"))
+        return;
+
+    measure warm("", name);
+    Pairs(c, warm, *virt, names);
+
+    measure mv("dispatch.virtual", name), ms("dispatch.static", name);
+    measure mc("dispatch.counted", name), ma("dispatch.adapter", name);
+    double base = Pairs(c, mv, *virt, names);
+    Keep(c, mv);
+
+    measure* rest[] = { &ms, &mc, &ma };
+    double ns[] = { Pairs(c, ms, bare, names), Pairs(c, mc, counted, names), Pairs(c, ma, *adapted, names) };
+    for(int i = 0; i < 3; i++)
+    {
+        rest[i]->extra["gain_ns_per_call"]  = base - ns[i];
+        rest[i]->extra["speedup"]           = ns[i] > 0 ? base / ns[i] : 0;
+        Keep(c, *rest[i]);
+    }
+}
+
+// What static dispatch saves per call, on the memory backend and on one
+// the compiler can inline
+static void Dispatch(context& c)
+{
+    std::vector<std::string> files;
+    std::vector<TSTRVIEW> names;
+    InMemoryStream seed;
+    if(!seed.Connect("connstream_dispatch") || !seed.MakeDir("/dispatch"))
+        return;
+    for(long long i = 0; i < c.o.metaFiles; i++)
+        files.push_back(Name("f", i));
+    for(size_t i = 0; i < files.size(); i++)
+    {
+        datastream s = seed.OpenWrite("/dispatch/" + files[i], false);
+        if(!s.IsOpen() || s.Write(files[i].data(), files[i].size()) != (long long)files[i].size() || !s.Close())
+            return;
+        names.push_back(files[i]);
+    }
+    if(names.empty())
+        return;
+
+    DispatchOn<InMemoryStream>(c, "memory", "connstream_dispatch", names);
+    DispatchOn<inlinestream>(c, "inline", "", names);
+    InMemoryStream::DropVolume("connstream_dispatch");
+}
+
+
+/// SERVER ///
+
+// The server gets a process of its own so its CPU time and allocations
+// stay out of the client's numbers. Returns its port, 0 on failure.
+static int SpawnServer(const options& o, const std::string& root, pid_t& child, int& hold)
+{
+    int ports[2], keep[2];
+    if(pipe(ports) < 0 || pipe(keep) < 0)
+        return 0;
+
+#if defined(CONNSTREAM_TLS)
+    // Made before the fork so this side knows the certificate to trust
+    std::shared_ptr<tlscontext> tls = tlscontext::SelfSigned(_T("localhost"), &g_tlsPem);
+#endif
+
+    child = fork();
+    if(child < 0)
+        return 0;
+    if(child == 0)
+    {
+        close(ports[0]);
+        close(keep[1]);
+
+        FTPServer srv;
+        srv.SetLatency(o.latency);
+        srv.SetBandwidth(o.bandwidth);
+        TLS_ONLY(srv.SetTLS(tls);)
+        for(std::map<std::string, int>::const_iterator it = o.delays.begin(); it != o.delays.end(); ++it)
+            srv.SetReplyDelay(it->first, it->second);
+
+        int port = srv.Start(root) ? srv.GetPort() : 0;
+        if(write(ports[1], &port, sizeof(port)) != sizeof(port))
+            port = 0;
+        close(ports[1]);
+
+        // Serves until the parent closes its end or goes away
+        char c;
+        while(port && read(keep[0], &c, 1) < 0 && errno == EINTR)
+            ;
+        srv.Stop();
+        _exit(0);
+    }
+
+    close(ports[1]);
+    close(keep[0]);
+    hold = keep[1];
+
+    int port = 0;
+    if(read(ports[0], &port, sizeof(port)) != sizeof(port))
+        port = 0;
+    close(ports[0]);
+    return port;
+}
+
+
+int main(int argc, char** argv)
+{
+    options o;
+    if(!Parse(argc, argv, o))
+    {
+        Usage();
+        return 2;
+    }
+
+    // A thousand sessions is two thousand descriptors on each side
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char pid[32];
+    snprintf(pid, sizeof(pid), "/connstream_bench.%d", (int)getpid());
+    std::string scratch = o.dir + pid;
+    if(!MakeDirs(scratch + "/ftp") || !MakeDirs(scratch + "/local"))
+    {
+        fprintf(stderr, "connstream_bench: can't create %s: %s\n", scratch.c_str(), strerror(errno));
+        return 1;
+    }
+
+    pid_t child = -1;
+    int hold    = -1;
+    int port    = SpawnServer(o, scratch + "/ftp", child, hold);
+    if(!port)
+    {
+        fprintf(stderr, "connstream_bench: the FTP server didn't start\n");
+        return 1;
+    }
+
+    std::vector<measure> results;
+    context c = { o, scratch + "/local", port, results };
+    int failed = 0;
+
+    for(size_t i = 0; i < o.scenarios.size(); i++)
+    {
+        const std::string& sc = o.scenarios[i];
+        fprintf(stderr, "%s\n", sc.c_str());
+        if(sc == "checksum")
+        {
+            Checksums(c);
+            continue;
+        }
+        if(sc == "compress")
+        {
+            Codecs(c);
+            continue;
+        }
+        if(sc == "dispatch")
+        {
+            Dispatch(c);
+            continue;
+        }
+
+        for(size_t k = 0; k < o.backends.size(); k++)
+        {
+            backend b;
+            b.name = o.backends[k];
+            if(!Connect(b, scratch, port))
+            {
+                fprintf(stderr, "  %s: can't connect, error %d\n", b.name.c_str(), b.conn ? b.conn->GetLastError() : 0);
+                failed++;
+                continue;
+            }
+
+            if(sc == "tiny")            Tiny(c, b);
+            else if(sc == "large")      Large(c, b);
+            else if(sc == "tree")       Tree(c, b);
+            else if(sc == "meta")       Meta(c, b);
+            else if(sc == "sessions")   Sessions(c, b);
+            else if(sc == "delta")      Delta(c, b);
+            else if(sc == "uring")      Uring(c, b);
+            else if(sc == "paths")      Paths(c, b);
+            else if(sc == "tls")        Tls(c, b);
+            else if(sc == "sched")      Sched(c, b);
+            else if(sc == "content")    Content(c, b);
+            else if(sc == "zerocopy")   ZeroCopy(c, b);
+            else if(sc == "resume")     Resume(c, b);
+            else
+            {
+                fprintf(stderr, "  unknown scenario %s\n", sc.c_str());
+                failed++;
+                break;
+            }
+            b.conn->Disconnect();
+        }
+    }
+
+    close(hold);
+    waitpid(child, NULL, 0);
+    InMemoryStream::DropVolume("connstream_bench");
+    if(!o.keep)
+        nftw(scratch.c_str(), Unlink, 64, FTW_DEPTH | FTW_PHYS);
+
+    std::string report = Report(o, results);
+    FILE* out = o.out.empty() ? stdout : fopen(o.out.c_str(), "w");
+    if(!out)
+    {
+        fprintf(stderr, "connstream_bench: can't write %s: %s\n", o.out.c_str(), strerror(errno));
+        return 1;
+    }
+    fputs(report.c_str(), out);
+    if(out != stdout)
+        fclose(out);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,676 @@
+#include <checksum.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHECKSUM_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(CHECKSUM_X86) && (defined(__GNUC__) || defined(__clang__))
+#define CHECKSUM_TARGET(isa) __attribute__((target(isa)))
+#else
+#undef CHECKSUM_X86
+#endif
+
+typedef uint32_t (*crcfn)(uint32_t crc, const unsigned char* p, size_t len);
+typedef void (*blockfn)(uint32_t* state, const unsigned char* p, size_t blocks);
+
+static inline uint32_t Load32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t Load64(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t Rotl32(uint32_t v, int r)
+{
+    return (v << r) | (v >> (32 - r));
+}
+
+static inline uint32_t Rotr32(uint32_t v, int r)
+{
+    return (v >> r) | (v << (32 - r));
+}
+
+static inline uint64_t Rotl64(uint64_t v, int r)
+{
+    return (v << r) | (v >> (64 - r));
+}
+
+
+/// CRC TABLES ///
+
+/* Slicing-by-8 for a reflected polynomial, t[k][b] is byte b's remainder k bytes further back */
+struct crctables
+{
+    uint32_t t[8][256];
+
+    crctables(uint32_t poly)
+    {
+        for(uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for(int k = 0; k < 8; k++)
+                c = c & 1 ? (c >> 1) ^ poly : c >> 1;
+            t[0][i] = c;
+        }
+        for(int k = 1; k < 8; k++)
+            for(int i = 0; i < 256; i++)
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+    }
+};
+
+static const crctables& Crc32cTables()
+{
+    static crctables t(0x82F63B78);
+    return t;
+}
+
+static const crctables& Crc32Tables()
+{
+    static crctables t(0xEDB88320);
+    return t;
+}
+
+static uint32_t CrcSlice8(const crctables& T, uint32_t crc, const unsigned char* p, size_t len)
+{
+    while(len >= 8)
+    {
+        // Little endian words, the low byte is the oldest
+        uint32_t lo = Load32(p) ^ crc;
+        uint32_t hi = Load32(p + 4);
+        crc = T.t[7][lo & 0xff] ^ T.t[6][(lo >> 8) & 0xff]
+            ^ T.t[5][(lo >> 16) & 0xff] ^ T.t[4][lo >> 24]
+            ^ T.t[3][hi & 0xff] ^ T.t[2][(hi >> 8) & 0xff]
+            ^ T.t[1][(hi >> 16) & 0xff] ^ T.t[0][hi >> 24];
+        p   += 8;
+        len -= 8;
+    }
+    while(len--)
+        crc = T.t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static uint32_t Crc32cTable(uint32_t crc, const unsigned char* p, size_t len)
+{
+    return CrcSlice8(Crc32cTables(), crc, p, len);
+}
+
+static uint32_t Crc32Table(uint32_t crc, const unsigned char* p, size_t len)
+{
+    return CrcSlice8(Crc32Tables(), crc, p, len);
+}
+
+
+/// X86 KERNELS ///
+
+#ifdef CHECKSUM_X86
+CHECKSUM_TARGET("sse4.2")
+static uint32_t Crc32cSSE42(uint32_t crc, const unsigned char* p, size_t len)
+{
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    while(len >= 8)
+    {
+        c    = _mm_crc32_u64(c, Load64(p));
+        p   += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+#endif
+    while(len >= 4)
+    {
+        crc  = _mm_crc32_u32(crc, Load32(p));
+        p   += 4;
+        len -= 4;
+    }
+    while(len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+/* Folds 64 bytes a round with carry-less multiplies, the constants are
+   x^(512+32), x^(512-32), x^(128+32) and x^(128-32) mod P bit-reflected.
+   The last 16 byte remainder goes through the table rather than a Barrett
+   reduction, it is the same CRC either way. */
+CHECKSUM_TARGET("pclmul,sse4.1")
+static uint32_t Crc32PCLMUL(uint32_t crc, const unsigned char* p, size_t len)
+{
+    if(len < 64)
+        return Crc32Table(crc, p, len);
+
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+
+    __m128i x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    p   += 64;
+    len -= 64;
+
+    while(len >= 64)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(p + 0x30)));
+        p   += 64;
+        len -= 64;
+    }
+
+    // Four lanes down to one, then any whole 16 byte blocks left
+    __m128i lanes[3] = { x2, x3, x4 };
+    for(int i = 0; i < 3; i++)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), lanes[i]);
+    }
+    while(len >= 16)
+    {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)p));
+        p   += 16;
+        len -= 16;
+    }
+
+    unsigned char rest[16];
+    _mm_storeu_si128((__m128i*)rest, x1);
+    crc = Crc32Table(0, rest, sizeof(rest));
+    return Crc32Table(crc, p, len);
+}
+#endif
+
+
+/// SHA-256 ///
+
+static const uint32_t SHA256_K[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void Sha256Portable(uint32_t* state, const unsigned char* p, size_t blocks)
+{
+    for(; blocks; blocks--, p += 64)
+    {
+        uint32_t w[64];
+        for(int i = 0; i < 16; i++)
+            w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16
+                 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+        for(int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = Rotr32(w[i - 15], 7) ^ Rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = Rotr32(w[i - 2], 17) ^ Rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for(int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (Rotr32(e, 6) ^ Rotr32(e, 11) ^ Rotr32(e, 25))
+                        + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+            uint32_t t2 = (Rotr32(a, 2) ^ Rotr32(a, 13) ^ Rotr32(a, 22))
+                        + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#ifdef CHECKSUM_X86
+/* The SHA extensions keep the state as ABEF/CDGH pairs and take four
+   rounds per pair of sha256rnds2, the schedule rotates through msg[0..3] */
+CHECKSUM_TARGET("sha,sse4.1")
+static void Sha256SHANI(uint32_t* state, const unsigned char* p, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp     = _mm_loadu_si128((const __m128i*)&state[0]);
+    __m128i state1  = _mm_loadu_si128((const __m128i*)&state[4]);
+    tmp     = _mm_shuffle_epi32(tmp, 0xB1);             // CDAB
+    state1  = _mm_shuffle_epi32(state1, 0x1B);          // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);   // ABEF
+    state1  = _mm_blend_epi16(state1, tmp, 0xF0);       // CDGH
+
+    for(; blocks; blocks--, p += 64)
+    {
+        __m128i abef = state0, cdgh = state1;
+        __m128i msg[4];
+
+        for(int g = 0; g < 16; g++)
+        {
+            __m128i& cur = msg[g & 3];
+            if(g < 4)
+                cur = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + g * 16)), mask);
+
+            __m128i m = _mm_add_epi32(cur, _mm_loadu_si128((const __m128i*)&SHA256_K[g * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, m);
+            if(g >= 3 && g <= 14)
+            {
+                __m128i& next = msg[(g + 1) & 3];
+                next = _mm_add_epi32(next, _mm_alignr_epi8(cur, msg[(g + 3) & 3], 4));
+                next = _mm_sha256msg2_epu32(next, cur);
+            }
+            m = _mm_shuffle_epi32(m, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, m);
+            if(g >= 1 && g <= 12)
+                msg[(g + 3) & 3] = _mm_sha256msg1_epu32(msg[(g + 3) & 3], cur);
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp     = _mm_shuffle_epi32(state0, 0x1B);          // FEBA
+    state1  = _mm_shuffle_epi32(state1, 0xB1);          // DCHG
+    state0  = _mm_blend_epi16(tmp, state1, 0xF0);       // DCBA
+    state1  = _mm_alignr_epi8(state1, tmp, 8);          // ABEF
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+#endif
+
+
+/// MD5 ///
+
+struct md5table
+{
+    uint32_t k[64];
+
+    // k[i] = floor(|sin(i + 1)| * 2^32), exact in double precision
+    md5table()
+    {
+        for(int i = 0; i < 64; i++)
+            k[i] = (uint32_t)(fabs(sin((double)(i + 1))) * 4294967296.0);
+    }
+};
+
+static void Md5Portable(uint32_t* state, const unsigned char* p, size_t blocks)
+{
+    static const int shift[4][4] = { { 7, 12, 17, 22 }, { 5, 9, 14, 20 }, { 4, 11, 16, 23 }, { 6, 10, 15, 21 } };
+    static const md5table T;
+    const uint32_t* K = T.k;
+
+    for(; blocks; blocks--, p += 64)
+    {
+        uint32_t m[16];
+        for(int i = 0; i < 16; i++)
+            m[i] = (uint32_t)p[i * 4] | (uint32_t)p[i * 4 + 1] << 8
+                 | (uint32_t)p[i * 4 + 2] << 16 | (uint32_t)p[i * 4 + 3] << 24;
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        for(int i = 0; i < 64; i++)
+        {
+            uint32_t f;
+            int g;
+            switch(i >> 4)
+            {
+                case 0:  f = (b & c) | (~b & d);    g = i;                  break;
+                case 1:  f = (d & b) | (~d & c);    g = (5 * i + 1) & 15;   break;
+                case 2:  f = b ^ c ^ d;             g = (3 * i + 5) & 15;   break;
+                default: f = c ^ (b | ~d);          g = (7 * i) & 15;       break;
+            }
+            uint32_t t = d;
+            d = c;
+            c = b;
+            b = b + Rotl32(a + f + K[i] + m[g], shift[i >> 4][i & 3]);
+            a = t;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    }
+}
+
+
+/// XXH64 ///
+
+static const uint64_t XXH_P1 = 11400714785074694791ULL;
+static const uint64_t XXH_P2 = 14029467366897019727ULL;
+static const uint64_t XXH_P3 = 1609587929392839161ULL;
+static const uint64_t XXH_P4 = 9650029242287828579ULL;
+static const uint64_t XXH_P5 = 2870177450012600261ULL;
+
+static inline uint64_t XxhRound(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc  = Rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t XxhMerge(uint64_t acc, uint64_t v)
+{
+    acc ^= XxhRound(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+
+/// KERNEL SELECTION ///
+
+struct checksumkernels
+{
+    crcfn       crc32c;
+    const char* crc32cName;
+    crcfn       crc32;
+    const char* crc32Name;
+    blockfn     sha256;
+    const char* sha256Name;
+};
+
+static checksumkernels PickKernels(bool accelerated)
+{
+    checksumkernels k;
+    k.crc32c        = Crc32cTable;
+    k.crc32cName    = "slice8";
+    k.crc32         = Crc32Table;
+    k.crc32Name     = "slice8";
+    k.sha256        = Sha256Portable;
+    k.sha256Name    = "portable";
+
+#ifdef CHECKSUM_X86
+    if(!accelerated)
+        return k;
+
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2"))
+    {
+        k.crc32c        = Crc32cSSE42;
+        k.crc32cName    = "sse4.2";
+    }
+    if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+    {
+        k.crc32         = Crc32PCLMUL;
+        k.crc32Name     = "pclmul";
+    }
+
+    // Older compilers don't know "sha" for __builtin_cpu_supports, ask cpuid
+    unsigned a, b, c, d;
+    if(__get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29)) && __builtin_cpu_supports("sse4.1"))
+    {
+        k.sha256        = Sha256SHANI;
+        k.sha256Name    = "sha-ni";
+    }
+#else
+    (void)accelerated;
+#endif
+    return k;
+}
+
+static checksumkernels& Kernels()
+{
+    static checksumkernels k = PickKernels(true);
+    return k;
+}
+
+void checksum::SetAccelerated(bool enable)
+{
+    Kernels() = PickKernels(enable);
+}
+
+const char* checksum::Kernel(int algorithm)
+{
+    switch(algorithm)
+    {
+        case CHECKSUM_CRC32C:   return Kernels().crc32cName;
+        case CHECKSUM_CRC32:    return Kernels().crc32Name;
+        case CHECKSUM_SHA256:   return Kernels().sha256Name;
+        case CHECKSUM_XXH64:
+        case CHECKSUM_MD5:      return "portable";
+    }
+    return "";
+}
+
+static const char* const CHECKSUM_NAMES[] = { "", "CRC32C", "XXH64", "SHA-256", "CRC32", "MD5" };
+
+const char* checksum::Name(int algorithm)
+{
+    if(algorithm < CHECKSUM_NONE || algorithm > CHECKSUM_MD5)
+        return "";
+    return CHECKSUM_NAMES[algorithm];
+}
+
+int checksum::Parse(const char* name)
+{
+    for(int i = CHECKSUM_CRC32C; i <= CHECKSUM_MD5; i++)
+        if(!strcasecmp(name, CHECKSUM_NAMES[i]))
+            return i;
+    return CHECKSUM_NONE;
+}
+
+
+/// CHECKSUM ///
+
+checksum::checksum(int algorithm)
+{
+    Reset(algorithm);
+}
+
+void checksum::Reset(int algorithm)
+{
+    m_alg = algorithm >= CHECKSUM_NONE && algorithm <= CHECKSUM_MD5 ? algorithm : CHECKSUM_NONE;
+    Reset();
+}
+
+void checksum::Reset()
+{
+    static const uint32_t sha256[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    static const uint32_t md5[4]    = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+
+    m_len       = 0;
+    m_buflen    = 0;
+    m_crc       = 0xFFFFFFFF;
+    m_xxh[0]    = XXH_P1 + XXH_P2;
+    m_xxh[1]    = XXH_P2;
+    m_xxh[2]    = 0;
+    m_xxh[3]    = 0 - XXH_P1;
+    if(m_alg == CHECKSUM_SHA256)
+        memcpy(m_state, sha256, sizeof(sha256));
+    else if(m_alg == CHECKSUM_MD5)
+        memcpy(m_state, md5, sizeof(md5));
+}
+
+void checksum::Block(const unsigned char* p, size_t blocks)
+{
+    if(m_alg == CHECKSUM_SHA256)
+        Kernels().sha256(m_state, p, blocks);
+    else if(m_alg == CHECKSUM_MD5)
+        Md5Portable(m_state, p, blocks);
+    else
+    {
+        // XXH64 stripes are 32 bytes, a "block" here is two of them
+        for(size_t i = 0; i < blocks * 2; i++, p += 32)
+        {
+            m_xxh[0] = XxhRound(m_xxh[0], Load64(p));
+            m_xxh[1] = XxhRound(m_xxh[1], Load64(p + 8));
+            m_xxh[2] = XxhRound(m_xxh[2], Load64(p + 16));
+            m_xxh[3] = XxhRound(m_xxh[3], Load64(p + 24));
+        }
+    }
+}
+
+void checksum::Update(const void* data, size_t len)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    m_len += len;
+
+    switch(m_alg)
+    {
+        case CHECKSUM_NONE:
+            return;
+        case CHECKSUM_CRC32C:
+            m_crc = Kernels().crc32c(m_crc, p, len);
+            return;
+        case CHECKSUM_CRC32:
+            m_crc = Kernels().crc32(m_crc, p, len);
+            return;
+    }
+
+    // Block algorithms: top up a partial block, run whole ones in place, keep the tail
+    if(m_buflen)
+    {
+        size_t take = sizeof(m_buf) - m_buflen < len ? sizeof(m_buf) - m_buflen : len;
+        memcpy(m_buf + m_buflen, p, take);
+        m_buflen += take;
+        p   += take;
+        len -= take;
+        if(m_buflen < sizeof(m_buf))
+            return;
+        Block(m_buf, 1);
+        m_buflen = 0;
+    }
+    if(len >= sizeof(m_buf))
+    {
+        Block(p, len / sizeof(m_buf));
+        p   += len - len % sizeof(m_buf);
+        len %= sizeof(m_buf);
+    }
+    memcpy(m_buf, p, len);
+    m_buflen = len;
+}
+
+std::string checksum::Hex() const
+{
+    char hex[65];
+
+    switch(m_alg)
+    {
+        case CHECKSUM_NONE:
+            return std::string();
+
+        case CHECKSUM_CRC32C:
+        case CHECKSUM_CRC32:
+            snprintf(hex, sizeof(hex), "%08x", ~m_crc);
+            return hex;
+
+        case CHECKSUM_XXH64:
+        {
+            uint64_t h;
+            if(m_len >= 32)
+            {
+                h = Rotl64(m_xxh[0], 1) + Rotl64(m_xxh[1], 7) + Rotl64(m_xxh[2], 12) + Rotl64(m_xxh[3], 18);
+                for(int i = 0; i < 4; i++)
+                    h = XxhMerge(h, m_xxh[i]);
+            }
+            else
+                h = XXH_P5;
+            h += m_len;
+
+            // Whatever is buffered is under a block, 32 bytes of it may still be a stripe
+            const unsigned char* p = m_buf;
+            size_t len = m_buflen;
+            if(len >= 32)
+            {
+                uint64_t v[4];
+                memcpy(v, m_xxh, sizeof(v));
+                for(int i = 0; i < 4; i++)
+                    v[i] = XxhRound(v[i], Load64(p + i * 8));
+                h = Rotl64(v[0], 1) + Rotl64(v[1], 7) + Rotl64(v[2], 12) + Rotl64(v[3], 18);
+                for(int i = 0; i < 4; i++)
+                    h = XxhMerge(h, v[i]);
+                h += m_len;
+                p   += 32;
+                len -= 32;
+            }
+            for(; len >= 8; len -= 8, p += 8)
+                h = Rotl64(h ^ XxhRound(0, Load64(p)), 27) * XXH_P1 + XXH_P4;
+            if(len >= 4)
+            {
+                h = Rotl64(h ^ ((uint64_t)Load32(p) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+                p   += 4;
+                len -= 4;
+            }
+            for(; len; len--, p++)
+                h = Rotl64(h ^ (*p * XXH_P5), 11) * XXH_P1;
+
+            h ^= h >> 33;
+            h *= XXH_P2;
+            h ^= h >> 29;
+            h *= XXH_P3;
+            h ^= h >> 32;
+            snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+            return hex;
+        }
+    }
+
+    // SHA-256 and MD5 pad a copy so the running state stays usable
+    uint32_t state[8];
+    memcpy(state, m_state, sizeof(state));
+    unsigned char pad[128];
+    memcpy(pad, m_buf, m_buflen);
+    size_t n = m_buflen;
+    pad[n++] = 0x80;
+    size_t total = n + 8 <= 64 ? 64 : 128;
+    memset(pad + n, 0, total - n);
+
+    unsigned long long bits = m_len * 8;
+    for(int i = 0; i < 8; i++)
+    {
+        if(m_alg == CHECKSUM_SHA256)
+            pad[total - 1 - i] = (unsigned char)(bits >> (i * 8));
+        else
+            pad[total - 8 + i] = (unsigned char)(bits >> (i * 8));
+    }
+
+    std::string out;
+    if(m_alg == CHECKSUM_SHA256)
+    {
+        Kernels().sha256(state, pad, total / 64);
+        for(int i = 0; i < 8; i++)
+        {
+            snprintf(hex, sizeof(hex), "%08x", state[i]);
+            out += hex;
+        }
+    }
+    else
+    {
+        Md5Portable(state, pad, total / 64);
+        for(int i = 0; i < 16; i++)
+        {
+            snprintf(hex, sizeof(hex), "%02x", (state[i / 4] >> ((i % 4) * 8)) & 0xff);
+            out += hex;
+        }
+    }
+    return out;
+}
+
+int checksum::Algorithm() const
+{
+    return m_alg;
+}
+
+unsigned long long checksum::Length() const
+{
+    return m_len;
+}
@@ -0,0 +1,92 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Checksum
+  *
+  * Incremental digests for hashing transfers while the bytes pass through,
+  * so a download never has to be read back to be verified. Fed in any
+  * chunk sizes, Hex() gives the digest the way FTP servers print it in
+  * HASH, XCRC and XMD5 replies.
+  *
+  * The kernel for each algorithm is picked once at runtime from what the
+  * CPU offers: CRC32C on the SSE4.2 crc32 instruction, CRC32 folded with
+  * PCLMULQDQ and SHA-256 on the SHA extensions. Anything else runs on
+  * slicing-by-8 tables or portable code. XXH64 and MD5 are portable only.
+  *
+  * E.G. Usage:
+  *     checksum sum(CHECKSUM_SHA256);
+  *     while((n = in.Read(buf, sizeof(buf))) > 0)
+  *         sum.Update(buf, n);
+  *     printf("%s\n", sum.Hex().c_str());
+  */
+
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#define CHECKSUM_NONE       0
+#define CHECKSUM_CRC32C     1       // Castagnoli, as used by iSCSI and ext4
+#define CHECKSUM_XXH64      2
+#define CHECKSUM_SHA256     3
+#define CHECKSUM_CRC32      4       // IEEE 802.3, what XCRC reports
+#define CHECKSUM_MD5        5       // What XMD5 reports, not for security
+
+class checksum
+{
+    public:
+        checksum(int algorithm = CHECKSUM_NONE);
+
+        /** void Reset(int)
+         *  Starts a new digest, with @algorithm or the current one.
+         */
+        void        Reset(int algorithm);
+        void        Reset(void);
+
+        /** void Update(const void*, size_t) - Hashes the next @len bytes */
+        void        Update(const void* data, size_t len);
+
+        /** std::string Hex(void)
+         *  The digest of everything so far in lowercase hex, the state is left
+         *  as is so Update may carry on. Empty for CHECKSUM_NONE.
+         */
+        std::string Hex(void) const;
+
+        int                 Algorithm(void) const;
+        unsigned long long  Length(void) const;
+
+        /** const char* Name(int)
+         *  The HASH command name of @algorithm ("SHA-256", "CRC32", ...).
+         *  Parse maps a name back, CHECKSUM_NONE when unknown.
+         */
+        static const char*  Name(int algorithm);
+        static int          Parse(const char* name);
+
+        /** const char* Kernel(int)
+         *  Which implementation of @algorithm is in use, e.g. "sse4.2".
+         */
+        /** void SetAccelerated(bool)
+         *  @false forces the portable kernels everywhere, to compare against.
+         *  Not thread-safe, call before hashing starts.
+         */
+        static const char*  Kernel(int algorithm);
+        static void         SetAccelerated(bool enable);
+
+    private:
+        void    Block(const unsigned char* p, size_t blocks);
+
+        int                 m_alg;
+        unsigned long long  m_len;
+        uint32_t            m_crc;
+        uint64_t            m_xxh[4];
+        uint32_t            m_state[8];     // SHA-256 (8 words) or MD5 (4)
+        unsigned char       m_buf[64];
+        size_t              m_buflen;
+};
+
+#endif // _CHECKSUM_H_
@@ -0,0 +1,679 @@
+#include <compress.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+#include <zlib.h>
+
+#if defined(CONNSTREAM_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(CONNSTREAM_LZ4)
+#include <lz4.h>
+#endif
+
+#define CODEC_SCRATCH   (64 << 10)      // zlib output window per call
+#define CODEC_BLOCK     (128 << 10)     // Raw bytes per zstd/lz4 block
+#define CODEC_HEADER    8               // Block header, see blockcodec
+
+/// DEFLATE ///
+
+class deflatecodec : public codec
+{
+    public:
+        deflatecodec(bool compress, int level)
+        {
+            m_kind      = CODEC_DEFLATE;
+            m_compress  = compress;
+            m_ended     = false;
+            memset(&m_z, 0, sizeof(m_z));
+            m_ok = compress ? deflateInit(&m_z, level < 0 ? Z_DEFAULT_COMPRESSION : level) == Z_OK
+                            : inflateInit(&m_z) == Z_OK;
+        }
+
+        ~deflatecodec(void)
+        {
+            if(m_compress)
+                deflateEnd(&m_z);
+            else
+                inflateEnd(&m_z);
+        }
+
+        bool Process(const char* in, size_t len, std::string& out, bool finish)
+        {
+            if(!m_ok)
+                return false;
+
+            m_z.next_in  = (Bytef*)in;
+            m_z.avail_in = (uInt)len;
+            return m_compress ? Deflate(out, finish ? Z_FINISH : Z_NO_FLUSH) : Inflate(out, finish);
+        }
+
+        void SetStored(void)
+        {
+            if(!m_ok || !m_compress)
+                return;
+
+            // deflateParams wants room to flush what the old level buffered,
+            // Z_BUF_ERROR means it got none and the switch has to be retried
+            m_z.next_in  = NULL;
+            m_z.avail_in = 0;
+            for(;;)
+            {
+                m_z.next_out  = m_scratch;
+                m_z.avail_out = sizeof(m_scratch);
+                int rc = deflateParams(&m_z, Z_NO_COMPRESSION, Z_DEFAULT_STRATEGY);
+                m_pending.append((char*)m_scratch, sizeof(m_scratch) - m_z.avail_out);
+                if(rc != Z_BUF_ERROR)
+                    break;
+                m_z.next_out  = m_scratch;
+                m_z.avail_out = sizeof(m_scratch);
+                deflate(&m_z, Z_BLOCK);
+                m_pending.append((char*)m_scratch, sizeof(m_scratch) - m_z.avail_out);
+            }
+        }
+
+    private:
+        bool Deflate(std::string& out, int flush)
+        {
+            out += m_pending;
+            m_pending.clear();
+            for(;;)
+            {
+                m_z.next_out  = m_scratch;
+                m_z.avail_out = sizeof(m_scratch);
+                int rc = deflate(&m_z, flush);
+                if(rc == Z_STREAM_ERROR)
+                    return (m_ok = false);
+                out.append((char*)m_scratch, sizeof(m_scratch) - m_z.avail_out);
+                if(rc == Z_STREAM_END || (m_z.avail_in == 0 && m_z.avail_out != 0 && flush != Z_FINISH))
+                    return true;
+            }
+        }
+
+        bool Inflate(std::string& out, bool finish)
+        {
+            while(m_z.avail_in && !m_ended)
+            {
+                m_z.next_out  = m_scratch;
+                m_z.avail_out = sizeof(m_scratch);
+                int rc = inflate(&m_z, Z_NO_FLUSH);
+                out.append((char*)m_scratch, sizeof(m_scratch) - m_z.avail_out);
+                if(rc == Z_STREAM_END)
+                    m_ended = true;
+                else if(rc != Z_OK && rc != Z_BUF_ERROR)
+                    return (m_ok = false);
+            }
+
+            // Anything past the end of the zlib stream isn't ours to ignore
+            if(m_ended && m_z.avail_in)
+                return (m_ok = false);
+            return !finish || m_ended;
+        }
+
+        z_stream        m_z;
+        bool            m_ok;
+        bool            m_ended;
+        std::string     m_pending;      // Output of a level switch, sent with the next data
+        unsigned char   m_scratch[CODEC_SCRATCH];
+};
+
+
+/// BLOCK CODECS ///
+
+#if defined(CONNSTREAM_ZSTD) || defined(CONNSTREAM_LZ4)
+
+/* zstd and lz4 run one-shot over CODEC_BLOCK sized blocks, each preceded by
+ * an 8 byte big endian header: the payload length with the top bit set when
+ * the block is stored raw, then the raw length. A zero header ends the
+ * stream, a 4 byte magic starts it so the two kinds can't be mixed up. */
+class blockcodec : public codec
+{
+    public:
+        blockcodec(int kind, bool compress, int level)
+        {
+            m_kind      = kind;
+            m_compress  = compress;
+            m_level     = level;
+            m_stored    = false;
+            m_started   = false;
+            m_ended     = false;
+        }
+
+        bool Process(const char* in, size_t len, std::string& out, bool finish)
+        {
+            m_buf.append(in, len);
+            return m_compress ? Encode(out, finish) : Decode(out, finish);
+        }
+
+        void SetStored(void)
+        {
+            m_stored = true;
+        }
+
+    private:
+        static void Put32(std::string& out, uint32_t v)
+        {
+            char b[4] = { (char)(v >> 24), (char)(v >> 16), (char)(v >> 8), (char)v };
+            out.append(b, 4);
+        }
+
+        static uint32_t Get32(const char* p)
+        {
+            const unsigned char* u = (const unsigned char*)p;
+            return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | u[3];
+        }
+
+        const char* Magic(void)
+        {
+            return m_kind == CODEC_ZSTD ? "CSZ1" : "CSL1";
+        }
+
+        bool Encode(std::string& out, bool finish)
+        {
+            if(!m_started)
+            {
+                out.append(Magic(), 4);
+                m_started = true;
+            }
+
+            size_t at = 0;
+            while(m_buf.size() - at >= CODEC_BLOCK || (finish && at < m_buf.size()))
+            {
+                size_t raw = m_buf.size() - at < CODEC_BLOCK ? m_buf.size() - at : CODEC_BLOCK;
+                const char* src = m_buf.data() + at;
+                at += raw;
+
+                size_t packed = 0;
+                if(!m_stored)
+                {
+                    m_tmp.resize(Bound(raw));
+                    packed = Compress(src, raw, &m_tmp[0], m_tmp.size());
+                }
+                if(packed && packed < raw)
+                {
+                    Put32(out, (uint32_t)packed);
+                    Put32(out, (uint32_t)raw);
+                    out.append(&m_tmp[0], packed);
+                }
+                else
+                {
+                    Put32(out, (uint32_t)raw | 0x80000000u);
+                    Put32(out, (uint32_t)raw);
+                    out.append(src, raw);
+                }
+            }
+            m_buf.erase(0, at);
+
+            if(finish)
+            {
+                Put32(out, 0);
+                Put32(out, 0);
+            }
+            return true;
+        }
+
+        bool Decode(std::string& out, bool finish)
+        {
+            size_t at = 0;
+            if(!m_started)
+            {
+                if(m_buf.size() < 4)
+                    return !finish;
+                if(memcmp(m_buf.data(), Magic(), 4))
+                    return false;
+                m_started = true;
+                at = 4;
+            }
+
+            while(!m_ended && m_buf.size() - at >= CODEC_HEADER)
+            {
+                uint32_t head   = Get32(m_buf.data() + at);
+                size_t   raw    = Get32(m_buf.data() + at + 4);
+                bool     stored = (head & 0x80000000u) != 0;
+                size_t   packed = head & 0x7fffffffu;
+                if(!packed && !raw)
+                {
+                    m_ended = true;
+                    at += CODEC_HEADER;
+                    break;
+                }
+                if(raw > CODEC_BLOCK || packed > Bound(CODEC_BLOCK) || (stored && packed != raw))
+                    return false;
+                if(m_buf.size() - at - CODEC_HEADER < packed)
+                    break;
+
+                const char* src = m_buf.data() + at + CODEC_HEADER;
+                if(stored)
+                    out.append(src, raw);
+                else
+                {
+                    size_t base = out.size();
+                    out.resize(base + raw);
+                    if(!Decompress(src, packed, &out[base], raw))
+                        return false;
+                }
+                at += CODEC_HEADER + packed;
+            }
+            m_buf.erase(0, at);
+
+            if(m_ended && !m_buf.empty())
+                return false;
+            return !finish || m_ended;
+        }
+
+        size_t Bound(size_t raw)
+        {
+#if defined(CONNSTREAM_ZSTD)
+            if(m_kind == CODEC_ZSTD)
+                return ZSTD_compressBound(raw);
+#endif
+#if defined(CONNSTREAM_LZ4)
+            if(m_kind == CODEC_LZ4)
+                return (size_t)LZ4_compressBound((int)raw);
+#endif
+            return raw;
+        }
+
+        size_t Compress(const char* src, size_t len, char* dst, size_t cap)
+        {
+#if defined(CONNSTREAM_ZSTD)
+            if(m_kind == CODEC_ZSTD)
+            {
+                size_t n = ZSTD_compress(dst, cap, src, len, m_level < 0 ? ZSTD_CLEVEL_DEFAULT : m_level);
+                return ZSTD_isError(n) ? 0 : n;
+            }
+#endif
+#if defined(CONNSTREAM_LZ4)
+            if(m_kind == CODEC_LZ4)
+            {
+                int n = LZ4_compress_fast(src, dst, (int)len, (int)cap, m_level < 1 ? 1 : m_level);
+                return n > 0 ? (size_t)n : 0;
+            }
+#endif
+            return 0;
+        }
+
+        bool Decompress(const char* src, size_t len, char* dst, size_t raw)
+        {
+#if defined(CONNSTREAM_ZSTD)
+            if(m_kind == CODEC_ZSTD)
+                return ZSTD_decompress(dst, raw, src, len) == raw;
+#endif
+#if defined(CONNSTREAM_LZ4)
+            if(m_kind == CODEC_LZ4)
+                return LZ4_decompress_safe(src, dst, (int)len, (int)raw) == (int)raw;
+#endif
+            return false;
+        }
+
+        int             m_level;
+        bool            m_stored;
+        bool            m_started;
+        bool            m_ended;
+        std::string     m_buf;      // Input not yet making up a whole block
+        std::string     m_tmp;
+};
+
+#endif
+
+
+/// CODEC ///
+
+codec* codec::Create(int kind, bool compress, int level)
+{
+    if(!Available(kind))
+        return NULL;
+    if(kind == CODEC_DEFLATE)
+        return new deflatecodec(compress, level);
+#if defined(CONNSTREAM_ZSTD) || defined(CONNSTREAM_LZ4)
+    return new blockcodec(kind, compress, level);
+#else
+    return NULL;
+#endif
+}
+
+bool codec::Available(int kind)
+{
+    switch(kind)
+    {
+        case CODEC_DEFLATE:
+            return true;
+#if defined(CONNSTREAM_ZSTD)
+        case CODEC_ZSTD:
+            return true;
+#endif
+#if defined(CONNSTREAM_LZ4)
+        case CODEC_LZ4:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+const char* codec::Name(int kind)
+{
+    switch(kind)
+    {
+        case CODEC_DEFLATE: return "deflate";
+        case CODEC_ZSTD:    return "zstd";
+        case CODEC_LZ4:     return "lz4";
+        default:            return "";
+    }
+}
+
+
+/// PIPE ///
+
+codecpipe::codecpipe(codec* c)
+{
+    m_codec     = c;
+    m_finish    = false;
+    m_ended     = false;
+    m_stop      = false;
+    m_stored    = false;
+    m_err       = c ? 0 : EINVAL;
+    m_bytesIn   = 0;
+    m_bytesOut  = 0;
+    if(c)
+        m_thread = std::thread(&codecpipe::Run, this);
+    else
+        m_ended = true;
+}
+
+codecpipe::~codecpipe()
+{
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+    if(m_thread.joinable())
+        m_thread.join();
+    delete m_codec;
+}
+
+int codecpipe::Pop(std::string& out)
+{
+    std::unique_lock<std::mutex> g(m_lock);
+    for(;;)
+    {
+        if(!m_out.empty())
+        {
+            out.swap(m_out.front());
+            m_out.pop_front();
+            m_bytesOut += (long long)out.size();
+            m_wake.notify_all();
+            return CODEC_DATA;
+        }
+        if(m_err)
+            return CODEC_FAILED;
+        if(m_ended)
+            return CODEC_END;
+        if(!m_finish && m_in.size() < CODEC_DEPTH)
+            return CODEC_MORE;
+        m_ready.wait(g);
+    }
+}
+
+void codecpipe::Push(const char* buf, size_t len)
+{
+    if(!len)
+        return;
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        m_in.push_back(std::string(buf, len));
+        m_bytesIn += (long long)len;
+    }
+    m_wake.notify_all();
+}
+
+void codecpipe::Finish()
+{
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        m_finish = true;
+    }
+    m_wake.notify_all();
+}
+
+void codecpipe::Run()
+{
+    std::string chunk, out;
+    long long in = 0, made = 0;
+
+    std::unique_lock<std::mutex> g(m_lock);
+    for(;;)
+    {
+        // Hold off while the caller hasn't taken what is already done
+        while(!m_stop && (m_out.size() >= CODEC_DEPTH || (m_in.empty() && !m_finish)))
+            m_wake.wait(g);
+        if(m_stop)
+            return;
+
+        bool last = m_in.empty();
+        if(!last)
+        {
+            chunk.swap(m_in.front());
+            m_in.pop_front();
+        }
+        m_ready.notify_all();
+        g.unlock();
+
+        out.clear();
+        bool ok = m_codec->Process(last ? NULL : chunk.data(), last ? 0 : chunk.size(), out, last);
+        in   += last ? 0 : (long long)chunk.size();
+        made += (long long)out.size();
+        chunk.clear();
+
+        // Ratio check, once per stream and only for compressors
+        bool stored = false;
+        if(ok && !last && m_codec->Compressing() && !m_stored
+            && in >= CODEC_SAMPLE && made * 100 > in * CODEC_PAYOFF)
+        {
+            m_codec->SetStored();
+            stored = true;
+        }
+
+        g.lock();
+        if(stored)
+            m_stored = true;
+        if(!out.empty())
+            m_out.push_back(std::move(out));
+        if(!ok)
+            m_err = EPROTO;
+        if(last || !ok)
+            m_ended = true;
+        m_ready.notify_all();
+        if(m_ended)
+            return;
+    }
+}
+
+long long codecpipe::BytesIn()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    return m_bytesIn;
+}
+
+long long codecpipe::BytesOut()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    return m_bytesOut;
+}
+
+bool codecpipe::Stored()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    return m_stored;
+}
+
+int codecpipe::GetLastError()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    return m_err;
+}
+
+
+/// STREAM WRAPPER ///
+
+class codecstream : public streamhandle
+{
+    public:
+        codecstream(datastream&& inner, int kind, int level)
+            : m_inner(std::move(inner))
+        {
+            m_kind      = kind;
+            m_level     = level;
+            m_writer    = NULL;
+            m_reader    = NULL;
+            m_pos       = 0;
+            m_seen      = 0;
+            m_err       = 0;
+        }
+
+        ~codecstream(void)
+        {
+            delete m_writer;
+            delete m_reader;
+        }
+
+        long long Read(char* buf, size_t len)
+        {
+            if(!m_reader)
+                m_reader = new codecpipe(codec::Create(m_kind, false, m_level));
+
+            while(m_pos == m_left.size())
+            {
+                m_left.clear();
+                m_pos = 0;
+                int r = m_reader->Pop(m_left);
+                if(r == CODEC_END)
+                    return 0;
+                if(r == CODEC_FAILED)
+                    return Failed(m_reader->GetLastError());
+                if(r == CODEC_MORE)
+                {
+                    m_chunk.resize(CODEC_CHUNK);
+                    long long n = m_inner.Read(&m_chunk[0], m_chunk.size());
+                    if(n < 0)
+                        return Failed(m_inner.GetLastError());
+                    // A file that was never written through Wrap is empty, not corrupt
+                    if(n == 0 && !m_seen)
+                        return 0;
+                    m_seen += n;
+                    if(n == 0)
+                        m_reader->Finish();
+                    else
+                        m_reader->Push(&m_chunk[0], (size_t)n);
+                }
+            }
+
+            size_t n = m_left.size() - m_pos < len ? m_left.size() - m_pos : len;
+            memcpy(buf, m_left.data() + m_pos, n);
+            m_pos += n;
+            return (long long)n;
+        }
+
+        long long Write(const char* buf, size_t len)
+        {
+            if(!m_writer)
+                m_writer = new codecpipe(codec::Create(m_kind, true, m_level));
+
+            for(size_t done = 0; done < len; )
+            {
+                int r = m_writer->Pop(m_block);
+                if(r == CODEC_DATA)
+                {
+                    if(m_inner.Write(m_block.data(), m_block.size()) < 0)
+                        return Failed(m_inner.GetLastError());
+                    continue;
+                }
+                if(r != CODEC_MORE)
+                    return Failed(m_writer->GetLastError());
+
+                size_t n = len - done < CODEC_CHUNK ? len - done : CODEC_CHUNK;
+                m_writer->Push(buf + done, n);
+                done += n;
+            }
+            return (long long)len;
+        }
+
+        bool Close(void)
+        {
+            bool ok = true;
+            if(m_writer)
+            {
+                // Flush the trailer before the backend completes the transfer
+                for(;;)
+                {
+                    int r = m_writer->Pop(m_block);
+                    if(r == CODEC_MORE)
+                        m_writer->Finish();
+                    else if(r == CODEC_DATA)
+                    {
+                        if(m_inner.Write(m_block.data(), m_block.size()) < 0)
+                        {
+                            Failed(m_inner.GetLastError());
+                            ok = false;
+                            break;
+                        }
+                    }
+                    else
+                    {
+                        if(r == CODEC_FAILED)
+                        {
+                            Failed(m_writer->GetLastError());
+                            ok = false;
+                        }
+                        break;
+                    }
+                }
+            }
+
+            if(!m_inner.Close() && ok)
+            {
+                Failed(m_inner.GetLastError());
+                ok = false;
+            }
+            return ok;
+        }
+
+        int GetHandle(void)
+        {
+            return m_inner.GetHandle();
+        }
+
+        int GetLastError(void)
+        {
+            return m_err;
+        }
+
+    private:
+        long long Failed(int err)
+        {
+            m_err = err ? err : EIO;
+            return -1;
+        }
+
+        datastream  m_inner;
+        int         m_kind;
+        int         m_level;
+        codecpipe*  m_writer;
+        codecpipe*  m_reader;
+        std::string m_left;     // Decompressed bytes not yet read
+        size_t      m_pos;
+        long long   m_seen;     // Compressed bytes read from m_inner
+        std::string m_block;
+        std::string m_chunk;
+        int         m_err;
+};
+
+datastream codec::Wrap(datastream&& inner, int kind, int level)
+{
+    if(!inner.IsOpen() || !Available(kind))
+        return std::move(inner);
+    return datastream(new codecstream(std::move(inner), kind, level));
+}
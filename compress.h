@@ -0,0 +1,156 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Compression
+  *
+  * Streaming compression for the data path. A codec turns one direction
+  * of a byte stream into deflate (zlib format, what FTP MODE Z carries),
+  * zstd or lz4 and back. A codecpipe runs a codec on its own thread so
+  * the caller keeps reading disk and moving sockets while the previous
+  * chunk is being (de)compressed.
+  *
+  * Compressing pipes watch their own ratio: once CODEC_SAMPLE bytes are
+  * in and the output is still above CODEC_PAYOFF percent of the input,
+  * the rest of that stream goes out stored, so incompressible files cost
+  * little more than a copy.
+  *
+  * codec::Wrap slots the same stage into any connstream backend through
+  * its OpenRead/OpenWrite datastreams. The far side sees the compressed
+  * bytes, so whatever reads the file back has to unwrap it the same way.
+  *
+  * zlib is always required. zstd and lz4 are built in with
+  * CONNSTREAM_ZSTD and CONNSTREAM_LZ4, codec::Available says which are.
+  *
+  * E.G. Usage:
+  *     datastream out = codec::Wrap(c->OpenWrite(_T("app.log.zst")), CODEC_ZSTD);
+  *     while((n = read(fd, buf, sizeof(buf))) > 0)
+  *         out.Write(buf, n);
+  *     out.Close();
+  */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "datastream.h"
+
+#define CODEC_NONE      0
+#define CODEC_DEFLATE   1       // zlib stream (RFC 1950), as used by MODE Z
+#define CODEC_ZSTD      2       // Needs CONNSTREAM_ZSTD
+#define CODEC_LZ4       3       // Needs CONNSTREAM_LZ4
+
+#define CODEC_CHUNK     (128 << 10)     // Input bytes handed to the pipe thread at a time
+#define CODEC_DEPTH     4               // Chunks queued each way before the producer waits
+#define CODEC_SAMPLE    (512 << 10)     // Input seen before the ratio is judged
+#define CODEC_PAYOFF    90              // Output percent of input above which compression stops
+
+/* codecpipe::Pop results */
+#define CODEC_FAILED    -1
+#define CODEC_END       0
+#define CODEC_DATA      1
+#define CODEC_MORE      2
+
+class codec
+{
+    public:
+        /** codec* Create(int, bool, int)
+         *  Makes a codec of @kind (CODEC_*).
+         *      @compress : Compressing when @true, decompressing when @false
+         *      @level    : Codec specific level, -1 for its default
+         *  Returns : a new codec for the caller to delete, NULL when @kind isn't built in
+         */
+        static codec*   Create(int kind, bool compress, int level = -1);
+        static bool     Available(int kind);
+        static const char* Name(int kind);
+
+        /** datastream Wrap(datastream&&, int, int)
+         *  Puts a codecpipe in front of @inner: Write compresses with @kind
+         *  and Read decompresses. Close flushes and closes @inner.
+         *  Returns : the wrapped stream, or @inner as is when @kind isn't built in
+         */
+        static datastream Wrap(datastream&& inner, int kind = CODEC_DEFLATE, int level = -1);
+
+        virtual ~codec(void) {};
+
+        /** bool Process(const char*, size_t, std::string&, bool)
+         *  Feeds @len bytes and appends whatever output is ready to @out.
+         *  @finish ends the stream: a compressor flushes its trailer, a
+         *  decompressor fails when the stream was cut short.
+         *  Returns : @false on corrupt input or a codec failure
+         */
+        virtual bool    Process(const char* in, size_t len, std::string& out, bool finish) = 0;
+
+        /** void SetStored(void)
+         *  Compressors only, everything after this goes out uncompressed
+         *  while staying a valid stream of the same kind.
+         */
+        virtual void    SetStored(void) = 0;
+
+        int             Kind(void) const        { return m_kind; }
+        bool            Compressing(void) const { return m_compress; }
+
+    protected:
+        int     m_kind;
+        bool    m_compress;
+};
+
+class codecpipe
+{
+    public:
+        /** Takes ownership of @c and starts the pipe thread */
+        codecpipe(codec* c);
+        /** Stops the thread, dropping anything still queued */
+        virtual ~codecpipe(void);
+
+        /** int Pop(std::string&)
+         *  Waits until there is something for the caller to do.
+         *  Returns : CODEC_DATA with output in @out,
+         *            CODEC_MORE when the pipe wants another Push or Finish,
+         *            CODEC_END once the last output has been taken,
+         *            CODEC_FAILED when the codec gave up (see GetLastError)
+         */
+        int     Pop(std::string& out);
+
+        /** void Push(const char*, size_t) - Queues input, call after CODEC_MORE */
+        /** void Finish(void) - No more input, call after CODEC_MORE */
+        void    Push(const char* buf, size_t len);
+        void    Finish(void);
+
+        /** Bytes taken in and handed out so far, and whether the
+         *  ratio check switched compression off */
+        long long   BytesIn(void);
+        long long   BytesOut(void);
+        bool        Stored(void);
+        int         GetLastError(void);
+
+    private:
+        codecpipe(const codecpipe&);
+        codecpipe& operator=(const codecpipe&);
+
+        void    Run(void);
+
+        codec*                  m_codec;
+        std::mutex              m_lock;
+        std::condition_variable m_wake;         // Pipe thread waits here
+        std::condition_variable m_ready;        // Caller waits here
+        std::deque<std::string> m_in;
+        std::deque<std::string> m_out;
+        bool                    m_finish;
+        bool                    m_ended;
+        bool                    m_stop;
+        bool                    m_stored;
+        int                     m_err;
+        long long               m_bytesIn;
+        long long               m_bytesOut;
+        std::thread             m_thread;
+};
+
+#endif // _COMPRESS_H_
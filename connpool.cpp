@@ -0,0 +1,377 @@
+#include <connpool.h>
+
+#include <errno.h>
+#include <string.h>
+
+double connstream_pool_stats::HitRate() const
+{
+    unsigned long long total = hits + misses;
+    return total ? (double)hits / (double)total : 0.0;
+}
+
+
+/// LEASE ///
+
+connstream_lease::connstream_lease()
+{
+    m_pool  = NULL;
+    m_conn  = NULL;
+    m_port  = 0;
+    m_err   = 0;
+}
+
+connstream_lease::connstream_lease(connstream_lease&& other)
+{
+    m_pool          = other.m_pool;
+    m_conn          = other.m_conn;
+    m_host.swap(other.m_host);
+    m_port          = other.m_port;
+    m_user.swap(other.m_user);
+    m_err           = other.m_err;
+    other.m_pool    = NULL;
+    other.m_conn    = NULL;
+}
+
+connstream_lease& connstream_lease::operator=(connstream_lease&& other)
+{
+    if(this != &other)
+    {
+        Release();
+        m_pool          = other.m_pool;
+        m_conn          = other.m_conn;
+        m_host.swap(other.m_host);
+        m_port          = other.m_port;
+        m_user.swap(other.m_user);
+        m_err           = other.m_err;
+        other.m_pool    = NULL;
+        other.m_conn    = NULL;
+    }
+    return *this;
+}
+
+connstream_lease::~connstream_lease()
+{
+    Release();
+}
+
+void connstream_lease::Release()
+{
+    if(m_pool && m_conn)
+        m_pool->Return(*this, false);
+    m_pool = NULL;
+    m_conn = NULL;
+}
+
+void connstream_lease::Discard()
+{
+    if(m_pool && m_conn)
+        m_pool->Return(*this, true);
+    m_pool = NULL;
+    m_conn = NULL;
+}
+
+int connstream_lease::GetLastError() const
+{
+    return m_err;
+}
+
+
+/// POOL ///
+
+bool connstream_pool::poolkey::operator<(const poolkey& o) const
+{
+    if(port != o.port)
+        return port < o.port;
+    int c = host.compare(o.host);
+    return c ? c < 0 : user < o.user;
+}
+
+connstream_pool::connstream_pool(factory create, int maxPerHost, int idleTtl)
+{
+    m_create        = create;
+    m_maxPerHost    = maxPerHost > 0 ? maxPerHost : 1;
+    m_ttl           = std::chrono::milliseconds(idleTtl);
+    m_healthAfter   = std::chrono::milliseconds(POOL_HEALTH_AFTER);
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+connstream_pool::~connstream_pool()
+{
+    Clear();
+}
+
+void connstream_pool::Close(std::list<connstream*>& dead)
+{
+    // Always outside the lock, QUIT is a network round trip
+    for(std::list<connstream*>::iterator it = dead.begin(); it != dead.end(); ++it)
+    {
+        (*it)->Disconnect();
+        delete *it;
+    }
+    dead.clear();
+}
+
+void connstream_pool::PruneLocked(clock::time_point now, std::list<connstream*>& dead)
+{
+    for(idlemap::iterator it = m_idle.begin(); it != m_idle.end(); )
+    {
+        std::list<idlesession>& l = it->second;
+
+        // Oldest at the front, the warmest session is reused from the back
+        while(!l.empty() && now - l.front().since >= m_ttl)
+        {
+            dead.push_back(l.front().conn);
+            l.pop_front();
+            m_hosts[std::make_pair(it->first.host, it->first.port)].idle--;
+            m_stats.idle--;
+            m_stats.evictions++;
+        }
+
+        if(l.empty())
+            m_idle.erase(it++);
+        else
+            ++it;
+    }
+}
+
+bool connstream_pool::EvictOldest(const TSTR& host, int port, std::list<connstream*>& dead)
+{
+    idlemap::iterator oldest = m_idle.end();
+    for(idlemap::iterator it = m_idle.begin(); it != m_idle.end(); ++it)
+    {
+        if(it->first.host != host || it->first.port != port || it->second.empty())
+            continue;
+        if(oldest == m_idle.end() || it->second.front().since < oldest->second.front().since)
+            oldest = it;
+    }
+    if(oldest == m_idle.end())
+        return false;
+
+    dead.push_back(oldest->second.front().conn);
+    oldest->second.pop_front();
+    if(oldest->second.empty())
+        m_idle.erase(oldest);
+
+    m_hosts[std::make_pair(host, port)].idle--;
+    m_stats.idle--;
+    m_stats.evictions++;
+    return true;
+}
+
+connstream_lease connstream_pool::Acquire(TSTR host, TSTR user, TSTR pwd, int port, int timeout)
+{
+    connstream_lease lease;
+    lease.m_host = host;
+    lease.m_port = port;
+    lease.m_user = user;
+
+    poolkey key;
+    key.host = host;
+    key.port = port;
+    key.user = user;
+
+    std::list<connstream*> dead;
+    clock::time_point start = clock::now();
+    clock::time_point deadline = start + std::chrono::milliseconds(timeout < 0 ? 0 : timeout);
+    bool waited = false;
+
+    std::unique_lock<std::mutex> g(m_lock);
+    for(;;)
+    {
+        clock::time_point now = clock::now();
+        PruneLocked(now, dead);
+
+        hostslots& slots = m_hosts[std::make_pair(host, port)];
+        if(slots.leased >= m_maxPerHost)
+        {
+            if(!waited)
+                m_stats.waits++;
+            waited = true;
+
+            if(timeout < 0)
+                m_freed.wait(g);
+            else if(m_freed.wait_until(g, deadline) == std::cv_status::timeout
+                    && m_hosts[std::make_pair(host, port)].leased >= m_maxPerHost)
+            {
+                m_stats.timeouts++;
+                g.unlock();
+                Close(dead);
+                lease.m_err = ETIMEDOUT;
+                return lease;
+            }
+            continue;
+        }
+
+        // A slot is ours, account the wait before any network work
+        if(waited)
+        {
+            unsigned long long us = (unsigned long long)
+                std::chrono::duration_cast<std::chrono::microseconds>(now - start).count();
+            m_stats.waitTotal += us;
+            if(us > m_stats.waitMax)
+                m_stats.waitMax = us;
+            waited = false;
+        }
+
+        idlemap::iterator it = m_idle.find(key);
+        if(it != m_idle.end() && !it->second.empty())
+        {
+            idlesession s = it->second.back();
+            it->second.pop_back();
+            if(it->second.empty())
+                m_idle.erase(it);
+            slots.idle--;
+            slots.leased++;
+            m_stats.idle--;
+            m_stats.leased++;
+
+            bool probe = now - s.since >= m_healthAfter;
+            g.unlock();
+            Close(dead);
+
+            if(!probe || s.conn->Command(_T("NOOP")))
+            {
+                g.lock();
+                m_stats.hits++;
+                lease.m_pool = this;
+                lease.m_conn = s.conn;
+                return lease;
+            }
+
+            // Gone stale behind our back, drop it and go round again
+            s.conn->Disconnect();
+            delete s.conn;
+            g.lock();
+            m_stats.healthFails++;
+            m_stats.leased--;
+            m_hosts[std::make_pair(host, port)].leased--;
+            start = clock::now();
+            continue;
+        }
+
+        // Make room under the host cap by closing someone else's idle session
+        if(slots.leased + slots.idle >= m_maxPerHost)
+            EvictOldest(host, port, dead);
+
+        hostslots& held = m_hosts[std::make_pair(host, port)];
+        held.leased++;
+        m_stats.leased++;
+        m_stats.misses++;
+        g.unlock();
+        Close(dead);
+
+        connstream* c = m_create ? m_create() : NULL;
+        if(c && c->Connect(host, user, pwd, port))
+        {
+            lease.m_pool = this;
+            lease.m_conn = c;
+            return lease;
+        }
+
+        lease.m_err = c ? c->GetLastError() : ENOMEM;
+        delete c;
+
+        g.lock();
+        m_stats.connectFails++;
+        m_stats.leased--;
+        m_hosts[std::make_pair(host, port)].leased--;
+        m_freed.notify_one();
+        return lease;
+    }
+}
+
+void connstream_pool::Return(connstream_lease& lease, bool discard)
+{
+    std::list<connstream*> dead;
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        hostslots& slots = m_hosts[std::make_pair(lease.m_host, lease.m_port)];
+        slots.leased--;
+        m_stats.leased--;
+
+        if(discard)
+            dead.push_back(lease.m_conn);
+        else
+        {
+            poolkey key;
+            key.host = lease.m_host;
+            key.port = lease.m_port;
+            key.user = lease.m_user;
+
+            idlesession s;
+            s.conn  = lease.m_conn;
+            s.since = clock::now();
+            m_idle[key].push_back(s);
+            slots.idle++;
+            m_stats.idle++;
+        }
+
+        PruneLocked(clock::now(), dead);
+    }
+    m_freed.notify_all();
+    Close(dead);
+}
+
+void connstream_pool::Prune()
+{
+    std::list<connstream*> dead;
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        PruneLocked(clock::now(), dead);
+    }
+    Close(dead);
+}
+
+void connstream_pool::Clear()
+{
+    std::list<connstream*> dead;
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        for(idlemap::iterator it = m_idle.begin(); it != m_idle.end(); ++it)
+        {
+            for(std::list<idlesession>::iterator s = it->second.begin(); s != it->second.end(); ++s)
+                dead.push_back(s->conn);
+            m_hosts[std::make_pair(it->first.host, it->first.port)].idle = 0;
+        }
+        m_idle.clear();
+        m_stats.idle = 0;
+    }
+    Close(dead);
+}
+
+void connstream_pool::SetMaxPerHost(int max)
+{
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        m_maxPerHost = max > 0 ? max : 1;
+    }
+    m_freed.notify_all();
+}
+
+void connstream_pool::SetIdleTTL(int ms)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    m_ttl = std::chrono::milliseconds(ms);
+}
+
+void connstream_pool::SetHealthCheck(int ms)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    m_healthAfter = std::chrono::milliseconds(ms);
+}
+
+connstream_pool_stats connstream_pool::GetStats()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    return m_stats;
+}
+
+void connstream_pool::ResetStats()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    unsigned int idle   = m_stats.idle;
+    unsigned int leased = m_stats.leased;
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_stats.idle    = idle;
+    m_stats.leased  = leased;
+}
@@ -0,0 +1,196 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Connection Stream Pool
+  *
+  * Keeps logged in connstream sessions warm so callers moving many
+  * small files don't pay a TCP handshake plus login per file.
+  * Sessions are keyed by (host, port, user) and handed out as RAII
+  * leases that go back to the pool when they leave scope. A session
+  * that sat idle for a while is probed with NOOP before reuse, and
+  * one idle past the TTL is disconnected. Each host has a cap on the
+  * number of sessions leased at once, Acquire waits for a free slot.
+  *
+  * The pool is thread-safe, a lease is owned by one thread at a time.
+  * NB: Sessions are handed back as they were left, so leases should
+  *     use absolute paths rather than rely on the working directory.
+  *
+  * E.G. Usage:
+  *     connstream_pool pool([]() -> connstream* { return new PosixFTP; });
+  *
+  *     connstream_lease c = pool.Acquire(_T("host"), _T("uid"), _T("pwd"), 21);
+  *     if(c)
+  *         c->Upload(_T("a.txt"), _T("/in/a.txt"));
+  */
+
+#ifndef _CONNPOOL_H_
+#define _CONNPOOL_H_
+
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include "connstream.h"
+
+#define POOL_MAX_PER_HOST   4       // Sessions leased to one host at once
+#define POOL_IDLE_TTL       60000   // Milliseconds an idle session is kept
+#define POOL_HEALTH_AFTER   2000    // Idle milliseconds before a NOOP probe on reuse
+
+class connstream_pool;
+
+/** Counters since construction (or ResetStats), all times in microseconds */
+struct connstream_pool_stats
+{
+    unsigned long long  hits;           // Acquires served by a warm session
+    unsigned long long  misses;         // Acquires that had to connect
+    unsigned long long  connectFails;   // Connect attempts that failed
+    unsigned long long  healthFails;    // Warm sessions that failed NOOP
+    unsigned long long  evictions;      // Idle sessions closed by TTL or to make room
+    unsigned long long  waits;          // Acquires that waited for a host slot
+    unsigned long long  timeouts;       // Acquires that gave up waiting
+    unsigned long long  waitTotal;
+    unsigned long long  waitMax;
+    unsigned int        idle;           // Sessions currently parked
+    unsigned int        leased;         // Sessions currently handed out
+
+    /** Hits / (hits + misses), 0 before the first Acquire */
+    double HitRate(void) const;
+};
+
+class connstream_lease
+{
+    public:
+        connstream_lease(void);
+        connstream_lease(connstream_lease&& other);
+        connstream_lease& operator=(connstream_lease&& other);
+        /** Returns the session to its pool on scope end */
+        ~connstream_lease(void);
+
+        connstream* operator->(void) const  { return m_conn; }
+        connstream* Get(void) const         { return m_conn; }
+        explicit operator bool(void) const  { return m_conn != NULL; }
+
+        /** void Release(void)
+         *  Hands the session back to the pool early.
+         */
+        /** void Discard(void)
+         *  Disconnects and drops the session instead of parking it, use after
+         *  a failure that leaves the connection in doubt.
+         */
+        void        Release(void);
+        void        Discard(void);
+
+        /** int GetLastError()
+         *  Returns : why Acquire produced an empty lease, ETIMEDOUT when no host
+         *            slot freed in time or the session's Connect error
+         */
+        int         GetLastError(void) const;
+
+    private:
+        friend class connstream_pool;
+        connstream_lease(const connstream_lease&);
+        connstream_lease& operator=(const connstream_lease&);
+
+        connstream_pool*    m_pool;
+        connstream*         m_conn;
+        TSTR                m_host;
+        int                 m_port;
+        TSTR                m_user;
+        int                 m_err;
+};
+
+class connstream_pool
+{
+    public:
+        typedef std::function<connstream*(void)> factory;
+
+        /** connstream_pool(factory, int, int)
+         *      @create     : Returns a new unconnected backend, e.g. new PosixFTP
+         *      @maxPerHost : Sessions that may be leased to one host:port at once
+         *      @idleTtl    : Milliseconds an unused session is kept before eviction
+         */
+        connstream_pool(factory create,
+                        int maxPerHost = POOL_MAX_PER_HOST,
+                        int idleTtl = POOL_IDLE_TTL);
+        /** Disconnects every parked session. Leases must be released first. */
+        virtual ~connstream_pool(void);
+
+        /** connstream_lease Acquire(TSTR, TSTR, TSTR, int, int)
+         *  Leases a logged in session, reusing a warm one when possible.
+         *      @host       : Fully qualified domain name or IP Address
+         *      @user       : User id
+         *      @pwd        : Password, only used when a new session is connected
+         *      @port       : Port, 0 for the backend default
+         *      @timeout    : Milliseconds to wait for a host slot, -1 waits forever
+         *  Returns : a lease holding the session, or an empty lease (see GetLastError)
+         */
+        connstream_lease Acquire(TSTR host,
+                                 TSTR user = _T(""),
+                                 TSTR pwd = _T(""),
+                                 int port = 0,
+                                 int timeout = -1);
+
+        /** void Prune(void)
+         *  Disconnects idle sessions older than the TTL, Acquire and Release
+         *  do this on the way through so it is only needed on a quiet pool.
+         */
+        /** void Clear(void)
+         *  Disconnects every idle session now.
+         */
+        void    Prune(void);
+        void    Clear(void);
+
+        void    SetMaxPerHost(int max);
+        void    SetIdleTTL(int ms);
+        void    SetHealthCheck(int ms);
+
+        connstream_pool_stats   GetStats(void);
+        void                    ResetStats(void);
+
+    private:
+        friend class connstream_lease;
+        typedef std::chrono::steady_clock clock;
+
+        struct poolkey
+        {
+            TSTR    host;
+            int     port;
+            TSTR    user;
+            bool operator<(const poolkey& o) const;
+        };
+        struct idlesession
+        {
+            connstream*         conn;
+            clock::time_point   since;
+        };
+        struct hostslots
+        {
+            int leased;
+            int idle;
+        };
+        typedef std::map<poolkey, std::list<idlesession> >  idlemap;
+        typedef std::map<std::pair<TSTR, int>, hostslots>   hostmap;
+
+        void    Return(connstream_lease& lease, bool discard);
+        void    PruneLocked(clock::time_point now, std::list<connstream*>& dead);
+        bool    EvictOldest(const TSTR& host, int port, std::list<connstream*>& dead);
+        void    Close(std::list<connstream*>& dead);
+
+        factory                     m_create;
+        int                         m_maxPerHost;
+        clock::duration             m_ttl;
+        clock::duration             m_healthAfter;
+
+        std::mutex                  m_lock;
+        std::condition_variable     m_freed;
+        idlemap                     m_idle;
+        hostmap                     m_hosts;
+        connstream_pool_stats       m_stats;
+};
+
+#endif // _CONNPOOL_H_
@@ -61,10 +61,29 @@
 // Suggested return for getfilesize()
 #define INVALID_FILE    -1
 
+#include <chrono>
 #include <string>
 #include <vector>
+#include "datastream.h"
+#include "dirlist.h"
+#include "patharena.h"
 
-#define LIST    std::vector<TSTR>
+#define LIST        std::vector<TSTR>
+#define TSTRVIEW    basic_pathview<TSTR::value_type>
+
+typedef basic_patharena<TSTR::value_type> patharena;
+
+/** Everything about how one call went, returned by value from the ...Ex methods */
+struct connresult
+{
+    bool        ok;
+    int         err;            // GetLastError() of the call, 0 when it succeeded
+    int         reply;          // Last protocol reply the session had, 0 for backends without one
+    long long   bytes;          // Payload a transfer moved, the size for GetFileSizeEx
+    double      seconds;        // Spent in the call
+
+    explicit operator bool() const  { return ok; }
+};
 
 class connstream
 {
@@ -105,6 +124,26 @@ class connstream
         virtual bool Upload(TSTR, TSTR) = 0;
         virtual bool Download(TSTR, TSTR) = 0;
 
+        /// STREAMING METHODS ///
+        /** datastream OpenRead(TSTR, long long)
+         *  Opens a host file for reading in chunks without landing it on client disk.
+         *      @location   : Host file location
+         *      @offset     : Byte offset to start reading from
+         *  Returns : an open datastream, or a closed one (IsOpen() is @false) on failure
+         *              or if the stream type has no streaming support.
+         */
+        /** datastream OpenWrite(TSTR, bool)
+         *  Opens a host file for writing in chunks.
+         *      @location   : Host file location
+         *      @append     : Append to an existing file instead of replacing it
+         *  Returns : an open datastream, or a closed one (IsOpen() is @false) on failure
+         *              or if the stream type has no streaming support.
+         *
+         *  NB: Only one stream can be open per connection, other calls fail until it is closed.
+         */
+        virtual datastream OpenRead(TSTR, long long = 0) { return datastream(); }
+        virtual datastream OpenWrite(TSTR, bool = false) { return datastream(); }
+
         /// DIRECTORY METHODS ///
         /** bool ChangeDirectory(TSTR)
          *  Change Directory to either a fully qualified path or relative path.
@@ -134,11 +173,59 @@ class connstream
          *      @searchstr  : Search string thats system valid, e.g. *.txt, file.txt, *.* etc.
          *  Returns a vector list of file names.
          */
+        /** bool ListDir(TSTR, DirList&)
+         *  Lists a directory with a size, time and type per entry, replacing
+         *  what @entries held. Backends that can override it with one
+         *  listing. The default builds it from SearchDir, a GetFileSize per
+         *  name and a ChangeDir probe for the rest, with no times. Each probe
+         *  puts the working directory back.
+         *      @dir  : Directory on host to list
+         *  Returns : @true with the listing or @false if it couldn't be had.
+         */
         virtual bool    ChangeDir(TSTR) = 0;
         virtual bool    MakeDir(TSTR) = 0;
         virtual bool    RemoveDir(TSTR) = 0;
         virtual TSTR    CurrentDir(void) = 0;
         virtual LIST    SearchDir(TSTR) = 0;
+#if !defined(UNICODE) && !defined(_UNICODE_)   // DirList names are narrow
+        virtual bool    ListDir(TSTR dir, DirList& entries)
+        {
+            entries.Clear();
+            LIST names = SearchDir(dir == _T("/") ? TSTR(_T("/*")) : dir + _T("/*"));
+            if(names.empty() && GetLastError())
+                return false;
+
+            TSTR cwd;
+            for(size_t i = 0; i < names.size(); i++)
+            {
+                TSTR name = names[i].substr(names[i].rfind('/') + 1);
+                if(name.empty() || name == _T(".") || name == _T(".."))
+                    continue;
+
+                TSTR path = (dir == _T("/") ? TSTR() : dir) + _T("/") + name;
+                DirEntry e;
+                e.name      = name.c_str();
+                e.namelen   = name.size();
+                e.size      = GetFileSize(path);
+                e.mtime     = -1;
+                e.type      = DIRENT_FILE;
+                e.perms     = 0;
+                if(e.size == INVALID_FILE)
+                {
+                    // No size, a directory if it can be entered
+                    if(cwd.empty())
+                        cwd = CurrentDir();
+                    if(cwd == _T("ERROR-1") || !ChangeDir(path))
+                        continue;
+                    ChangeDir(cwd);
+                    e.type = DIRENT_DIR;
+                }
+                entries.Add(e);
+            }
+            m_err = 0;
+            return true;
+        }
+#endif
 
         /// FILE HANDLING METHODS ///
         /** bool Remove(TSTR)
@@ -166,10 +253,17 @@ class connstream
          *  Returns : File size as a long long or @INVALID_FILE if file does not exist or
          *              if there is no active connection.
          */
+        /** LONGLONG GetModTime(TSTR)
+         *  Last modification of existing host file.
+         *      @filename   : Name of file to retrieve the time of on host.
+         *  Returns : UTC seconds since the epoch or @INVALID_FILE if file does not exist,
+         *              if there is no active connection or the backend can't tell.
+         */
         virtual bool        Remove(TSTR) = 0;
         virtual bool        Rename(TSTR, TSTR) = 0;
         virtual bool        Exists(TSTR) = 0;
         virtual long long   GetFileSize(TSTR) = 0;
+        virtual long long   GetModTime(TSTR)    { return INVALID_FILE; }
 
         /// MISCELLANEOUS METHODS ///
         /** bool Command(TSTR)
@@ -189,9 +283,149 @@ class connstream
          */
         virtual int GetLastError(void) = 0;
 
+        /// RESULT METHODS ///
+        /** connresult ...Ex(...)
+         *  The calls above with their whole outcome returned as a connresult
+         *  instead of left behind in GetLastError(). Each reads its error,
+         *  reply and byte count straight after the call, so nothing a later
+         *  call does can change what it returned. Building the result never
+         *  touches the heap and takes no lock.
+         *
+         *  Paths are taken by reference and the directory and file calls go
+         *  through the ...View methods, allocation free on a backend that
+         *  overrides them. Connect, Upload, Download and Command still copy
+         *  into their plain method.
+         *
+         *  CurrentDirEx and SearchDirEx return their data through @out,
+         *  CurrentDirEx reusing its capacity.
+         *
+         *  NB: A session is one conversation with the host and is used by one
+         *      thread at a time, Ex calls included. Threads that share one
+         *      take turns outside it, or each lease their own from a
+         *      connstream_pool.
+         */
+        virtual connresult ConnectEx(const TSTR& url, const TSTR& uid = _T(""), const TSTR& pwd = _T(""), int port = 0)
+        {
+            return Call([&]() { return Connect(url, uid, pwd, port); });
+        }
+        virtual connresult DisconnectEx(void)
+        {
+            return Call([&]() { return Disconnect(); });
+        }
+        virtual connresult UploadEx(const TSTR& location, const TSTR& rename)
+        {
+            return Call([&]() { return Upload(location, rename); }, true);
+        }
+        virtual connresult DownloadEx(const TSTR& location, const TSTR& rename)
+        {
+            return Call([&]() { return Download(location, rename); }, true);
+        }
+        virtual connresult ChangeDirEx(const TSTR& dir)
+        {
+            return Call([&]() { return ChangeDirView(dir); });
+        }
+        virtual connresult MakeDirEx(const TSTR& dir)
+        {
+            return Call([&]() { return MakeDirView(dir); });
+        }
+        virtual connresult RemoveDirEx(const TSTR& dir)
+        {
+            return Call([&]() { return RemoveDirView(dir); });
+        }
+        virtual connresult CurrentDirEx(TSTR& out)
+        {
+            return Call([&]()
+            {
+                TSTRVIEW cwd = CurrentDirView();
+                out.assign(cwd.data(), cwd.size());
+                return !cwd.empty() && !GetLastError();
+            });
+        }
+        virtual connresult SearchDirEx(const TSTR& searchstr, LIST& out)
+        {
+            return Call([&]() { out = SearchDir(searchstr); return !out.empty() || !GetLastError(); });
+        }
+        virtual connresult RemoveEx(const TSTR& filename)
+        {
+            return Call([&]() { return RemoveView(filename); });
+        }
+        virtual connresult RenameEx(const TSTR& oldFilename, const TSTR& newFilename)
+        {
+            return Call([&]() { return RenameView(oldFilename, newFilename); });
+        }
+        virtual connresult ExistsEx(const TSTR& filename)
+        {
+            return Call([&]() { return ExistsView(filename); });
+        }
+        virtual connresult GetFileSizeEx(const TSTR& filename)
+        {
+            long long size = INVALID_FILE;
+            connresult r = Call([&]() { return (size = GetFileSizeView(filename)) != INVALID_FILE; });
+            r.bytes = r.ok ? size : 0;
+            return r;
+        }
+        virtual connresult CommandEx(const TSTR& command)
+        {
+            return Call([&]() { return Command(command); });
+        }
+
+        /// PATH VIEW METHODS ///
+        /** bool ...View(TSTRVIEW)
+         *  The directory and file handling calls above taking their paths as
+         *  views, a literal or part of a longer string goes in as it is. A
+         *  backend that overrides them works its paths out in its patharena
+         *  and costs no heap allocation once warm, the defaults copy into
+         *  the arena and call the TSTR method.
+         */
+        /** TSTRVIEW CurrentDirView(void)
+         *  The working directory as last known, asking the host only when
+         *  it isn't. Valid until the next call on this session, empty when
+         *  it can't be had.
+         */
+        virtual bool        ChangeDirView(TSTRVIEW dir)         { return ChangeDir(m_paths.Copy(0, dir)); }
+        virtual bool        MakeDirView(TSTRVIEW dir)           { return MakeDir(m_paths.Copy(0, dir)); }
+        virtual bool        RemoveDirView(TSTRVIEW dir)         { return RemoveDir(m_paths.Copy(0, dir)); }
+        virtual TSTRVIEW    CurrentDirView(void)
+        {
+            m_paths[0] = CurrentDir();
+            return m_paths[0] != _T("ERROR-1") ? TSTRVIEW(m_paths[0]) : TSTRVIEW();
+        }
+        virtual bool        RemoveView(TSTRVIEW filename)       { return Remove(m_paths.Copy(0, filename)); }
+        virtual bool        RenameView(TSTRVIEW oldFilename, TSTRVIEW newFilename)
+        {
+            return Rename(m_paths.Copy(0, oldFilename), m_paths.Copy(1, newFilename));
+        }
+        virtual bool        ExistsView(TSTRVIEW filename)       { return Exists(m_paths.Copy(0, filename)); }
+        virtual long long   GetFileSizeView(TSTRVIEW filename)  { return GetFileSize(m_paths.Copy(0, filename)); }
+
     protected:
-        bool    m_connected;
-        int     m_err;
+        /** int LastReply(void) / long long LastMoved(void)
+         *  What the backend can add to a connresult, read straight after the
+         *  call. The reply is the last one the session got,
+         *  the byte count that of the last Upload/Download.
+         */
+        virtual int         LastReply(void)     { return 0; }
+        virtual long long   LastMoved(void)     { return 0; }
+
+        /** Runs @op and fills a connresult from it */
+        template<class F>
+        connresult Call(F op, bool transfer = false)
+        {
+            typedef std::chrono::steady_clock clock;
+
+            clock::time_point t0 = clock::now();
+            connresult r;
+            r.ok        = op();
+            r.err       = r.ok ? 0 : GetLastError();
+            r.reply     = LastReply();
+            r.bytes     = transfer && r.ok ? LastMoved() : 0;
+            r.seconds   = std::chrono::duration<double>(clock::now() - t0).count();
+            return r;
+        }
+
+        bool        m_connected;
+        int         m_err;
+        patharena   m_paths;        // Scratch for paths, see patharena.h
 };
 
 #endif // _CONNSTREAM_H
@@ -0,0 +1,542 @@
+#include <contentcache.h>
+
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include "checksum.h"
+
+#define CONTENT_BUFSIZE     (1 << 20)       // Hashing and read/write fallback
+#define CONTENT_COPY_CHUNK  (1 << 30)       // Bytes asked of one copy_file_range call
+#define CONTENT_MAGIC       "connstream-content"
+
+static std::atomic<unsigned> g_unique(0);
+
+/** flock(2) on the cache's lock file while in scope, Held() says whether it was got */
+class contentlock
+{
+    public:
+        contentlock(const TSTR& dir, int how)
+        {
+            m_fd = open((dir + "/lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            int r = 0;
+            while(m_fd >= 0 && (r = flock(m_fd, how)) < 0 && errno == EINTR)
+                ;
+            if(m_fd >= 0 && r < 0)
+            {
+                close(m_fd);
+                m_fd = -1;
+            }
+        }
+        ~contentlock(void)
+        {
+            // Closing the only descriptor on it lets the lock go
+            if(m_fd >= 0)
+                close(m_fd);
+        }
+        bool Held(void) const
+        {
+            return m_fd >= 0;
+        }
+
+    private:
+        int m_fd;
+};
+
+static bool MakeDir(const TSTR& path)
+{
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+static TSTR Digest(const TSTR& text)
+{
+    checksum sum(CHECKSUM_SHA256);
+    sum.Update(text.data(), text.size());
+    return sum.Hex();
+}
+
+static int DigestFile(const TSTR& path, TSTR& hex)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return errno;
+
+    checksum sum(CHECKSUM_SHA256);
+    std::vector<char> buf(CONTENT_BUFSIZE);
+    int err = 0;
+    for(;;)
+    {
+        ssize_t n = read(fd, &buf[0], buf.size());
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            err = n < 0 ? errno : 0;
+            break;
+        }
+        sum.Update(&buf[0], (size_t)n);
+    }
+    close(fd);
+    hex = sum.Hex();
+    return err;
+}
+
+static int CopyFd(int in, int out)
+{
+    for(;;)
+    {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, CONTENT_COPY_CHUNK, 0);
+        if(n > 0)
+            continue;
+        if(n == 0)
+            return 0;
+        if(errno == EINTR)
+            continue;
+        if(errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+            break;
+        return errno;
+    }
+
+    std::vector<char> buf(CONTENT_BUFSIZE);
+    for(;;)
+    {
+        ssize_t n = read(in, &buf[0], buf.size());
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return n < 0 ? errno : 0;
+        for(ssize_t done = 0; done < n; )
+        {
+            ssize_t w = write(out, &buf[done], (size_t)(n - done));
+            if(w < 0 && errno == EINTR)
+                continue;
+            if(w < 0)
+                return errno;
+            done += w;
+        }
+    }
+}
+
+/** Calls @visit for every file one shard below @area, objects/ab/ab12... */
+static void Walk(const TSTR& area, const std::function<void(const TSTR&, const struct stat&)>& visit)
+{
+    DIR* top = opendir(area.c_str());
+    if(!top)
+        return;
+    while(struct dirent* shard = readdir(top))
+    {
+        if(shard->d_name[0] == '.')
+            continue;
+        TSTR dir = area + "/" + shard->d_name;
+        DIR* d = opendir(dir.c_str());
+        if(!d)
+            continue;
+        while(struct dirent* e = readdir(d))
+        {
+            struct stat st;
+            TSTR path = dir + "/" + e->d_name;
+            if(e->d_name[0] != '.' && lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                visit(path, st);
+        }
+        closedir(d);
+    }
+    closedir(top);
+}
+
+double contentcache_stats::HitRate() const
+{
+    unsigned long long lookups = hits + misses;
+    return lookups ? (double)hits / (double)lookups : 0;
+}
+
+contentcache::contentcache(TSTR dir, long long maxBytes, unsigned link)
+    : m_dir(dir), m_maxBytes(maxBytes), m_link(link)
+{
+    while(m_dir.size() > 1 && m_dir[m_dir.size() - 1] == '/')
+        m_dir.erase(m_dir.size() - 1);
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+contentcache::~contentcache()
+{
+}
+
+
+/// DOWNLOAD ///
+
+connresult contentcache::Download(connstream& conn, const TSTR& site, TSTR remote, TSTR local)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point t0 = clock::now();
+    if(local.empty())
+        local = remote;
+
+    long long size  = conn.GetFileSize(remote);
+    long long mtime = size != INVALID_FILE ? conn.GetModTime(remote) : INVALID_FILE;
+    TSTR key;
+    if(mtime == INVALID_FILE || !Setup() || !Key(conn, site, remote, key))
+    {
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            m_stats.uncacheable++;
+        }
+        return conn.DownloadEx(remote, local);
+    }
+
+    connresult r;
+    TSTR object;
+    {
+        contentlock lock(m_dir, LOCK_SH);
+        if(lock.Held() && Lookup(key, size, mtime, object))
+        {
+            // Under the lock, so nothing evicts it half way through
+            int err = Materialize(object, local);
+            if(!err)
+            {
+                std::lock_guard<std::mutex> g(m_lock);
+                m_stats.hits++;
+                m_stats.bytesSaved += size;
+            }
+            r.ok        = !err;
+            r.err       = err;
+            r.reply     = 0;
+            r.bytes     = 0;
+            r.seconds   = std::chrono::duration<double>(clock::now() - t0).count();
+            return r;
+        }
+    }
+
+    TSTR tmp = Unique(m_dir + "/tmp/");
+    r = conn.DownloadEx(remote, tmp);
+    if(r.ok)
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        m_stats.misses++;
+        m_stats.bytesFetched += r.bytes ? r.bytes : size;
+    }
+
+    // The local name is served first, the cache only gets what is left.
+    // A file whose size moved while it came down is delivered, not kept.
+    struct stat st;
+    int err = r.ok ? Materialize(tmp, local) : 0;
+    if(!r.ok || err || stat(tmp.c_str(), &st) < 0 || (long long)st.st_size != size
+        || !Insert(key, size, mtime, tmp))
+        unlink(tmp.c_str());
+    else
+        Trim();
+
+    if(err)
+    {
+        r.ok    = false;
+        r.err   = err;
+    }
+    r.seconds = std::chrono::duration<double>(clock::now() - t0).count();
+    return r;
+}
+
+bool contentcache::Setup()
+{
+    return MakeDir(m_dir) && MakeDir(m_dir + "/objects") && MakeDir(m_dir + "/index")
+        && MakeDir(m_dir + "/tmp");
+}
+
+bool contentcache::Key(connstream& conn, const TSTR& site, const TSTR& remote, TSTR& key)
+{
+    key = site + "\n";
+    if(!remote.empty() && remote[0] == '/')
+    {
+        patharena::Normalize(key, TSTRVIEW(), remote);
+        return true;
+    }
+
+    TSTRVIEW cwd = conn.CurrentDirView();
+    if(cwd.empty() || cwd[0] != '/')
+        return false;
+    patharena::Normalize(key, cwd, remote);
+    return true;
+}
+
+TSTR contentcache::Path(const char* area, const TSTR& hex)
+{
+    return m_dir + "/" + area + "/" + hex.substr(0, 2) + "/" + hex;
+}
+
+TSTR contentcache::Unique(const TSTR& prefix)
+{
+    char name[48];
+    snprintf(name, sizeof(name), ".content.%d.%u", (int)getpid(), g_unique.fetch_add(1));
+    return prefix + name;
+}
+
+long long contentcache::Budget()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    return m_maxBytes;
+}
+
+bool contentcache::Lookup(const TSTR& key, long long size, long long mtime, TSTR& object)
+{
+    FILE* f = fopen(Path("index", Digest(key)).c_str(), "re");
+    if(!f)
+        return false;
+
+    TSTR text;
+    char buf[4096];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        text.append(buf, n);
+    fclose(f);
+
+    // magic, "size mtime", content digest, then the key itself
+    char head[96];
+    snprintf(head, sizeof(head), CONTENT_MAGIC "\n%lld %lld\n", size, mtime);
+    size_t hexEnd = text.find('\n', strlen(head));
+    if(text.compare(0, strlen(head), head) || hexEnd == TSTR::npos
+        || text.compare(hexEnd + 1, TSTR::npos, key + "\n"))
+        return false;
+
+    object = Path("objects", text.substr(strlen(head), hexEnd - strlen(head)));
+
+    // Touching it is the LRU clock, failing that it has to at least be there
+    return utimensat(AT_FDCWD, object.c_str(), NULL, 0) == 0
+        || (errno != ENOENT && access(object.c_str(), R_OK) == 0);
+}
+
+bool contentcache::Insert(const TSTR& key, long long size, long long mtime, const TSTR& tmp)
+{
+    TSTR hex;
+    if(DigestFile(tmp, hex))
+        return false;
+
+    TSTR object = Path("objects", hex);
+    TSTR entry  = Path("index", Digest(key));
+    TSTR staged = tmp + ".index";
+
+    FILE* f = fopen(staged.c_str(), "we");
+    if(!f)
+        return false;
+    bool written = fprintf(f, CONTENT_MAGIC "\n%lld %lld\n%s\n%s\n", size, mtime, hex.c_str(), key.c_str()) > 0;
+    if(fclose(f) != 0 || !written)
+    {
+        unlink(staged.c_str());
+        return false;
+    }
+
+    contentlock lock(m_dir, LOCK_EX);
+    bool dedup = access(object.c_str(), F_OK) == 0;
+    bool filed = lock.Held()
+        && MakeDir(object.substr(0, object.rfind('/')))
+        && MakeDir(entry.substr(0, entry.rfind('/')));
+
+    // Already there under another name or host: the copy just fetched goes
+    if(filed && dedup)
+        filed = unlink(tmp.c_str()) == 0;
+    else if(filed)
+        filed = chmod(tmp.c_str(), 0444) == 0 && rename(tmp.c_str(), object.c_str()) == 0;
+
+    // Its mtime is the LRU clock, a download may carry the host's time
+    if(filed)
+        utimensat(AT_FDCWD, object.c_str(), NULL, 0);
+
+    if(!filed || rename(staged.c_str(), entry.c_str()) < 0)
+    {
+        unlink(staged.c_str());
+        return false;
+    }
+
+    if(dedup)
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        m_stats.dedups++;
+    }
+    return true;
+}
+
+int contentcache::Materialize(const TSTR& from, const TSTR& local)
+{
+    TSTR tmp = Unique(local);
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if(in < 0)
+        return errno;
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if(out < 0)
+    {
+        int err = errno;
+        close(in);
+        return err;
+    }
+
+    int err = 0;
+    unsigned long long contentcache_stats::* how = NULL;
+#if defined(FICLONE)
+    if((m_link & CONTENT_REFLINK) && ioctl(out, FICLONE, in) == 0)
+        how = &contentcache_stats::reflinks;
+#endif
+    if(!how && (m_link & CONTENT_HARDLINK))
+    {
+        // link() won't take a name that exists, give back the one just made
+        close(out);
+        unlink(tmp.c_str());
+        out = -1;
+        if(link(from.c_str(), tmp.c_str()) == 0)
+            how = &contentcache_stats::hardlinks;
+        else if((out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) < 0)
+            err = errno;
+    }
+    if(!how && !err)
+    {
+        err = CopyFd(in, out);
+        how = &contentcache_stats::copies;
+    }
+
+    close(in);
+    if(out >= 0 && close(out) < 0 && !err)
+        err = errno;
+    if(!err && rename(tmp.c_str(), local.c_str()) < 0)
+        err = errno;
+    if(err)
+    {
+        unlink(tmp.c_str());
+        return err;
+    }
+
+    std::lock_guard<std::mutex> g(m_lock);
+    m_stats.*how += 1;
+    return 0;
+}
+
+
+/// MAINTENANCE ///
+
+bool contentcache::Trim()
+{
+    struct item
+    {
+        struct timespec used;
+        long long       size;
+        TSTR            path;
+
+        bool operator<(const item& o) const
+        {
+            return used.tv_sec != o.used.tv_sec ? used.tv_sec < o.used.tv_sec : used.tv_nsec < o.used.tv_nsec;
+        }
+    };
+
+    if(!Setup())
+        return false;
+    contentlock lock(m_dir, LOCK_EX);
+    if(!lock.Held())
+        return false;
+
+    std::vector<item> items;
+    long long total = 0;
+    Walk(m_dir + "/objects", [&](const TSTR& path, const struct stat& st)
+    {
+        item it = { st.st_mtim, (long long)st.st_size, path };
+        items.push_back(it);
+        total += it.size;
+    });
+
+    long long budget = Budget();
+    unsigned long long evicted = 0;
+    if(total > budget)
+    {
+        std::sort(items.begin(), items.end());
+        for(size_t i = 0; i < items.size() && total > budget; i++)
+            if(unlink(items[i].path.c_str()) == 0)
+            {
+                total -= items[i].size;
+                evicted++;
+            }
+    }
+
+    // Index entries whose content went are dead weight
+    if(evicted)
+    {
+        Walk(m_dir + "/index", [&](const TSTR& path, const struct stat&)
+        {
+            char buf[256];
+            FILE* f = fopen(path.c_str(), "re");
+            size_t n = f ? fread(buf, 1, sizeof(buf) - 1, f) : 0;
+            if(f)
+                fclose(f);
+            buf[n] = '\0';
+
+            char* hex = strchr(buf, '\n');
+            hex = hex ? strchr(hex + 1, '\n') : NULL;
+            char* end = hex ? strchr(hex + 1, '\n') : NULL;
+            if(end && access(Path("objects", TSTR(hex + 1, end)).c_str(), F_OK) < 0 && errno == ENOENT)
+                unlink(path.c_str());
+        });
+    }
+
+    // Downloads a crashed process never finished
+    TSTR tmp = m_dir + "/tmp";
+    if(DIR* d = opendir(tmp.c_str()))
+    {
+        time_t stale = time(NULL) - CONTENT_STALE;
+        while(struct dirent* e = readdir(d))
+        {
+            struct stat st;
+            TSTR path = tmp + "/" + e->d_name;
+            if(e->d_name[0] == '.' && (!e->d_name[1] || e->d_name[1] == '.'))
+                continue;
+            if(lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime < stale)
+                unlink(path.c_str());
+        }
+        closedir(d);
+    }
+
+    std::lock_guard<std::mutex> g(m_lock);
+    m_stats.evictions += evicted;
+    return true;
+}
+
+void contentcache::Clear()
+{
+    contentlock lock(m_dir, LOCK_EX);
+    if(!lock.Held())
+        return;
+    Walk(m_dir + "/index", [](const TSTR& path, const struct stat&) { unlink(path.c_str()); });
+    Walk(m_dir + "/objects", [](const TSTR& path, const struct stat&) { unlink(path.c_str()); });
+}
+
+void contentcache::SetMaxBytes(long long bytes)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    m_maxBytes = bytes;
+}
+
+long long contentcache::Usage()
+{
+    long long total = 0;
+    contentlock lock(m_dir, LOCK_SH);
+    if(lock.Held())
+        Walk(m_dir + "/objects", [&](const TSTR&, const struct stat& st) { total += (long long)st.st_size; });
+    return total;
+}
+
+contentcache_stats contentcache::GetStats()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    return m_stats;
+}
+
+void contentcache::ResetStats()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    memset(&m_stats, 0, sizeof(m_stats));
+}
@@ -0,0 +1,148 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Content Cache
+  *
+  * A download cache on local disk that any number of processes on the
+  * host can share. Download goes through it with any connstream: the
+  * host file is looked up by site, path, size and modification time,
+  * and a hit lands at the local name without touching the network.
+  *
+  * What is stored is addressed by the SHA-256 of the bytes, so the same
+  * artifact published under several names or by several hosts is kept
+  * once. A hit is cloned out with FICLONE where the filesystem shares
+  * extents (btrfs, XFS), hard linked when CONTENT_HARDLINK allows it and
+  * copied with copy_file_range otherwise. A hard linked file shares its
+  * inode with the cache: it is read-only and must be replaced, never
+  * written in place, which is why linking has to be asked for.
+  *
+  * The cache is kept under a byte budget, dropping the content used
+  * least recently first. Processes coordinate through flock(2) on a
+  * lock file in the directory: lookups share it, inserts and evictions
+  * take it alone. The transfer itself runs outside the lock, two
+  * processes missing on the same file at once both fetch it and the
+  * second finds the content already there.
+  *
+  * Layout under the directory:
+  *     objects/ab/ab12...  content, read-only, named by its digest
+  *     index/cd/cd34...    one entry per (site, path), named by their digest
+  *     tmp/                downloads in progress
+  *
+  * E.G. Usage:
+  *     contentcache cache(_T("/var/cache/connstream"), 20LL << 30);
+  *     connresult r = cache.Download(ftp, _T("user@host:21"), _T("/pub/a.iso"), _T("a.iso"));
+  *     printf("%.0f%% hits\n", 100 * cache.GetStats().HitRate());
+  */
+
+#ifndef _CONTENTCACHE_H_
+#define _CONTENTCACHE_H_
+
+#if defined(_MSC_VER)
+#error contentcache.h is built on Linux system calls, it is not supported by MSVC
+#endif
+
+#include <mutex>
+#include "connstream.h"
+
+#if defined(UNICODE) || defined(_UNICODE_)
+#error contentcache.h only supports narrow TSTR
+#endif
+
+#define CONTENT_MAX_BYTES   (10LL << 30)    // Budget for the content kept
+#define CONTENT_STALE       86400           // Seconds before a left over download is removed
+
+/* Ways a hit may be materialized, a copy when none of them works */
+#define CONTENT_REFLINK     0x1
+#define CONTENT_HARDLINK    0x2
+
+/** Counters for this object since construction (or ResetStats) */
+struct contentcache_stats
+{
+    unsigned long long  hits;
+    unsigned long long  misses;
+    unsigned long long  uncacheable;    // The backend gave no size or time, passed straight through
+    unsigned long long  dedups;         // Misses whose content was stored already
+    unsigned long long  evictions;
+    unsigned long long  reflinks;       // How hits and misses reached the local name
+    unsigned long long  hardlinks;
+    unsigned long long  copies;
+    long long           bytesSaved;     // Served from the cache instead of the network
+    long long           bytesFetched;
+
+    /** Hits / (hits + misses), 0 before the first lookup */
+    double HitRate(void) const;
+};
+
+class contentcache
+{
+    public:
+        /** contentcache(TSTR, long long, unsigned)
+         *      @dir      : Directory to keep the cache in, made when missing
+         *      @maxBytes : Content kept before the least recently used goes
+         *      @link     : CONTENT_* ways to materialize, tried in that order
+         */
+        contentcache(TSTR dir, long long maxBytes = CONTENT_MAX_BYTES, unsigned link = CONTENT_REFLINK);
+        virtual ~contentcache(void);
+
+        /** connresult Download(connstream&, const TSTR&, TSTR, TSTR)
+         *  @conn's Download(@remote, @local) through the cache. The size and
+         *  modification time come from @conn's GetFileSize and GetModTime,
+         *  a backend without either is passed straight through. A cache that
+         *  can't be written to never fails the download, only the network
+         *  and the local name can.
+         *      @site : Names the host, user@host:port for FTP, so the same
+         *              path on two hosts is two entries
+         *  Returns : the outcome, bytes is what came over the network
+         */
+        connresult  Download(connstream& conn, const TSTR& site, TSTR remote, TSTR local);
+
+        /** bool Trim(void)
+         *  Evicts the least recently used content until the rest fits the
+         *  budget and removes downloads left behind CONTENT_STALE ago.
+         *  Download does this after every insert.
+         */
+        /** void Clear(void) - Empties the cache for every process using it */
+        bool        Trim(void);
+        void        Clear(void);
+
+        void        SetMaxBytes(long long bytes);
+
+        /** long long Usage(void) - Bytes of content on disk now */
+        long long   Usage(void);
+
+        contentcache_stats  GetStats(void);
+        void                ResetStats(void);
+
+    private:
+        contentcache(const contentcache&);
+        contentcache& operator=(const contentcache&);
+
+        /** Key is "site\npath" with the path made absolute against @conn's
+         *  working directory. Lookup finds the content stored for it at
+         *  @size and @mtime and marks it used, under the shared lock.
+         *  Insert files the finished download @tmp under its digest and
+         *  points the key at it. Materialize puts a file at @local with the
+         *  content of @from, replacing whatever was there in one rename.
+         */
+        bool        Setup(void);
+        bool        Key(connstream& conn, const TSTR& site, const TSTR& remote, TSTR& key);
+        bool        Lookup(const TSTR& key, long long size, long long mtime, TSTR& object);
+        bool        Insert(const TSTR& key, long long size, long long mtime, const TSTR& tmp);
+        int         Materialize(const TSTR& from, const TSTR& local);
+
+        TSTR        Path(const char* area, const TSTR& hex);
+        TSTR        Unique(const TSTR& prefix);
+        long long   Budget(void);
+
+        TSTR                m_dir;
+        long long           m_maxBytes;
+        unsigned            m_link;
+
+        std::mutex          m_lock;         // Stats and budget, the disk is under the lock file
+        contentcache_stats  m_stats;
+};
+
+#endif // _CONTENTCACHE_H_
@@ -0,0 +1,191 @@
+#include <datastream.h>
+
+#include <errno.h>
+#include <string.h>
+#include <utility>
+
+datastream::datastream()
+{
+    m_handle    = NULL;
+    m_err       = 0;
+}
+
+datastream::datastream(streamhandle* handle)
+{
+    m_handle    = handle;
+    m_err       = handle ? 0 : EBADF;
+}
+
+datastream::datastream(datastream&& other)
+{
+    m_handle        = other.m_handle;
+    m_err           = other.m_err;
+    other.m_handle  = NULL;
+}
+
+datastream& datastream::operator=(datastream&& other)
+{
+    if(this != &other)
+    {
+        Close();
+        m_handle        = other.m_handle;
+        m_err           = other.m_err;
+        other.m_handle  = NULL;
+    }
+    return *this;
+}
+
+datastream::~datastream()
+{
+    Close();
+}
+
+bool datastream::IsOpen() const
+{
+    return m_handle != NULL;
+}
+
+long long datastream::Read(char* buf, size_t len)
+{
+    if(!m_handle)
+    {
+        m_err = EBADF;
+        return -1;
+    }
+
+    long long n = m_handle->Read(buf, len);
+    m_err = n < 0 ? m_handle->GetLastError() : 0;
+    return n;
+}
+
+long long datastream::Write(const char* buf, size_t len)
+{
+    if(!m_handle)
+    {
+        m_err = EBADF;
+        return -1;
+    }
+
+    long long n = m_handle->Write(buf, len);
+    m_err = n < 0 ? m_handle->GetLastError() : 0;
+    return n;
+}
+
+bool datastream::Close()
+{
+    if(!m_handle)
+        return false;
+
+    bool ok = m_handle->Close();
+    m_err   = ok ? 0 : m_handle->GetLastError();
+
+    delete m_handle;
+    m_handle = NULL;
+    return ok;
+}
+
+int datastream::GetHandle() const
+{
+    return m_handle ? m_handle->GetHandle() : -1;
+}
+
+int datastream::GetLastError() const
+{
+    return m_err;
+}
+
+
+/// STREAMBUF ADAPTER ///
+
+datastreambuf::datastreambuf(datastream&& stream, size_t bufsize)
+    : m_stream(std::move(stream)), m_get(bufsize ? bufsize : 1), m_put(bufsize ? bufsize : 1)
+{
+    setg(&m_get[0], &m_get[0], &m_get[0]);
+    setp(&m_put[0], &m_put[0] + m_put.size());
+}
+
+datastreambuf::~datastreambuf()
+{
+    Close();
+}
+
+bool datastreambuf::Close()
+{
+    bool ok = sync() == 0;
+    if(m_stream.IsOpen())
+        ok = m_stream.Close() && ok;
+    return ok;
+}
+
+datastream& datastreambuf::Stream()
+{
+    return m_stream;
+}
+
+datastreambuf::int_type datastreambuf::underflow()
+{
+    if(gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+
+    long long n = m_stream.Read(&m_get[0], m_get.size());
+    if(n <= 0)
+        return traits_type::eof();
+
+    setg(&m_get[0], &m_get[0], &m_get[0] + n);
+    return traits_type::to_int_type(*gptr());
+}
+
+std::streamsize datastreambuf::xsgetn(char_type* s, std::streamsize n)
+{
+    // Drain what is buffered, then read large requests straight into the caller
+    std::streamsize done = 0;
+    while(done < n)
+    {
+        std::streamsize avail = egptr() - gptr();
+        if(avail > 0)
+        {
+            std::streamsize take = avail < n - done ? avail : n - done;
+            memcpy(s + done, gptr(), (size_t)take);
+            gbump((int)take);
+            done += take;
+            continue;
+        }
+
+        if(n - done >= (std::streamsize)m_get.size())
+        {
+            long long r = m_stream.Read(s + done, (size_t)(n - done));
+            if(r <= 0)
+                break;
+            done += (std::streamsize)r;
+            continue;
+        }
+
+        if(traits_type::eq_int_type(underflow(), traits_type::eof()))
+            break;
+    }
+    return done;
+}
+
+datastreambuf::int_type datastreambuf::overflow(int_type ch)
+{
+    if(sync() != 0)
+        return traits_type::eof();
+
+    if(!traits_type::eq_int_type(ch, traits_type::eof()))
+    {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+int datastreambuf::sync()
+{
+    size_t len = (size_t)(pptr() - pbase());
+    if(!len)
+        return 0;
+
+    long long n = m_stream.Write(pbase(), len);
+    setp(&m_put[0], &m_put[0] + m_put.size());
+    return n == (long long)len ? 0 : -1;
+}
@@ -0,0 +1,144 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Data Stream
+  *
+  * A movable handle on one open remote file returned by
+  * connstream::OpenRead/OpenWrite. Bytes are pulled or pushed in
+  * caller sized chunks straight off the backend's data connection
+  * so remote files can be piped into parsers or compressors with
+  * bounded memory. Read blocks until data arrives and Write blocks
+  * until the connection accepts it, so a slow consumer or server
+  * throttles the other side rather than growing a buffer.
+  *
+  * Backends implement streamhandle, callers only see datastream.
+  *
+  * E.G. Usage:
+  *     datastream in = c->OpenRead(_T("log.csv"), 0);
+  *     char buf[65536];
+  *     long long n;
+  *     while((n = in.Read(buf, sizeof(buf))) > 0)
+  *         parse(buf, n);
+  *     in.Close();
+  *
+  *     datastreambuf sb(c->OpenRead(_T("log.csv")));
+  *     std::istream is(&sb);
+  */
+
+#ifndef _DATASTREAM_H_
+#define _DATASTREAM_H_
+
+#include <stddef.h>
+#include <streambuf>
+#include <vector>
+
+#if __cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)
+#define DATASTREAM_SPAN
+#include <span>
+#endif
+
+/** Backend side of an open stream, owned by exactly one datastream */
+class streamhandle
+{
+    public:
+        streamhandle() {};
+        virtual ~streamhandle(void) {};
+
+        /** Read/Write move up to @len bytes, returning the count moved,
+         *  0 at end of file (Read only) or -1 on failure. */
+        virtual long long   Read(char* buf, size_t len) = 0;
+        virtual long long   Write(const char* buf, size_t len) = 0;
+        /** Completes the transfer, aborting a read that hasn't reached EOF */
+        virtual bool        Close(void) = 0;
+        virtual int         GetHandle(void) = 0;
+        virtual int         GetLastError(void) = 0;
+};
+
+class datastream
+{
+    public:
+        datastream(void);
+        explicit datastream(streamhandle* handle);
+        datastream(datastream&& other);
+        datastream& operator=(datastream&& other);
+        /** Closes the stream on scope end if still open */
+        ~datastream(void);
+
+        /** bool IsOpen(void)
+         *  Returns : @true while the stream holds an open transfer
+         */
+        bool        IsOpen(void) const;
+
+        /** long long Read(char*, size_t)
+         *  Blocks until at least one byte is available.
+         *  Returns : bytes read, 0 at end of file or -1 on failure
+         */
+        /** long long Write(const char*, size_t)
+         *  Blocks until every byte has been accepted by the connection.
+         *  Returns : @len or -1 on failure
+         */
+        long long   Read(char* buf, size_t len);
+        long long   Write(const char* buf, size_t len);
+#if defined(DATASTREAM_SPAN)
+        long long   Read(std::span<char> buf)           { return Read(buf.data(), buf.size()); }
+        long long   Write(std::span<const char> buf)    { return Write(buf.data(), buf.size()); }
+#endif
+
+        /** bool Close(void)
+         *  Finishes the transfer and waits for the server's completion reply.
+         *  Closing a read stream before end of file aborts the transfer.
+         *
+         *  Returns : @true if the server confirmed the transfer (or the abort)
+         */
+        bool        Close(void);
+
+        /** int GetHandle(void)
+         *  Gets the underlying data socket so callers can poll(2) it for readiness
+         *
+         *  Returns : socket descriptor or -1 when closed
+         */
+        int         GetHandle(void) const;
+
+        /** int GetLastError()
+         *  Returns : 0x00 after a successful call, otherwise a backend error code
+         */
+        int         GetLastError(void) const;
+
+    private:
+        datastream(const datastream&);
+        datastream& operator=(const datastream&);
+
+        streamhandle*   m_handle;
+        int             m_err;
+};
+
+/** std::streambuf adapter so iostream code can consume a datastream */
+class datastreambuf : public std::streambuf
+{
+    public:
+        explicit datastreambuf(datastream&& stream, size_t bufsize = 65536);
+        /** Flushes pending output and closes the stream */
+        virtual ~datastreambuf(void);
+
+        /** bool Close(void)
+         *  Flushes pending output then closes the underlying stream.
+         */
+        bool        Close(void);
+        datastream& Stream(void);
+
+    protected:
+        int_type        underflow(void);
+        int_type        overflow(int_type ch);
+        int             sync(void);
+        std::streamsize xsgetn(char_type* s, std::streamsize n);
+
+    private:
+        datastream          m_stream;
+        std::vector<char>   m_get;
+        std::vector<char>   m_put;
+};
+
+#endif // _DATASTREAM_H_
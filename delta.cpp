@@ -0,0 +1,577 @@
+#include <delta.h>
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define DELTA_X86
+#include <immintrin.h>
+#endif
+
+#if defined(DELTA_X86) && (defined(__GNUC__) || defined(__clang__))
+#define DELTA_TARGET(isa) __attribute__((target(isa)))
+#else
+#undef DELTA_X86
+#endif
+
+#define DELTA_MAGIC     "CSIG"
+#define DELTA_VERSION   1
+#define DELTA_HEADER    48      // Magic up to the reserved word, the whole file digest follows
+
+typedef uint32_t (*weakfn)(const unsigned char* p, size_t len);
+
+
+/// WEAK SUM KERNELS ///
+
+/* Weight n - i for byte i: seeding a window is a plain sum and a weighted
+ * sum, which is what SAD and multiply-add do 16 or 32 bytes at a time */
+static uint32_t WeakPortable(const unsigned char* p, size_t len)
+{
+    uint32_t a = 0, b = 0;
+    for(size_t i = 0; i < len; i++)
+    {
+        a += p[i];
+        b += (uint32_t)(len - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+#ifdef DELTA_X86
+
+DELTA_TARGET("ssse3")
+static uint32_t HSum128(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4e));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xb1));
+    return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+/* Over K chunks of W bytes, chunk k's bytes weigh W*(K-1-k) plus their
+ * place in the chunk. The first part is W times the running total of the
+ * chunks before each one (vprev), the second a multiply-add by W..1. */
+DELTA_TARGET("ssse3")
+static uint32_t WeakSSSE3(const unsigned char* p, size_t len)
+{
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i ones  = _mm_set1_epi16(1);
+    const __m128i taps  = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i va = zero, vprev = zero, vb = zero;
+
+    size_t n = len & ~(size_t)15;
+    for(size_t i = 0; i < n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(p + i));
+        vprev = _mm_add_epi32(vprev, va);
+        va    = _mm_add_epi32(va, _mm_sad_epu8(x, zero));
+        vb    = _mm_add_epi32(vb, _mm_madd_epi16(_mm_maddubs_epi16(x, taps), ones));
+    }
+
+    uint32_t a = HSum128(va);
+    uint32_t b = 16 * HSum128(vprev) + HSum128(vb) + (uint32_t)(len - n) * a;
+    for(size_t i = n; i < len; i++)
+    {
+        a += p[i];
+        b += (uint32_t)(len - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+DELTA_TARGET("avx2")
+static uint32_t HSum256(__m256i v)
+{
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return (uint32_t)_mm_cvtsi128_si32(s);
+}
+
+DELTA_TARGET("avx2")
+static uint32_t WeakAVX2(const unsigned char* p, size_t len)
+{
+    const __m256i zero  = _mm256_setzero_si256();
+    const __m256i ones  = _mm256_set1_epi16(1);
+    const __m256i taps  = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                           16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    __m256i va = zero, vprev = zero, vb = zero;
+
+    size_t n = len & ~(size_t)31;
+    for(size_t i = 0; i < n; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(p + i));
+        vprev = _mm256_add_epi32(vprev, va);
+        va    = _mm256_add_epi32(va, _mm256_sad_epu8(x, zero));
+        vb    = _mm256_add_epi32(vb, _mm256_madd_epi16(_mm256_maddubs_epi16(x, taps), ones));
+    }
+
+    uint32_t a = HSum256(va);
+    uint32_t b = 32 * HSum256(vprev) + HSum256(vb) + (uint32_t)(len - n) * a;
+    for(size_t i = n; i < len; i++)
+    {
+        a += p[i];
+        b += (uint32_t)(len - i) * p[i];
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+#endif // DELTA_X86
+
+struct weakkernel
+{
+    weakfn      fn;
+    const char* name;
+
+    weakkernel()
+    {
+        fn      = WeakPortable;
+        name    = "portable";
+#ifdef DELTA_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2"))
+        {
+            fn      = WeakAVX2;
+            name    = "avx2";
+        }
+        else if(__builtin_cpu_supports("ssse3"))
+        {
+            fn      = WeakSSSE3;
+            name    = "ssse3";
+        }
+#endif
+    }
+};
+
+static const weakkernel& Kernels()
+{
+    static weakkernel k;
+    return k;
+}
+
+
+/// HELPERS ///
+
+static inline uint32_t Tag(uint32_t weak)
+{
+    return (weak ^ (weak >> 16)) & 0xffff;
+}
+
+static void FromHex(const std::string& hex, unsigned char* out)
+{
+    for(size_t i = 0; i + 1 < hex.size(); i += 2)
+    {
+        unsigned v;
+        sscanf(hex.c_str() + i, "%2x", &v);
+        out[i / 2] = (unsigned char)v;
+    }
+}
+
+static std::string ToHex(const unsigned char* p, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(len * 2, '0');
+    for(size_t i = 0; i < len; i++)
+    {
+        hex[i * 2]      = digits[p[i] >> 4];
+        hex[i * 2 + 1]  = digits[p[i] & 15];
+    }
+    return hex;
+}
+
+static void Put32(std::string& out, uint32_t v)
+{
+    for(int i = 0; i < 4; i++)
+        out += (char)(v >> (8 * i));
+}
+
+static void Put64(std::string& out, uint64_t v)
+{
+    for(int i = 0; i < 8; i++)
+        out += (char)(v >> (8 * i));
+}
+
+static uint32_t Get32(const unsigned char* p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t Get64(const unsigned char* p)
+{
+    return Get32(p) | (uint64_t)Get32(p + 4) << 32;
+}
+
+static long long ModTimeNs(const struct stat& st)
+{
+    return (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+
+/// DELTASIG ///
+
+deltasig::deltasig()
+{
+    m_block     = DELTA_BLOCK;
+    m_alg       = CHECKSUM_NONE;
+    m_strongLen = 0;
+    m_size      = 0;
+    m_mtime     = -1;
+    m_stamp     = -1;
+}
+
+unsigned deltasig::BlockFor(long long size)
+{
+    unsigned block = DELTA_BLOCK;
+    while(size / block > DELTA_MAX_BLOCKS && block < (1u << 30))
+        block <<= 1;
+    return block;
+}
+
+uint32_t deltasig::Weak(const unsigned char* p, size_t len)
+{
+    return Kernels().fn(p, len);
+}
+
+const char* deltasig::Kernel()
+{
+    return Kernels().name;
+}
+
+bool deltasig::Build(int fd, unsigned block, int algorithm)
+{
+    struct stat st;
+    if(fstat(fd, &st) < 0)
+        return false;
+
+    checksum whole(algorithm), part(algorithm);
+    if(whole.Algorithm() == CHECKSUM_NONE)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    m_block     = block ? block : BlockFor((long long)st.st_size);
+    m_alg       = algorithm;
+    m_strongLen = whole.Hex().size() / 2;
+    m_size      = (long long)st.st_size;
+    m_mtime     = ModTimeNs(st);
+    m_weak.clear();
+    m_strong.clear();
+    m_weak.reserve(Count());
+    m_strong.reserve(Count() * m_strongLen);
+
+    std::vector<unsigned char> buf(m_block);
+    long long off = 0;
+    while(off < m_size)
+    {
+        size_t want = m_size - off < (long long)m_block ? (size_t)(m_size - off) : m_block;
+        size_t got  = 0;
+        while(got < want)
+        {
+            ssize_t n = pread(fd, &buf[got], want - got, (off_t)(off + got));
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+            {
+                // Shorter than fstat said, it changed under us
+                if(n == 0)
+                    errno = ESTALE;
+                return false;
+            }
+            got += (size_t)n;
+        }
+
+        m_weak.push_back(Weak(&buf[0], want));
+        part.Reset();
+        part.Update(&buf[0], want);
+        m_strong.resize(m_strong.size() + m_strongLen);
+        FromHex(part.Hex(), &m_strong[m_strong.size() - m_strongLen]);
+        whole.Update(&buf[0], want);
+        off += (long long)want;
+    }
+
+    m_digest.resize(m_strongLen);
+    FromHex(whole.Hex(), &m_digest[0]);
+    return true;
+}
+
+void deltasig::Match(const unsigned char* data, size_t len, std::vector<long long>& at) const
+{
+    size_t count = Count();
+    at.assign(count, -1);
+    if(!count)
+        return;
+
+    // Full blocks go in a table of 16 bit tags, sorted by counting so each
+    // tag's candidates sit together. A short last block is checked apart.
+    size_t full = (size_t)(m_size / m_block);
+    std::vector<uint32_t> first(65537, 0);
+    std::vector<uint32_t> order(full);
+    for(size_t i = 0; i < full; i++)
+        first[Tag(m_weak[i]) + 1]++;
+    for(size_t t = 0; t < 65536; t++)
+        first[t + 1] += first[t];
+    std::vector<uint32_t> fill(first.begin(), first.end() - 1);
+    for(size_t i = 0; i < full; i++)
+        order[fill[Tag(m_weak[i])]++] = (uint32_t)i;
+
+    // Most windows miss, a bit per tag rejects them from L1
+    uint64_t present[1024] = { 0 };
+    for(size_t i = 0; i < full; i++)
+        present[Tag(m_weak[i]) >> 6] |= 1ULL << (Tag(m_weak[i]) & 63);
+
+    checksum sum(m_alg);
+    unsigned char strong[64];
+    size_t left = full;
+    size_t bs   = m_block;
+    size_t pos  = 0;
+    uint32_t a = 0, b = 0;
+    bool seeded = false;
+
+    while(left && pos + bs <= len)
+    {
+        if(!seeded)
+        {
+            uint32_t w = Weak(data + pos, bs);
+            a = w & 0xffff;
+            b = w >> 16;
+            seeded = true;
+        }
+
+        uint32_t weak   = (a & 0xffff) | (b << 16);
+        uint32_t tag    = Tag(weak);
+        bool hashed     = false;
+        bool hit        = false;
+        uint32_t k = 0, end = 0;
+        if(present[tag >> 6] & (1ULL << (tag & 63)))
+        {
+            k   = first[tag];
+            end = first[tag + 1];
+        }
+        for(; k < end; k++)
+        {
+            uint32_t i = order[k];
+            if(m_weak[i] != weak || at[i] >= 0)
+                continue;
+            if(!hashed)
+            {
+                sum.Reset();
+                sum.Update(data + pos, bs);
+                FromHex(sum.Hex(), strong);
+                hashed = true;
+            }
+            if(memcmp(strong, &m_strong[i * m_strongLen], m_strongLen))
+                continue;
+
+            // Every block with these bytes is found here, not just the first
+            at[i] = (long long)pos;
+            left--;
+            hit = true;
+        }
+
+        if(hit)
+        {
+            pos    += bs;
+            seeded  = false;
+            continue;
+        }
+        if(pos + bs >= len)
+            break;
+
+        // Roll the window one byte: a loses the old byte and gains the new,
+        // every byte left in b moves one weight down
+        uint32_t out = data[pos], in = data[pos + bs];
+        a = a - out + in;
+        b = b - (uint32_t)bs * out + a;
+        pos++;
+    }
+
+    if(full == count)
+        return;
+
+    // The short last block is looked for where it was and at the end of @data
+    size_t tail = (size_t)(m_size - (long long)full * m_block);
+    size_t tries[2] = { full * bs, len - tail };
+    for(int t = 0; t < 2 && at[full] < 0 && len >= tail; t++)
+    {
+        if(tries[t] + tail > len || Weak(data + tries[t], tail) != m_weak[full])
+            continue;
+        sum.Reset();
+        sum.Update(data + tries[t], tail);
+        FromHex(sum.Hex(), strong);
+        if(!memcmp(strong, &m_strong[full * m_strongLen], m_strongLen))
+            at[full] = (long long)tries[t];
+    }
+}
+
+std::string deltasig::Save() const
+{
+    std::string out(DELTA_MAGIC);
+    Put32(out, DELTA_VERSION);
+    Put32(out, m_block);
+    Put32(out, (uint32_t)m_alg);
+    Put32(out, (uint32_t)m_strongLen);
+    Put64(out, (uint64_t)m_size);
+    Put64(out, (uint64_t)m_mtime);
+    Put64(out, (uint64_t)m_stamp);
+    Put32(out, 0);      // Reserved
+    out.append(m_digest.begin(), m_digest.end());
+
+    for(size_t i = 0; i < m_weak.size(); i++)
+    {
+        Put32(out, m_weak[i]);
+        out.append((const char*)&m_strong[i * m_strongLen], m_strongLen);
+    }
+    return out;
+}
+
+bool deltasig::Load(const std::string& data)
+{
+    const unsigned char* p = (const unsigned char*)data.data();
+    if(data.size() < DELTA_HEADER || memcmp(p, DELTA_MAGIC, 4) || Get32(p + 4) != DELTA_VERSION)
+        return false;
+
+    unsigned block  = Get32(p + 8);
+    int alg         = (int)Get32(p + 12);
+    size_t strong   = Get32(p + 16);
+    long long size  = (long long)Get64(p + 20);
+    checksum probe(alg);
+    if(!block || size < 0 || probe.Algorithm() == CHECKSUM_NONE || strong != probe.Hex().size() / 2)
+        return false;
+
+    unsigned long long count = ((unsigned long long)size + block - 1) / block;
+    if(data.size() != DELTA_HEADER + strong + count * (4 + strong))
+        return false;
+
+    m_block     = block;
+    m_alg       = alg;
+    m_strongLen = strong;
+    m_size      = size;
+    m_mtime     = (long long)Get64(p + 28);
+    m_stamp     = (long long)Get64(p + 36);
+    m_digest.assign(p + DELTA_HEADER, p + DELTA_HEADER + strong);
+
+    m_weak.resize((size_t)count);
+    m_strong.resize((size_t)count * strong);
+    p += DELTA_HEADER + strong;
+    for(size_t i = 0; i < count; i++, p += 4 + strong)
+    {
+        m_weak[i] = Get32(p);
+        memcpy(&m_strong[i * strong], p + 4, strong);
+    }
+    return true;
+}
+
+bool deltasig::SaveFile(const std::string& path) const
+{
+    // Written aside and renamed in, a reader never sees half a signature
+    std::string tmp  = path + ".tmp";
+    std::string data = Save();
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return false;
+
+    const char* p = data.data();
+    size_t len = data.size();
+    while(len)
+    {
+        ssize_t n = write(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            break;
+        p   += n;
+        len -= (size_t)n;
+    }
+
+    int err = len ? errno : 0;
+    if(close(fd) < 0 && !err)
+        err = errno;
+    if(!err && rename(tmp.c_str(), path.c_str()) < 0)
+        err = errno;
+    if(err)
+    {
+        unlink(tmp.c_str());
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+bool deltasig::LoadFile(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+
+    std::string data;
+    char buf[65536];
+    ssize_t n;
+    while((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+        if(n > 0)
+            data.append(buf, (size_t)n);
+    close(fd);
+
+    if(n < 0)
+        return false;
+    if(!Load(data))
+    {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+bool deltasig::Current(int fd) const
+{
+    struct stat st;
+    return m_alg != CHECKSUM_NONE && fstat(fd, &st) == 0
+        && (long long)st.st_size == m_size && ModTimeNs(st) == m_mtime;
+}
+
+size_t deltasig::Count() const
+{
+    return (size_t)((m_size + m_block - 1) / m_block);
+}
+
+unsigned deltasig::Block() const
+{
+    return m_block;
+}
+
+long long deltasig::Size() const
+{
+    return m_size;
+}
+
+long long deltasig::BlockLen(size_t i) const
+{
+    long long off = (long long)i * m_block;
+    return m_size - off < (long long)m_block ? m_size - off : (long long)m_block;
+}
+
+int deltasig::Algorithm() const
+{
+    return m_alg;
+}
+
+std::string deltasig::Strong(size_t i) const
+{
+    return ToHex(&m_strong[i * m_strongLen], m_strongLen);
+}
+
+std::string deltasig::Digest() const
+{
+    return m_digest.empty() ? std::string() : ToHex(&m_digest[0], m_digest.size());
+}
+
+long long deltasig::Stamp() const
+{
+    return m_stamp;
+}
+
+void deltasig::SetStamp(long long stamp)
+{
+    m_stamp = stamp;
+}
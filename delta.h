@@ -0,0 +1,132 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Delta Transfer
+  *
+  * Block signatures for moving only what changed in a large file, the way
+  * rsync does. A signature cuts a file into fixed blocks and keeps two sums
+  * for each: a weak one that can be rolled along a byte at a time (rsync's
+  * Adler variant, seeded with SSSE3/AVX2 where the CPU has them) and a
+  * strong one from checksum.h to confirm a hit.
+  *
+  * Match() slides a window over another copy of the file and says where
+  * each block of the signature turns up in it, at any byte offset, so data
+  * that moved because something was inserted ahead of it is still found.
+  *
+  * Signatures save to a small portable file so they can be cached next to
+  * the file they describe and rebuilt only when its size or time changes.
+  *
+  * E.G. Usage:
+  *     deltasig sig;
+  *     sig.Build(fd);
+  *     std::vector<long long> at;
+  *     sig.Match(map, mapLen, at);
+  *     for(size_t i = 0; i < sig.Count(); i++)
+  *         if(at[i] < 0) .... // Block i has to be fetched
+  */
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "checksum.h"
+
+#define DELTA_BLOCK         (64 << 10)  // Smallest block size
+#define DELTA_MAX_BLOCKS    16384       // Block size doubles past this many blocks
+#define DELTA_MERGE         4           // Blocks between two misses below which one range fetches both
+#define DELTA_SUFFIX        ".connsig"  // Signature file kept beside the file it describes
+
+/* delta_stats modes */
+#define DELTA_FULL          0           // The whole file moved
+#define DELTA_INPLACE       1           // Blocks compared at the same offsets
+#define DELTA_ROLLING       2           // Blocks found at any offset against a signature
+
+struct delta_stats
+{
+    int         mode;           // DELTA_*
+    long long   size;           // Of the file as it ends up
+    long long   reused;         // Bytes the target side already had
+    long long   sent;           // File bytes that crossed the data connection
+    size_t      ranges;         // Data connections opened to move them
+};
+
+class deltasig
+{
+    public:
+        deltasig(void);
+
+        /** bool Build(int, unsigned, int)
+         *  Reads @fd from the start and signs it. The size and modification
+         *  time are taken from fstat so Current() can check them later.
+         *      @block     : Block size, 0 for BlockFor(size)
+         *      @algorithm : Strong sum, CHECKSUM_*
+         *  Returns : @false with errno set when @fd can't be read
+         */
+        bool        Build(int fd, unsigned block = 0, int algorithm = CHECKSUM_XXH64);
+
+        /** void Match(const unsigned char*, size_t, std::vector<long long>&)
+         *  Finds this signature's blocks in @data, @at gets the offset each
+         *  block was found at or -1 when it wasn't.
+         */
+        void        Match(const unsigned char* data, size_t len, std::vector<long long>& at) const;
+
+        /** std::string Save(void) / bool Load(const std::string&)
+         *  The signature as bytes and back, Load fails on anything malformed.
+         *  SaveFile replaces @path atomically, LoadFile reads it back.
+         */
+        std::string Save(void) const;
+        bool        Load(const std::string& data);
+        bool        SaveFile(const std::string& path) const;
+        bool        LoadFile(const std::string& path);
+
+        /** bool Current(int)
+         *  Whether @fd still has the size and modification time this was built from.
+         */
+        bool        Current(int fd) const;
+
+        size_t      Count(void) const;
+        unsigned    Block(void) const;
+        long long   Size(void) const;
+        long long   BlockLen(size_t i) const;
+        int         Algorithm(void) const;
+
+        /** Strong sum of block @i and of the whole file, lowercase hex */
+        std::string Strong(size_t i) const;
+        std::string Digest(void) const;
+
+        /** long long Stamp(void) / void SetStamp(long long)
+         *  Free for the owner, e.g. the host's modification time of the file
+         *  this was built from. -1 until set.
+         */
+        long long   Stamp(void) const;
+        void        SetStamp(long long stamp);
+
+        /** unsigned BlockFor(long long) - The default block size for a file of @size */
+        static unsigned     BlockFor(long long size);
+
+        /** uint32_t Weak(const unsigned char*, size_t)
+         *  The rolling sum of @len bytes, low half a = sum of bytes, high half
+         *  b = sum of (len - i) * byte[i], both mod 2^16.
+         */
+        static uint32_t     Weak(const unsigned char* p, size_t len);
+        static const char*  Kernel(void);
+
+    private:
+        unsigned                    m_block;
+        int                         m_alg;
+        size_t                      m_strongLen;    // Bytes of one strong sum
+        long long                   m_size;
+        long long                   m_mtime;        // Nanoseconds, of the file Build read
+        long long                   m_stamp;
+        std::vector<uint32_t>       m_weak;
+        std::vector<unsigned char>  m_strong;       // m_strongLen bytes per block
+        std::vector<unsigned char>  m_digest;       // Whole file
+};
+
+#endif // _DELTA_H_
@@ -0,0 +1,308 @@
+#include <dirlist.h>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <utility>
+
+DirList::DirList()
+{
+}
+
+DirList::DirList(const DirList& other)
+    : m_entries(other.m_entries), m_arena(other.m_arena)
+{
+    Rebase(other.m_arena.data(), m_arena.data());
+}
+
+DirList::DirList(DirList&& other)
+    : m_entries(std::move(other.m_entries)), m_arena(std::move(other.m_arena))
+{
+}
+
+DirList& DirList::operator=(const DirList& other)
+{
+    if(this != &other)
+    {
+        m_entries   = other.m_entries;
+        m_arena     = other.m_arena;
+        Rebase(other.m_arena.data(), m_arena.data());
+    }
+    return *this;
+}
+
+DirList& DirList::operator=(DirList&& other)
+{
+    m_entries.swap(other.m_entries);
+    m_arena.swap(other.m_arena);
+    return *this;
+}
+
+void DirList::Rebase(const char* from, char* to)
+{
+    if(from == to)
+        return;
+    for(size_t i = 0; i < m_entries.size(); i++)
+        m_entries[i].name = to + (m_entries[i].name - from);
+}
+
+void DirList::Grow(size_t need)
+{
+    // Move to a bigger arena by hand so the old names are still there to rebase from
+    size_t cap = m_arena.capacity() * 2;
+    if(cap < 4096)
+        cap = 4096;
+    if(cap < need)
+        cap = need;
+
+    std::vector<char> bigger;
+    bigger.reserve(cap);
+    bigger.assign(m_arena.begin(), m_arena.end());
+    Rebase(m_arena.data(), bigger.data());
+    m_arena.swap(bigger);
+}
+
+void DirList::Add(const DirEntry& entry)
+{
+    size_t off = m_arena.size();
+    if(off + entry.namelen + 1 > m_arena.capacity())
+        Grow(off + entry.namelen + 1);
+
+    m_arena.insert(m_arena.end(), entry.name, entry.name + entry.namelen);
+    m_arena.push_back('\0');
+
+    m_entries.push_back(entry);
+    m_entries.back().name = m_arena.data() + off;
+}
+
+void DirList::Reserve(size_t entries, size_t nameBytes)
+{
+    m_entries.reserve(entries);
+    if(nameBytes > m_arena.capacity())
+        Grow(nameBytes);
+}
+
+void DirList::Clear()
+{
+    m_entries.clear();
+    m_arena.clear();
+}
+
+
+/// PARSERS ///
+
+static long long FactTime(const char* v, size_t len)
+{
+    if(len < 14)
+        return -1;
+    for(int i = 0; i < 14; i++)
+        if(!isdigit((unsigned char)v[i]))
+            return -1;
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year  = (v[0] - '0') * 1000 + (v[1] - '0') * 100 + (v[2] - '0') * 10 + (v[3] - '0') - 1900;
+    tm.tm_mon   = (v[4] - '0') * 10 + (v[5] - '0') - 1;
+    tm.tm_mday  = (v[6] - '0') * 10 + (v[7] - '0');
+    tm.tm_hour  = (v[8] - '0') * 10 + (v[9] - '0');
+    tm.tm_min   = (v[10] - '0') * 10 + (v[11] - '0');
+    tm.tm_sec   = (v[12] - '0') * 10 + (v[13] - '0');
+    return (long long)timegm(&tm);
+}
+
+bool ParseMLSD(const char* line, size_t len, DirEntry& entry)
+{
+    const char* sp = (const char*)memchr(line, ' ', len);
+    if(!sp || sp + 1 >= line + len)
+        return false;
+
+    entry.name      = sp + 1;
+    entry.namelen   = (size_t)(line + len - entry.name);
+    entry.size      = -1;
+    entry.mtime     = -1;
+    entry.type      = DIRENT_OTHER;
+    entry.perms     = 0;
+
+    for(const char* p = line; p < sp; )
+    {
+        const char* semi = (const char*)memchr(p, ';', (size_t)(sp - p));
+        if(!semi)
+            semi = sp;
+        const char* eq = (const char*)memchr(p, '=', (size_t)(semi - p));
+        if(!eq)
+        {
+            p = semi + 1;
+            continue;
+        }
+
+        size_t klen = (size_t)(eq - p);
+        const char* v = eq + 1;
+        size_t vlen = (size_t)(semi - v);
+
+        if(klen == 4 && !strncasecmp(p, "type", 4))
+        {
+            if(vlen == 4 && !strncasecmp(v, "file", 4))
+                entry.type = DIRENT_FILE;
+            else if(vlen == 3 && !strncasecmp(v, "dir", 3))
+                entry.type = DIRENT_DIR;
+            else if(vlen == 4 && (!strncasecmp(v, "cdir", 4) || !strncasecmp(v, "pdir", 4)))
+                return false;
+            else if(vlen > 8 && !strncasecmp(v, "OS.unix=", 8)
+                    && (!strncasecmp(v + 8, "slink", 5) || !strncasecmp(v + 8, "symlink", 7)))
+                entry.type = DIRENT_LINK;
+        }
+        else if(klen == 4 && !strncasecmp(p, "size", 4))
+            entry.size = strtoll(v, NULL, 10);
+        else if(klen == 6 && !strncasecmp(p, "modify", 6))
+            entry.mtime = FactTime(v, vlen);
+        else if(klen == 9 && !strncasecmp(p, "UNIX.mode", 9))
+            entry.perms = (unsigned)strtoul(v, NULL, 8) & 07777;
+
+        p = semi + 1;
+    }
+
+    return true;
+}
+
+static int Month(const char* p, size_t len)
+{
+    static const char months[] = "janfebmaraprmayjunjulaugsepoctnovdec";
+    if(len != 3)
+        return -1;
+    for(int m = 0; m < 12; m++)
+        if(!strncasecmp(p, months + m * 3, 3))
+            return m;
+    return -1;
+}
+
+static bool Digits(const char* p, size_t len)
+{
+    if(!len)
+        return false;
+    for(size_t i = 0; i < len; i++)
+        if(!isdigit((unsigned char)p[i]))
+            return false;
+    return true;
+}
+
+bool ParseUnixList(const char* line, size_t len, DirEntry& entry, long long now)
+{
+    if(len < 11 || !strchr("-dlbcps", line[0]))
+        return false;
+
+    entry.size  = -1;
+    entry.mtime = -1;
+    entry.perms = 0;
+    entry.type  = line[0] == '-' ? DIRENT_FILE
+                : line[0] == 'd' ? DIRENT_DIR
+                : line[0] == 'l' ? DIRENT_LINK : DIRENT_OTHER;
+
+    // rwxrwxrwx with s/S and t/T standing in for the execute bits
+    static const char rwx[] = "rwxrwxrwx";
+    for(int i = 0; i < 9; i++)
+    {
+        char c = line[i + 1];
+        if(c == rwx[i] || ((i % 3) == 2 && (c == 's' || c == 't')))
+            entry.perms |= 0400 >> i;
+        if(i == 2 && (c == 's' || c == 'S'))
+            entry.perms |= 04000;
+        else if(i == 5 && (c == 's' || c == 'S'))
+            entry.perms |= 02000;
+        else if(i == 8 && (c == 't' || c == 'T'))
+            entry.perms |= 01000;
+    }
+
+    // Owner and group columns vary (some servers drop the group), so find the
+    // "Mon DD HH:MM|YYYY" date and take the size from the column before it
+    const char* tok[8];
+    size_t toklen[8];
+    int ntok = 0;
+    const char* p   = line + 10;
+    const char* end = line + len;
+
+    for(;;)
+    {
+        while(p < end && *p == ' ')
+            p++;
+        if(p >= end)
+            return false;
+        const char* s = p;
+        while(p < end && *p != ' ')
+            p++;
+
+        if(ntok == 8)
+        {
+            memmove(tok, tok + 1, sizeof(tok) - sizeof(tok[0]));
+            memmove(toklen, toklen + 1, sizeof(toklen) - sizeof(toklen[0]));
+            ntok--;
+        }
+        tok[ntok]       = s;
+        toklen[ntok]    = (size_t)(p - s);
+        ntok++;
+
+        // Need size, month, day and time/year, month sits third from last
+        if(ntok < 4)
+            continue;
+        int m = Month(tok[ntok - 3], toklen[ntok - 3]);
+        if(m < 0 || !Digits(tok[ntok - 4], toklen[ntok - 4])
+            || !Digits(tok[ntok - 2], toklen[ntok - 2]) || toklen[ntok - 2] > 2)
+            continue;
+
+        const char* when = tok[ntok - 1];
+        size_t wlen = toklen[ntok - 1];
+        bool hhmm = wlen == 5 && when[2] == ':' && Digits(when, 2) && Digits(when + 3, 2);
+        if(!hhmm && !(wlen == 4 && Digits(when, 4)))
+            continue;
+
+        entry.size = strtoll(tok[ntok - 4], NULL, 10);
+
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        tm.tm_mon   = m;
+        tm.tm_mday  = atoi(tok[ntok - 2]);
+        if(hhmm)
+        {
+            time_t t = (time_t)now;
+            struct tm today;
+            gmtime_r(&t, &today);
+            tm.tm_year  = today.tm_year;
+            tm.tm_hour  = atoi(when);
+            tm.tm_min   = atoi(when + 3);
+            entry.mtime = (long long)timegm(&tm);
+            // ls drops the year for the last six months, a date ahead of us is last year's
+            if(entry.mtime > now + 86400)
+            {
+                tm.tm_year--;
+                entry.mtime = (long long)timegm(&tm);
+            }
+        }
+        else
+        {
+            tm.tm_year  = atoi(when) - 1900;
+            entry.mtime = (long long)timegm(&tm);
+        }
+        break;
+    }
+
+    // The name is everything after the single space that follows the date
+    if(p >= end || p + 1 >= end)
+        return false;
+    entry.name      = p + 1;
+    entry.namelen   = (size_t)(end - entry.name);
+
+    if(entry.type == DIRENT_LINK)
+    {
+        for(size_t i = 0; i + 4 <= entry.namelen; i++)
+        {
+            if(!memcmp(entry.name + i, " -> ", 4))
+            {
+                entry.namelen = i;
+                break;
+            }
+        }
+    }
+
+    return entry.namelen > 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Directory Listing
+  *
+  * DirEntry is one parsed listing line: name, size, modification time,
+  * type and permission bits. DirList holds a whole directory with every
+  * name packed into one contiguous, NUL separated arena, so a listing
+  * costs two growing buffers rather than a heap string per entry.
+  *
+  * The parsers understand RFC 3659 MLSD/MLST fact lines and the UNIX
+  * "ls -l" style LIST output most servers without MLSD still send.
+  *
+  * E.G. Usage:
+  *     DirList dir;
+  *     ftp.ListDir(_T("/pub"), dir);
+  *     for(DirList::const_iterator it = dir.begin(); it != dir.end(); ++it)
+  *         if(it->type == DIRENT_FILE) ....
+  */
+
+#ifndef _DIRLIST_H_
+#define _DIRLIST_H_
+
+#include <stddef.h>
+#include <vector>
+
+/* DirEntry types */
+#define DIRENT_FILE     1
+#define DIRENT_DIR      2
+#define DIRENT_LINK     3
+#define DIRENT_OTHER    4
+
+struct DirEntry
+{
+    const char* name;       // NUL terminated, owned by the listing it came from
+    size_t      namelen;
+    long long   size;       // -1 when the listing didn't say
+    long long   mtime;      // UTC seconds since the epoch, -1 when unknown
+    int         type;       // DIRENT_*
+    unsigned    perms;      // POSIX mode bits (07777), 0 when unknown
+};
+
+class DirList
+{
+    public:
+        typedef std::vector<DirEntry>::const_iterator const_iterator;
+
+        DirList(void);
+        DirList(const DirList& other);
+        DirList(DirList&& other);
+        DirList& operator=(const DirList& other);
+        DirList& operator=(DirList&& other);
+
+        /** void Add(const DirEntry&)
+         *  Appends @entry, copying its name into the arena. The pointer held
+         *  by the caller's entry is not kept.
+         */
+        void    Add(const DirEntry& entry);
+        void    Reserve(size_t entries, size_t nameBytes);
+        void    Clear(void);
+
+        size_t              Count(void) const       { return m_entries.size(); }
+        size_t              ArenaBytes(void) const  { return m_arena.size(); }
+        const DirEntry&     operator[](size_t i) const  { return m_entries[i]; }
+        const_iterator      begin(void) const       { return m_entries.begin(); }
+        const_iterator      end(void) const         { return m_entries.end(); }
+
+    private:
+        void    Grow(size_t need);
+        void    Rebase(const char* from, char* to);
+
+        std::vector<DirEntry>   m_entries;
+        std::vector<char>       m_arena;
+};
+
+/** bool ParseMLSD(const char*, size_t, DirEntry&)
+ *  Parses "fact=value;...; name". The name is left pointing into @line.
+ *  Returns : @false for malformed lines and the cdir/pdir entries
+ */
+/** bool ParseUnixList(const char*, size_t, DirEntry&, long long)
+ *  Parses "drwxr-xr-x 2 user group 4096 Nov 21 12:00 name". Dates without
+ *  a year are placed in the twelve months before @now. The name is left
+ *  pointing into @line, a symlink's " -> target" is cut off.
+ *  Returns : @false for "total" lines and anything not shaped like an entry
+ */
+bool ParseMLSD(const char* line, size_t len, DirEntry& entry);
+bool ParseUnixList(const char* line, size_t len, DirEntry& entry, long long now);
+
+#endif // _DIRLIST_H_
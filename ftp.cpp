@@ -10,6 +10,7 @@ FTP::FTP()
                                NULL,
                                0);
     m_connected = false;
+    m_err       = m_hInternet ? 0 : (int)::GetLastError();
 }
 
 FTP::~FTP()
@@ -32,9 +33,10 @@ bool FTP::Connect(TSTR lpszServerName, TSTR lpszUser, TSTR lpszPassword, int por
                                     INTERNET_SERVICE_FTP,
                                     0,
                                     0);
-    if (!m_hFtpSession)
+    if (!Result(m_hFtpSession != NULL))
         return false;
 
+    m_cwd.clear();
     return (m_connected = true);
 }
 
@@ -46,73 +48,87 @@ bool FTP::Disconnect()
         InternetCloseHandle(m_hInternet);
         m_connected = false;
     }
+    m_cwd.clear();
 
+    m_err = 0;
     return !m_connected;
 }
 
 bool FTP::Upload(TSTR lpszLocation, TSTR lpszRemFile)
 {
-    return !m_connected ? false : FtpPutFile(m_hFtpSession,
-                                             (LPTSTR)lpszLocation.c_str(),
-                                             lpszRemFile.empty() ?
-                                                (LPTSTR)lpszLocation.c_str()
-                                                : (LPTSTR)lpszRemFile.c_str(),
-                                             FTP_TRANSFER_TYPE_BINARY,
-                                             0) == TRUE;
+    return !m_connected ?
+        Fail(ERROR_NOT_CONNECTED)
+        : Result(FtpPutFile(m_hFtpSession,
+                            (LPTSTR)lpszLocation.c_str(),
+                            lpszRemFile.empty() ?
+                               (LPTSTR)lpszLocation.c_str()
+                               : (LPTSTR)lpszRemFile.c_str(),
+                            FTP_TRANSFER_TYPE_BINARY,
+                            0));
 }
 
 bool FTP::Download(TSTR lpszLocation, TSTR lpszRemFile)
 {
     return !m_connected ?
-        false
-        : FtpGetFile(m_hFtpSession,
-                     (LPTSTR)lpszLocation.c_str(),
-                     lpszRemFile.empty() ?
-                        (LPTSTR)lpszLocation.c_str()
-                        : (LPTSTR)lpszRemFile.c_str(),
-                     0,
-                     0,
-                     FTP_TRANSFER_TYPE_BINARY,
-                     0) == TRUE;
+        Fail(ERROR_NOT_CONNECTED)
+        : Result(FtpGetFile(m_hFtpSession,
+                            (LPTSTR)lpszLocation.c_str(),
+                            lpszRemFile.empty() ?
+                               (LPTSTR)lpszLocation.c_str()
+                               : (LPTSTR)lpszRemFile.c_str(),
+                            0,
+                            0,
+                            FTP_TRANSFER_TYPE_BINARY,
+                            0));
 }
 
 bool FTP::MakeDir(TSTR lpszDirectory)
 {
     return !m_connected ?
-        false
-        : FtpCreateDirectory(m_hFtpSession,
-                             (LPTSTR)lpszDirectory.c_str()) == TRUE;
+        Fail(ERROR_NOT_CONNECTED)
+        : Result(FtpCreateDirectory(m_hFtpSession,
+                                    (LPTSTR)lpszDirectory.c_str()));
 }
 
 bool FTP::ChangeDir(TSTR lpszDirectory)
 {
-    return !m_connected ?
-        false
-        : FtpSetCurrentDirectory(m_hFtpSession,
-                                 (LPTSTR)lpszDirectory.c_str()) == TRUE;
+    if(!m_connected)
+        return Fail(ERROR_NOT_CONNECTED);
+    if(!Result(FtpSetCurrentDirectory(m_hFtpSession, (LPTSTR)lpszDirectory.c_str())))
+        return false;
+
+    // Followed here rather than asked for again, a relative change from
+    // somewhere unknown leaves it unknown until the next CurrentDir
+    if(!m_cwd.empty() || (!lpszDirectory.empty() && lpszDirectory[0] == '/'))
+    {
+        TSTR cwd;
+        patharena::Normalize(cwd, m_cwd, lpszDirectory);
+        m_cwd.swap(cwd);
+    }
+    return true;
 }
 
 bool FTP::Remove(TSTR lpszFileName)
 {
     return !m_connected ?
-        false
-        : FtpDeleteFile(m_hFtpSession,
-                        (LPTSTR)lpszFileName.c_str()) == TRUE;
+        Fail(ERROR_NOT_CONNECTED)
+        : Result(FtpDeleteFile(m_hFtpSession,
+                               (LPTSTR)lpszFileName.c_str()));
 }
 
 bool FTP::Rename(TSTR lpszOldFileName, TSTR lpszNewFileName)
 {
     return !m_connected ?
-        false
-        : FtpRenameFile(m_hFtpSession,
-                        (LPTSTR)lpszOldFileName.c_str(),
-                        (LPTSTR)lpszNewFileName.c_str()) == TRUE;
+        Fail(ERROR_NOT_CONNECTED)
+        : Result(FtpRenameFile(m_hFtpSession,
+                               (LPTSTR)lpszOldFileName.c_str(),
+                               (LPTSTR)lpszNewFileName.c_str()));
 }
 
 bool FTP::Exists(TSTR lpszFileName)
 {
     if(!m_connected)
-        return false;
+        return Fail(ERROR_NOT_CONNECTED);
 
     WIN32_FIND_DATA data;
 
@@ -124,7 +140,7 @@ bool FTP::Exists(TSTR lpszFileName)
                                          INTERNET_FLAG_RELOAD |
                                          INTERNET_FLAG_RESYNCHRONIZE,
                                          NULL);
-    if(!fHandle)
+    if(!Result(fHandle != NULL))
         return false;
 
     InternetCloseHandle(fHandle);
@@ -136,9 +152,9 @@ bool FTP::Exists(TSTR lpszFileName)
 bool FTP::RemoveDir(TSTR lpszDirectory)
 {
     return !m_connected ?
-        false
-        : FtpRemoveDirectory(m_hFtpSession,
-                             (LPTSTR)lpszDirectory.c_str()) == TRUE;
+        Fail(ERROR_NOT_CONNECTED)
+        : Result(FtpRemoveDirectory(m_hFtpSession,
+                                    (LPTSTR)lpszDirectory.c_str()));
 }
 
 HINTERNET FTP::GetHandle()
@@ -148,32 +164,42 @@ HINTERNET FTP::GetHandle()
 
 TSTR FTP::CurrentDir()
 {
-    LPTSTR lpszCurrentDirectory = (LPTSTR)GlobalAlloc(GPTR, MAX_PATH + 1);
-    DWORD lpdwCurrentDirectory  = MAX_PATH;
-    TSTR strCurrentDirectory;
+    TSTRVIEW dir = CurrentDirView();
+    return m_err ? TSTR(_T("ERROR-1")) : TSTR(dir.data(), dir.size());
+}
 
-    if (!FtpGetCurrentDirectory(m_hFtpSession,
-                                lpszCurrentDirectory,
-                                &lpdwCurrentDirectory))
+TSTRVIEW FTP::CurrentDirView()
+{
+    if(!m_connected)
     {
-        strCurrentDirectory = _T("ERROR-1");
-        return strCurrentDirectory;
+        Fail(ERROR_NOT_CONNECTED);
+        return TSTRVIEW();
     }
-
-    int len = (int)lpdwCurrentDirectory;
-    for (int i = 0; i < len; i++)
+    if(!m_cwd.empty())
     {
-        strCurrentDirectory += lpszCurrentDirectory[i];
+        m_err = 0;
+        return m_cwd;
     }
-    GlobalFree((HANDLE)lpszCurrentDirectory);
 
-    return strCurrentDirectory;
+    // The length goes in and comes back in TCHARs, the NUL included going in
+    TCHAR szCurrentDirectory[MAX_PATH + 1];
+    DWORD dwCurrentDirectory = MAX_PATH + 1;
+    if(!Result(FtpGetCurrentDirectory(m_hFtpSession,
+                                      szCurrentDirectory,
+                                      &dwCurrentDirectory)))
+        return TSTRVIEW();
+
+    m_cwd.assign(szCurrentDirectory, dwCurrentDirectory);
+    return m_cwd;
 }
 
 LONGLONG FTP::GetFileSize(TSTR lpszFileName)
 {
     if(!m_connected)
+    {
+        Fail(ERROR_NOT_CONNECTED);
         return INVALID_FILE;
+    }
 
     HINTERNET fHandle = FtpOpenFile(m_hFtpSession,
                                     (LPTSTR)lpszFileName.c_str(),
@@ -184,11 +210,13 @@ LONGLONG FTP::GetFileSize(TSTR lpszFileName)
     DWORD dwFileSizeLow = INVALID_FILE;
     DWORD dwFileSizeHigh = INVALID_FILE;
 
-    if(fHandle)
+    if(Result(fHandle != NULL))
     {
         dwFileSizeLow = FtpGetFileSize(fHandle,
                                        &dwFileSizeHigh);
-
+        // A low part of all ones is only a failure when the error says so
+        if(dwFileSizeLow == INVALID_FILE_SIZE && !Result(::GetLastError() == NO_ERROR))
+            dwFileSizeHigh = INVALID_FILE;
 
         InternetCloseHandle(fHandle);
     }
@@ -202,7 +230,7 @@ LONGLONG FTP::GetFileSize(TSTR lpszFileName)
 bool FTP::GetFileData(TSTR lpszFileName, WIN32_FIND_DATA& data)
 {
     if(!m_connected)
-        return false;
+        return Fail(ERROR_NOT_CONNECTED);
 
     HINTERNET fHandle = FtpFindFirstFile(m_hFtpSession,
                                          (LPTSTR)lpszFileName.c_str(),
@@ -212,7 +240,7 @@ bool FTP::GetFileData(TSTR lpszFileName, WIN32_FIND_DATA& data)
                                          INTERNET_FLAG_RELOAD |
                                          INTERNET_FLAG_RESYNCHRONIZE,
                                          NULL);
-    if(!fHandle)
+    if(!Result(fHandle != NULL))
     {
         memset(&data, 0, sizeof(WIN32_FIND_DATA));
         return false;
@@ -226,7 +254,10 @@ bool FTP::GetFileData(TSTR lpszFileName, WIN32_FIND_DATA& data)
 LIST FTP::SearchDir(TSTR lpszSearchStr)
 {
     if(!m_connected)
+    {
+        Fail(ERROR_NOT_CONNECTED);
         return LIST();
+    }
 
     LIST files;
     WIN32_FIND_DATA data;
@@ -240,8 +271,13 @@ LIST FTP::SearchDir(TSTR lpszSearchStr)
                                          INTERNET_FLAG_RESYNCHRONIZE,
                                          NULL);
     if(!fHandle)
+    {
+        // Nothing matching isn't a failure
+        Result(::GetLastError() == ERROR_NO_MORE_FILES);
         return files;
+    }
 
+    m_err = 0;
     files.push_back(data.cFileName);
 
     while(InternetFindNextFile(fHandle, &data))
@@ -255,19 +291,45 @@ LIST FTP::SearchDir(TSTR lpszSearchStr)
 bool FTP::Command(TSTR lpszCommand)
 {
     return !m_connected ?
-        false
-        : FtpCommand(m_hFtpSession,
-                     FALSE,
-                     FTP_TRANSFER_TYPE_BINARY,
-                     (LPTSTR)lpszCommand.c_str(),
-                     0,
-                     NULL) == TRUE;
+        Fail(ERROR_NOT_CONNECTED)
+        : Result(FtpCommand(m_hFtpSession,
+                            FALSE,
+                            FTP_TRANSFER_TYPE_BINARY,
+                            (LPTSTR)lpszCommand.c_str(),
+                            0,
+                            NULL));
 }
 
 
 int FTP::GetLastError(void)
 {
-    return (int)GetLastError();
+    return m_err;
+}
+
+int FTP::LastReply(void)
+{
+    if(m_err != ERROR_INTERNET_EXTENDED_ERROR)
+        return 0;
+
+    // The server's own reply, "550 No such file" and the like
+    TCHAR text[256];
+    DWORD code = 0;
+    DWORD len  = sizeof(text) / sizeof(text[0]);
+    if(!InternetGetLastResponseInfo(&code, text, &len) || len < 3)
+        return 0;
+    return _ttoi(text);
+}
+
+bool FTP::Result(BOOL ok)
+{
+    m_err = ok ? 0 : (int)::GetLastError();
+    return ok != FALSE;
+}
+
+bool FTP::Fail(DWORD err)
+{
+    m_err = (int)err;
+    return false;
 }
 
 #endif
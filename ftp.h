@@ -23,7 +23,8 @@
 #include "connstream.h"
 #pragma comment (lib, "wininet.lib")
 
-/** NOTE: Use GetLastError() to examine the @false result from any method */
+/** NOTE: Use GetLastError() to examine the @false result from any method,
+ *        it is kept per session rather than read back from the thread */
 
 class FTP : public connstream
 {
@@ -88,7 +89,8 @@ class FTP : public connstream
          *              if there is no active connection.
          */
         /** TSTR CurrentDir(void)
-         *  Retrieves current directory path
+         *  Retrieves current directory path, from the server the first time
+         *  and as ChangeDir has moved it since.
          *
          *  Returns : currently pointed to server directory as a TSTR for unicode support
          */
@@ -103,6 +105,9 @@ class FTP : public connstream
         TSTR    CurrentDir(void);
         LIST    SearchDir(TSTR lpszSearchStr);
 
+        /** TSTRVIEW CurrentDirView(void) - CurrentDir without the copy */
+        TSTRVIEW    CurrentDirView(void);
+
         /// FILE HANDLING METHODS ///
         /** bool Remove(TSTR)
          *  Removes a file from FTP server.
@@ -169,9 +174,19 @@ class FTP : public connstream
          */
         int GetLastError(void);
 
+    protected:
+        /** LastReply gives connresult the server's reply behind an
+         *  ERROR_INTERNET_EXTENDED_ERROR */
+        int     LastReply(void);
+
     private:
+        /** Result keeps the thread's error for a failed WinInet call in m_err */
+        bool    Result(BOOL ok);
+        bool    Fail(DWORD err);
+
         HINTERNET   m_hInternet;
         HINTERNET   m_hFtpSession;
+        TSTR        m_cwd;          // Empty until known
 };
 
 #endif
@@ -0,0 +1,1338 @@
+#include <ftpserver.h>
+#include "checksum.h"
+#include "compress.h"
+
+#if !defined(_MSC_VER)
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define SRV_LINE_BUFSIZE    8192
+#define SRV_DATA_BUFSIZE    65536
+#define SRV_ACCEPT_TIMEOUT  30000
+
+struct ftpsession
+{
+    FTPServer*  srv;
+    std::thread thread;
+    bool        done;
+
+    int         ctrl;
+    int         pasv;
+    int         data;
+
+    bool        authed;
+    std::string user;
+    std::string cwd;
+    std::string rnfr;
+    long long   rest;
+    long long   rangFrom;   // RANG, inclusive, for the next RETR/STOR/HASH
+    long long   rangTo;     // -1 when no range is set
+    int         hash;       // Algorithm HASH answers with, set by OPTS HASH
+    bool        deflate;    // MODE Z
+
+    char        buf[SRV_LINE_BUFSIZE];
+    size_t      head;
+    size_t      tail;
+
+    long long   paced;      // Bytes on the data connection so far
+    std::chrono::steady_clock::time_point pacedFrom;
+    long long   cutAt;      // Where InjectDisconnect cuts this transfer, -1 for never
+    bool        cutSession; // Taking the control connection with it
+#if defined(CONNSTREAM_TLS)
+    tlslink     ctrlTls;    // After AUTH TLS
+    tlslink     dataTls;
+    bool        pbsz;
+    bool        prot;       // PROT P, data connections start TLS once accepted
+#endif
+
+    /// CONTROL CHANNEL ///
+    bool        Reply(int code, const char* fmt, ...);
+    bool        Raw(const std::string& text);
+    bool        ReadCommand(std::string& line);
+    ssize_t     Recv(int fd, void* p, size_t len);
+    ssize_t     Send(int fd, const void* p, size_t len);
+
+    /// PATHS ///
+    std::string Resolve(const std::string& arg);
+    std::string Real(const std::string& vpath);
+
+    /// DATA CHANNEL ///
+    bool        OpenPassive(bool extended);
+    int         AcceptData(void);
+    void        CloseData(bool graceful);
+    bool        SendData(int fd, const std::string& text);
+    ssize_t     SendFile(int sock, int fd, off_t* off, size_t len);
+    size_t      Quantum(size_t len);
+    bool        Moved(size_t len);
+    void        Arm(void);
+    bool        Dropped(void);
+
+    /// COMMANDS ///
+    bool        Dispatch(const std::string& verb, const std::string& arg);
+    void        Retrieve(const std::string& arg);
+    void        Store(const std::string& arg, bool append);
+    void        List(const std::string& arg, char mode);
+};
+
+static void CloseFd(std::mutex& lock, int& fd)
+{
+    std::lock_guard<std::mutex> g(lock);
+    if(fd >= 0)
+        close(fd);
+    fd = -1;
+}
+
+static std::string ModTime(time_t t)
+{
+    char ts[32];
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(ts, sizeof(ts), "%Y%m%d%H%M%S", &tm);
+    return ts;
+}
+
+static std::string Facts(const struct stat& st)
+{
+    char buf[128];
+    if(S_ISDIR(st.st_mode))
+        snprintf(buf, sizeof(buf), "type=dir;modify=%s;perm=flcdmpe;UNIX.mode=0%o;",
+                 ModTime(st.st_mtime).c_str(), (unsigned)(st.st_mode & 07777));
+    else
+        snprintf(buf, sizeof(buf), "type=file;size=%lld;modify=%s;perm=adfrw;UNIX.mode=0%o;",
+                 (long long)st.st_size, ModTime(st.st_mtime).c_str(), (unsigned)(st.st_mode & 07777));
+    return buf;
+}
+
+// Hex digest of a local file from @from up to and including @to, -1 for its end
+static bool HashFile(const std::string& real, int alg, std::string& hex, long long& size,
+                     long long from = 0, long long to = -1)
+{
+    int fd = open(real.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+
+    checksum sum(alg);
+    char buf[SRV_DATA_BUFSIZE];
+    ssize_t n = 0;
+    for(off_t off = (off_t)from; to < 0 || off <= to; off += n)
+    {
+        size_t want = to < 0 || to - off + 1 > (off_t)sizeof(buf) ? sizeof(buf) : (size_t)(to - off + 1);
+        if((n = pread(fd, buf, want, off)) <= 0)
+            break;
+        sum.Update(buf, (size_t)n);
+    }
+    close(fd);
+    if(n < 0)
+        return false;
+
+    hex  = sum.Hex();
+    size = (long long)sum.Length();
+    return true;
+}
+
+static bool WriteFd(ftpsession* s, int fd, const char* p, size_t len)
+{
+    while(len)
+    {
+        ssize_t n = s->Send(fd, p, len);
+        if(n < 0 && errno == ENOTSOCK)
+            n = write(fd, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        p   += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// Runs @pipe from descriptor @in to @out until the stream ends, pacing
+// whichever side is @s's data connection
+static bool PipeFds(ftpsession* s, codecpipe& pipe, int in, int out)
+{
+    std::string block;
+    char chunk[SRV_DATA_BUFSIZE];
+    for(;;)
+    {
+        int r = pipe.Pop(block);
+        if(r == CODEC_END)
+            return true;
+        if(r == CODEC_FAILED)
+            return false;
+        if(r == CODEC_DATA)
+        {
+            if(!WriteFd(s, out, block.data(), block.size()))
+                return false;
+            if(out == s->data && !s->Moved(block.size()))
+                return false;
+            continue;
+        }
+
+        ssize_t n = in == s->data ? s->Recv(in, chunk, sizeof(chunk)) : read(in, chunk, sizeof(chunk));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return false;
+        if(in == s->data && !s->Moved((size_t)n))
+            return false;
+        if(n == 0)
+            pipe.Finish();
+        else
+            pipe.Push(chunk, (size_t)n);
+    }
+}
+
+static std::string LongEntry(const struct stat& st, const std::string& name)
+{
+    char perms[11] = "----------";
+    const char* rwx = "rwxrwxrwx";
+    if(S_ISDIR(st.st_mode))
+        perms[0] = 'd';
+    for(int i = 0; i < 9; i++)
+        if(st.st_mode & (0400 >> i))
+            perms[i + 1] = rwx[i];
+
+    char when[32];
+    struct tm tm;
+    gmtime_r(&st.st_mtime, &tm);
+    if(time(NULL) - st.st_mtime > 180 * 24 * 3600)
+        strftime(when, sizeof(when), "%b %d  %Y", &tm);
+    else
+        strftime(when, sizeof(when), "%b %d %H:%M", &tm);
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s 1 ftp ftp %12lld %s ",
+             perms, (long long)st.st_size, when);
+    return buf + name;
+}
+
+
+/// CONTROL CHANNEL ///
+
+bool ftpsession::Raw(const std::string& text)
+{
+    const char* p = text.c_str();
+    size_t len = text.size();
+    while(len)
+    {
+        ssize_t n = Send(ctrl, p, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        p   += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+bool ftpsession::Reply(int code, const char* fmt, ...)
+{
+    char text[SRV_LINE_BUFSIZE];
+    int n = snprintf(text, sizeof(text), "%03d ", code);
+
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(text + n, sizeof(text) - n - 2, fmt, ap);
+    va_end(ap);
+
+    return Raw(std::string(text) + "\r\n");
+}
+
+bool ftpsession::ReadCommand(std::string& line)
+{
+    for(;;)
+    {
+        char* nl = (char*)memchr(buf + head, '\n', tail - head);
+        if(nl)
+        {
+            size_t n = (size_t)(nl - (buf + head));
+            line.assign(buf + head, n && nl[-1] == '\r' ? n - 1 : n);
+            head = (size_t)(nl - buf) + 1;
+            return true;
+        }
+
+        memmove(buf, buf + head, tail - head);
+        tail -= head;
+        head  = 0;
+        if(tail == sizeof(buf))
+            return false;
+
+        ssize_t n = Recv(ctrl, buf + tail, sizeof(buf) - tail);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        tail += (size_t)n;
+    }
+}
+
+ssize_t ftpsession::Recv(int fd, void* p, size_t len)
+{
+#if defined(CONNSTREAM_TLS)
+    if(ctrlTls.Active() && fd == ctrl)
+        return ctrlTls.Recv(p, len);
+    if(dataTls.Active() && fd == data)
+        return dataTls.Recv(p, len);
+#endif
+    return recv(fd, p, len, 0);
+}
+
+ssize_t ftpsession::Send(int fd, const void* p, size_t len)
+{
+#if defined(CONNSTREAM_TLS)
+    if(ctrlTls.Active() && fd == ctrl)
+        return ctrlTls.Send(p, len);
+    if(dataTls.Active() && fd == data)
+        return dataTls.Send(p, len);
+#endif
+    return send(fd, p, len, MSG_NOSIGNAL);
+}
+
+
+/// PATHS ///
+
+std::string ftpsession::Resolve(const std::string& arg)
+{
+    std::string path = arg.empty() ? cwd : (arg[0] == '/' ? arg : cwd + "/" + arg);
+
+    // Lexical normalisation, ".." never climbs out of the served root
+    std::vector<std::string> parts;
+    size_t pos = 0;
+    while(pos <= path.size())
+    {
+        size_t end = path.find('/', pos);
+        if(end == std::string::npos)
+            end = path.size();
+        std::string part = path.substr(pos, end - pos);
+        pos = end + 1;
+
+        if(part.empty() || part == ".")
+            continue;
+        if(part == "..")
+        {
+            if(!parts.empty())
+                parts.pop_back();
+            continue;
+        }
+        parts.push_back(part);
+    }
+
+    std::string out;
+    for(size_t i = 0; i < parts.size(); i++)
+        out += "/" + parts[i];
+    return out.empty() ? "/" : out;
+}
+
+std::string ftpsession::Real(const std::string& vpath)
+{
+    return vpath == "/" ? srv->m_root : srv->m_root + vpath;
+}
+
+
+/// DATA CHANNEL ///
+
+bool ftpsession::OpenPassive(bool extended)
+{
+    CloseFd(srv->m_lock, pasv);
+
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if(getsockname(ctrl, (struct sockaddr*)&addr, &len) < 0)
+        return false;
+
+    if(addr.ss_family == AF_INET6)
+        ((struct sockaddr_in6*)&addr)->sin6_port = 0;
+    else if(addr.ss_family == AF_INET)
+        ((struct sockaddr_in*)&addr)->sin_port = 0;
+    else
+        return false;
+
+    int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return false;
+    if(bind(fd, (struct sockaddr*)&addr, len) < 0 || listen(fd, 1) < 0
+        || getsockname(fd, (struct sockaddr*)&addr, &len) < 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> g(srv->m_lock);
+        pasv = fd;
+    }
+
+    if(extended)
+        return Reply(229, "Entering Extended Passive Mode (|||%d|)",
+                     addr.ss_family == AF_INET6 ? ntohs(((struct sockaddr_in6*)&addr)->sin6_port)
+                                                : ntohs(((struct sockaddr_in*)&addr)->sin_port));
+
+    if(addr.ss_family != AF_INET)
+        return Reply(522, "Network protocol not supported, use (2)");
+
+    unsigned char* ip = (unsigned char*)&((struct sockaddr_in*)&addr)->sin_addr;
+    int port = ntohs(((struct sockaddr_in*)&addr)->sin_port);
+    return Reply(227, "Entering Passive Mode (%d,%d,%d,%d,%d,%d)",
+                 ip[0], ip[1], ip[2], ip[3], port >> 8, port & 0xff);
+}
+
+int ftpsession::AcceptData()
+{
+    if(pasv < 0)
+        return -1;
+
+    struct pollfd p;
+    p.fd        = pasv;
+    p.events    = POLLIN;
+    p.revents   = 0;
+    if(poll(&p, 1, SRV_ACCEPT_TIMEOUT) <= 0)
+    {
+        CloseFd(srv->m_lock, pasv);
+        return -1;
+    }
+
+    int fd = accept4(pasv, NULL, NULL, SOCK_CLOEXEC);
+    CloseFd(srv->m_lock, pasv);
+
+    // The connection's own round trip, then pacing starts from its first byte
+    int ms = srv->m_latency.load();
+    if(fd >= 0 && ms > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    paced       = 0;
+    pacedFrom   = std::chrono::steady_clock::now();
+    cutAt       = -1;
+
+    {
+        std::lock_guard<std::mutex> g(srv->m_lock);
+        data = fd;
+    }
+
+#if defined(CONNSTREAM_TLS)
+    // Under PROT P the client starts TLS as soon as it has the 150
+    if(data >= 0 && prot && !dataTls.Handshake(srv->TLS(), data, SRV_ACCEPT_TIMEOUT))
+        CloseData(false);
+#endif
+    return data;
+}
+
+// With @graceful a TLS data connection ends on close_notify, otherwise it
+// is cut off the way a dropped connection would be
+void ftpsession::CloseData(bool graceful)
+{
+#if defined(CONNSTREAM_TLS)
+    dataTls.Close(graceful, SRV_ACCEPT_TIMEOUT);
+#else
+    (void)graceful;
+#endif
+    CloseFd(srv->m_lock, data);
+}
+
+bool ftpsession::SendData(int fd, const std::string& text)
+{
+    const char* p = text.c_str();
+    size_t len = text.size();
+    while(len)
+    {
+        ssize_t n = Send(fd, p, Quantum(len));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0 || !Moved((size_t)n))
+            return false;
+        p   += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// sendfile(2), or pread and Send while the data connection's TLS is in user space
+ssize_t ftpsession::SendFile(int sock, int fd, off_t* off, size_t len)
+{
+#if defined(CONNSTREAM_TLS)
+    if(dataTls.Active() && sock == data && !dataTls.KernelSend())
+    {
+        char chunk[SRV_DATA_BUFSIZE];
+        ssize_t n = pread(fd, chunk, len < sizeof(chunk) ? len : sizeof(chunk), *off);
+        if(n > 0 && (n = dataTls.Send(chunk, (size_t)n)) > 0)
+            *off += n;
+        return n;
+    }
+#endif
+    return sendfile(sock, fd, off, len);
+}
+
+// Under a bandwidth cap data moves a buffer at a time so it can be paced,
+// and never past the point an injected disconnect cuts at
+size_t ftpsession::Quantum(size_t len)
+{
+    if(srv->m_bandwidth.load() > 0 && len > SRV_DATA_BUFSIZE)
+        len = SRV_DATA_BUFSIZE;
+    if(cutAt > paced && (long long)len > cutAt - paced)
+        len = (size_t)(cutAt - paced);
+    return len;
+}
+
+// Counts @len more bytes on the data connection and sleeps until they are
+// within the cap, measured from the connection's start so a slow write
+// isn't paid for twice. @false once an injected disconnect is due.
+bool ftpsession::Moved(size_t len)
+{
+    long long bw = srv->m_bandwidth.load();
+    paced += (long long)len;
+    if(bw > 0)
+    {
+        long long due = (long long)((double)paced * 1e6 / (double)bw);
+        std::this_thread::sleep_until(pacedFrom + std::chrono::microseconds(due));
+    }
+    return cutAt < 0 || paced < cutAt;
+}
+
+// Takes one of InjectDisconnect's faults for the file transfer just accepted
+void ftpsession::Arm()
+{
+    int left = srv->m_faults.load();
+    while(left > 0 && !srv->m_faults.compare_exchange_weak(left, left - 1))
+        ;
+    if(left <= 0)
+        return;
+    cutAt       = srv->m_faultAt.load();
+    cutSession  = srv->m_faultSession.load();
+    if(!cutAt)
+        cutAt = 1;      // The earliest a transfer can break, one byte in
+}
+
+// After a cut transfer, ends the session without a reply when the fault says so
+bool ftpsession::Dropped()
+{
+    if(cutAt < 0 || paced < cutAt || !cutSession)
+        return false;
+    shutdown(ctrl, SHUT_RDWR);
+    return true;
+}
+
+
+/// COMMANDS ///
+
+void ftpsession::Retrieve(const std::string& arg)
+{
+    std::string vpath = Resolve(arg);
+    long long offset  = rangTo >= 0 ? rangFrom : rest;
+    long long last    = rangTo;
+    rest    = 0;
+    rangTo  = -1;
+
+    struct stat st;
+    int fd = open(Real(vpath).c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        if(fd >= 0)
+            close(fd);
+        Reply(550, "%s: No such file", vpath.c_str());
+        return;
+    }
+
+    if(pasv < 0)
+    {
+        close(fd);
+        Reply(425, "Use PASV or EPSV first");
+        return;
+    }
+
+    off_t end = last >= 0 && last < (long long)st.st_size ? (off_t)last + 1 : st.st_size;
+    Reply(150, "Opening BINARY mode data connection for %s (%lld bytes)",
+          vpath.c_str(), (long long)(last >= 0 ? end - offset : st.st_size));
+
+    int sock = AcceptData();
+    if(sock < 0)
+    {
+        close(fd);
+        Reply(425, "Can't open data connection");
+        return;
+    }
+    Arm();
+
+    bool ok = true;
+    off_t off = (off_t)offset;
+    if(deflate)
+    {
+        codecpipe pipe(codec::Create(CODEC_DEFLATE, true));
+        ok  = lseek(fd, off, SEEK_SET) == off && PipeFds(this, pipe, fd, sock);
+        off = end;
+    }
+    while(ok && off < end)
+    {
+        ssize_t n = SendFile(sock, fd, &off, Quantum((size_t)(end - off)));
+        if(n < 0 && errno == EINTR)
+            continue;
+        ok = n > 0 && Moved((size_t)n);
+    }
+    close(fd);
+    CloseData(ok);
+
+    if(Dropped())
+        return;
+    if(ok)
+        Reply(226, "Transfer complete");
+    else
+        Reply(426, "Connection closed; transfer aborted");
+}
+
+void ftpsession::Store(const std::string& arg, bool append)
+{
+    std::string vpath = Resolve(arg);
+    bool ranged       = rangTo >= 0;
+    long long offset  = ranged ? rangFrom : rest;
+    rest    = 0;
+    rangTo  = -1;
+
+    // A ranged STOR writes over the file in place like REST does
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    if(append)
+        flags |= O_APPEND;
+    else if(!offset && !ranged)
+        flags |= O_TRUNC;
+
+    int fd = open(Real(vpath).c_str(), flags, 0644);
+    if(fd < 0 || (offset && lseek(fd, (off_t)offset, SEEK_SET) < 0))
+    {
+        if(fd >= 0)
+            close(fd);
+        Reply(553, "%s: %s", vpath.c_str(), strerror(errno));
+        return;
+    }
+
+    if(pasv < 0)
+    {
+        close(fd);
+        Reply(425, "Use PASV or EPSV first");
+        return;
+    }
+
+    Reply(150, "Ok to send data");
+
+    int sock = AcceptData();
+    if(sock < 0)
+    {
+        close(fd);
+        Reply(425, "Can't open data connection");
+        return;
+    }
+    Arm();
+
+    char chunk[SRV_DATA_BUFSIZE];
+    bool ok = true;
+    if(deflate)
+    {
+        codecpipe pipe(codec::Create(CODEC_DEFLATE, false));
+        ok = PipeFds(this, pipe, sock, fd);
+    }
+    else
+    {
+        for(;;)
+        {
+            ssize_t n = Recv(sock, chunk, Quantum(sizeof(chunk)));
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+            {
+                ok = n == 0;
+                break;
+            }
+            for(ssize_t w = 0; ok && w < n; )
+            {
+                ssize_t r = write(fd, chunk + w, (size_t)(n - w));
+                if(r < 0 && errno == EINTR)
+                    continue;
+                if(r < 0)
+                    ok = false;
+                else
+                    w += r;
+            }
+            if(!ok || !Moved((size_t)n))
+            {
+                ok = false;
+                break;
+            }
+        }
+    }
+    if(close(fd) < 0)
+        ok = false;
+    CloseData(ok);
+
+    if(Dropped())
+        return;
+    if(ok)
+        Reply(226, "Transfer complete");
+    else
+        Reply(451, "Transfer aborted");
+}
+
+void ftpsession::List(const std::string& arg, char mode)
+{
+    // LIST takes ls style flags some clients still send
+    std::string target = arg;
+    if(mode == 'L' && !target.empty() && target[0] == '-')
+    {
+        size_t sp = target.find(' ');
+        target = sp == std::string::npos ? "" : target.substr(sp + 1);
+    }
+
+    std::string vpath = Resolve(target);
+    std::string real  = Real(vpath);
+
+    struct stat st;
+    if(stat(real.c_str(), &st) < 0)
+    {
+        Reply(550, "%s: No such file or directory", vpath.c_str());
+        return;
+    }
+    if(mode == 'M' && !S_ISDIR(st.st_mode))
+    {
+        Reply(501, "%s: Not a directory", vpath.c_str());
+        return;
+    }
+
+    std::string out;
+    if(S_ISDIR(st.st_mode))
+    {
+        DIR* d = opendir(real.c_str());
+        if(!d)
+        {
+            Reply(550, "%s: %s", vpath.c_str(), strerror(errno));
+            return;
+        }
+        for(struct dirent* e = readdir(d); e; e = readdir(d))
+        {
+            std::string name = e->d_name;
+            if(name == "." || name == "..")
+                continue;
+
+            struct stat es;
+            if(stat((real + "/" + name).c_str(), &es) < 0)
+                continue;
+
+            if(mode == 'M')
+                out += Facts(es) + " " + name + "\r\n";
+            else if(mode == 'L')
+                out += LongEntry(es, name) + "\r\n";
+            else
+                out += name + "\r\n";
+        }
+        closedir(d);
+    }
+    else
+    {
+        std::string name = vpath.substr(vpath.rfind('/') + 1);
+        out = (mode == 'L' ? LongEntry(st, name) : (target.empty() ? name : target)) + "\r\n";
+    }
+
+    if(pasv < 0)
+    {
+        Reply(425, "Use PASV or EPSV first");
+        return;
+    }
+
+    Reply(150, "Here comes the directory listing");
+
+    int sock = AcceptData();
+    if(sock < 0)
+    {
+        Reply(425, "Can't open data connection");
+        return;
+    }
+
+    if(deflate)
+    {
+        codec* z = codec::Create(CODEC_DEFLATE, true);
+        std::string packed;
+        z->Process(out.data(), out.size(), packed, true);
+        delete z;
+        out.swap(packed);
+    }
+
+    bool ok = SendData(sock, out);
+    CloseData(ok);
+
+    if(ok)
+        Reply(226, "Directory send OK");
+    else
+        Reply(426, "Connection closed; transfer aborted");
+}
+
+bool ftpsession::Dispatch(const std::string& verb, const std::string& arg)
+{
+    const char* v = verb.c_str();
+
+    if(!strcmp(v, "QUIT"))
+    {
+        Reply(221, "Goodbye");
+        return false;
+    }
+    if(!strcmp(v, "USER"))
+    {
+        user    = arg;
+        authed  = false;
+        return Reply(331, "Please specify the password");
+    }
+    if(!strcmp(v, "PASS"))
+    {
+        if(!srv->m_user.empty() && (user != srv->m_user || arg != srv->m_pwd))
+            return Reply(530, "Login incorrect");
+        authed = true;
+        return Reply(230, "Login successful");
+    }
+    if(!strcmp(v, "FEAT"))
+    {
+        // The algorithm in use is starred, as draft-bryan-ftpext-hash asks
+        std::string algs;
+        static const int offered[] = { CHECKSUM_SHA256, CHECKSUM_MD5, CHECKSUM_CRC32,
+                                       CHECKSUM_CRC32C, CHECKSUM_XXH64 };
+        for(size_t i = 0; i < sizeof(offered) / sizeof(offered[0]); i++)
+        {
+            algs += i ? ";" : "";
+            algs += checksum::Name(offered[i]);
+            algs += offered[i] == hash ? "*" : "";
+        }
+        std::string secure;
+        TLS_ONLY(if(srv->TLS()) secure = " AUTH TLS\r\n PBSZ\r\n PROT\r\n";)
+        return Raw("211-Features:\r\n" + secure +
+                   " EPSV\r\n"
+                   " HASH " + algs + "\r\n"
+                   " MDTM\r\n"
+                   " MODE Z\r\n"
+                   " MLST type*;size*;modify*;perm*;\r\n"
+                   " PASV\r\n"
+                   " RANG STREAM\r\n"
+                   " REST STREAM\r\n"
+                   " SIZE\r\n"
+                   " UTF8\r\n"
+                   "211 End\r\n");
+    }
+    if(!strcmp(v, "SYST"))
+        return Reply(215, "UNIX Type: L8");
+    if(!strcmp(v, "OPTS"))
+    {
+        if(strncasecmp(arg.c_str(), "HASH", 4) || (arg.size() > 4 && arg[4] != ' '))
+            return Reply(200, "Always in UTF8 mode");
+        if(arg.size() > 5)
+        {
+            int alg = checksum::Parse(arg.c_str() + 5);
+            if(alg == CHECKSUM_NONE)
+                return Reply(501, "Unknown algorithm, current selection not changed");
+            hash = alg;
+        }
+        return Reply(200, "%s", checksum::Name(hash));
+    }
+    if(!strcmp(v, "NOOP"))
+        return Reply(200, "NOOP ok");
+#if defined(CONNSTREAM_TLS)
+    if(!strcmp(v, "AUTH"))
+    {
+        std::shared_ptr<tlscontext> tls = srv->TLS();
+        if(!tls)
+            return Reply(502, "AUTH not supported");
+        if(strcasecmp(arg.c_str(), "TLS") && strcasecmp(arg.c_str(), "TLS-C") && strcasecmp(arg.c_str(), "SSL"))
+            return Reply(504, "AUTH %s not supported", arg.c_str());
+        if(ctrlTls.Active())
+            return Reply(503, "Already using TLS");
+
+        // Anything sent behind AUTH came in cleartext, it's dropped unread.
+        // RFC 4217 has the login start over once the connection is secure.
+        head    = 0;
+        tail    = 0;
+        user.clear();
+        authed  = false;
+        return Reply(234, "Proceed with negotiation") && ctrlTls.Handshake(tls, ctrl, SRV_ACCEPT_TIMEOUT);
+    }
+    if(!strcmp(v, "PBSZ"))
+    {
+        if(!ctrlTls.Active())
+            return Reply(503, "PBSZ needs AUTH TLS first");
+        pbsz = true;
+        return Reply(200, "PBSZ=0");
+    }
+    if(!strcmp(v, "PROT"))
+    {
+        if(!pbsz)
+            return Reply(503, "PROT needs PBSZ first");
+        if(arg != "P" && arg != "C")
+            return Reply(504, "PROT %s not supported", arg.c_str());
+        prot = arg == "P";
+        return Reply(200, "PROT now %s", prot ? "Private" : "Clear");
+    }
+#endif
+
+    if(!authed)
+        return Reply(530, "Please login with USER and PASS");
+
+    if(!strcmp(v, "TYPE"))
+    {
+        if(arg == "I" || arg == "A" || arg == "L 8")
+            return Reply(200, "Switching to %s mode", arg == "A" ? "ASCII" : "Binary");
+        return Reply(504, "Unsupported type");
+    }
+    if(!strcmp(v, "MODE"))
+    {
+        if(arg != "S" && arg != "Z")
+            return Reply(504, "Unsupported mode");
+        deflate = arg == "Z";
+        return Reply(200, "Mode set to %s", arg.c_str());
+    }
+    if(!strcmp(v, "STRU"))
+        return arg == "F" ? Reply(200, "Structure set to F") : Reply(504, "Unsupported structure");
+    if(!strcmp(v, "PWD") || !strcmp(v, "XPWD"))
+    {
+        std::string quoted;
+        for(size_t i = 0; i < cwd.size(); i++)
+            quoted += cwd[i] == '"' ? "\"\"" : std::string(1, cwd[i]);
+        return Reply(257, "\"%s\" is the current directory", quoted.c_str());
+    }
+    if(!strcmp(v, "CWD") || !strcmp(v, "CDUP") || !strcmp(v, "XCUP"))
+    {
+        std::string vpath = Resolve(v[1] == 'W' ? arg : std::string(".."));
+        struct stat st;
+        if(stat(Real(vpath).c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+            return Reply(550, "Failed to change directory");
+        cwd = vpath;
+        return Reply(250, "Directory successfully changed");
+    }
+    if(!strcmp(v, "MKD") || !strcmp(v, "XMKD"))
+    {
+        std::string vpath = Resolve(arg);
+        if(mkdir(Real(vpath).c_str(), 0755) < 0)
+            return Reply(550, "Create directory operation failed");
+        return Reply(257, "\"%s\" created", vpath.c_str());
+    }
+    if(!strcmp(v, "RMD") || !strcmp(v, "XRMD"))
+    {
+        std::string vpath = Resolve(arg);
+        if(vpath == "/" || rmdir(Real(vpath).c_str()) < 0)
+            return Reply(550, "Remove directory operation failed");
+        return Reply(250, "Remove directory operation successful");
+    }
+    if(!strcmp(v, "DELE"))
+    {
+        if(unlink(Real(Resolve(arg)).c_str()) < 0)
+            return Reply(550, "Delete operation failed");
+        return Reply(250, "Delete operation successful");
+    }
+    if(!strcmp(v, "RNFR"))
+    {
+        struct stat st;
+        std::string vpath = Resolve(arg);
+        if(stat(Real(vpath).c_str(), &st) < 0)
+            return Reply(550, "RNFR command failed");
+        rnfr = vpath;
+        return Reply(350, "Ready for RNTO");
+    }
+    if(!strcmp(v, "RNTO"))
+    {
+        if(rnfr.empty())
+            return Reply(503, "RNFR required first");
+        std::string from = rnfr;
+        rnfr.clear();
+        if(rename(Real(from).c_str(), Real(Resolve(arg)).c_str()) < 0)
+            return Reply(550, "Rename failed");
+        return Reply(250, "Rename successful");
+    }
+    if(!strcmp(v, "SIZE") || !strcmp(v, "MDTM"))
+    {
+        struct stat st;
+        if(stat(Real(Resolve(arg)).c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+            return Reply(550, "Could not get file %s", v[0] == 'S' ? "size" : "modification time");
+        if(v[0] == 'S')
+            return Reply(213, "%lld", (long long)st.st_size);
+        return Reply(213, "%s", ModTime(st.st_mtime).c_str());
+    }
+    if(!strcmp(v, "HASH") || !strcmp(v, "XCRC") || !strcmp(v, "XMD5"))
+    {
+        int alg = v[0] == 'H' ? hash : v[1] == 'C' ? CHECKSUM_CRC32 : CHECKSUM_MD5;
+        long long from  = v[0] == 'H' && rangTo >= 0 ? rangFrom : 0;
+        long long to    = v[0] == 'H' ? rangTo : -1;
+        rangTo = -1;
+
+        std::string vpath = Resolve(arg);
+        std::string hex;
+        long long size;
+        struct stat st;
+        if(stat(Real(vpath).c_str(), &st) < 0 || !S_ISREG(st.st_mode)
+            || !HashFile(Real(vpath), alg, hex, size, from, to))
+            return Reply(550, "%s: Could not hash file", vpath.c_str());
+        if(v[0] != 'H')
+            return Reply(250, "%s", hex.c_str());
+        return Reply(213, "%s %lld-%lld %s %s", checksum::Name(alg), from, from + size, hex.c_str(), vpath.c_str());
+    }
+    if(!strcmp(v, "MLST"))
+    {
+        struct stat st;
+        std::string vpath = Resolve(arg);
+        if(stat(Real(vpath).c_str(), &st) < 0)
+            return Reply(550, "%s: No such file or directory", vpath.c_str());
+        return Raw("250-Listing " + vpath + "\r\n " + Facts(st) + " " + vpath + "\r\n250 End\r\n");
+    }
+    if(!strcmp(v, "REST"))
+    {
+        char* end;
+        long long off = strtoll(arg.c_str(), &end, 10);
+        if(arg.empty() || *end || off < 0)
+            return Reply(501, "Bad REST offset");
+        rest    = off;
+        rangTo  = -1;
+        return Reply(350, "Restart position accepted (%lld)", off);
+    }
+    if(!strcmp(v, "RANG"))
+    {
+        // draft-bryan-ftp-range, both ends inclusive and "RANG 1 0" clears it
+        long long from, to;
+        char extra;
+        if(sscanf(arg.c_str(), "%lld %lld %c", &from, &to, &extra) != 2 || from < 0 || to < 0)
+            return Reply(501, "Bad RANG range");
+        if(from == 1 && to == 0)
+        {
+            rangTo = -1;
+            return Reply(350, "Byte range cleared");
+        }
+        if(to < from)
+            return Reply(501, "Bad RANG range");
+        if(deflate)
+            return Reply(504, "RANG is not supported in MODE Z");
+        rest        = 0;
+        rangFrom    = from;
+        rangTo      = to;
+        return Reply(350, "Restarting at %lld. End byte range at %lld", from, to);
+    }
+    if(!strcmp(v, "PASV"))
+        return OpenPassive(false) || Reply(425, "Can't open passive connection");
+    if(!strcmp(v, "EPSV"))
+        return OpenPassive(true) || Reply(425, "Can't open passive connection");
+    if(!strcmp(v, "ABOR"))
+        return Reply(225, "No transfer to ABOR");
+
+    if(!strcmp(v, "RETR"))
+        Retrieve(arg);
+    else if(!strcmp(v, "STOR"))
+        Store(arg, false);
+    else if(!strcmp(v, "APPE"))
+        Store(arg, true);
+    else if(!strcmp(v, "LIST"))
+        List(arg, 'L');
+    else if(!strcmp(v, "NLST"))
+        List(arg, 'N');
+    else if(!strcmp(v, "MLSD"))
+        List(arg, 'M');
+    else
+        return Reply(502, "Command not implemented");
+
+    return true;
+}
+
+
+/// SERVER ///
+
+FTPServer::FTPServer()
+{
+    m_listen    = -1;
+    m_wake[0]   = -1;
+    m_wake[1]   = -1;
+    m_port      = 0;
+    m_running   = false;
+    m_latency   = 0;
+    m_bandwidth = 0;
+    m_faults    = 0;
+    m_faultAt   = 0;
+    m_faultSession = true;
+}
+
+FTPServer::~FTPServer()
+{
+    Stop();
+}
+
+bool FTPServer::Start(TSTR root, int port, TSTR user, TSTR pwd)
+{
+    if(m_running)
+        return false;
+
+    m_root  = root;
+    m_user  = user;
+    m_pwd   = pwd;
+    while(m_root.size() > 1 && m_root[m_root.size() - 1] == '/')
+        m_root.erase(m_root.size() - 1);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family         = AF_INET;
+    addr.sin_port           = htons((uint16_t)port);
+    addr.sin_addr.s_addr    = htonl(INADDR_LOOPBACK);
+
+    socklen_t len = sizeof(addr);
+    int one = 1;
+
+    m_listen = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(m_listen < 0)
+        return false;
+    setsockopt(m_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if(bind(m_listen, (struct sockaddr*)&addr, len) < 0
+        || listen(m_listen, SOMAXCONN) < 0
+        || getsockname(m_listen, (struct sockaddr*)&addr, &len) < 0
+        || pipe2(m_wake, O_CLOEXEC) < 0)
+    {
+        close(m_listen);
+        m_listen = -1;
+        return false;
+    }
+
+    m_port      = ntohs(addr.sin_port);
+    m_running   = true;
+    m_thread    = std::thread(&FTPServer::Listen, this);
+    return true;
+}
+
+void FTPServer::Stop()
+{
+    if(!m_running)
+        return;
+
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        m_running = false;
+    }
+    if(write(m_wake[1], "x", 1) < 0)
+        {}
+    m_thread.join();
+
+    // Unblock every session, each closes its own descriptors on the way out
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        for(std::list<ftpsession*>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it)
+        {
+            if((*it)->ctrl >= 0)
+                shutdown((*it)->ctrl, SHUT_RDWR);
+            if((*it)->data >= 0)
+                shutdown((*it)->data, SHUT_RDWR);
+            if((*it)->pasv >= 0)
+                shutdown((*it)->pasv, SHUT_RDWR);
+        }
+    }
+    for(std::list<ftpsession*>::iterator it = m_sessions.begin(); it != m_sessions.end(); ++it)
+    {
+        (*it)->thread.join();
+        delete *it;
+    }
+    m_sessions.clear();
+
+    close(m_listen);
+    close(m_wake[0]);
+    close(m_wake[1]);
+    m_listen    = -1;
+    m_wake[0]   = -1;
+    m_wake[1]   = -1;
+    m_port      = 0;
+}
+
+int FTPServer::GetPort()
+{
+    return m_running ? m_port : 0;
+}
+
+bool FTPServer::IsRunning()
+{
+    return m_running;
+}
+
+void FTPServer::SetLatency(int ms)
+{
+    m_latency = ms > 0 ? ms : 0;
+}
+
+void FTPServer::SetBandwidth(long long bytesPerSec)
+{
+    m_bandwidth = bytesPerSec > 0 ? bytesPerSec : 0;
+}
+
+void FTPServer::SetReplyDelay(TSTR verb, int ms)
+{
+    std::string v(verb.begin(), verb.end());
+    for(size_t i = 0; i < v.size(); i++)
+        v[i] = (char)toupper((unsigned char)v[i]);
+
+    std::lock_guard<std::mutex> g(m_lock);
+    if(ms > 0)
+        m_delays[v] = ms;
+    else
+        m_delays.erase(v);
+}
+
+void FTPServer::InjectDisconnect(long long afterBytes, int times, bool session)
+{
+    m_faultAt       = afterBytes > 0 ? afterBytes : 0;
+    m_faultSession  = session;
+    m_faults        = times > 0 ? times : 0;
+}
+
+#if defined(CONNSTREAM_TLS)
+void FTPServer::SetTLS(std::shared_ptr<tlscontext> ctx)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    m_tls = ctx;
+}
+
+std::shared_ptr<tlscontext> FTPServer::TLS()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    return m_tls;
+}
+#endif
+
+int FTPServer::ReplyDelay(const std::string& verb)
+{
+    int ms = m_latency.load();
+
+    std::lock_guard<std::mutex> g(m_lock);
+    if(m_delays.empty())
+        return ms;
+    std::map<std::string, int>::const_iterator it = m_delays.find(verb);
+    if(it != m_delays.end())
+        ms += it->second;
+    it = m_delays.find(std::string());
+    if(it != m_delays.end())
+        ms += it->second;
+    return ms;
+}
+
+void FTPServer::Listen()
+{
+    for(;;)
+    {
+        struct pollfd p[2];
+        p[0].fd = m_listen;
+        p[0].events = POLLIN;
+        p[1].fd = m_wake[0];
+        p[1].events = POLLIN;
+
+        if(poll(p, 2, -1) < 0 && errno != EINTR)
+            break;
+        if(p[1].revents)
+            break;
+        if(!(p[0].revents & POLLIN))
+            continue;
+
+        int fd = accept4(m_listen, NULL, NULL, SOCK_CLOEXEC);
+        if(fd < 0)
+            continue;
+
+        // Replies are small and back to back, don't let Nagle sit on them
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::lock_guard<std::mutex> g(m_lock);
+        if(!m_running)
+        {
+            close(fd);
+            break;
+        }
+
+        // Reap sessions whose client already left
+        for(std::list<ftpsession*>::iterator it = m_sessions.begin(); it != m_sessions.end(); )
+        {
+            if((*it)->done)
+            {
+                (*it)->thread.join();
+                delete *it;
+                it = m_sessions.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        ftpsession* s = new ftpsession();
+        s->srv      = this;
+        s->done     = false;
+        s->ctrl     = fd;
+        s->pasv     = -1;
+        s->data     = -1;
+        s->authed   = false;
+        s->cwd      = "/";
+        s->rest     = 0;
+        s->rangFrom = 0;
+        s->rangTo   = -1;
+        s->hash     = CHECKSUM_SHA256;
+        s->deflate  = false;
+        s->head     = 0;
+        s->tail     = 0;
+        s->paced    = 0;
+        s->cutAt    = -1;
+        s->cutSession = false;
+#if defined(CONNSTREAM_TLS)
+        s->pbsz     = false;
+        s->prot     = false;
+#endif
+        m_sessions.push_back(s);
+        s->thread = std::thread(&FTPServer::Serve, this, s);
+    }
+}
+
+void FTPServer::Serve(ftpsession* s)
+{
+    std::string line;
+
+    // RETR uses sendfile which can't take MSG_NOSIGNAL, a client dropping
+    // the data connection must not take the host process down with SIGPIPE
+    sigset_t pipe;
+    sigemptyset(&pipe);
+    sigaddset(&pipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe, NULL);
+
+    if(s->Reply(220, "connstream loopback FTP server ready"))
+    {
+        while(s->ReadCommand(line))
+        {
+            size_t sp = line.find(' ');
+            std::string verb = line.substr(0, sp);
+            std::string arg  = sp == std::string::npos ? "" : line.substr(sp + 1);
+            for(size_t i = 0; i < verb.size(); i++)
+                verb[i] = (char)toupper((unsigned char)verb[i]);
+
+            int ms = ReplyDelay(verb);
+            if(ms > 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+
+            if(!s->Dispatch(verb, arg))
+                break;
+        }
+    }
+
+    TLS_ONLY(s->ctrlTls.Close(true, SRV_ACCEPT_TIMEOUT);)
+    CloseFd(m_lock, s->pasv);
+    CloseFd(m_lock, s->data);
+    CloseFd(m_lock, s->ctrl);
+
+    std::lock_guard<std::mutex> g(m_lock);
+    s->done = true;
+}
+
+#endif
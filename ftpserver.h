@@ -0,0 +1,139 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Loopback FTP Server
+  *
+  * A small in-process RFC 959 server that serves a local directory
+  * so every connstream FTP backend can be exercised without a real
+  * server. It listens on 127.0.0.1 only, runs each session on its
+  * own thread and jails every path inside the served root.
+  *
+  * It can also stand in for a server further away: SetLatency holds
+  * every command and data connection for a round trip, SetBandwidth
+  * paces data connections and SetReplyDelay slows chosen verbs, so
+  * benchmarks see WAN-like timings on loopback. InjectDisconnect cuts
+  * transfers part way to exercise resume. SetTLS offers explicit FTPS
+  * (AUTH TLS, PBSZ, PROT) when built with CONNSTREAM_TLS.
+  *
+  * E.G. Usage:
+  *     FTPServer srv;
+  *     srv.Start("/tmp/ftproot");
+  *
+  *     PosixFTP ftp;
+  *     srv.SetLatency(20);                 // Optional, 20ms round trips
+  *     ftp.Connect("127.0.0.1", "", "", srv.GetPort());
+  *     ....
+  *     srv.Stop();
+  */
+
+#ifndef _FTPSERVER_H_
+#define _FTPSERVER_H_
+
+#if !defined(_MSC_VER)
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <memory>
+#include "connstream.h"
+#include "tls.h"
+
+struct ftpsession;
+
+class FTPServer
+{
+    public:
+        FTPServer(void);
+        /** Stops the server on scope end if still running */
+        virtual ~FTPServer(void);
+
+        /** bool Start(TSTR, int, TSTR, TSTR)
+         *  Starts listening on 127.0.0.1.
+         *      @root   : Local directory served as "/"
+         *      @port   : Port to listen on, 0 picks a free one (see GetPort)
+         *      @user   : Required user id, blank accepts any login
+         *      @pwd    : Required password when @user is set
+         *  Returns : @true once listening or @false if the socket could not be bound
+         */
+        /** void Stop(void)
+         *  Closes the listener and every open session then joins their threads.
+         */
+        bool    Start(TSTR root, int port = 0, TSTR user = _T(""), TSTR pwd = _T(""));
+        void    Stop(void);
+
+        /** int GetPort(void)
+         *  Returns : the bound port or 0 when the server isn't running
+         */
+        int     GetPort(void);
+        bool    IsRunning(void);
+
+        /// SHAPING ///
+        /** void SetLatency(int)
+         *  Holds every command @ms before it is answered and every data
+         *  connection @ms before its first byte, 0 for none.
+         */
+        /** void SetBandwidth(long long)
+         *  Caps each data connection at @bytesPerSec either way, 0 for no cap.
+         */
+        /** void SetReplyDelay(TSTR, int)
+         *  Adds @ms on top of the latency before @verb ("SIZE", "RETR", ...)
+         *  is answered, or before every verb when @verb is blank. 0 clears it.
+         */
+        /** void InjectDisconnect(long long, int, bool)
+         *  Cuts the next @times RETR/STOR/APPE data connections after
+         *  @afterBytes, whatever was written up to there stays. With @session
+         *  the control connection goes too and no reply is sent, otherwise
+         *  the transfer fails with 426/451. 0 @times disarms it.
+         */
+        void    SetLatency(int ms);
+        void    SetBandwidth(long long bytesPerSec);
+        void    SetReplyDelay(TSTR verb, int ms);
+        void    InjectDisconnect(long long afterBytes, int times = 1, bool session = true);
+
+#if defined(CONNSTREAM_TLS)
+        /** void SetTLS(std::shared_ptr<tlscontext>)
+         *  Offers AUTH TLS with @ctx, a server context such as
+         *  tlscontext::SelfSigned makes. Sessions that never ask stay in
+         *  cleartext and PROT P makes their data connections TLS too.
+         *  NULL (the default) stops offering it.
+         */
+        void    SetTLS(std::shared_ptr<tlscontext> ctx);
+#endif
+
+    private:
+        friend struct ftpsession;
+
+        void    Listen(void);
+        void    Serve(ftpsession* s);
+        int     ReplyDelay(const std::string& verb);
+        TLS_ONLY(std::shared_ptr<tlscontext> TLS(void);)
+
+        TSTR                    m_root;
+        TSTR                    m_user;
+        TSTR                    m_pwd;
+        int                     m_listen;
+        int                     m_wake[2];
+        int                     m_port;
+        bool                    m_running;
+        std::thread             m_thread;
+        std::mutex              m_lock;
+        std::list<ftpsession*>  m_sessions;
+
+        std::atomic<int>        m_latency;
+        std::atomic<long long>  m_bandwidth;
+        std::map<std::string, int> m_delays;        // Verb to ms, "" for all, under m_lock
+        std::atomic<int>        m_faults;           // Transfers InjectDisconnect has yet to cut
+        std::atomic<long long>  m_faultAt;
+        std::atomic<bool>       m_faultSession;
+        TLS_ONLY(std::shared_ptr<tlscontext> m_tls;)    // Under m_lock
+};
+
+#endif
+
+#endif
@@ -0,0 +1,653 @@
+#include <localfs.h>
+
+#if !defined(_MSC_VER)
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "metacache.h"
+
+#define LOCALFS_RW_BUFSIZE  (1 << 20)   // read/write fallback when the kernel won't copy
+
+/* What SYS_getdents64 fills the buffer with, glibc doesn't export it */
+struct localfs_dirent64
+{
+    unsigned long long  d_ino;
+    long long           d_off;
+    unsigned short      d_reclen;
+    unsigned char       d_type;
+    char                d_name[1];
+};
+
+LocalFS::LocalFS()
+{
+    m_clone     = true;
+    m_moved     = 0;
+    m_connected = false;
+    m_err       = 0;
+}
+
+LocalFS::~LocalFS()
+{
+    if(m_connected)
+        Disconnect();
+}
+
+bool LocalFS::Fail(int err)
+{
+    m_err = err ? err : EIO;
+    return false;
+}
+
+
+/// CONNECTION METHODS ///
+
+bool LocalFS::Connect(TSTR lpszRoot, TSTR /*lpszUser*/, TSTR /*lpszPassword*/, int /*port*/)
+{
+    TELEMETRY_SCOPE(TELEMETRY_CONNECT);
+    if(m_connected)
+        Disconnect();
+
+    char real[PATH_MAX];
+    struct stat st;
+    if(!realpath(lpszRoot.c_str(), real) || stat(real, &st) < 0)
+        return Fail(errno);
+    if(!S_ISDIR(st.st_mode))
+        return Fail(ENOTDIR);
+
+    m_root = real;
+    if(m_root == _T("/"))
+        m_root.clear();
+    m_cwd       = _T("/");
+    m_connected = true;
+    m_err       = 0;
+    return true;
+}
+
+bool LocalFS::Disconnect()
+{
+    TELEMETRY_SCOPE(TELEMETRY_DISCONNECT);
+    m_connected = false;
+    m_root.clear();
+    m_cwd.clear();
+    m_err = 0;
+    return true;
+}
+
+TSTR LocalFS::Real(TSTR lpszPath) const
+{
+    return m_root + metacache::Normalize(m_cwd, lpszPath);
+}
+
+
+/// GET/PUSH METHODS ///
+
+int LocalFS::CopyFd(int in, int out)
+{
+    for(;;)
+    {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, LOCALFS_COPY_CHUNK, 0);
+        if(n > 0)
+            continue;
+        if(n == 0)
+            return 0;
+        if(errno == EINTR)
+            continue;
+        // Cross device on older kernels, or a filesystem that can't, both
+        // offsets have moved past whatever did get copied
+        if(errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)
+            break;
+        return errno;
+    }
+
+    std::vector<char> buf(LOCALFS_RW_BUFSIZE);
+    for(;;)
+    {
+        ssize_t n = read(in, &buf[0], buf.size());
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return errno;
+        }
+        if(n == 0)
+            return 0;
+
+        for(ssize_t done = 0; done < n; )
+        {
+            ssize_t w = write(out, &buf[done], n - done);
+            if(w < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                return errno;
+            }
+            done += w;
+        }
+    }
+}
+
+bool LocalFS::CopyFile(const TSTR& from, const TSTR& to)
+{
+    m_moved = 0;
+
+    int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if(in < 0)
+        return Fail(errno);
+
+    struct stat st;
+    int err = fstat(in, &st) < 0 ? errno : S_ISDIR(st.st_mode) ? EISDIR : 0;
+    if(err)
+    {
+        close(in);
+        return Fail(err);
+    }
+
+    // Truncating the destination would empty a source that is the same file
+    struct stat dst;
+    if(stat(to.c_str(), &dst) == 0 && dst.st_dev == st.st_dev && dst.st_ino == st.st_ino)
+    {
+        close(in);
+        return Fail(EINVAL);
+    }
+
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(out < 0)
+    {
+        err = errno;
+        close(in);
+        return Fail(err);
+    }
+
+#if defined(FICLONE)
+    if(!m_clone || ioctl(out, FICLONE, in) < 0)
+#endif
+        err = CopyFd(in, out);
+
+    close(in);
+    if(close(out) < 0 && !err)
+        err = errno;
+    if(err)
+        return Fail(err);
+
+    m_moved = (long long)st.st_size;
+    m_err   = 0;
+    return true;
+}
+
+long long LocalFS::LastMoved()
+{
+    return m_moved;
+}
+
+bool LocalFS::Upload(TSTR lpszLocation, TSTR lpszRemFile)
+{
+    TELEMETRY_SCOPE(TELEMETRY_UPLOAD);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+    return CopyFile(lpszLocation, Real(lpszRemFile.empty() ? lpszLocation : lpszRemFile));
+}
+
+bool LocalFS::Download(TSTR lpszLocation, TSTR lpszRemName)
+{
+    TELEMETRY_SCOPE(TELEMETRY_DOWNLOAD);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+    return CopyFile(Real(lpszLocation), lpszRemName.empty() ? lpszLocation : lpszRemName);
+}
+
+
+/// STREAMING METHODS ///
+
+class localstream : public streamhandle
+{
+    public:
+        localstream(int fd, bool reading)
+        {
+            m_fd    = fd;
+            m_read  = reading;
+            m_err   = 0;
+        }
+        ~localstream()
+        {
+            Close();
+        }
+
+        long long Read(char* buf, size_t len)
+        {
+            if(m_fd < 0 || !m_read)
+                return Fail(m_fd < 0 ? EBADF : EPERM);
+            for(;;)
+            {
+                ssize_t n = read(m_fd, buf, len);
+                if(n >= 0)
+                    return n;
+                if(errno != EINTR)
+                    return Fail(errno);
+            }
+        }
+
+        long long Write(const char* buf, size_t len)
+        {
+            if(m_fd < 0 || m_read)
+                return Fail(m_fd < 0 ? EBADF : EPERM);
+            for(size_t done = 0; done < len; )
+            {
+                ssize_t n = write(m_fd, buf + done, len - done);
+                if(n < 0)
+                {
+                    if(errno == EINTR)
+                        continue;
+                    return Fail(errno);
+                }
+                done += n;
+            }
+            return (long long)len;
+        }
+
+        bool Close()
+        {
+            if(m_fd < 0)
+                return m_err == 0;
+            if(close(m_fd) < 0 && !m_err)
+                m_err = errno;
+            m_fd = -1;
+            return m_err == 0;
+        }
+
+        int GetHandle()
+        {
+            return m_fd;
+        }
+
+        int GetLastError()
+        {
+            return m_err;
+        }
+
+    private:
+        long long Fail(int err)
+        {
+            m_err = err ? err : EIO;
+            return -1;
+        }
+
+        int     m_fd;
+        bool    m_read;
+        int     m_err;
+};
+
+datastream LocalFS::OpenRead(TSTR lpszLocation, long long offset)
+{
+    TELEMETRY_SCOPE(TELEMETRY_OPENREAD);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return datastream();
+    }
+
+    int fd = open(Real(lpszLocation).c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        Fail(errno);
+        return datastream();
+    }
+
+    struct stat st;
+    int err = fstat(fd, &st) < 0 ? errno : S_ISDIR(st.st_mode) ? EISDIR : 0;
+    if(!err && offset > 0 && lseek(fd, offset, SEEK_SET) < 0)
+        err = errno;
+    if(err)
+    {
+        close(fd);
+        Fail(err);
+        return datastream();
+    }
+
+    m_err = 0;
+    return datastream(new localstream(fd, true));
+}
+
+datastream LocalFS::OpenWrite(TSTR lpszLocation, bool append)
+{
+    TELEMETRY_SCOPE(TELEMETRY_OPENWRITE);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return datastream();
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC);
+    int fd = open(Real(lpszLocation).c_str(), flags, 0644);
+    if(fd < 0)
+    {
+        Fail(errno);
+        return datastream();
+    }
+
+    m_err = 0;
+    return datastream(new localstream(fd, false));
+}
+
+
+/// DIRECTORY METHODS ///
+
+bool LocalFS::Dents(const TSTR& dir, DENTCALLBACK callback)
+{
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+        return Fail(errno);
+
+    std::vector<char> buf(LOCALFS_DENTS_BUFSIZE);
+    for(;;)
+    {
+        long n = syscall(SYS_getdents64, fd, &buf[0], buf.size());
+        if(n < 0)
+        {
+            int err = errno;
+            close(fd);
+            return Fail(err);
+        }
+        if(n == 0)
+            break;
+
+        for(long pos = 0; pos < n; )
+        {
+            const localfs_dirent64* d = (const localfs_dirent64*)&buf[pos];
+            pos += d->d_reclen;
+
+            const char* name = d->d_name;
+            if(name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+                continue;
+            if(!callback(fd, name))
+            {
+                close(fd);
+                m_err = 0;
+                return true;
+            }
+        }
+    }
+
+    close(fd);
+    m_err = 0;
+    return true;
+}
+
+bool LocalFS::ChangeDir(TSTR lpszDirectory)
+{
+    return ChangeDirView(lpszDirectory);
+}
+
+bool LocalFS::MakeDir(TSTR lpszDirectory)
+{
+    return MakeDirView(lpszDirectory);
+}
+
+bool LocalFS::RemoveDir(TSTR lpszDirectory)
+{
+    return RemoveDirView(lpszDirectory);
+}
+
+TSTR LocalFS::CurrentDir()
+{
+    TSTRVIEW dir = CurrentDirView();
+    return m_err ? TSTR(_T("ERROR-1")) : TSTR(dir.data(), dir.size());
+}
+
+LIST LocalFS::SearchDir(TSTR lpszSearchStr)
+{
+    TELEMETRY_SCOPE(TELEMETRY_SEARCHDIR);
+    LIST files;
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return files;
+    }
+
+    TSTR dir, pattern = lpszSearchStr;
+    size_t slash = lpszSearchStr.rfind('/');
+    if(slash != TSTR::npos)
+    {
+        dir     = lpszSearchStr.substr(0, slash ? slash : 1);
+        pattern = lpszSearchStr.substr(slash + 1);
+    }
+    if(pattern.empty() || pattern == _T("*.*"))
+        pattern = _T("*");
+
+    bool all = pattern == _T("*");
+    Dents(Real(dir), [&](int, const char* name) -> bool
+    {
+        if(all ? name[0] != '.' : fnmatch(pattern.c_str(), name, FNM_PERIOD) == 0)
+            files.push_back(name);
+        return true;
+    });
+    return files;
+}
+
+bool LocalFS::ListDir(TSTR lpszDirectory, DirList& entries)
+{
+    TELEMETRY_SCOPE(TELEMETRY_LISTDIR);
+    entries.Clear();
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    return Dents(Real(lpszDirectory), [&](int dirfd, const char* name) -> bool
+    {
+        DirEntry e;
+        struct stat st;
+
+        // Links are listed as what they point to, a dangling one as itself
+        if(fstatat(dirfd, name, &st, 0) < 0 && fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            return true;
+
+        e.name      = name;
+        e.namelen   = strlen(name);
+        e.size      = (long long)st.st_size;
+        e.mtime     = (long long)st.st_mtime;
+        e.perms     = st.st_mode & 07777;
+        e.type      = S_ISREG(st.st_mode) ? DIRENT_FILE
+                    : S_ISDIR(st.st_mode) ? DIRENT_DIR
+                    : S_ISLNK(st.st_mode) ? DIRENT_LINK
+                    : DIRENT_OTHER;
+        entries.Add(e);
+        return true;
+    });
+}
+
+
+/// FILE HANDLING METHODS ///
+
+bool LocalFS::Remove(TSTR lpszFileName)
+{
+    return RemoveView(lpszFileName);
+}
+
+bool LocalFS::Rename(TSTR lpszOldFileName, TSTR lpszNewFileName)
+{
+    return RenameView(lpszOldFileName, lpszNewFileName);
+}
+
+bool LocalFS::Exists(TSTR lpszFilename)
+{
+    return ExistsView(lpszFilename);
+}
+
+long long LocalFS::GetFileSize(TSTR lpszFileName)
+{
+    return GetFileSizeView(lpszFileName);
+}
+
+long long LocalFS::GetModTime(TSTR lpszFileName)
+{
+    return GetModTimeView(lpszFileName);
+}
+
+
+/// PATH VIEW METHODS ///
+
+bool LocalFS::ChangeDirView(TSTRVIEW dir)
+{
+    TELEMETRY_SCOPE(TELEMETRY_CHANGEDIR);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    const TSTR& real = m_paths.Join(0, m_root, m_cwd, dir);
+    struct stat st;
+    if(stat(real.c_str(), &st) < 0)
+        return Fail(errno);
+    if(!S_ISDIR(st.st_mode))
+        return Fail(ENOTDIR);
+
+    m_cwd.assign(real, m_root.size(), TSTR::npos);
+    m_err = 0;
+    return true;
+}
+
+bool LocalFS::MakeDirView(TSTRVIEW dir)
+{
+    TELEMETRY_SCOPE(TELEMETRY_MAKEDIR);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+    if(mkdir(m_paths.Join(0, m_root, m_cwd, dir).c_str(), 0755) < 0)
+        return Fail(errno);
+    m_err = 0;
+    return true;
+}
+
+bool LocalFS::RemoveDirView(TSTRVIEW dir)
+{
+    TELEMETRY_SCOPE(TELEMETRY_REMOVEDIR);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    // Normalize clamps ".." at "/", never let that remove the root itself
+    const TSTR& real = m_paths.Join(0, m_root, m_cwd, dir);
+    if(real.size() == m_root.size() + 1)
+        return Fail(EBUSY);
+    if(rmdir(real.c_str()) < 0)
+        return Fail(errno);
+    m_err = 0;
+    return true;
+}
+
+TSTRVIEW LocalFS::CurrentDirView()
+{
+    TELEMETRY_SCOPE(TELEMETRY_CURRENTDIR);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return TSTRVIEW();
+    }
+    m_err = 0;
+    return m_cwd;
+}
+
+bool LocalFS::RemoveView(TSTRVIEW filename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_REMOVE);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+    if(unlink(m_paths.Join(0, m_root, m_cwd, filename).c_str()) < 0)
+        return Fail(errno);
+    m_err = 0;
+    return true;
+}
+
+bool LocalFS::RenameView(TSTRVIEW oldFilename, TSTRVIEW newFilename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_RENAME);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    const TSTR& from = m_paths.Join(0, m_root, m_cwd, oldFilename);
+    if(from.size() == m_root.size() + 1)
+        return Fail(EBUSY);
+    if(rename(from.c_str(), m_paths.Join(1, m_root, m_cwd, newFilename).c_str()) < 0)
+        return Fail(errno);
+    m_err = 0;
+    return true;
+}
+
+bool LocalFS::ExistsView(TSTRVIEW filename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_EXISTS);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    struct stat st;
+    if(stat(m_paths.Join(0, m_root, m_cwd, filename).c_str(), &st) < 0)
+        return Fail(errno);
+    m_err = 0;
+    return true;
+}
+
+long long LocalFS::GetFileSizeView(TSTRVIEW filename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_GETFILESIZE);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return INVALID_FILE;
+    }
+
+    struct stat st;
+    int err = stat(m_paths.Join(0, m_root, m_cwd, filename).c_str(), &st) < 0 ? errno
+            : S_ISREG(st.st_mode) ? 0 : EISDIR;
+    if(err)
+    {
+        Fail(err);
+        return INVALID_FILE;
+    }
+    m_err = 0;
+    return (long long)st.st_size;
+}
+
+long long LocalFS::GetModTimeView(TSTRVIEW filename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_GETMODTIME);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return INVALID_FILE;
+    }
+
+    struct stat st;
+    if(stat(m_paths.Join(0, m_root, m_cwd, filename).c_str(), &st) < 0)
+    {
+        Fail(errno);
+        return INVALID_FILE;
+    }
+    m_err = 0;
+    return (long long)st.st_mtime;
+}
+
+
+/// MISCELLANEOUS METHODS ///
+
+bool LocalFS::Command(TSTR /*lpszCommand*/)
+{
+    TELEMETRY_SCOPE(TELEMETRY_COMMAND);
+    return Fail(m_connected ? EOPNOTSUPP : ENOTCONN);
+}
+
+int LocalFS::GetLastError()
+{
+    return m_err;
+}
+
+void LocalFS::SetClone(bool enable)
+{
+    m_clone = enable;
+}
+
+#endif
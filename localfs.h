@@ -0,0 +1,153 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Local Filesystem
+  *
+  * A connstream over a directory on this machine, served as "/" the way
+  * an FTP server would serve it. Code written against connstream runs
+  * unchanged on local staging, and the same pipeline over LocalFS gives
+  * the zero-network baseline for what a network backend adds.
+  *
+  * Upload/Download clone the file with FICLONE where the filesystem can
+  * share extents (btrfs, XFS), otherwise hand the copy to the kernel with
+  * copy_file_range, and only read/write where both are refused. Listings
+  * come straight from getdents64 into one buffer, no DIR stream and no
+  * allocation per entry.
+  *
+  * Host paths are resolved lexically against the root and ".." stops at
+  * it. Symbolic links inside the root are followed.
+  *
+  * E.G. Usage:
+  *     LocalFS fs;
+  *     fs.Connect(_T("/srv/staging"));
+  *     fs.Upload(_T("report.pdf"), _T("/out/report.pdf"));
+  */
+
+#ifndef _LOCALFS_H_
+#define _LOCALFS_H_
+
+#if defined(_MSC_VER)
+#error localfs.h is built on Linux system calls, it is not supported by MSVC
+#endif
+
+#include <functional>
+#include "connstream.h"
+#include "dirlist.h"
+#include "telemetry.h"
+
+#if defined(UNICODE) || defined(_UNICODE_)
+#error localfs.h only supports narrow TSTR
+#endif
+
+#define LOCALFS_DENTS_BUFSIZE   (64 << 10)  // getdents64 buffer
+#define LOCALFS_COPY_CHUNK      (1 << 30)   // Bytes asked of one copy_file_range call
+
+/** NOTE: GetLastError() holds the errno of the last failure */
+
+class LocalFS : public connstream
+{
+    public:
+        LocalFS(void);
+        virtual ~LocalFS(void);
+
+        /// CONNECTION METHODS ///
+        /** bool Connect(TSTR, TSTR, TSTR, int)
+         *  Serves the directory @lpszRoot as "/", user, password and port
+         *  are ignored. The working directory starts at "/".
+         *  Returns : @false when @lpszRoot isn't a directory
+         */
+        bool Connect(TSTR lpszRoot,
+                     TSTR lpszUser = _T(""),
+                     TSTR lpszPassword = _T(""),
+                     int port = 0);
+        bool Disconnect(void);
+
+        /// GET/PUSH METHODS ///
+        /** Upload copies a client file into the root, Download copies one out.
+         *  A blank second name keeps the first. See SetClone.
+         */
+        bool Upload(TSTR lpszLocation, TSTR lpszRemFile);
+        bool Download(TSTR lpszLocation, TSTR lpszRemName);
+
+        /// STREAMING METHODS ///
+        /** Plain file descriptors, any number may be open at once */
+        datastream  OpenRead(TSTR lpszLocation, long long offset = 0);
+        datastream  OpenWrite(TSTR lpszLocation, bool append = false);
+
+        /// DIRECTORY METHODS ///
+        /** LIST SearchDir(TSTR)
+         *  Names in the directory part of @lpszSearchStr matching the wildcard
+         *  part with fnmatch(3), "*.*" matches every name as it does on Windows.
+         */
+        /** bool ListDir(TSTR, DirList&)
+         *  Every entry of @lpszDirectory with its size, time and mode, the
+         *  same shape PosixFTP::ListDir gives.
+         */
+        bool    ChangeDir(TSTR lpszDirectory);
+        bool    MakeDir(TSTR lpszDirectory);
+        bool    RemoveDir(TSTR lpszDirectory);
+        TSTR    CurrentDir(void);
+        LIST    SearchDir(TSTR lpszSearchStr);
+        bool    ListDir(TSTR lpszDirectory, DirList& entries);
+
+        /// FILE HANDLING METHODS ///
+        bool        Remove(TSTR lpszFileName);
+        bool        Rename(TSTR lpszOldFileName, TSTR lpszNewFileName);
+        bool        Exists(TSTR lpszFilename);
+        long long   GetFileSize(TSTR lpszFileName);
+        long long   GetModTime(TSTR lpszFileName);
+
+        /// PATH VIEW METHODS ///
+        /** The calls above with each path joined onto the root in m_paths,
+         *  the system call is the only cost once the arena is warm.
+         */
+        bool        ChangeDirView(TSTRVIEW dir);
+        bool        MakeDirView(TSTRVIEW dir);
+        bool        RemoveDirView(TSTRVIEW dir);
+        TSTRVIEW    CurrentDirView(void);
+        bool        RemoveView(TSTRVIEW filename);
+        bool        RenameView(TSTRVIEW oldFilename, TSTRVIEW newFilename);
+        bool        ExistsView(TSTRVIEW filename);
+        long long   GetFileSizeView(TSTRVIEW filename);
+        long long   GetModTimeView(TSTRVIEW filename);
+
+        /// MISCELLANEOUS METHODS ///
+        /** bool Command(TSTR) - There is no command channel, fails with EOPNOTSUPP */
+        bool    Command(TSTR lpszCommand);
+        int     GetLastError(void);
+
+        /** void SetClone(bool)
+         *  Tries FICLONE before copying (the default). Off, every copy moves
+         *  the bytes, which is what a benchmark of the copy path wants.
+         */
+        void    SetClone(bool enable);
+
+        /** TSTR Real(TSTR) - Where a host path lives on this machine */
+        TSTR    Real(TSTR lpszPath) const;
+
+    protected:
+        typedef std::function<bool(int dirfd, const char* name)> DENTCALLBACK;
+
+        /** Dents walks @dir with getdents64, skipping "." and "..", until
+         *  @callback returns @false. @dirfd is the open directory, for the
+         *  *at() calls. */
+        bool    Dents(const TSTR& dir, DENTCALLBACK callback);
+
+        /** CopyFd moves everything from @in's offset to @out's, returning 0
+         *  or the errno that stopped it. */
+        int     CopyFd(int in, int out);
+        bool    CopyFile(const TSTR& from, const TSTR& to);
+
+        bool        Fail(int err);
+        long long   LastMoved(void);
+
+        TSTR        m_root;         // Without a trailing '/'
+        TSTR        m_cwd;          // Host side, absolute
+        bool        m_clone;
+        long long   m_moved;        // Size of the last file copied
+};
+
+#endif // _LOCALFS_H_
@@ -0,0 +1,810 @@
+#include <memstream.h>
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "metacache.h"
+
+class memfile;
+
+/** One tree of files, shared by every session connected to its name */
+class memvolume
+{
+    public:
+        struct memnode
+        {
+            int                         type;   // DIRENT_FILE or DIRENT_DIR
+            long long                   mtime;  // Directories only, a file keeps its own
+            std::shared_ptr<memfile>    file;
+        };
+        typedef std::map<TSTR, memnode> nodemap;
+
+        memvolume(void) : m_slabBytes(0) {}
+        ~memvolume(void)
+        {
+            // Files hand their pages back as they go, while the free list is still here
+            m_nodes.clear();
+        }
+
+        /** Page/Release take and give back pages, the caller holds m_lock */
+        char*   Page(void)
+        {
+            if(m_free.empty())
+            {
+                char* slab = new char[MEM_SLAB];
+                m_slabs.push_back(std::unique_ptr<char[]>(slab));
+                m_slabBytes += MEM_SLAB;
+                for(size_t off = MEM_SLAB; off; off -= MEM_PAGE)
+                    m_free.push_back(slab + off - MEM_PAGE);
+            }
+            char* p = m_free.back();
+            m_free.pop_back();
+            return p;
+        }
+
+        void    Release(std::vector<char*>& pages)
+        {
+            m_free.insert(m_free.end(), pages.begin(), pages.end());
+            pages.clear();
+        }
+
+        /** Whether @path is "/" or a directory node, under m_lock */
+        bool    IsDir(const TSTR& path) const
+        {
+            if(path == _T("/"))
+                return true;
+            nodemap::const_iterator it = m_nodes.find(path);
+            return it != m_nodes.end() && it->second.type == DIRENT_DIR;
+        }
+
+        std::mutex                          m_lock;
+        nodemap                             m_nodes;        // Normalized paths, "/" itself isn't kept
+        size_t                              m_slabBytes;
+
+    private:
+        std::vector<std::unique_ptr<char[]>> m_slabs;
+        std::vector<char*>                  m_free;
+};
+
+/** A file's pages. Owned by its node and by any stream still open on it */
+class memfile
+{
+    public:
+        explicit memfile(memvolume* vol)
+        {
+            m_vol   = vol;
+            m_size  = 0;
+            m_mtime = (long long)time(NULL);
+        }
+        ~memfile(void)
+        {
+            std::lock_guard<std::mutex> guard(m_vol->m_lock);
+            m_vol->Release(m_pages);
+        }
+
+        /** Reserve makes room for @bytes in total, the caller holds m_lock
+         *  when the file has been published */
+        void    Reserve(long long bytes)
+        {
+            size_t need = (size_t)((bytes + MEM_PAGE - 1) / MEM_PAGE);
+            if(need <= m_pages.size())
+                return;
+            m_pages.reserve(need);
+            std::lock_guard<std::mutex> guard(m_vol->m_lock);
+            while(m_pages.size() < need)
+                m_pages.push_back(m_vol->Page());
+        }
+
+        size_t  ReadAt(long long pos, char* buf, size_t len)
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if(pos >= m_size)
+                return 0;
+            if((long long)len > m_size - pos)
+                len = (size_t)(m_size - pos);
+
+            for(size_t done = 0; done < len; )
+            {
+                size_t off = (size_t)((pos + done) % MEM_PAGE);
+                size_t n   = len - done < MEM_PAGE - off ? len - done : MEM_PAGE - off;
+                memcpy(buf + done, m_pages[(pos + done) / MEM_PAGE] + off, n);
+                done += n;
+            }
+            return len;
+        }
+
+        void    Append(const char* buf, size_t len)
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            Reserve(m_size + len);
+            for(size_t done = 0; done < len; )
+            {
+                size_t off = (size_t)(m_size % MEM_PAGE);
+                size_t n   = len - done < MEM_PAGE - off ? len - done : MEM_PAGE - off;
+                memcpy(m_pages[m_size / MEM_PAGE] + off, buf + done, n);
+                m_size += n;
+                done   += n;
+            }
+            m_mtime = (long long)time(NULL);
+        }
+
+        std::mutex                  m_lock;         // Over m_pages and the bytes in them
+        std::vector<char*>          m_pages;
+        std::atomic<long long>      m_size;         // Atomic so listings needn't take m_lock
+        std::atomic<long long>      m_mtime;
+
+    private:
+        // Not owned, the volume's node map and every stream keep it alive
+        memvolume*                  m_vol;
+};
+
+/** Named volumes, kept until DropVolume */
+static std::mutex                                           g_volLock;
+static std::map<TSTR, std::shared_ptr<memvolume> >          g_volumes;
+
+/** Where the subtree under @dir starts in the node map */
+static TSTR ChildPrefix(const TSTR& dir)
+{
+    return dir == _T("/") ? dir : dir + _T("/");
+}
+
+InMemoryStream::InMemoryStream()
+{
+    m_moved     = 0;
+    m_connected = false;
+    m_err       = 0;
+}
+
+InMemoryStream::~InMemoryStream()
+{
+    if(m_connected)
+        Disconnect();
+}
+
+bool InMemoryStream::Fail(int err)
+{
+    m_err = err ? err : EIO;
+    return false;
+}
+
+TSTR InMemoryStream::Path(const TSTR& path) const
+{
+    return metacache::Normalize(m_cwd, path);
+}
+
+const TSTR& InMemoryStream::Path(int slot, TSTRVIEW path)
+{
+    return m_paths.Join(slot, TSTRVIEW(), m_cwd, path);
+}
+
+
+/// CONNECTION METHODS ///
+
+bool InMemoryStream::Connect(TSTR lpszVolume, TSTR /*lpszUser*/, TSTR /*lpszPassword*/, int /*port*/)
+{
+    TELEMETRY_SCOPE(TELEMETRY_CONNECT);
+    if(m_connected)
+        Disconnect();
+
+    if(lpszVolume.empty())
+        m_vol.reset(new memvolume);
+    else
+    {
+        std::lock_guard<std::mutex> guard(g_volLock);
+        std::shared_ptr<memvolume>& vol = g_volumes[lpszVolume];
+        if(!vol)
+            vol.reset(new memvolume);
+        m_vol = vol;
+    }
+
+    m_cwd       = _T("/");
+    m_connected = true;
+    m_err       = 0;
+    return true;
+}
+
+bool InMemoryStream::Disconnect()
+{
+    TELEMETRY_SCOPE(TELEMETRY_DISCONNECT);
+    m_vol.reset();
+    m_cwd.clear();
+    m_connected = false;
+    m_err       = 0;
+    return true;
+}
+
+bool InMemoryStream::DropVolume(TSTR lpszVolume)
+{
+    std::lock_guard<std::mutex> guard(g_volLock);
+    return g_volumes.erase(lpszVolume) != 0;
+}
+
+size_t InMemoryStream::ArenaBytes() const
+{
+    if(!m_vol)
+        return 0;
+    std::lock_guard<std::mutex> guard(m_vol->m_lock);
+    return m_vol->m_slabBytes;
+}
+
+
+/// GET/PUSH METHODS ///
+
+bool InMemoryStream::Upload(TSTR lpszLocation, TSTR lpszRemFile)
+{
+    TELEMETRY_SCOPE(TELEMETRY_UPLOAD);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+    m_moved = 0;
+
+    int fd = open(lpszLocation.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return Fail(errno);
+
+    struct stat st;
+    int err = fstat(fd, &st) < 0 ? errno : S_ISREG(st.st_mode) ? 0 : EISDIR;
+    if(err)
+    {
+        close(fd);
+        return Fail(err);
+    }
+
+    // Fill the pages before anyone can see the file, so no lock is held
+    // while reading
+    std::shared_ptr<memfile> file(new memfile(m_vol.get()));
+    file->Reserve((long long)st.st_size);
+    for(;;)
+    {
+        size_t off = (size_t)(file->m_size % MEM_PAGE);
+        if(file->m_size / MEM_PAGE >= (long long)file->m_pages.size())
+            file->Reserve(file->m_size + MEM_PAGE);
+        ssize_t n = read(fd, file->m_pages[file->m_size / MEM_PAGE] + off, MEM_PAGE - off);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            err = errno;
+            close(fd);
+            return Fail(err);
+        }
+        if(n == 0)
+            break;
+        file->m_size += n;
+    }
+    close(fd);
+
+    TSTR path = Path(lpszRemFile.empty() ? lpszLocation : lpszRemFile);
+    std::lock_guard<std::mutex> guard(m_vol->m_lock);
+    if(!m_vol->IsDir(metacache::Parent(path)))
+        return Fail(ENOENT);
+    if(m_vol->IsDir(path))
+        return Fail(EISDIR);
+
+    memvolume::memnode& node = m_vol->m_nodes[path];
+    node.type   = DIRENT_FILE;
+    node.mtime  = file->m_mtime;
+    node.file.swap(file);
+    m_moved = node.file->m_size;
+    m_err   = 0;
+    return true;
+}
+
+bool InMemoryStream::Download(TSTR lpszLocation, TSTR lpszRemName)
+{
+    TELEMETRY_SCOPE(TELEMETRY_DOWNLOAD);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+    m_moved = 0;
+
+    std::shared_ptr<memfile> file;
+    {
+        std::lock_guard<std::mutex> guard(m_vol->m_lock);
+        memvolume::nodemap::iterator it = m_vol->m_nodes.find(Path(lpszLocation));
+        if(it == m_vol->m_nodes.end())
+            return Fail(ENOENT);
+        if(it->second.type != DIRENT_FILE)
+            return Fail(EISDIR);
+        file = it->second.file;
+    }
+
+    const TSTR& local = lpszRemName.empty() ? lpszLocation : lpszRemName;
+    int fd = open(local.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return Fail(errno);
+
+    int err = 0;
+    {
+        std::lock_guard<std::mutex> guard(file->m_lock);
+        for(long long pos = 0; pos < file->m_size && !err; )
+        {
+            size_t off = (size_t)(pos % MEM_PAGE);
+            size_t len = file->m_size - pos < (long long)(MEM_PAGE - off)
+                       ? (size_t)(file->m_size - pos) : MEM_PAGE - off;
+            ssize_t n = write(fd, file->m_pages[pos / MEM_PAGE] + off, len);
+            if(n < 0)
+                err = errno == EINTR ? 0 : errno;
+            else
+                pos += n;
+        }
+    }
+
+    if(close(fd) < 0 && !err)
+        err = errno;
+    if(err)
+        return Fail(err);
+    m_moved = file->m_size;
+    m_err   = 0;
+    return true;
+}
+
+long long InMemoryStream::LastMoved()
+{
+    return m_moved;
+}
+
+
+/// STREAMING METHODS ///
+
+class memstreamhandle : public streamhandle
+{
+    public:
+            memstreamhandle(const std::shared_ptr<memvolume>& vol,
+                        const std::shared_ptr<memfile>& file,
+                        long long offset,
+                        bool reading)
+            : m_vol(vol), m_file(file)
+        {
+            m_pos   = offset;
+            m_read  = reading;
+            m_err   = 0;
+        }
+
+        long long Read(char* buf, size_t len)
+        {
+            if(!m_file || !m_read)
+                return Fail(m_file ? EPERM : EBADF);
+            size_t n = m_file->ReadAt(m_pos, buf, len);
+            m_pos += n;
+            return (long long)n;
+        }
+
+        long long Write(const char* buf, size_t len)
+        {
+            if(!m_file || m_read)
+                return Fail(m_file ? EPERM : EBADF);
+            m_file->Append(buf, len);
+            return (long long)len;
+        }
+
+        bool Close()
+        {
+            m_file.reset();
+            return m_err == 0;
+        }
+
+        int GetHandle()
+        {
+            return -1;
+        }
+
+        int GetLastError()
+        {
+            return m_err;
+        }
+
+    private:
+        long long Fail(int err)
+        {
+            m_err = err;
+            return -1;
+        }
+
+        // Declared first so the file's pages go back before the volume can
+        std::shared_ptr<memvolume>  m_vol;
+        std::shared_ptr<memfile>    m_file;
+        long long                   m_pos;
+        bool                        m_read;
+        int                         m_err;
+};
+
+datastream InMemoryStream::OpenRead(TSTR lpszLocation, long long offset)
+{
+    TELEMETRY_SCOPE(TELEMETRY_OPENREAD);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return datastream();
+    }
+
+    std::lock_guard<std::mutex> guard(m_vol->m_lock);
+    memvolume::nodemap::iterator it = m_vol->m_nodes.find(Path(lpszLocation));
+    if(it == m_vol->m_nodes.end() || it->second.type != DIRENT_FILE)
+    {
+        Fail(it == m_vol->m_nodes.end() ? ENOENT : EISDIR);
+        return datastream();
+    }
+
+    m_err = 0;
+    return datastream(new memstreamhandle(m_vol, it->second.file, offset > 0 ? offset : 0, true));
+}
+
+datastream InMemoryStream::OpenWrite(TSTR lpszLocation, bool append)
+{
+    TELEMETRY_SCOPE(TELEMETRY_OPENWRITE);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return datastream();
+    }
+
+    TSTR path = Path(lpszLocation);
+    std::shared_ptr<memfile> fresh(new memfile(m_vol.get()));
+
+    std::lock_guard<std::mutex> guard(m_vol->m_lock);
+    if(!m_vol->IsDir(metacache::Parent(path)) || m_vol->IsDir(path))
+    {
+        Fail(m_vol->IsDir(path) ? EISDIR : ENOENT);
+        return datastream();
+    }
+
+    // A new file object for STOR, readers of the old one aren't disturbed.
+    // Whichever one is left over in fresh is released after the lock.
+    memvolume::memnode& node = m_vol->m_nodes[path];
+    node.type = DIRENT_FILE;
+    if(!append || !node.file)
+        node.file.swap(fresh);
+
+    m_err = 0;
+    return datastream(new memstreamhandle(m_vol, node.file, 0, false));
+}
+
+
+/// DIRECTORY METHODS ///
+
+bool InMemoryStream::ChangeDir(TSTR lpszDirectory)
+{
+    return ChangeDirView(lpszDirectory);
+}
+
+bool InMemoryStream::MakeDir(TSTR lpszDirectory)
+{
+    return MakeDirView(lpszDirectory);
+}
+
+bool InMemoryStream::RemoveDir(TSTR lpszDirectory)
+{
+    return RemoveDirView(lpszDirectory);
+}
+
+TSTR InMemoryStream::CurrentDir()
+{
+    TSTRVIEW dir = CurrentDirView();
+    return m_err ? TSTR(_T("ERROR-1")) : TSTR(dir.data(), dir.size());
+}
+
+LIST InMemoryStream::SearchDir(TSTR lpszSearchStr)
+{
+    TELEMETRY_SCOPE(TELEMETRY_SEARCHDIR);
+    LIST files;
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return files;
+    }
+
+    TSTR dir, pattern = lpszSearchStr;
+    size_t slash = lpszSearchStr.rfind('/');
+    if(slash != TSTR::npos)
+    {
+        dir     = lpszSearchStr.substr(0, slash ? slash : 1);
+        pattern = lpszSearchStr.substr(slash + 1);
+    }
+    if(pattern.empty() || pattern == _T("*.*"))
+        pattern = _T("*");
+
+    DirList entries;
+    if(!ListDir(dir, entries))
+        return files;
+    for(DirList::const_iterator it = entries.begin(); it != entries.end(); ++it)
+        if(fnmatch(pattern.c_str(), it->name, FNM_PERIOD) == 0)
+            files.push_back(TSTR(it->name, it->namelen));
+    return files;
+}
+
+bool InMemoryStream::ListDir(TSTR lpszDirectory, DirList& entries)
+{
+    TELEMETRY_SCOPE(TELEMETRY_LISTDIR);
+    entries.Clear();
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    TSTR path = Path(lpszDirectory);
+    std::lock_guard<std::mutex> guard(m_vol->m_lock);
+    if(!m_vol->IsDir(path))
+        return Fail(m_vol->m_nodes.count(path) ? ENOTDIR : ENOENT);
+
+    // Walk the children in order, stepping over each subdirectory's
+    // contents: "name0" sorts right after everything under "name/"
+    TSTR prefix = ChildPrefix(path);
+    memvolume::nodemap::const_iterator it = m_vol->m_nodes.lower_bound(prefix);
+    while(it != m_vol->m_nodes.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+    {
+        const TSTR& key = it->first;
+        const memvolume::memnode& node = it->second;
+
+        DirEntry e;
+        e.name      = key.c_str() + prefix.size();
+        e.namelen   = key.size() - prefix.size();
+        e.type      = node.type;
+        e.size      = node.file ? node.file->m_size.load() : 0;
+        e.mtime     = node.file ? node.file->m_mtime.load() : node.mtime;
+        e.perms     = 0;
+        entries.Add(e);
+
+        if(node.type == DIRENT_DIR)
+            it = m_vol->m_nodes.lower_bound(key + _T("0"));
+        else
+            ++it;
+    }
+
+    m_err = 0;
+    return true;
+}
+
+
+/// FILE HANDLING METHODS ///
+
+bool InMemoryStream::Remove(TSTR lpszFileName)
+{
+    return RemoveView(lpszFileName);
+}
+
+bool InMemoryStream::Rename(TSTR lpszOldFileName, TSTR lpszNewFileName)
+{
+    return RenameView(lpszOldFileName, lpszNewFileName);
+}
+
+bool InMemoryStream::Exists(TSTR lpszFilename)
+{
+    return ExistsView(lpszFilename);
+}
+
+long long InMemoryStream::GetFileSize(TSTR lpszFileName)
+{
+    return GetFileSizeView(lpszFileName);
+}
+
+long long InMemoryStream::GetModTime(TSTR lpszFileName)
+{
+    return GetModTimeView(lpszFileName);
+}
+
+
+/// PATH VIEW METHODS ///
+
+bool InMemoryStream::ChangeDirView(TSTRVIEW dir)
+{
+    TELEMETRY_SCOPE(TELEMETRY_CHANGEDIR);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    const TSTR& path = Path(0, dir);
+    std::lock_guard<std::mutex> guard(m_vol->m_lock);
+    if(!m_vol->IsDir(path))
+        return Fail(m_vol->m_nodes.count(path) ? ENOTDIR : ENOENT);
+    m_cwd = path;
+    m_err = 0;
+    return true;
+}
+
+bool InMemoryStream::MakeDirView(TSTRVIEW dir)
+{
+    TELEMETRY_SCOPE(TELEMETRY_MAKEDIR);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    const TSTR& path = Path(0, dir);
+    std::lock_guard<std::mutex> guard(m_vol->m_lock);
+    if(path == _T("/") || m_vol->m_nodes.count(path))
+        return Fail(EEXIST);
+    if(!m_vol->IsDir(metacache::Parent(path)))
+        return Fail(ENOENT);
+
+    memvolume::memnode& node = m_vol->m_nodes[path];
+    node.type   = DIRENT_DIR;
+    node.mtime  = (long long)time(NULL);
+    m_err = 0;
+    return true;
+}
+
+bool InMemoryStream::RemoveDirView(TSTRVIEW dir)
+{
+    TELEMETRY_SCOPE(TELEMETRY_REMOVEDIR);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    const TSTR& path = Path(0, dir);
+    if(path == _T("/"))
+        return Fail(EBUSY);
+
+    std::lock_guard<std::mutex> guard(m_vol->m_lock);
+    memvolume::nodemap::iterator it = m_vol->m_nodes.find(path);
+    if(it == m_vol->m_nodes.end() || it->second.type != DIRENT_DIR)
+        return Fail(it == m_vol->m_nodes.end() ? ENOENT : ENOTDIR);
+
+    // Children sort straight after "path/"
+    TSTR prefix = ChildPrefix(path);
+    memvolume::nodemap::iterator child = m_vol->m_nodes.lower_bound(prefix);
+    if(child != m_vol->m_nodes.end() && child->first.compare(0, prefix.size(), prefix) == 0)
+        return Fail(ENOTEMPTY);
+
+    m_vol->m_nodes.erase(it);
+    m_err = 0;
+    return true;
+}
+
+TSTRVIEW InMemoryStream::CurrentDirView()
+{
+    TELEMETRY_SCOPE(TELEMETRY_CURRENTDIR);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return TSTRVIEW();
+    }
+    m_err = 0;
+    return m_cwd;
+}
+
+bool InMemoryStream::RemoveView(TSTRVIEW filename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_REMOVE);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    std::shared_ptr<memfile> file;     // Released after the volume lock
+    std::lock_guard<std::mutex> guard(m_vol->m_lock);
+    memvolume::nodemap::iterator it = m_vol->m_nodes.find(Path(0, filename));
+    if(it == m_vol->m_nodes.end() || it->second.type != DIRENT_FILE)
+        return Fail(it == m_vol->m_nodes.end() ? ENOENT : EISDIR);
+
+    file.swap(it->second.file);
+    m_vol->m_nodes.erase(it);
+    m_err = 0;
+    return true;
+}
+
+bool InMemoryStream::RenameView(TSTRVIEW oldFilename, TSTRVIEW newFilename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_RENAME);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    const TSTR& from = Path(0, oldFilename);
+    const TSTR& to   = Path(1, newFilename);
+    if(from == _T("/") || to == _T("/"))
+        return Fail(EBUSY);
+    if(from == to)
+        return !(m_err = 0);
+    if(to.compare(0, from.size() + 1, from + _T("/")) == 0)
+        return Fail(EINVAL);
+
+    std::shared_ptr<memfile> replaced;
+    std::lock_guard<std::mutex> guard(m_vol->m_lock);
+    memvolume::nodemap& nodes = m_vol->m_nodes;
+    memvolume::nodemap::iterator it = nodes.find(from);
+    if(it == nodes.end())
+        return Fail(ENOENT);
+    if(!m_vol->IsDir(metacache::Parent(to)))
+        return Fail(ENOENT);
+
+    memvolume::nodemap::iterator dst = nodes.find(to);
+    if(dst != nodes.end())
+    {
+        if(dst->second.type == DIRENT_DIR || it->second.type == DIRENT_DIR)
+            return Fail(dst->second.type == DIRENT_DIR ? EISDIR : ENOTDIR);
+        replaced.swap(dst->second.file);
+        nodes.erase(dst);
+    }
+
+    nodes[to] = it->second;
+    nodes.erase(it);
+
+    // A directory takes everything under it along
+    TSTR prefix = from + _T("/");
+    it = nodes.lower_bound(prefix);
+    while(it != nodes.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+    {
+        nodes[to + it->first.substr(from.size())] = it->second;
+        nodes.erase(it++);
+    }
+
+    m_err = 0;
+    return true;
+}
+
+bool InMemoryStream::ExistsView(TSTRVIEW filename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_EXISTS);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    const TSTR& path = Path(0, filename);
+    std::lock_guard<std::mutex> guard(m_vol->m_lock);
+    if(path != _T("/") && !m_vol->m_nodes.count(path))
+        return Fail(ENOENT);
+    m_err = 0;
+    return true;
+}
+
+long long InMemoryStream::GetFileSizeView(TSTRVIEW filename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_GETFILESIZE);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return INVALID_FILE;
+    }
+
+    std::shared_ptr<memfile> file;
+    {
+        std::lock_guard<std::mutex> guard(m_vol->m_lock);
+        memvolume::nodemap::iterator it = m_vol->m_nodes.find(Path(0, filename));
+        if(it == m_vol->m_nodes.end() || it->second.type != DIRENT_FILE)
+        {
+            Fail(it == m_vol->m_nodes.end() ? ENOENT : EISDIR);
+            return INVALID_FILE;
+        }
+        file = it->second.file;
+    }
+    m_err = 0;
+    return file->m_size;
+}
+
+long long InMemoryStream::GetModTimeView(TSTRVIEW filename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_GETMODTIME);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return INVALID_FILE;
+    }
+
+    const TSTR& path = Path(0, filename);
+    std::shared_ptr<memfile> file;
+    long long mtime = INVALID_FILE;
+    {
+        std::lock_guard<std::mutex> guard(m_vol->m_lock);
+        memvolume::nodemap::iterator it = m_vol->m_nodes.find(path);
+        if(it == m_vol->m_nodes.end())
+        {
+            Fail(ENOENT);
+            return INVALID_FILE;
+        }
+        file  = it->second.file;
+        mtime = it->second.mtime;
+    }
+    m_err = 0;
+    return file ? file->m_mtime.load() : mtime;
+}
+
+
+/// MISCELLANEOUS METHODS ///
+
+bool InMemoryStream::Command(TSTR /*lpszCommand*/)
+{
+    TELEMETRY_SCOPE(TELEMETRY_COMMAND);
+    return Fail(m_connected ? EOPNOTSUPP : ENOTCONN);
+}
+
+int InMemoryStream::GetLastError()
+{
+    return m_err;
+}
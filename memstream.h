@@ -0,0 +1,135 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** In-Memory Stream
+  *
+  * A connstream whose files live in process memory, for tests and for
+  * measuring everything above the transport with the transport taken
+  * away. Sessions that connect to the same volume name share one tree,
+  * so a connstream_pool of InMemoryStreams behaves like a pool of
+  * sessions to one server.
+  *
+  * File contents sit in fixed size pages carved out of large slabs, the
+  * way an arena hands out memory: a file costs a vector of page pointers,
+  * not a heap block that has to be regrown and copied as it is written.
+  * Pages go back on the volume's free list when the last reference to a
+  * file is dropped, slabs are only given back with the volume.
+  *
+  * Replacing a file gives it new pages. A stream already reading the old
+  * contents carries on reading them, the way an open descriptor does.
+  *
+  * E.G. Usage:
+  *     InMemoryStream mem;
+  *     mem.Connect(_T("scratch"));
+  *     mem.Upload(_T("report.pdf"), _T("/out/report.pdf"));
+  *     ....
+  *     InMemoryStream::DropVolume(_T("scratch"));
+  */
+
+#ifndef _MEMSTREAM_H_
+#define _MEMSTREAM_H_
+
+#include <memory>
+#include "connstream.h"
+#include "dirlist.h"
+#include "telemetry.h"
+
+#if defined(UNICODE) || defined(_UNICODE_)
+#error memstream.h only supports narrow TSTR
+#endif
+
+#define MEM_PAGE    (64 << 10)      // Bytes of file data per page
+#define MEM_SLAB    (16 << 20)      // Bytes the arena grows by
+
+/** NOTE: GetLastError() holds an errno value, as a POSIX call would have set */
+
+class memvolume;
+
+class InMemoryStream : public connstream
+{
+    public:
+        InMemoryStream(void);
+        virtual ~InMemoryStream(void);
+
+        /// CONNECTION METHODS ///
+        /** bool Connect(TSTR, TSTR, TSTR, int)
+         *  Attaches to the volume @lpszVolume, creating it empty the first
+         *  time the name is used. A blank name gives this session a volume
+         *  of its own. User, password and port are ignored.
+         */
+        bool Connect(TSTR lpszVolume,
+                     TSTR lpszUser = _T(""),
+                     TSTR lpszPassword = _T(""),
+                     int port = 0);
+        bool Disconnect(void);
+
+        /// GET/PUSH METHODS ///
+        bool Upload(TSTR lpszLocation, TSTR lpszRemFile);
+        bool Download(TSTR lpszLocation, TSTR lpszRemName);
+
+        /// STREAMING METHODS ///
+        /** GetHandle() of these streams is always -1, there is nothing to poll */
+        datastream  OpenRead(TSTR lpszLocation, long long offset = 0);
+        datastream  OpenWrite(TSTR lpszLocation, bool append = false);
+
+        /// DIRECTORY METHODS ///
+        /** LIST SearchDir(TSTR) - As LocalFS::SearchDir */
+        /** bool ListDir(TSTR, DirList&) - Sizes, times and types, perms are 0 */
+        bool    ChangeDir(TSTR lpszDirectory);
+        bool    MakeDir(TSTR lpszDirectory);
+        bool    RemoveDir(TSTR lpszDirectory);
+        TSTR    CurrentDir(void);
+        LIST    SearchDir(TSTR lpszSearchStr);
+        bool    ListDir(TSTR lpszDirectory, DirList& entries);
+
+        /// FILE HANDLING METHODS ///
+        bool        Remove(TSTR lpszFileName);
+        bool        Rename(TSTR lpszOldFileName, TSTR lpszNewFileName);
+        bool        Exists(TSTR lpszFilename);
+        long long   GetFileSize(TSTR lpszFileName);
+        long long   GetModTime(TSTR lpszFileName);
+
+        /// PATH VIEW METHODS ///
+        /** The calls above with each path normalized into m_paths, a lookup
+         *  keys the volume's map with the slot itself.
+         */
+        bool        ChangeDirView(TSTRVIEW dir);
+        bool        MakeDirView(TSTRVIEW dir);
+        bool        RemoveDirView(TSTRVIEW dir);
+        TSTRVIEW    CurrentDirView(void);
+        bool        RemoveView(TSTRVIEW filename);
+        bool        RenameView(TSTRVIEW oldFilename, TSTRVIEW newFilename);
+        bool        ExistsView(TSTRVIEW filename);
+        long long   GetFileSizeView(TSTRVIEW filename);
+        long long   GetModTimeView(TSTRVIEW filename);
+
+        /// MISCELLANEOUS METHODS ///
+        /** bool Command(TSTR) - There is no command channel, fails with EOPNOTSUPP */
+        bool    Command(TSTR lpszCommand);
+        int     GetLastError(void);
+
+        /** size_t ArenaBytes(void) - Slab memory held by the attached volume */
+        size_t  ArenaBytes(void) const;
+
+        /** bool DropVolume(TSTR)
+         *  Forgets the volume @lpszVolume so the next Connect to the name
+         *  starts empty. Sessions still attached keep it until they disconnect.
+         *  Returns : @false when no volume has the name
+         */
+        static bool DropVolume(TSTR lpszVolume);
+
+    protected:
+        bool        Fail(int err);
+        TSTR        Path(const TSTR& path) const;
+        const TSTR& Path(int slot, TSTRVIEW path);
+        long long   LastMoved(void);
+
+        std::shared_ptr<memvolume>  m_vol;
+        TSTR                        m_cwd;
+        long long                   m_moved;        // Size of the last file copied in or out
+};
+
+#endif // _MEMSTREAM_H_
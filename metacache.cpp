@@ -0,0 +1,311 @@
+#include <metacache.h>
+
+#include <string.h>
+#include <algorithm>
+
+double metacache_stats::HitRate() const
+{
+    unsigned long long total = hits + misses;
+    return total ? (double)hits / (double)total : 0.0;
+}
+
+metacache::metacache(int ttl, size_t maxBytes)
+{
+    m_ttl       = std::chrono::milliseconds(ttl > 0 ? ttl : META_TTL);
+    m_maxBytes  = maxBytes;
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+metacache::~metacache()
+{
+}
+
+
+/// LOOKUP ///
+
+bool metacache::Lookup(const TSTR& key, metaentry& entry)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+
+    nodemap::iterator it = m_nodes.find(key);
+    if(it == m_nodes.end() || !it->second.hasStat)
+    {
+        m_stats.misses++;
+        return false;
+    }
+
+    node& n = it->second;
+    if(clock::now() - n.statAt > m_ttl)
+    {
+        n.hasStat = false;
+        m_stats.expired++;
+        m_stats.misses++;
+        if(!n.hasNames)
+            Erase(it);
+        return false;
+    }
+
+    m_lru.splice(m_lru.begin(), m_lru, n.lru);
+    entry = n.stat;
+    m_stats.hits++;
+    return true;
+}
+
+bool metacache::LookupDir(const TSTR& key, LIST& names)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+
+    nodemap::iterator it = m_nodes.find(key);
+    if(it == m_nodes.end() || !it->second.hasNames)
+    {
+        m_stats.misses++;
+        return false;
+    }
+
+    node& n = it->second;
+    if(clock::now() - n.namesAt > m_ttl)
+    {
+        n.hasNames = false;
+        LIST().swap(n.names);
+        Account(n);
+        m_stats.expired++;
+        m_stats.misses++;
+        if(!n.hasStat)
+            Erase(it);
+        return false;
+    }
+
+    m_lru.splice(m_lru.begin(), m_lru, n.lru);
+    names = n.names;
+    m_stats.hits++;
+    return true;
+}
+
+bool metacache::Listed(const TSTR& key, const TSTR& name, bool& present)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+
+    nodemap::iterator it = m_nodes.find(key);
+    if(it == m_nodes.end() || !it->second.hasNames || clock::now() - it->second.namesAt > m_ttl)
+    {
+        m_stats.misses++;
+        return false;
+    }
+
+    node& n = it->second;
+    m_lru.splice(m_lru.begin(), m_lru, n.lru);
+    present = std::find(n.names.begin(), n.names.end(), name) != n.names.end();
+    m_stats.hits++;
+    return true;
+}
+
+
+/// STORE ///
+
+metacache::node& metacache::Touch(const TSTR& key)
+{
+    std::pair<nodemap::iterator, bool> ins = m_nodes.insert(nodemap::value_type(key, node()));
+    node& n = ins.first->second;
+
+    if(ins.second)
+    {
+        n.hasStat   = false;
+        n.hasNames  = false;
+        n.bytes     = 0;
+        m_lru.push_front(key);
+        n.lru       = m_lru.begin();
+        Account(n);
+    }
+    else
+        m_lru.splice(m_lru.begin(), m_lru, n.lru);
+
+    return n;
+}
+
+void metacache::Store(const TSTR& key, const metaentry& entry)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+
+    node& n = Touch(key);
+    clock::time_point now = clock::now();
+
+    metaentry merged = entry;
+    if(n.hasStat && n.stat.type == entry.type && now - n.statAt <= m_ttl)
+    {
+        if(merged.size == INVALID_FILE)
+            merged.size = n.stat.size;
+        if(merged.mtime == INVALID_FILE)
+            merged.mtime = n.stat.mtime;
+    }
+
+    n.stat      = merged;
+    n.statAt    = now;
+    n.hasStat   = true;
+    Trim();
+}
+
+void metacache::StoreDir(const TSTR& key, const LIST& names)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+
+    node& n = Touch(key);
+    clock::time_point now = clock::now();
+
+    n.names     = names;
+    n.namesAt   = now;
+    n.hasNames  = true;
+
+    if(!n.hasStat || n.stat.type != META_DIR)
+    {
+        n.stat.type     = META_DIR;
+        n.stat.size     = INVALID_FILE;
+        n.stat.mtime    = INVALID_FILE;
+    }
+    n.statAt    = now;
+    n.hasStat   = true;
+
+    Account(n);
+    Trim();
+}
+
+
+/// INVALIDATION ///
+
+void metacache::Invalidate(const TSTR& key)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+
+    nodemap::iterator it = m_nodes.find(key);
+    if(it == m_nodes.end())
+        return;
+    Erase(it);
+    m_stats.invalidations++;
+}
+
+void metacache::InvalidateDir(const TSTR& key)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+
+    nodemap::iterator it = m_nodes.find(key);
+    if(it == m_nodes.end() || !it->second.hasNames)
+        return;
+
+    node& n = it->second;
+    n.hasNames = false;
+    LIST().swap(n.names);
+    Account(n);
+    m_stats.invalidations++;
+    if(!n.hasStat)
+        Erase(it);
+}
+
+void metacache::InvalidateTree(const TSTR& key)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+
+    // Keys aren't ordered, a removed or renamed directory is rare enough to scan for
+    TSTR prefix = key;
+    if(prefix.empty() || prefix[prefix.size() - 1] != '/')
+        prefix += '/';
+
+    for(nodemap::iterator it = m_nodes.begin(); it != m_nodes.end(); )
+    {
+        nodemap::iterator cur = it++;
+        if(cur->first == key || !cur->first.compare(0, prefix.size(), prefix))
+        {
+            Erase(cur);
+            m_stats.invalidations++;
+        }
+    }
+}
+
+void metacache::Clear()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    m_nodes.clear();
+    m_lru.clear();
+    m_stats.entries = 0;
+    m_stats.bytes   = 0;
+}
+
+
+/// BOOKKEEPING ///
+
+void metacache::Account(node& n)
+{
+    // Rough footprint: key and node twice (map and LRU list) plus every cached name
+    size_t bytes = sizeof(node) + 2 * (sizeof(TSTR) + n.lru->size());
+    for(size_t i = 0; i < n.names.size(); i++)
+        bytes += sizeof(TSTR) + n.names[i].size();
+
+    m_stats.bytes   = m_stats.bytes - n.bytes + bytes;
+    n.bytes         = bytes;
+    m_stats.entries = m_nodes.size();
+}
+
+void metacache::Erase(nodemap::iterator it)
+{
+    m_stats.bytes -= it->second.bytes;
+    m_lru.erase(it->second.lru);
+    m_nodes.erase(it);
+    m_stats.entries = m_nodes.size();
+}
+
+void metacache::Trim()
+{
+    // Never evict the entry just stored, it sits at the front
+    while(m_stats.bytes > m_maxBytes && m_lru.size() > 1)
+    {
+        Erase(m_nodes.find(m_lru.back()));
+        m_stats.evictions++;
+    }
+}
+
+
+/// SETTINGS ///
+
+void metacache::SetTTL(int ms)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    m_ttl = std::chrono::milliseconds(ms > 0 ? ms : META_TTL);
+}
+
+void metacache::SetMaxBytes(size_t bytes)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    m_maxBytes = bytes;
+    Trim();
+}
+
+metacache_stats metacache::GetStats()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    return m_stats;
+}
+
+void metacache::ResetStats()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    size_t entries  = m_stats.entries;
+    size_t bytes    = m_stats.bytes;
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_stats.entries = entries;
+    m_stats.bytes   = bytes;
+}
+
+
+/// PATHS ///
+
+TSTR metacache::Normalize(const TSTR& cwd, const TSTR& path)
+{
+    TSTR out;
+    out.reserve(cwd.size() + path.size() + 2);
+    patharena::Normalize(out, cwd, path);
+    return out;
+}
+
+TSTR metacache::Parent(const TSTR& path)
+{
+    TSTRVIEW parent = patharena::Parent(path);
+    return TSTR(parent.data(), parent.size());
+}
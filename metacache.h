@@ -0,0 +1,168 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Metadata Cache
+  *
+  * Remembers what a server said about its paths so repeated metadata
+  * questions don't go back over the wire. Two kinds of entry are kept
+  * per key: a stat entry (type, size, modification time, or "missing"
+  * for a path known not to exist) and a directory listing.
+  *
+  * Entries expire after a TTL and the least recently used ones are
+  * evicted once the cache holds more than its byte budget. A session
+  * that changes the server updates or invalidates the entries it
+  * touched, so its own writes are never served stale. Changes made by
+  * other clients are only picked up once the TTL runs out.
+  *
+  * Keys are opaque to the cache. A backend prefixes the normalized
+  * absolute path with its site (user@host:port), which lets one cache
+  * be shared by every session in a pool. Thread-safe.
+  *
+  * E.G. Usage:
+  *     std::shared_ptr<metacache> cache(new metacache(10000));
+  *     PosixFTP ftp;
+  *     ftp.SetCache(cache);
+  *     ftp.Exists(_T("/pub/a.txt"));       // MLST
+  *     ftp.Exists(_T("/pub/a.txt"));       // Served from the cache
+  */
+
+#ifndef _METACACHE_H_
+#define _METACACHE_H_
+
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include "connstream.h"
+
+#define META_TTL            30000           // Milliseconds an entry is trusted
+#define META_MAX_BYTES      (16 << 20)      // Approximate memory budget
+
+/* metaentry types */
+#define META_MISSING        0               // Known not to exist
+#define META_FILE           1
+#define META_DIR            2
+#define META_OTHER          3               // Links, devices...
+
+struct metaentry
+{
+    int         type;
+    long long   size;       // INVALID_FILE when unknown
+    long long   mtime;      // UTC seconds since the epoch, INVALID_FILE when unknown
+};
+
+/** Counters since construction (or ResetStats) */
+struct metacache_stats
+{
+    unsigned long long  hits;
+    unsigned long long  misses;         // Includes entries found expired
+    unsigned long long  expired;
+    unsigned long long  evictions;      // Dropped to stay inside the byte budget
+    unsigned long long  invalidations;
+    size_t              entries;
+    size_t              bytes;
+
+    /** Hits / (hits + misses), 0 before the first lookup */
+    double HitRate(void) const;
+};
+
+class metacache
+{
+    public:
+        /** metacache(int, size_t)
+         *      @ttl      : Milliseconds an entry is served before it is refetched
+         *      @maxBytes : Approximate memory the entries may use
+         */
+        metacache(int ttl = META_TTL, size_t maxBytes = META_MAX_BYTES);
+        virtual ~metacache(void);
+
+        /** bool Lookup(const TSTR&, metaentry&)
+         *  bool LookupDir(const TSTR&, LIST&)
+         *  Copies a live stat entry or directory listing for @key.
+         *  Returns : @false on a miss or an expired entry
+         */
+        /** bool Listed(const TSTR&, const TSTR&, bool&)
+         *  Checks a live listing of @key for @name without copying it.
+         *  Returns : @false when there is no listing, otherwise @present says
+         *            whether the name was in it
+         */
+        bool    Lookup(const TSTR& key, metaentry& entry);
+        bool    LookupDir(const TSTR& key, LIST& names);
+        bool    Listed(const TSTR& key, const TSTR& name, bool& present);
+
+        /** void Store(const TSTR&, const metaentry&)
+         *  Records a stat entry. Fields left INVALID_FILE keep the value
+         *  already cached for the same type, so a SIZE reply doesn't erase
+         *  a known mtime.
+         */
+        /** void StoreDir(const TSTR&, const LIST&)
+         *  Records the names in a directory, the directory itself is
+         *  stored as META_DIR alongside.
+         */
+        void    Store(const TSTR& key, const metaentry& entry);
+        void    StoreDir(const TSTR& key, const LIST& names);
+
+        /** void Invalidate(const TSTR&)
+         *  Drops both entries for @key.
+         */
+        /** void InvalidateDir(const TSTR&)
+         *  Drops only the listing of @key, for a change inside that directory.
+         */
+        /** void InvalidateTree(const TSTR&)
+         *  Drops @key and every key below it, for a removed or renamed directory.
+         */
+        void    Invalidate(const TSTR& key);
+        void    InvalidateDir(const TSTR& key);
+        void    InvalidateTree(const TSTR& key);
+        void    Clear(void);
+
+        void    SetTTL(int ms);
+        void    SetMaxBytes(size_t bytes);
+
+        metacache_stats GetStats(void);
+        void            ResetStats(void);
+
+        /** TSTR Normalize(const TSTR&, const TSTR&)
+         *  Resolves @path against the directory @cwd into an absolute path with
+         *  ".", ".." and repeated or trailing '/' removed. Lexical only.
+         */
+        /** TSTR Parent(const TSTR&)
+         *  Directory part of a normalized path, "/" for a top level name.
+         */
+        static TSTR Normalize(const TSTR& cwd, const TSTR& path);
+        static TSTR Parent(const TSTR& path);
+
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct node
+        {
+            metaentry                       stat;
+            clock::time_point               statAt;
+            bool                            hasStat;
+            LIST                            names;
+            clock::time_point               namesAt;
+            bool                            hasNames;
+            size_t                          bytes;
+            std::list<TSTR>::iterator       lru;
+        };
+        typedef std::unordered_map<TSTR, node> nodemap;
+
+        node&   Touch(const TSTR& key);
+        void    Account(node& n);
+        void    Erase(nodemap::iterator it);
+        void    Trim(void);
+
+        clock::duration     m_ttl;
+        size_t              m_maxBytes;
+
+        std::mutex          m_lock;
+        nodemap             m_nodes;
+        std::list<TSTR>     m_lru;          // Most recently used at the front
+        metacache_stats     m_stats;
+};
+
+#endif // _METACACHE_H_
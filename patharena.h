@@ -0,0 +1,196 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Path Arena
+  *
+  * Paths handed around without copying them. basic_pathview is
+  * std::basic_string_view when the compiler has it (C++17) and a
+  * small stand-in with the same members otherwise, so the TSTRVIEW
+  * methods of connstream take a string literal, a TSTR or part of
+  * either without building a string.
+  *
+  * basic_patharena is a handful of strings a session reuses for the
+  * paths it works out: joined against its working directory,
+  * normalized, NUL terminated for the system or the wire and given a
+  * prefix where a backend keys or roots them. Each slot keeps its
+  * capacity, so once the longest path has been seen a call costs no
+  * heap allocation at all.
+  *
+  * E.G. Usage:
+  *     patharena paths;
+  *     const TSTR& real = paths.Join(0, m_root, m_cwd, lpszPath);
+  *     stat(real.c_str(), &st);
+  */
+
+#ifndef _PATHARENA_H_
+#define _PATHARENA_H_
+
+#include <stddef.h>
+#include <string>
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define PATHARENA_STRING_VIEW
+#include <string_view>
+#endif
+
+#define PATHARENA_SLOTS     6       // Strings one session can hold at once
+
+#if defined(PATHARENA_STRING_VIEW)
+
+template<class T>
+using basic_pathview = std::basic_string_view<T>;
+
+#else
+
+/** The part of std::basic_string_view paths need, for C++11 and C++14 */
+template<class T>
+class basic_pathview
+{
+    public:
+        typedef const T*    const_iterator;
+        static const size_t npos = (size_t)-1;
+
+        basic_pathview(void)                            : m_data(NULL), m_size(0) {}
+        basic_pathview(const T* s)                      : m_data(s), m_size(std::char_traits<T>::length(s)) {}
+        basic_pathview(const T* s, size_t n)            : m_data(s), m_size(n) {}
+        basic_pathview(const std::basic_string<T>& s)   : m_data(s.data()), m_size(s.size()) {}
+
+        const T*        data(void) const                { return m_data; }
+        size_t          size(void) const                { return m_size; }
+        size_t          length(void) const              { return m_size; }
+        bool            empty(void) const               { return !m_size; }
+        const T&        operator[](size_t i) const      { return m_data[i]; }
+        const_iterator  begin(void) const               { return m_data; }
+        const_iterator  end(void) const                 { return m_data + m_size; }
+
+        basic_pathview  substr(size_t pos, size_t n = npos) const
+        {
+            return basic_pathview(m_data + pos, n < m_size - pos ? n : m_size - pos);
+        }
+        size_t  find(T c, size_t pos = 0) const
+        {
+            for(; pos < m_size; pos++)
+                if(m_data[pos] == c)
+                    return pos;
+            return npos;
+        }
+        size_t  rfind(T c, size_t pos = npos) const
+        {
+            for(size_t i = pos < m_size ? pos + 1 : m_size; i; i--)
+                if(m_data[i - 1] == c)
+                    return i - 1;
+            return npos;
+        }
+
+        friend bool operator==(basic_pathview a, basic_pathview b)
+        {
+            return a.m_size == b.m_size && !std::char_traits<T>::compare(a.m_data, b.m_data, a.m_size);
+        }
+        friend bool operator!=(basic_pathview a, basic_pathview b)
+        {
+            return !(a == b);
+        }
+
+    private:
+        const T*    m_data;
+        size_t      m_size;
+};
+
+template<class T>
+const size_t basic_pathview<T>::npos;
+
+#endif // PATHARENA_STRING_VIEW
+
+template<class T>
+class basic_patharena
+{
+    public:
+        typedef std::basic_string<T>    string;
+        typedef basic_pathview<T>       view;
+
+        /** string& operator[](int) - Slot @slot to fill by hand, capacity and all */
+        string&         operator[](int slot)            { return m_slot[slot]; }
+
+        /** const string& Copy(int, view)
+         *  @path as it is, NUL terminated in @slot.
+         *  Returns : the slot, good until it is next written
+         */
+        const string&   Copy(int slot, view path)
+        {
+            m_slot[slot].assign(path.data(), path.size());
+            return m_slot[slot];
+        }
+
+        /** const string& Join(int, view, view, view)
+         *  @prefix then @path resolved against @cwd by Normalize, in @slot.
+         *  Returns : the slot, good until it is next written
+         */
+        const string&   Join(int slot, view prefix, view cwd, view path)
+        {
+            string& out = m_slot[slot];
+            out.assign(prefix.data(), prefix.size());
+            Normalize(out, cwd, path);
+            return out;
+        }
+
+        /** void Normalize(string&, view, view)
+         *  Appends @path, taken relative to @cwd unless it starts with '/', to
+         *  @out as an absolute path with "." and ".." resolved and no empty or
+         *  trailing components. ".." stops at "/" and never eats into what
+         *  @out already held.
+         */
+        static void     Normalize(string& out, view cwd, view path)
+        {
+            size_t base = out.size();
+            if(path.empty() || path[0] != '/')
+                Components(out, base, cwd);
+            Components(out, base, path);
+            if(out.size() == base)
+                out += '/';
+        }
+
+        /** view Parent(view) - @path up to its last '/', "/" for the root and its children */
+        static view     Parent(view path)
+        {
+            size_t slash = path.rfind('/');
+            if(slash == view::npos || slash == 0)
+                return view(s_root, 1);
+            return path.substr(0, slash);
+        }
+
+    private:
+        static void     Components(string& out, size_t base, view in)
+        {
+            for(size_t pos = 0; pos < in.size(); )
+            {
+                size_t end = in.find('/', pos);
+                if(end == view::npos)
+                    end = in.size();
+                size_t len = end - pos;
+
+                if(len == 2 && in[pos] == '.' && in[pos + 1] == '.')
+                {
+                    size_t slash = out.rfind('/');
+                    out.erase(slash == string::npos || slash < base ? base : slash);
+                }
+                else if(len && !(len == 1 && in[pos] == '.'))
+                {
+                    out += '/';
+                    out.append(in.data() + pos, len);
+                }
+                pos = end + 1;
+            }
+        }
+
+        static const T  s_root[2];
+
+        string  m_slot[PATHARENA_SLOTS];
+};
+
+template<class T>
+const T basic_patharena<T>::s_root[2] = { '/', 0 };
+
+#endif // _PATHARENA_H_
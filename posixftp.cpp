@@ -0,0 +1,3319 @@
+#include <posixftp.h>
+
+#if !defined(_MSC_VER)
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FTP_DATA_BUFSIZE    65536
+
+PosixFTP::PosixFTP()
+{
+    m_ctrl          = -1;
+    m_timeout       = FTP_TIMEOUT;
+    m_feat          = 0;
+    m_noEpsv        = false;
+    m_peerlen       = 0;
+    m_reply         = 0;
+    m_textlen       = 0;
+    m_text[0]       = '\0';
+    m_rhead         = 0;
+    m_rtail         = 0;
+    m_zeroCopy      = true;
+    m_sumVerify     = false;
+    m_hashSel       = CHECKSUM_NONE;
+    m_compress      = false;
+    m_level         = -1;
+    m_modeZ         = false;
+    m_delta         = false;
+    m_retries       = 0;
+    m_port          = 0;
+    m_pipe[0]       = -1;
+    m_pipe[1]       = -1;
+    m_stream        = NULL;
+    m_connected     = false;
+    m_err           = 0;
+    memset(&m_deltaStats, 0, sizeof(m_deltaStats));
+#if defined(CONNSTREAM_TLS)
+    m_protect       = true;
+    m_private       = false;
+    memset(&m_tlsStats, 0, sizeof(m_tlsStats));
+#endif
+}
+
+PosixFTP::~PosixFTP()
+{
+    DetachStream();
+    if(m_connected)
+        Disconnect();
+    if(m_pipe[0] >= 0)
+    {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+}
+
+
+/// SOCKET HELPERS ///
+
+bool PosixFTP::WaitFd(int fd, short events)
+{
+    struct pollfd p;
+    p.fd        = fd;
+    p.events    = events;
+    p.revents   = 0;
+
+    int r;
+    do
+        r = poll(&p, 1, m_timeout);
+    while(r < 0 && errno == EINTR);
+
+    if(r == 0)
+        errno = ETIMEDOUT;
+
+    return r > 0;
+}
+
+bool PosixFTP::SendAll(int fd, const char* buf, size_t len)
+{
+    while(len)
+    {
+        ssize_t n = Send(fd, buf, len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            if(!WaitFd(fd, POLLOUT))
+                return false;
+            continue;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+ssize_t PosixFTP::Recv(int fd, void* buf, size_t len)
+{
+#if defined(CONNSTREAM_TLS)
+    if(m_ctrlTls.Active() && fd == m_ctrlTls.GetHandle())
+        return m_ctrlTls.Recv(buf, len);
+    if(m_dataTls.Active() && fd == m_dataTls.GetHandle())
+        return m_dataTls.Recv(buf, len);
+#endif
+    return recv(fd, buf, len, 0);
+}
+
+ssize_t PosixFTP::Send(int fd, const void* buf, size_t len)
+{
+#if defined(CONNSTREAM_TLS)
+    if(m_ctrlTls.Active() && fd == m_ctrlTls.GetHandle())
+        return m_ctrlTls.Send(buf, len);
+    if(m_dataTls.Active() && fd == m_dataTls.GetHandle())
+        return m_dataTls.Send(buf, len);
+#endif
+    return send(fd, buf, len, MSG_NOSIGNAL);
+}
+
+bool PosixFTP::Offload(int data, bool sending)
+{
+#if defined(CONNSTREAM_TLS)
+    // Bytes OpenSSL already pulled off the socket would be skipped by a splice
+    if(m_dataTls.Active() && data == m_dataTls.GetHandle())
+        return sending ? m_dataTls.KernelSend() : m_dataTls.KernelRecv() && !m_dataTls.Pending();
+#else
+    (void)data;
+    (void)sending;
+#endif
+    return true;
+}
+
+void PosixFTP::CloseData(int data, bool graceful)
+{
+#if defined(CONNSTREAM_TLS)
+    if(m_dataTls.Active() && data == m_dataTls.GetHandle())
+        m_dataTls.Close(graceful, m_timeout);
+#else
+    (void)graceful;
+#endif
+    close(data);
+}
+
+void PosixFTP::Pace(size_t bytes)
+{
+    if(m_sched)
+        m_sched->Acquire(m_flow, bytes);
+}
+
+int PosixFTP::ConnectTo(const struct sockaddr* addr, socklen_t len)
+{
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        return -1;
+
+    if(connect(fd, addr, len) < 0)
+    {
+        int soerr = errno;
+        socklen_t sl = sizeof(soerr);
+
+        if(errno != EINPROGRESS
+            || !WaitFd(fd, POLLOUT)
+            || getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &sl) < 0
+            || soerr != 0)
+        {
+            if(soerr)
+                errno = soerr;
+            int e = errno;
+            close(fd);
+            errno = e;
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+
+/// CONTROL CHANNEL ///
+
+bool PosixFTP::Fail(int err)
+{
+    m_err = err ? err : EIO;
+    return false;
+}
+
+bool PosixFTP::Drop(int err)
+{
+    TLS_ONLY(m_ctrlTls.Close(false, 0);)
+    if(m_ctrl >= 0)
+        close(m_ctrl);
+    m_ctrl      = -1;
+    m_connected = false;
+    return Fail(err);
+}
+
+bool PosixFTP::Refused(int code)
+{
+    // 0 means the command was never sent and m_err already says why,
+    // -1 is a dead control connection so the session can't be trusted anymore
+    if(code == 0)
+        return false;
+    if(code < 0)
+        return m_ctrl < 0 ? false : Drop(errno);
+    return Fail(code);
+}
+
+static int ReplyCode(const char* line, size_t len)
+{
+    if(len < 3 || line[0] < '1' || line[0] > '5'
+        || line[1] < '0' || line[1] > '9' || line[2] < '0' || line[2] > '9')
+        return -1;
+    return (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+}
+
+bool PosixFTP::ReadLine(const char** line, size_t* len)
+{
+    for(;;)
+    {
+        char* start = m_rbuf + m_rhead;
+        char* nl    = (char*)memchr(start, '\n', m_rtail - m_rhead);
+
+        if(nl)
+        {
+            size_t n = (size_t)(nl - start);
+            if(n && start[n - 1] == '\r')
+                n--;
+            *line   = start;
+            *len    = n;
+            m_rhead = (size_t)(nl - m_rbuf) + 1;
+            return true;
+        }
+
+        // Compact, then hand back an over-long line as-is rather than allocating
+        if(m_rhead)
+        {
+            memmove(m_rbuf, start, m_rtail - m_rhead);
+            m_rtail -= m_rhead;
+            m_rhead  = 0;
+        }
+        if(m_rtail == sizeof(m_rbuf))
+        {
+            *line   = m_rbuf;
+            *len    = m_rtail;
+            m_rtail = 0;
+            return true;
+        }
+
+        ssize_t n = Recv(m_ctrl, m_rbuf + m_rtail, sizeof(m_rbuf) - m_rtail);
+        if(n > 0)
+        {
+            m_rtail += (size_t)n;
+            continue;
+        }
+        if(n == 0)
+        {
+            errno = ECONNRESET;
+            return false;
+        }
+        if(errno == EINTR)
+            continue;
+        if((errno != EAGAIN && errno != EWOULDBLOCK) || !WaitFd(m_ctrl, POLLIN))
+            return false;
+    }
+}
+
+int PosixFTP::ReadReply()
+{
+    const char* line;
+    size_t len;
+
+    m_textlen = 0;
+    m_text[0] = '\0';
+
+    if(!ReadLine(&line, &len))
+        return -1;
+
+    int code = ReplyCode(line, len);
+    if(code < 0)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    bool multiline = len > 3 && line[3] == '-';
+
+    for(;;)
+    {
+        // Keep as much of the reply text as fits, lines joined with '\n'
+        size_t skip = len >= 4 && ReplyCode(line, len) == code ? 4 : 0;
+        size_t room = sizeof(m_text) - 1 - m_textlen;
+        size_t n    = len - skip;
+        if(m_textlen && room)
+        {
+            m_text[m_textlen++] = '\n';
+            room--;
+        }
+        if(n > room)
+            n = room;
+        memcpy(m_text + m_textlen, line + skip, n);
+        m_textlen += n;
+        m_text[m_textlen] = '\0';
+
+        if(!multiline)
+            break;
+        if(!ReadLine(&line, &len))
+            return -1;
+        if(len >= 4 && line[3] == ' ' && ReplyCode(line, len) == code)
+            multiline = false;
+    }
+
+    return (m_reply = code);
+}
+
+bool PosixFTP::SendCmd(const char* verb, const char* arg)
+{
+    if(m_ctrl < 0)
+        return Fail(ENOTCONN);
+    if(m_stream)
+        return Fail(EBUSY);
+
+    if(arg && strpbrk(arg, "\r\n"))
+        return Fail(EINVAL);
+
+    int n = arg ? snprintf(m_cmd, sizeof(m_cmd), "%s %s\r\n", verb, arg)
+                : snprintf(m_cmd, sizeof(m_cmd), "%s\r\n", verb);
+    if(n < 0 || (size_t)n >= sizeof(m_cmd))
+        return Fail(ENAMETOOLONG);
+
+    if(!SendAll(m_ctrl, m_cmd, (size_t)n))
+        return Drop(errno);
+
+    return true;
+}
+
+int PosixFTP::Exec(const char* verb, const char* arg)
+{
+    TELEMETRY_TRACE(TRACE_COMMAND, TRACE_BEGIN, verb);
+    if(!SendCmd(verb, arg))
+    {
+        TELEMETRY_TRACE(TRACE_COMMAND, TRACE_END, verb, -1);
+        return m_ctrl < 0 ? -1 : 0;
+    }
+
+    int code = ReadReply();
+    if(code < 0)
+        Drop(errno);
+    TELEMETRY_TRACE(TRACE_COMMAND, TRACE_END, verb, code);
+    return code;
+}
+
+// MDTM answers "YYYYMMDDHHMMSS[.sss]" in UTC
+static long long ModTime(const char* text)
+{
+    for(int i = 0; i < 14; i++)
+        if(!isdigit((unsigned char)text[i]))
+            return INVALID_FILE;
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    sscanf(text, "%4d%2d%2d%2d%2d%2d",
+           &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+    tm.tm_year -= 1900;
+    tm.tm_mon  -= 1;
+    return (long long)timegm(&tm);
+}
+
+static long long ReplyValue(const char* verb, const char* text)
+{
+    if(!strcasecmp(verb, "MDTM"))
+        return ModTime(text);
+
+    char* end;
+    long long value = strtoll(text, &end, 10);
+    return end == text || value < 0 ? INVALID_FILE : value;
+}
+
+static void ToMeta(const DirEntry& d, metaentry& e)
+{
+    e.type  = d.type == DIRENT_FILE ? META_FILE : d.type == DIRENT_DIR ? META_DIR : META_OTHER;
+    e.size  = d.size;
+    e.mtime = d.mtime;
+}
+
+bool PosixFTP::Pipeline(const std::vector<pipecmd>& cmds, int* codes, long long* values, TSTR* texts)
+{
+    size_t count = cmds.size();
+    for(size_t i = 0; i < count; i++)
+    {
+        codes[i] = -1;
+        if(values)
+            values[i] = INVALID_FILE;
+        if(texts)
+            texts[i].clear();
+    }
+
+    if(m_ctrl < 0)
+        return Fail(ENOTCONN);
+    if(m_stream)
+        return Fail(EBUSY);
+
+    std::string out;                        // Framed commands not yet written
+    size_t outpos   = 0;
+    size_t next     = 0;                    // Next command to frame
+    size_t flight[FTP_PIPELINE_DEPTH];      // Commands awaiting a reply, oldest at head
+    size_t head     = 0;
+    size_t pending  = 0;
+
+    while(next < count || pending)
+    {
+        while(next < count && pending < FTP_PIPELINE_DEPTH)
+        {
+            const pipecmd& c = cmds[next];
+            int n = c.arg ? snprintf(m_cmd, sizeof(m_cmd), "%s %s\r\n", c.verb, c.arg)
+                          : snprintf(m_cmd, sizeof(m_cmd), "%s\r\n", c.verb);
+            if((c.arg && strpbrk(c.arg, "\r\n")) || n < 0 || (size_t)n >= sizeof(m_cmd))
+            {
+                codes[next++] = 0;
+                continue;
+            }
+            out.append(m_cmd, (size_t)n);
+            flight[(head + pending++) % FTP_PIPELINE_DEPTH] = next++;
+        }
+        if(!pending)
+            break;
+
+        // Write and read together, a server stalled on a full send buffer
+        // stops reading too. Replies already buffered, or decrypted and
+        // waiting in the TLS link, skip the poll.
+        struct pollfd p;
+        p.fd        = m_ctrl;
+        p.events    = POLLIN | (outpos < out.size() ? POLLOUT : 0);
+        p.revents   = 0;
+
+        bool buffered = memchr(m_rbuf + m_rhead, '\n', m_rtail - m_rhead) != NULL
+                        TLS_ONLY(|| m_ctrlTls.Pending());
+        if(!buffered)
+        {
+            int r;
+            do
+                r = poll(&p, 1, m_timeout);
+            while(r < 0 && errno == EINTR);
+            if(r == 0)
+                errno = ETIMEDOUT;
+            if(r <= 0)
+                return Drop(errno);
+        }
+
+        if(p.revents & POLLOUT)
+        {
+            ssize_t n = Send(m_ctrl, out.data() + outpos, out.size() - outpos);
+            if(n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+                return Drop(errno);
+            if(n > 0 && (outpos += (size_t)n) == out.size())
+            {
+                out.clear();
+                outpos = 0;
+            }
+        }
+
+        if(buffered || (p.revents & (POLLIN | POLLERR | POLLHUP)))
+        {
+            int code = ReadReply();
+            if(code < 0)
+                return Drop(errno);
+
+            size_t i = flight[head];
+            head = (head + 1) % FTP_PIPELINE_DEPTH;
+            pending--;
+
+            codes[i] = code;
+            if(values && code == 213)
+                values[i] = ReplyValue(cmds[i].verb, m_text);
+            if(texts)
+                texts[i].assign(m_text, m_textlen);
+        }
+    }
+
+    return true;
+}
+
+
+/// DATA CHANNEL ///
+
+int PosixFTP::OpenData()
+{
+    struct sockaddr_storage addr;
+    memcpy(&addr, &m_peer, m_peerlen);
+
+    int code = 0;
+    if(!m_noEpsv)
+    {
+        code = Exec("EPSV");
+        if(code < 0)
+            return -1;
+        if(code == 229)
+        {
+            // 229 Entering Extended Passive Mode (|||port|)
+            const char* p = strchr(m_text, '(');
+            if(!p || !p[1] || p[1] != p[2] || p[2] != p[3])
+            {
+                Fail(EPROTO);
+                return -1;
+            }
+            int port = atoi(p + 4);
+            if(addr.ss_family == AF_INET6)
+                ((struct sockaddr_in6*)&addr)->sin6_port = htons((uint16_t)port);
+            else
+                ((struct sockaddr_in*)&addr)->sin_port = htons((uint16_t)port);
+        }
+        else if(code >= 500 && code <= 502)
+            m_noEpsv = true;    // Not understood, PASV from here on
+        else
+        {
+            // A transient refusal or a send that failed, EPSV stays on for the next try
+            if(code > 0)
+                Fail(code);
+            return -1;
+        }
+    }
+
+    if(m_noEpsv)
+    {
+        if(addr.ss_family != AF_INET)
+        {
+            Fail(code ? code : EAFNOSUPPORT);
+            return -1;
+        }
+        code = Exec("PASV");
+        if(code != 227)
+        {
+            if(code > 0)
+                Fail(code);
+            return -1;
+        }
+
+        // 227 Entering Passive Mode (h1,h2,h3,h4,p1,p2), the host part is
+        // ignored in favour of the control peer so a server can't bounce us
+        const char* p = m_text;
+        while(*p && (*p < '0' || *p > '9'))
+            p++;
+        unsigned v[6];
+        if(sscanf(p, "%u,%u,%u,%u,%u,%u", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) != 6)
+        {
+            Fail(EPROTO);
+            return -1;
+        }
+        ((struct sockaddr_in*)&addr)->sin_port = htons((uint16_t)(v[4] * 256 + v[5]));
+    }
+
+    int fd = ConnectTo((struct sockaddr*)&addr, m_peerlen);
+    if(fd < 0)
+        Fail(errno);
+    return fd;
+}
+
+int PosixFTP::OpenTransfer(const char* verb, const char* arg, long long offset, bool deflate, long long last)
+{
+    int code;
+    if(deflate != m_modeZ)
+    {
+        code = Exec("MODE", deflate ? "Z" : "S");
+        if(code != 200)
+        {
+            Refused(code);
+            return -1;
+        }
+        m_modeZ = deflate;
+    }
+
+    int data = OpenData();
+    if(data < 0)
+        return -1;
+
+    // REST or RANG has to be the last command before the transfer itself
+    if(last >= 0 || offset > 0)
+    {
+        char rest[64];
+        if(last >= 0)
+            snprintf(rest, sizeof(rest), "%lld %lld", offset, last);
+        else
+            snprintf(rest, sizeof(rest), "%lld", offset);
+        code = Exec(last >= 0 ? "RANG" : "REST", rest);
+        if(code != 350)
+        {
+            close(data);
+            Refused(code);
+            return -1;
+        }
+    }
+
+    code = Exec(verb, arg);
+    if(code < 100 || code >= 200)
+    {
+        close(data);
+        if(code > 0)
+            Refused(code);
+        return -1;
+    }
+
+#if defined(CONNSTREAM_TLS)
+    // The server starts TLS once it has taken the command, offering it the
+    // control connection's session makes this handshake an abbreviated one
+    if(m_private)
+    {
+        if(!m_dataTls.Handshake(m_tls, data, m_timeout, &m_ctrlTls, m_host.c_str()))
+        {
+            // The server fails the transfer over it, keep the replies in step
+            int err = errno;
+            close(data);
+            if(ReadReply() < 0)
+                Drop(errno);
+            else
+                Fail(err);
+            return -1;
+        }
+        m_tlsStats.handshakes++;
+        m_tlsStats.resumed      += m_dataTls.Resumed();
+        m_tlsStats.kernelSend   += m_dataTls.KernelSend();
+        m_tlsStats.kernelRecv   += m_dataTls.KernelRecv();
+    }
+#endif
+
+#if defined(CONNSTREAM_TELEMETRY)
+    // A read's first byte is when the server starts sending, only worth
+    // waiting on when someone is listening
+    m_telemetry.Begin();
+    if(telemetry::Tracing())
+    {
+        if(strcmp(verb, "STOR") && strcmp(verb, "APPE"))
+            WaitFd(data, POLLIN);
+        telemetry::Trace(TRACE_FIRST_BYTE, TRACE_MARK, this, verb);
+    }
+#endif
+    return data;
+}
+
+void PosixFTP::TransferDone()
+{
+    TELEMETRY_TRACE(TRACE_LAST_BYTE, TRACE_MARK, NULL);
+    TELEMETRY_ONLY(m_telemetry.End();)
+}
+
+bool PosixFTP::CloseTransfer(int data, int err)
+{
+    CloseData(data, !err);
+    TransferDone();
+
+    int code = ReadReply();
+    if(code < 0)
+        return Drop(errno);
+    if(code >= 300)
+        return Fail(code);
+    if(err)
+        return Fail(err);
+
+    m_err = 0;
+    return true;
+}
+
+bool PosixFTP::ListData(const char* verb, const char* arg, std::string& out)
+{
+    out.clear();
+
+    int data = OpenTransfer(verb, arg);
+    if(data < 0)
+        return false;
+
+    char buf[FTP_DATA_BUFSIZE];
+    int err = 0;
+    for(;;)
+    {
+        ssize_t n = Recv(data, buf, sizeof(buf));
+        if(n > 0)
+        {
+            out.append(buf, (size_t)n);
+            continue;
+        }
+        if(n == 0)
+            break;
+        if(errno == EINTR)
+            continue;
+        if((errno != EAGAIN && errno != EWOULDBLOCK) || !WaitFd(data, POLLIN))
+        {
+            err = errno;
+            break;
+        }
+    }
+
+    return CloseTransfer(data, err);
+}
+
+
+long long PosixFTP::AnnouncedSize()
+{
+    // 150 Opening BINARY mode data connection for file (1234 bytes)
+    const char* p = strrchr(m_text, '(');
+    if(!p)
+        return INVALID_FILE;
+
+    char* end;
+    long long size = strtoll(p + 1, &end, 10);
+    return end != p + 1 && !strncmp(end, " bytes", 6) ? size : INVALID_FILE;
+}
+
+int PosixFTP::SendFileZeroCopy(int fd, int data)
+{
+    // sendfile has no MSG_NOSIGNAL, hold SIGPIPE on this thread and swallow
+    // the one a vanished peer raises rather than touching the process handler
+    sigset_t pipe, old;
+    sigemptyset(&pipe);
+    sigaddset(&pipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe, &old);
+
+    // A scheduled session goes a grant at a time so others can cut in
+    size_t chunk = m_sched ? SCHED_QUANTUM : FTP_ZEROCOPY_CHUNK;
+    int err = 0;
+    for(;;)
+    {
+        ssize_t n = sendfile(data, fd, NULL, chunk);
+        if(n > 0)
+        {
+            Pace((size_t)n);
+            continue;
+        }
+        if(n == 0)
+            break;
+        if(errno == EINTR)
+            continue;
+        if((errno == EAGAIN || errno == EWOULDBLOCK) && WaitFd(data, POLLOUT))
+            continue;
+        err = errno;
+        break;
+    }
+
+    if(err == EPIPE && !sigismember(&old, SIGPIPE))
+    {
+        struct timespec zero = { 0, 0 };
+        while(sigtimedwait(&pipe, NULL, &zero) < 0 && errno == EINTR)
+            ;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return err;
+}
+
+int PosixFTP::SendFromFile(int fd, int data)
+{
+    bool hashing = m_sum.Algorithm() != CHECKSUM_NONE;
+    if(m_engine && !m_sched && Offload(data, true))
+    {
+        long long moved = 0;
+        int err = m_engine->SendFile(fd, data, m_timeout, &moved, hashing ? &m_sum : NULL);
+        if(moved || (err != ENOSYS && err != EINVAL && err != EOPNOTSUPP))
+            return err;
+    }
+
+    // sendfile(2) moves page cache pages straight to the socket, the file
+    // offset advances with it so the buffered loop can pick up anywhere.
+    // Hashing needs to see the bytes, so it always takes the buffered loop,
+    // as does TLS the kernel isn't doing.
+    if(m_zeroCopy && !hashing && Offload(data, true))
+    {
+        int err = SendFileZeroCopy(fd, data);
+        if(err != EINVAL && err != ENOSYS && err != EOPNOTSUPP)
+            return err;
+    }
+
+    char buf[FTP_DATA_BUFSIZE];
+    for(;;)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return n < 0 ? errno : 0;
+        if(!SendAll(data, buf, (size_t)n))
+            return errno;
+        m_sum.Update(buf, (size_t)n);
+        Pace((size_t)n);
+    }
+}
+
+int PosixFTP::WriteAll(int fd, const char* buf, size_t len)
+{
+    while(len)
+    {
+        ssize_t w = write(fd, buf, len);
+        if(w < 0 && errno == EINTR)
+            continue;
+        if(w < 0)
+            return errno;
+        buf += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+int PosixFTP::RecvToFile(int data, int fd)
+{
+    // The engine's plain recv can't take the alert that ends a TLS stream
+    bool hashing = m_sum.Algorithm() != CHECKSUM_NONE;
+    if(m_engine && !m_sched TLS_ONLY(&& !m_dataTls.Active()))
+    {
+        long long moved = 0;
+        int err = m_engine->RecvFile(data, fd, m_timeout, &moved, hashing ? &m_sum : NULL);
+        if(moved || (err != ENOSYS && err != EINVAL && err != EOPNOTSUPP))
+            return err;
+    }
+
+    char buf[FTP_DATA_BUFSIZE];
+
+    // splice(2) socket -> pipe -> file keeps the payload in kernel pages,
+    // the pipe is created once per session and reused
+    if(m_zeroCopy && m_pipe[0] < 0 && pipe2(m_pipe, O_CLOEXEC | O_NONBLOCK) == 0)
+        fcntl(m_pipe[1], F_SETPIPE_SZ, FTP_PIPE_SIZE);
+
+    bool spliced = m_zeroCopy && !hashing && m_pipe[0] >= 0 && Offload(data, false);
+    while(spliced)
+    {
+        ssize_t n = splice(data, NULL, m_pipe[1], NULL, m_sched ? SCHED_QUANTUM : FTP_PIPE_SIZE,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n == 0)
+            return 0;
+        if(n > 0)
+            Pace((size_t)n);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if(!WaitFd(data, POLLIN))
+                    return errno;
+                continue;
+            }
+            if(errno != EINVAL && errno != ENOSYS)
+                return errno;
+            break;
+        }
+
+        while(n > 0)
+        {
+            ssize_t w = splice(m_pipe[0], NULL, fd, NULL, (size_t)n, SPLICE_F_MOVE);
+            if(w > 0)
+            {
+                n -= w;
+                continue;
+            }
+            if(w < 0 && errno == EINTR)
+                continue;
+            if(w == 0 || (errno != EINVAL && errno != ENOSYS))
+                return w == 0 ? EIO : errno;
+
+            // The destination refuses splice, drain what is queued and fall back
+            spliced = false;
+            while(n > 0)
+            {
+                ssize_t r = read(m_pipe[0], buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf));
+                if(r < 0 && errno == EINTR)
+                    continue;
+                if(r <= 0)
+                    return r < 0 ? errno : EIO;
+                int err = WriteAll(fd, buf, (size_t)r);
+                if(err)
+                    return err;
+                n -= r;
+            }
+        }
+    }
+
+    for(;;)
+    {
+        ssize_t n = Recv(data, buf, sizeof(buf));
+        if(n > 0)
+        {
+            m_sum.Update(buf, (size_t)n);
+            int err = WriteAll(fd, buf, (size_t)n);
+            if(err)
+                return err;
+            Pace((size_t)n);
+            continue;
+        }
+        if(n == 0)
+            return 0;
+        if(errno == EINTR)
+            continue;
+        if((errno != EAGAIN && errno != EWOULDBLOCK) || !WaitFd(data, POLLIN))
+            return errno;
+    }
+}
+
+int PosixFTP::SendDeflated(int fd, int data)
+{
+    // This thread reads the file and feeds the socket while the pipe
+    // thread deflates the chunk in between
+    codecpipe pipe(codec::Create(CODEC_DEFLATE, true, m_level));
+    std::string block;
+    char buf[FTP_DATA_BUFSIZE];
+    for(;;)
+    {
+        int r = pipe.Pop(block);
+        if(r == CODEC_END)
+            return 0;
+        if(r == CODEC_FAILED)
+            return pipe.GetLastError();
+        if(r == CODEC_DATA)
+        {
+            if(!SendAll(data, block.data(), block.size()))
+                return errno;
+            Pace(block.size());
+            continue;
+        }
+
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return errno;
+        if(n == 0)
+            pipe.Finish();
+        else
+        {
+            m_sum.Update(buf, (size_t)n);
+            pipe.Push(buf, (size_t)n);
+        }
+    }
+}
+
+int PosixFTP::RecvInflated(int data, int fd)
+{
+    codecpipe pipe(codec::Create(CODEC_DEFLATE, false));
+    std::string block;
+    char buf[FTP_DATA_BUFSIZE];
+    for(;;)
+    {
+        int r = pipe.Pop(block);
+        if(r == CODEC_END)
+            return 0;
+        if(r == CODEC_FAILED)
+            return pipe.GetLastError();
+        if(r == CODEC_DATA)
+        {
+            m_sum.Update(block.data(), block.size());
+            int err = WriteAll(fd, block.data(), block.size());
+            if(err)
+                return err;
+            continue;
+        }
+
+        ssize_t n = Recv(data, buf, sizeof(buf));
+        if(n > 0)
+        {
+            pipe.Push(buf, (size_t)n);
+            Pace((size_t)n);
+        }
+        else if(n == 0)
+            pipe.Finish();
+        else if(errno != EINTR
+            && ((errno != EAGAIN && errno != EWOULDBLOCK) || !WaitFd(data, POLLIN)))
+            return errno;
+    }
+}
+
+
+/// CONNECTION METHODS ///
+
+bool PosixFTP::Connect(TSTR lpszServerName, TSTR lpszUser, TSTR lpszPassword, int port)
+{
+    TELEMETRY_SCOPE(TELEMETRY_CONNECT);
+    if(m_connected)
+        Disconnect();
+
+    m_host      = lpszServerName;
+    m_user      = lpszUser;
+    m_pwd       = lpszPassword;
+    m_port      = port;
+    m_feat      = 0;
+    m_noEpsv    = false;
+    m_hashAlgs.clear();
+    m_hashSel   = CHECKSUM_NONE;
+    m_modeZ     = false;
+    m_rhead     = 0;
+    m_rtail     = 0;
+    m_cwd.clear();
+#if defined(CONNSTREAM_TLS)
+    m_private   = false;
+    memset(&m_tlsStats, 0, sizeof(m_tlsStats));
+#endif
+
+    char site[32];
+    snprintf(site, sizeof(site), ":%d", port ? port : FTP_DEFAULT_PORT);
+    m_site = (lpszUser.empty() ? TSTR(_T("anonymous")) : lpszUser) + _T("@") + lpszServerName + site;
+    m_flow.SetHost(lpszServerName + site);
+    TELEMETRY_ONLY(m_telemetry.SetName(m_site);)
+    TELEMETRY_SPAN(TRACE_CONNECT, m_site.c_str());
+
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family     = AF_UNSPEC;
+    hints.ai_socktype   = SOCK_STREAM;
+
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port ? port : FTP_DEFAULT_PORT);
+
+    int gai = getaddrinfo(lpszServerName.c_str(), service, &hints, &res);
+    if(gai != 0)
+        return Fail(gai == EAI_SYSTEM ? errno : EHOSTUNREACH);
+
+    for(struct addrinfo* ai = res; ai && m_ctrl < 0; ai = ai->ai_next)
+    {
+        m_ctrl = ConnectTo(ai->ai_addr, ai->ai_addrlen);
+        if(m_ctrl >= 0)
+        {
+            memcpy(&m_peer, ai->ai_addr, ai->ai_addrlen);
+            m_peerlen = ai->ai_addrlen;
+        }
+    }
+    freeaddrinfo(res);
+
+    if(m_ctrl < 0)
+        return Fail(errno);
+
+    int one = 1;
+    setsockopt(m_ctrl, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // 120 means the server wants us to wait for its 220
+    int code;
+    do
+        code = ReadReply();
+    while(code == 120);
+    if(code != 220)
+        return Drop(code < 0 ? errno : code);
+
+#if defined(CONNSTREAM_TLS)
+    // RFC 4217: nothing past the greeting, the login least of all, goes in
+    // cleartext, so a server without AUTH TLS fails the connect. Bytes that
+    // came in behind the 234 were never encrypted and can't be trusted.
+    if(m_tls)
+    {
+        code = Exec("AUTH", "TLS");
+        if(code != 234)
+            return Drop(code > 0 ? code : m_err);
+        if(m_rhead != m_rtail)
+            return Drop(EPROTO);
+        if(!m_ctrlTls.Handshake(m_tls, m_ctrl, m_timeout, NULL, lpszServerName.c_str()))
+            return Drop(errno);
+    }
+#endif
+
+    code = Exec("USER", lpszUser.empty() ? "anonymous" : lpszUser.c_str());
+    if(code == 331)
+        code = Exec("PASS", lpszPassword.c_str());
+    if(code != 230 && code != 202)
+        return Drop(code > 0 ? code : m_err);
+
+#if defined(CONNSTREAM_TLS)
+    if(m_tls && m_protect)
+    {
+        code = Exec("PBSZ", "0");
+        if(code == 200)
+            code = Exec("PROT", "P");
+        if(code != 200)
+            return Drop(code > 0 ? code : m_err);
+        m_private = true;
+    }
+#endif
+
+    m_connected = true;
+
+    // FEAT is optional, a server without it gets the RFC 959 subset
+    if(Exec("FEAT") == 211)
+    {
+        for(const char* p = m_text; *p; )
+        {
+            const char* e = strchr(p, '\n');
+            size_t n = e ? (size_t)(e - p) : strlen(p);
+            while(n && *p == ' ')
+                p++, n--;
+
+            if(n >= 4 && !strncasecmp(p, "EPSV", 4))
+                m_feat |= FTP_FEAT_EPSV;
+            else if(n >= 4 && !strncasecmp(p, "SIZE", 4))
+                m_feat |= FTP_FEAT_SIZE;
+            else if(n >= 4 && !strncasecmp(p, "MDTM", 4))
+                m_feat |= FTP_FEAT_MDTM;
+            else if(n >= 11 && !strncasecmp(p, "REST STREAM", 11))
+                m_feat |= FTP_FEAT_REST;
+            else if(n >= 4 && !strncasecmp(p, "MLST", 4))
+                m_feat |= FTP_FEAT_MLST;
+            else if(n >= 4 && !strncasecmp(p, "UTF8", 4))
+                m_feat |= FTP_FEAT_UTF8;
+            else if(n >= 6 && !strncasecmp(p, "MODE Z", 6))
+                m_feat |= FTP_FEAT_MODEZ;
+            else if(n >= 11 && !strncasecmp(p, "RANG STREAM", 11))
+                m_feat |= FTP_FEAT_RANG;
+            else if(n > 5 && !strncasecmp(p, "HASH ", 5))
+            {
+                // The algorithm HASH uses right now carries a '*'
+                m_feat |= FTP_FEAT_HASH;
+                m_hashAlgs.assign(p + 5, n - 5);
+                size_t star = m_hashAlgs.find('*');
+                if(star != TSTR::npos)
+                {
+                    size_t from = m_hashAlgs.rfind(';', star);
+                    from = from == TSTR::npos ? 0 : from + 1;
+                    m_hashSel = checksum::Parse(m_hashAlgs.substr(from, star - from).c_str());
+                }
+            }
+
+            p += n;
+            if(*p == '\n')
+                p++;
+        }
+    }
+    if(!m_connected)
+        return false;
+
+    code = Exec("TYPE", "I");
+    if(code != 200)
+        return Drop(code > 0 ? code : m_err);
+
+    m_err = 0;
+    return true;
+}
+
+bool PosixFTP::Disconnect()
+{
+    TELEMETRY_SCOPE(TELEMETRY_DISCONNECT);
+    DetachStream();
+
+    if(m_ctrl >= 0)
+    {
+        // Best effort, the server may already have gone
+        if(m_connected && SendCmd("QUIT", NULL))
+            ReadReply();
+        TLS_ONLY(m_ctrlTls.Close(m_ctrl >= 0, m_timeout);)
+        if(m_ctrl >= 0)
+            close(m_ctrl);
+        m_ctrl = -1;
+    }
+    m_pwd.clear();
+
+    bool was     = m_connected;
+    m_connected  = false;
+    m_err        = was ? 0 : ENOTCONN;
+    return was;
+}
+
+
+/// GET/PUSH METHODS ///
+
+bool PosixFTP::Upload(TSTR lpszLocation, TSTR lpszRemFile)
+{
+    TELEMETRY_SCOPE(TELEMETRY_UPLOAD);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    int fd = open(lpszLocation.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return Fail(errno);
+
+    const TSTR& remote = lpszRemFile.empty() ? lpszLocation : lpszRemFile;
+    TSTR key;
+    bool cached = CacheKey(remote, key);
+
+    m_digest.clear();
+    m_sum.Reset();
+
+    struct stat st;
+    long long size = fstat(fd, &st) == 0 ? (long long)st.st_size : INVALID_FILE;
+
+    memset(&m_deltaStats, 0, sizeof(m_deltaStats));
+    m_deltaStats.size = size;
+
+    int delta = m_delta ? UploadDelta(fd, lpszLocation, remote) : -1;
+    bool ok = delta > 0;
+    if(delta < 0)
+    {
+        memset(&m_deltaStats, 0, sizeof(m_deltaStats));
+        m_deltaStats.size = size;
+
+        // The journal entry pins the local file, a match means the remote
+        // copy is a prefix of it from an earlier attempt
+        long long offset = 0;
+        TSTR journal;
+        if(m_retries && !m_journal.empty())
+        {
+            journal = JournalPath(true, remote, lpszLocation);
+            offset  = Checkpoint(journal, size, size >= 0 ? (long long)st.st_mtime : INVALID_FILE, Probe("SIZE", remote));
+        }
+
+        bool deflate = m_compress && (m_feat & FTP_FEAT_MODEZ);
+        long long from = offset;
+        ok = Rehash(fd, offset) && Push(fd, remote, offset, deflate);
+        int attempt = 0;
+        while(!ok && Resumable(attempt))
+        {
+            // A failed STOR may still have left part of the file behind,
+            // SIZE says how much so APPE only sends the rest
+            long long have = Probe("SIZE", remote);
+            offset = have > 0 && have <= size ? have : 0;
+            ok = Rehash(fd, offset) && Push(fd, remote, offset, deflate);
+        }
+
+        if(ok)
+        {
+            m_deltaStats.sent   = size - from;
+            m_deltaStats.ranges = 1;
+            if(m_sum.Algorithm() != CHECKSUM_NONE)
+                m_digest = m_sum.Hex();
+            if(!journal.empty())
+                unlink(journal.c_str());
+        }
+    }
+
+    if(cached)
+        CacheChanged(key, ok ? META_FILE : -1, size);
+    if(ok && m_sumVerify)
+        ok = VerifyChecksum(remote);
+
+    // The signature is for whoever downloads next, failing to leave it
+    // doesn't fail the upload
+    if(ok && m_delta)
+    {
+        PublishSig(fd, lpszLocation, remote);
+        m_err = 0;
+    }
+    close(fd);
+    TELEMETRY_ONLY(m_telemetry.Bytes(m_deltaStats.sent);)
+    return ok;
+}
+
+bool PosixFTP::Download(TSTR lpszLocation, TSTR lpszRemName)
+{
+    TELEMETRY_SCOPE(TELEMETRY_DOWNLOAD);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    const TSTR& local = lpszRemName.empty() ? lpszLocation : lpszRemName;
+
+    m_digest.clear();
+    m_sum.Reset();
+    memset(&m_deltaStats, 0, sizeof(m_deltaStats));
+
+    if(m_delta)
+    {
+        int delta = DownloadDelta(lpszLocation, local);
+        TELEMETRY_ONLY(m_telemetry.Bytes(m_deltaStats.sent);)
+        if(delta >= 0)
+            return delta > 0 && (!m_sumVerify || VerifyChecksum(lpszLocation));
+        m_digest.clear();
+        m_sum.Reset();
+        memset(&m_deltaStats, 0, sizeof(m_deltaStats));
+    }
+
+    // A journal entry for the same remote file means whatever is already
+    // at @local came from an earlier attempt and only the tail is missing
+    long long offset = 0;
+    TSTR journal;
+    if(m_retries && !m_journal.empty() && (m_feat & FTP_FEAT_REST))
+    {
+        struct stat st;
+        long long size  = Probe("SIZE", lpszLocation);
+        long long mtime = Probe("MDTM", lpszLocation);
+        journal = JournalPath(false, lpszLocation, local);
+        offset  = Checkpoint(journal, size, mtime, stat(local.c_str(), &st) == 0 ? (long long)st.st_size : 0);
+    }
+
+    int fd = open(local.c_str(), O_RDWR | O_CREAT | (offset ? 0 : O_TRUNC) | O_CLOEXEC, 0644);
+    if(fd < 0)
+        return Fail(errno);
+
+    bool deflate = m_compress && (m_feat & FTP_FEAT_MODEZ);
+    long long from = offset;
+    bool ok = Rehash(fd, offset) && Fetch(lpszLocation, fd, offset, deflate);
+    int attempt = 0;
+    while(!ok && Resumable(attempt))
+    {
+        // The file position is the end of what landed in order, anything
+        // past it (a split write, io_uring's ring) is fetched again
+        offset = (m_feat & FTP_FEAT_REST) ? (long long)lseek(fd, 0, SEEK_CUR) : 0;
+        if(offset < 0 || ftruncate(fd, (off_t)offset) < 0)
+            offset = 0;
+        ok = Rehash(fd, offset) && Fetch(lpszLocation, fd, offset, deflate);
+    }
+
+    struct stat st;
+    if(ok && fstat(fd, &st) == 0)
+    {
+        m_deltaStats.size   = (long long)st.st_size;
+        m_deltaStats.sent   = (long long)st.st_size - from;
+        m_deltaStats.ranges = 1;
+    }
+    else if(!ok && m_retries)
+    {
+        // Leave only the bytes known good for the next call to pick up from
+        off_t end = lseek(fd, 0, SEEK_CUR);
+        if(end >= 0)
+            ftruncate(fd, end);
+    }
+    if(close(fd) < 0 && ok)
+        ok = Fail(errno);
+    TELEMETRY_ONLY(m_telemetry.Bytes(m_deltaStats.sent);)
+
+    if(!ok)
+        return false;
+    if(!journal.empty())
+        unlink(journal.c_str());
+    if(m_sum.Algorithm() == CHECKSUM_NONE)
+        return true;
+    m_digest = m_sum.Hex();
+    return !m_sumVerify || VerifyChecksum(lpszLocation);
+}
+
+// The first whitespace separated token of @text that is @len hex digits
+static TSTR HexToken(const char* text, size_t len)
+{
+    for(const char* p = text; *p; )
+    {
+        while(*p && isspace((unsigned char)*p))
+            p++;
+        const char* start = p;
+        while(*p && isxdigit((unsigned char)*p))
+            p++;
+        if((size_t)(p - start) == len && (!*p || isspace((unsigned char)*p)))
+            return TSTR(start, len);
+        while(*p && !isspace((unsigned char)*p))
+            p++;
+    }
+    return TSTR();
+}
+
+bool PosixFTP::HashOffered(int alg)
+{
+    if(!(m_feat & FTP_FEAT_HASH))
+        return false;
+
+    for(size_t at = 0; at < m_hashAlgs.size(); )
+    {
+        size_t end = m_hashAlgs.find(';', at);
+        if(end == TSTR::npos)
+            end = m_hashAlgs.size();
+        TSTR entry = m_hashAlgs.substr(at, end - at);
+        if(!entry.empty() && entry[entry.size() - 1] == '*')
+            entry.erase(entry.size() - 1);
+        if(checksum::Parse(entry.c_str()) == alg)
+            return true;
+        at = end + 1;
+    }
+    return false;
+}
+
+bool PosixFTP::SelectHash(int alg)
+{
+    if(m_hashSel == alg)
+        return true;
+
+    TSTR opt = TSTR("HASH ") + checksum::Name(alg);
+    int code = Exec("OPTS", opt.c_str());
+    if(code != 200)
+        return code >= 500 ? Fail(EOPNOTSUPP) : Refused(code);
+    m_hashSel = alg;
+    return true;
+}
+
+bool PosixFTP::RemoteDigest(const TSTR& remote, int alg, TSTR& hex)
+{
+    // HASH (draft-bryan-ftpext-hash) when the server offers the algorithm,
+    // otherwise the older XCRC/XMD5 which only ever cover CRC32 and MD5
+    int code;
+    if(HashOffered(alg))
+    {
+        if(!SelectHash(alg))
+            return false;
+        code = Exec("HASH", remote.c_str());
+        if(code != 213)
+            return code == 500 || code == 502 || code == 504 ? Fail(EOPNOTSUPP) : Refused(code);
+    }
+    else if(alg == CHECKSUM_CRC32 || alg == CHECKSUM_MD5)
+    {
+        code = Exec(alg == CHECKSUM_CRC32 ? "XCRC" : "XMD5", remote.c_str());
+        if(code < 200 || code >= 300)
+            return code == 500 || code == 502 ? Fail(EOPNOTSUPP) : Refused(code);
+    }
+    else
+        return Fail(EOPNOTSUPP);
+
+    // "213 SHA-256 0-1234 <hex> name" or "250 <hex>", the path may hold
+    // anything so take the first token that looks like the digest
+    hex = HexToken(m_text, checksum(alg).Hex().size());
+    return !hex.empty() || Fail(EPROTO);
+}
+
+bool PosixFTP::VerifyChecksum(const TSTR& remote)
+{
+    TSTR theirs;
+    if(!RemoteDigest(remote, m_sum.Algorithm(), theirs))
+        return false;
+    if(strcasecmp(theirs.c_str(), m_digest.c_str()))
+        return Fail(EBADMSG);
+    return true;
+}
+
+
+/// STREAMING METHODS ///
+
+class ftpstream : public streamhandle
+{
+    public:
+        ftpstream(PosixFTP* owner, int data, bool reading)
+        {
+            m_owner = owner;
+            m_data  = data;
+            m_read  = reading;
+            m_eof   = false;
+            m_err   = 0;
+            TELEMETRY_ONLY(m_counted = false;)
+        }
+        ~ftpstream()
+        {
+            if(m_owner)
+                m_owner->EndStream(this);
+        }
+
+        long long Read(char* buf, size_t len)
+        {
+            if(!m_owner || !m_read)
+                return Fail(m_owner ? EBADF : ENOTCONN);
+            if(m_eof)
+                return 0;
+
+            for(;;)
+            {
+                ssize_t n = m_owner->Recv(m_data, buf, len);
+                if(n >= 0)
+                {
+                    m_eof = n == 0;
+                    TELEMETRY_ONLY(if(m_counted) m_owner->m_telemetry.Bytes(n);)
+                    if(n)
+                        m_owner->Pace((size_t)n);
+                    return n;
+                }
+                if(errno == EINTR)
+                    continue;
+                if((errno != EAGAIN && errno != EWOULDBLOCK) || !m_owner->WaitFd(m_data, POLLIN))
+                    return Fail(errno);
+            }
+        }
+
+        long long Write(const char* buf, size_t len)
+        {
+            if(!m_owner || m_read)
+                return Fail(m_owner ? EBADF : ENOTCONN);
+            if(!m_owner->SendAll(m_data, buf, len))
+                return Fail(errno);
+            TELEMETRY_ONLY(if(m_counted) m_owner->m_telemetry.Bytes((long long)len);)
+            m_owner->Pace(len);
+            return (long long)len;
+        }
+
+        bool Close()
+        {
+            if(!m_owner)
+                return m_err == 0;
+            return m_owner->EndStream(this);
+        }
+
+        int GetHandle()
+        {
+            return m_data;
+        }
+
+        int GetLastError()
+        {
+            return m_err;
+        }
+
+    private:
+        friend class PosixFTP;
+
+        long long Fail(int err)
+        {
+            m_err = err ? err : EIO;
+            return -1;
+        }
+
+        PosixFTP*   m_owner;
+        int         m_data;
+        bool        m_read;
+        bool        m_eof;
+        int         m_err;
+        TELEMETRY_ONLY(bool m_counted;)     // A caller's stream, internal ones count themselves
+};
+
+datastream PosixFTP::OpenRead(TSTR lpszLocation, long long offset)
+{
+    TELEMETRY_SCOPE(TELEMETRY_OPENREAD);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return datastream();
+    }
+
+    int data = OpenTransfer("RETR", lpszLocation.c_str(), offset);
+    if(data < 0)
+        return datastream();
+
+    m_err = 0;
+    m_stream = new ftpstream(this, data, true);
+    TELEMETRY_ONLY(m_stream->m_counted = true;)
+    return datastream(m_stream);
+}
+
+datastream PosixFTP::OpenWrite(TSTR lpszLocation, bool append)
+{
+    TELEMETRY_SCOPE(TELEMETRY_OPENWRITE);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return datastream();
+    }
+
+    TSTR key;
+    if(CacheKey(lpszLocation, key))
+        CacheChanged(key, -1);
+
+    int data = OpenTransfer(append ? "APPE" : "STOR", lpszLocation.c_str());
+    if(data < 0)
+        return datastream();
+    m_streamKey = key;
+
+    m_err = 0;
+    m_stream = new ftpstream(this, data, false);
+    TELEMETRY_ONLY(m_stream->m_counted = true;)
+    return datastream(m_stream);
+}
+
+bool PosixFTP::EndStream(ftpstream* s)
+{
+    int data    = s->m_data;
+    s->m_owner  = NULL;
+    s->m_data   = -1;
+    m_stream    = NULL;
+
+    if(!s->m_read && !m_streamKey.empty())
+    {
+        // Other sessions sharing the cache may have sized the file mid-write
+        CacheChanged(m_streamKey, -1);
+        m_streamKey.clear();
+    }
+
+    if(!s->m_read || s->m_eof)
+    {
+        bool ok  = CloseTransfer(data, s->m_err);
+        s->m_err = ok ? 0 : m_err;
+        return ok;
+    }
+
+    // Abort: drop our end so the server stops sending, then ABOR. The server
+    // answers the transfer (426, or 226 if it had already finished) and the ABOR.
+    CloseData(data, false);
+    TransferDone();
+
+    int code = SendCmd("ABOR", NULL) ? ReadReply() : -1;
+    if(code > 0)
+        code = ReadReply();
+    if(code < 0)
+    {
+        Refused(m_ctrl < 0 ? 0 : -1);
+        s->m_err = m_err;
+        return false;
+    }
+
+    s->m_err = code >= 400 ? code : 0;
+    return code >= 400 ? Fail(code) : !(m_err = 0);
+}
+
+void PosixFTP::DetachStream()
+{
+    if(!m_stream)
+        return;
+
+    // The session is going away under an open stream, leave it closed and failed
+    if(m_stream->m_data >= 0)
+    {
+        CloseData(m_stream->m_data, false);
+        TransferDone();
+    }
+    m_stream->m_data    = -1;
+    m_stream->m_owner   = NULL;
+    m_stream->m_err     = ENOTCONN;
+    m_stream            = NULL;
+}
+
+
+/// RESUME ///
+
+bool PosixFTP::Fetch(const TSTR& remote, int fd, long long offset, bool deflate)
+{
+    if(lseek(fd, (off_t)offset, SEEK_SET) < 0)
+        return Fail(errno);
+
+    int data = OpenTransfer("RETR", remote.c_str(), offset, deflate);
+    if(data < 0)
+        return false;
+
+    // Reserve the blocks up front when the 150 reply announced a size,
+    // KEEP_SIZE leaves the length honest if the transfer dies part way
+    long long size = AnnouncedSize();
+    if(size > 0)
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)size);
+
+    int err = deflate ? RecvInflated(data, fd) : RecvToFile(data, fd);
+    return CloseTransfer(data, err);
+}
+
+bool PosixFTP::Push(int fd, const TSTR& remote, long long offset, bool deflate)
+{
+    if(lseek(fd, (off_t)offset, SEEK_SET) < 0)
+        return Fail(errno);
+
+    int data = OpenTransfer(offset ? "APPE" : "STOR", remote.c_str(), 0, deflate);
+    if(data < 0)
+        return false;
+
+    int err = deflate ? SendDeflated(fd, data) : SendFromFile(fd, data);
+    return CloseTransfer(data, err);
+}
+
+bool PosixFTP::Resumable(int& attempt)
+{
+    if(!m_retries)
+        return false;
+
+    // Lost connections and the server's own transient replies, a 550 or a
+    // full disk is the same answer however often it's asked
+    switch(m_ctrl < 0 ? ECONNRESET : m_err)
+    {
+        case 421: case 425: case 426: case 450: case 451:
+        case ECONNRESET: case ECONNABORTED: case ECONNREFUSED: case EPIPE:
+        case ETIMEDOUT: case ENOTCONN: case EHOSTUNREACH: case ENETUNREACH:
+        case ENETDOWN: case EPROTO:
+            break;
+        default:
+            return false;
+    }
+
+    int err = m_err;
+    while(attempt < m_retries)
+    {
+        // Exponential with up to half again of jitter, so sessions cut off
+        // together don't all come back in the same instant
+        long long ms = (long long)FTP_RESUME_BACKOFF << (attempt < 6 ? attempt : 6);
+        if(ms > FTP_RESUME_BACKOFF_MAX)
+            ms = FTP_RESUME_BACKOFF_MAX;
+        ms += (long long)(rand() % (int)(ms / 2 + 1));
+        attempt++;
+
+        struct timespec ts;
+        ts.tv_sec   = (time_t)(ms / 1000);
+        ts.tv_nsec  = (long)(ms % 1000) * 1000000L;
+        while(nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+
+        if(m_ctrl >= 0)
+            return true;
+
+        // A fresh login starts at the home directory, put the session back
+        // where the caller left it
+        TSTR cwd = m_cwd;
+        if(Connect(m_host, m_user, m_pwd, m_port) && (cwd.empty() || ChangeDir(cwd)))
+            return true;
+        if(m_ctrl >= 0 && m_err >= 500 && m_err < 600)
+            break;
+    }
+
+    if(!m_err)
+        m_err = err;
+    return false;
+}
+
+bool PosixFTP::Rehash(int fd, long long offset)
+{
+    // The running checksum must cover the whole file, not just this attempt
+    m_sum.Reset();
+    if(m_sum.Algorithm() == CHECKSUM_NONE)
+        return true;
+
+    char buf[FTP_DATA_BUFSIZE];
+    for(long long at = 0; at < offset; )
+    {
+        size_t want = offset - at < (long long)sizeof(buf) ? (size_t)(offset - at) : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, (off_t)at);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return Fail(n < 0 ? errno : EIO);
+        m_sum.Update(buf, (size_t)n);
+        at += n;
+    }
+    return true;
+}
+
+long long PosixFTP::Probe(const char* verb, const TSTR& path)
+{
+    // Straight to the server, a cached size is exactly what can't be trusted
+    // after a transfer broke off
+    return Exec(verb, path.c_str()) == 213 ? ReplyValue(verb, m_text) : INVALID_FILE;
+}
+
+TSTR PosixFTP::JournalPath(bool upload, const TSTR& remote, const TSTR& local)
+{
+    TSTR path = local;
+    char cwd[PATH_MAX];
+    if((path.empty() || path[0] != '/') && getcwd(cwd, sizeof(cwd)))
+        path = TSTR(cwd) + "/" + local;
+
+    TSTR key = TSTR(upload ? "U" : "D") + m_site + "\n" + m_cwd + "\n" + remote + "\n" + path;
+    checksum sum(CHECKSUM_XXH64);
+    sum.Update(key.data(), key.size());
+    return m_journal + "/" + sum.Hex() + ".ckpt";
+}
+
+long long PosixFTP::Checkpoint(const TSTR& path, long long size, long long mtime, long long have)
+{
+    // Without a size there's nothing to tell a prefix from a different file
+    if(size < 0)
+    {
+        unlink(path.c_str());
+        return 0;
+    }
+
+    long long offset = 0;
+    FILE* f = fopen(path.c_str(), "re");
+    if(f)
+    {
+        long long was, wasTime;
+        if(fscanf(f, "connstream-checkpoint %lld %lld", &was, &wasTime) == 2
+            && was == size && wasTime == mtime && have > 0 && have <= size)
+            offset = have;
+        fclose(f);
+    }
+
+    // Written aside and renamed in, a crash never leaves half an entry
+    TSTR tmp = path + ".tmp";
+    f = fopen(tmp.c_str(), "we");
+    if(!f)
+        return 0;
+    fprintf(f, "connstream-checkpoint\n%lld %lld\n%s\n", size, mtime, m_site.c_str());
+    if(fclose(f) != 0 || rename(tmp.c_str(), path.c_str()) < 0)
+    {
+        unlink(tmp.c_str());
+        return 0;
+    }
+    return offset;
+}
+
+
+/// DELTA TRANSFER ///
+
+typedef std::vector<std::pair<long long, long long> > RANGES;
+
+// Adds @len bytes at @off, running on from the last range when the gap is under @gap
+static void AddRange(RANGES& ranges, long long off, long long len, long long gap)
+{
+    if(!ranges.empty() && ranges.back().first + ranges.back().second + gap >= off)
+    {
+        long long end = off + len > ranges.back().first + ranges.back().second
+                      ? off + len : ranges.back().first + ranges.back().second;
+        ranges.back().second = end - ranges.back().first;
+        return;
+    }
+    ranges.push_back(std::make_pair(off, len));
+}
+
+// Copies between local files, copy_file_range lets the filesystem share or offload the extents
+static int CopyRange(int in, long long from, int out, long long to, long long len)
+{
+    loff_t src = from, dst = to;
+    while(len > 0)
+    {
+        ssize_t n = copy_file_range(in, &src, out, &dst, (size_t)len, 0);
+        if(n > 0)
+        {
+            len -= n;
+            continue;
+        }
+        if(n == 0)
+            return ESTALE;
+        if(errno == EINTR)
+            continue;
+        if(errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+            return errno;
+        break;
+    }
+
+    char buf[FTP_DATA_BUFSIZE];
+    while(len > 0)
+    {
+        ssize_t n = pread(in, buf, len < (long long)sizeof(buf) ? (size_t)len : sizeof(buf), (off_t)src);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return n < 0 ? errno : ESTALE;
+        for(ssize_t w = 0; w < n; )
+        {
+            ssize_t r = pwrite(out, buf + w, (size_t)(n - w), (off_t)(dst + w));
+            if(r < 0 && errno != EINTR)
+                return errno;
+            if(r > 0)
+                w += r;
+        }
+        src += n;
+        dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Hex digest of a whole local file
+static bool FileDigest(int fd, int alg, TSTR& hex)
+{
+    checksum sum(alg);
+    char buf[FTP_DATA_BUFSIZE];
+    off_t off = 0;
+    for(;;)
+    {
+        ssize_t n = pread(fd, buf, sizeof(buf), off);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            return false;
+        if(n == 0)
+            break;
+        sum.Update(buf, (size_t)n);
+        off += n;
+    }
+    hex = sum.Hex();
+    return true;
+}
+
+int PosixFTP::DeltaAlgorithm()
+{
+    // Fastest first, every one of them is only trusted alongside a whole file check
+    static const int preferred[] = { CHECKSUM_XXH64, CHECKSUM_SHA256, CHECKSUM_MD5,
+                                     CHECKSUM_CRC32C, CHECKSUM_CRC32 };
+    for(size_t i = 0; i < sizeof(preferred) / sizeof(preferred[0]); i++)
+        if(HashOffered(preferred[i]))
+            return preferred[i];
+    return CHECKSUM_NONE;
+}
+
+TSTR PosixFTP::SigPath(const TSTR& local)
+{
+    if(m_sigDir.empty())
+        return local + DELTA_SUFFIX;
+
+    // One flat directory for every file, named by a digest of the absolute path
+    TSTR path = local;
+    char cwd[PATH_MAX];
+    if((path.empty() || path[0] != '/') && getcwd(cwd, sizeof(cwd)))
+        path = TSTR(cwd) + "/" + local;
+
+    checksum sum(CHECKSUM_XXH64);
+    sum.Update(path.data(), path.size());
+    return m_sigDir + "/" + sum.Hex() + DELTA_SUFFIX;
+}
+
+bool PosixFTP::LocalSig(int fd, const TSTR& local, unsigned block, int alg, deltasig& sig)
+{
+    TSTR path = SigPath(local);
+    if(sig.LoadFile(path) && sig.Current(fd) && sig.Algorithm() == alg && (!block || sig.Block() == block))
+        return true;
+    if(!sig.Build(fd, block, alg))
+        return Fail(errno);
+
+    // Only a cache, the next run builds it again if this fails
+    sig.SaveFile(path);
+    return true;
+}
+
+bool PosixFTP::RemoteSig(const TSTR& remote, long long size, deltasig& sig)
+{
+    std::string data;
+    TSTR path = remote + DELTA_SUFFIX;
+    if(!ListData("RETR", path.c_str(), data) || !sig.Load(data) || sig.Size() != size)
+        return false;
+
+    // Stamped with the file's MDTM when it was published, anything that
+    // rewrote the file since without a new signature shows up here
+    if(sig.Stamp() < 0)
+        return true;
+    int code = Exec("MDTM", remote.c_str());
+    return code == 213 && ModTime(m_text) == sig.Stamp();
+}
+
+bool PosixFTP::BlockDigests(const TSTR& remote, long long size, unsigned block, int alg, LIST& hex)
+{
+    if(!SelectHash(alg))
+        return false;
+
+    // RANG then HASH for every block, all written back-to-back
+    size_t count = (size_t)((size + block - 1) / block);
+    std::vector<TSTR> ranges(count);
+    std::vector<pipecmd> cmds(count * 2);
+    char arg[64];
+    for(size_t i = 0; i < count; i++)
+    {
+        long long off = (long long)i * block;
+        long long end = off + block < size ? off + block : size;
+        snprintf(arg, sizeof(arg), "%lld %lld", off, end - 1);
+        ranges[i]           = arg;
+        cmds[i * 2].verb    = "RANG";
+        cmds[i * 2].arg     = ranges[i].c_str();
+        cmds[i * 2 + 1].verb = "HASH";
+        cmds[i * 2 + 1].arg  = remote.c_str();
+    }
+
+    std::vector<int> codes(cmds.size());
+    std::vector<TSTR> texts(cmds.size());
+    if(!Pipeline(cmds, &codes[0], NULL, &texts[0]))
+        return false;
+
+    size_t len = checksum(alg).Hex().size();
+    hex.resize(count);
+    for(size_t i = 0; i < count; i++)
+    {
+        int code = codes[i * 2] != 350 ? codes[i * 2] : codes[i * 2 + 1];
+        if(code != 213)
+            return Fail(code > 0 ? code : EPROTO);
+        hex[i] = HexToken(texts[i * 2 + 1].c_str(), len);
+        if(hex[i].empty())
+            return Fail(EPROTO);
+    }
+    return true;
+}
+
+bool PosixFTP::FetchRange(const TSTR& remote, long long offset, long long len, int fd)
+{
+    // RANG has the server send just the range. Without it the transfer
+    // starts at REST and the stream ABORs the rest once the range is in.
+    if(lseek(fd, (off_t)offset, SEEK_SET) < 0)
+        return Fail(errno);
+
+    bool rang = (m_feat & FTP_FEAT_RANG) != 0;
+    int data  = OpenTransfer("RETR", remote.c_str(), offset, false, rang ? offset + len - 1 : -1);
+    if(data < 0)
+        return false;
+
+    datastream in(m_stream = new ftpstream(this, data, true));
+    char buf[FTP_DATA_BUFSIZE];
+    while(len > 0)
+    {
+        long long n = in.Read(buf, len < (long long)sizeof(buf) ? (size_t)len : sizeof(buf));
+        int err = n < 0 ? in.GetLastError() : n == 0 ? EPROTO : WriteAll(fd, buf, (size_t)n);
+        if(err)
+        {
+            in.Close();
+            return Fail(err);
+        }
+        len -= n;
+    }
+
+    // A ranged transfer ends on its own, read up to that so it closes cleanly
+    if(rang && in.Read(buf, 1) != 0)
+    {
+        in.Close();
+        return Fail(EPROTO);
+    }
+
+    // Past the range an abort is expected, only a lost session counts
+    if(!in.Close() && m_ctrl < 0)
+        return false;
+    m_err = 0;
+    return true;
+}
+
+bool PosixFTP::SendRange(int fd, const TSTR& remote, long long offset, long long len)
+{
+    // RANG bounds the write when the server has it, REST + STOR otherwise
+    // writes over the file from @offset without cutting it short
+    bool rang = (m_feat & FTP_FEAT_RANG) != 0;
+    int data  = OpenTransfer("STOR", remote.c_str(), offset, false, rang ? offset + len - 1 : -1);
+    if(data < 0)
+        return false;
+
+    char buf[FTP_DATA_BUFSIZE];
+    int err = 0;
+    while(len > 0 && !err)
+    {
+        ssize_t n = pread(fd, buf, len < (long long)sizeof(buf) ? (size_t)len : sizeof(buf), (off_t)offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            err = n < 0 ? errno : ESTALE;
+        else if(!SendAll(data, buf, (size_t)n))
+            err = errno;
+        else
+        {
+            offset  += n;
+            len     -= n;
+            Pace((size_t)n);
+        }
+    }
+    return CloseTransfer(data, err);
+}
+
+int PosixFTP::DownloadDelta(const TSTR& remote, const TSTR& local)
+{
+    // Nothing local to start from, or nothing on the host to compare with
+    int fd = open(local.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+
+    struct stat st;
+    int code = -1;
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size
+        || (code = Exec("SIZE", remote.c_str())) != 213)
+    {
+        close(fd);
+        return code < 0 && m_ctrl < 0 ? 0 : -1;
+    }
+    long long size = ReplyValue("SIZE", m_text);
+
+    // The host's signature finds blocks wherever they sit in the local
+    // copy. Without one, the blocks can only be compared where they are.
+    deltasig theirs, mine;
+    std::vector<long long> at;
+    int alg         = CHECKSUM_NONE;
+    unsigned block  = 0;
+    LIST hex;
+    if(size > 0 && RemoteSig(remote, size, theirs))
+    {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map == MAP_FAILED)
+        {
+            close(fd);
+            return -1;
+        }
+        madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+        theirs.Match((const unsigned char*)map, (size_t)st.st_size, at);
+        munmap(map, (size_t)st.st_size);
+
+        alg     = theirs.Algorithm();
+        block   = theirs.Block();
+        m_deltaStats.mode = DELTA_ROLLING;
+    }
+    else if(size > 0 && m_ctrl >= 0 && (m_feat & FTP_FEAT_RANG)
+        && (alg = DeltaAlgorithm()) != CHECKSUM_NONE
+        && LocalSig(fd, local, 0, alg, mine)
+        && BlockDigests(remote, size, mine.Block(), alg, hex))
+    {
+        block = mine.Block();
+        at.assign(hex.size(), -1);
+        for(size_t i = 0; i < hex.size() && i < mine.Count(); i++)
+            if(mine.BlockLen(i) == (i + 1 < hex.size() ? (long long)block : size - (long long)i * block)
+                && !strcasecmp(hex[i].c_str(), mine.Strong(i).c_str()))
+                at[i] = (long long)i * block;
+        m_deltaStats.mode = DELTA_INPLACE;
+    }
+    else
+    {
+        close(fd);
+        return m_ctrl < 0 ? 0 : -1;
+    }
+
+    // With nothing in common one plain RETR is cheaper
+    size_t count = at.size();
+    bool common  = false;
+    for(size_t i = 0; i < count && !common; i++)
+        common = at[i] >= 0;
+    if(!common)
+    {
+        close(fd);
+        return -1;
+    }
+
+    // Built aside and renamed in, the local copy stays whole until the new one checks out
+    TSTR part = local + _T(".delta-part");
+    int out = open(part.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(out < 0)
+    {
+        Fail(errno);
+        close(fd);
+        return 0;
+    }
+    fallocate(out, FALLOC_FL_KEEP_SIZE, 0, (off_t)size);
+
+    RANGES missing;
+    int err = 0;
+    for(size_t i = 0; i < count && !err; i++)
+    {
+        long long off = (long long)i * block;
+        long long len = off + block < size ? (long long)block : size - off;
+        if(at[i] >= 0)
+            err = CopyRange(fd, at[i], out, off, len);
+        else
+            AddRange(missing, off, len, (long long)DELTA_MERGE * block);
+    }
+    close(fd);
+
+    bool ok = !err || Fail(err);
+    for(size_t i = 0; ok && i < missing.size(); i++)
+    {
+        ok = FetchRange(remote, missing[i].first, missing[i].second, out);
+        m_deltaStats.sent   += missing[i].second;
+        m_deltaStats.ranges += 1;
+    }
+
+    // One read of the result proves it against the host and signs it for next time
+    deltasig result;
+    TSTR want;
+    ok = ok && result.Build(out, block, alg) && result.Size() == size;
+    if(ok && m_deltaStats.mode == DELTA_ROLLING)
+        want = theirs.Digest();
+    else if(ok)
+        ok = RemoteDigest(remote, alg, want);
+    ok = ok && !strcasecmp(want.c_str(), result.Digest().c_str());
+
+    if(ok && m_sum.Algorithm() != CHECKSUM_NONE)
+    {
+        if(m_sum.Algorithm() == alg)
+            m_digest = result.Digest();
+        else
+            ok = FileDigest(out, m_sum.Algorithm(), m_digest) || Fail(errno);
+    }
+    if(close(out) < 0 && ok)
+        ok = Fail(errno);
+
+    if(ok && rename(part.c_str(), local.c_str()) < 0)
+    {
+        Fail(errno);
+        unlink(part.c_str());
+        return 0;
+    }
+    if(!ok)
+    {
+        unlink(part.c_str());
+        m_digest.clear();
+        return m_ctrl < 0 ? 0 : -1;
+    }
+
+    result.SaveFile(SigPath(local));
+    m_deltaStats.size   = size;
+    m_deltaStats.reused = size - m_deltaStats.sent;
+    m_err = 0;
+    return 1;
+}
+
+int PosixFTP::UploadDelta(int fd, const TSTR& local, const TSTR& remote)
+{
+    // In place needs REST (or RANG) to land a block and HASH to prove the result
+    int alg = DeltaAlgorithm();
+    if(!(m_feat & (FTP_FEAT_REST | FTP_FEAT_RANG)) || alg == CHECKSUM_NONE)
+        return -1;
+
+    struct stat st;
+    int code = -1;
+    if(fstat(fd, &st) < 0 || (code = Exec("SIZE", remote.c_str())) != 213)
+        return code < 0 && m_ctrl < 0 ? 0 : -1;
+
+    // FTP can't shorten a file, and an empty one has nothing to keep
+    long long size  = (long long)st.st_size;
+    long long there = ReplyValue("SIZE", m_text);
+    if(there <= 0 || there > size)
+        return -1;
+
+    // The host's blocks from its signature when it is current, else from HASH
+    deltasig theirs, mine;
+    LIST hex;
+    bool published = RemoteSig(remote, there, theirs);
+    if(!published && m_ctrl < 0)
+        return 0;
+    if(!LocalSig(fd, local, published ? theirs.Block() : 0, published ? theirs.Algorithm() : alg, mine))
+        return -1;
+    if(!published && (!(m_feat & FTP_FEAT_RANG) || !BlockDigests(remote, there, mine.Block(), alg, hex)))
+        return m_ctrl < 0 ? 0 : -1;
+
+    unsigned block = mine.Block();
+    size_t count   = (size_t)((there + block - 1) / block);
+    bool common    = false;
+    RANGES changed;
+    for(size_t i = 0; i < count; i++)
+    {
+        long long off = (long long)i * block;
+        long long len = off + block < there ? (long long)block : there - off;
+        bool same = mine.BlockLen(i) == len
+                 && (published ? theirs.Strong(i) == mine.Strong(i)
+                               : !strcasecmp(hex[i].c_str(), mine.Strong(i).c_str()));
+        if(!same)
+            AddRange(changed, off, mine.BlockLen(i), (long long)DELTA_MERGE * block);
+        common = common || same;
+    }
+    if(size > there)
+        AddRange(changed, there, size - there, (long long)DELTA_MERGE * block);
+
+    // Nothing kept is a whole upload anyway, and REST 0 + STOR truncates on
+    // most servers so only RANG can rewrite the start in place
+    if(!common || (!changed.empty() && !changed[0].first && !(m_feat & FTP_FEAT_RANG)))
+        return -1;
+
+    m_deltaStats.mode = DELTA_INPLACE;
+    for(size_t i = 0; i < changed.size(); i++)
+    {
+        if(!SendRange(fd, remote, changed[i].first, changed[i].second))
+            return m_ctrl < 0 ? 0 : -1;
+        m_deltaStats.sent   += changed[i].second;
+        m_deltaStats.ranges += 1;
+    }
+
+    // A server that cut the file at REST or ignored it shows up here, the
+    // whole upload that follows puts it right
+    TSTR want, theirsHex;
+    if(alg == mine.Algorithm())
+        want = mine.Digest();
+    else if(!FileDigest(fd, alg, want))
+    {
+        Fail(errno);
+        return 0;
+    }
+    if(!RemoteDigest(remote, alg, theirsHex) || strcasecmp(want.c_str(), theirsHex.c_str()))
+        return m_ctrl < 0 ? 0 : -1;
+
+    if(m_sum.Algorithm() == alg)
+        m_digest = want;
+    else if(m_sum.Algorithm() != CHECKSUM_NONE && !FileDigest(fd, m_sum.Algorithm(), m_digest))
+    {
+        Fail(errno);
+        return 0;
+    }
+
+    m_deltaStats.reused = size - m_deltaStats.sent;
+    m_err = 0;
+    return 1;
+}
+
+bool PosixFTP::PublishSig(int fd, const TSTR& local, const TSTR& remote)
+{
+    deltasig sig;
+    if(!LocalSig(fd, local, 0, CHECKSUM_XXH64, sig))
+        return false;
+
+    int code = (m_feat & FTP_FEAT_MDTM) ? Exec("MDTM", remote.c_str()) : 0;
+    sig.SetStamp(code == 213 ? ModTime(m_text) : -1);
+
+    std::string data = sig.Save();
+    datastream out = OpenWrite(remote + DELTA_SUFFIX);
+    bool ok = out.Write(data.data(), data.size()) == (long long)data.size();
+    return out.Close() && ok;
+}
+
+
+/// DIRECTORY METHODS ///
+
+bool PosixFTP::ChangeDir(TSTR lpszDirectory)
+{
+    return ChangeDirView(lpszDirectory);
+}
+
+bool PosixFTP::MakeDir(TSTR lpszDirectory)
+{
+    return MakeDirView(lpszDirectory);
+}
+
+bool PosixFTP::RemoveDir(TSTR lpszDirectory)
+{
+    return RemoveDirView(lpszDirectory);
+}
+
+TSTR PosixFTP::CurrentDir()
+{
+    TSTRVIEW dir = CurrentDirView();
+    return m_err ? TSTR(_T("ERROR-1")) : TSTR(dir.data(), dir.size());
+}
+
+bool PosixFTP::ListNames(const TSTR& dir, const TSTR* key, LIST& names)
+{
+    bool mlsd = (m_feat & FTP_FEAT_MLST) != 0;
+    std::string listing;
+    if(!ListData(mlsd ? "MLSD" : "NLST", dir.empty() ? NULL : dir.c_str(), listing))
+        return false;
+
+    TSTR child;
+    for(size_t pos = 0; pos < listing.size(); )
+    {
+        size_t eol = listing.find('\n', pos);
+        if(eol == std::string::npos)
+            eol = listing.size();
+        size_t end = eol;
+        if(end > pos && listing[end - 1] == '\r')
+            end--;
+
+        const char* line = listing.c_str() + pos;
+        size_t len = end - pos;
+        pos = eol + 1;
+
+        if(!len)
+            continue;
+
+        DirEntry d;
+        if(mlsd)
+        {
+            if(!ParseMLSD(line, len, d))
+                continue;
+            line    = d.name;
+            len     = d.namelen;
+        }
+        else
+        {
+            // Some servers prefix NLST names with the listed directory
+            const char* base = line;
+            for(size_t i = 0; i < len; i++)
+                if(line[i] == '/')
+                    base = line + i + 1;
+            len -= (size_t)(base - line);
+            line = base;
+        }
+
+        names.push_back(TSTR(line, len));
+        const TSTR& name = names.back();
+        if(name == _T(".") || name == _T(".."))
+        {
+            names.pop_back();
+            continue;
+        }
+
+        // MLSD facts answer later Exists/GetFileSize calls on the children too
+        if(mlsd && key)
+        {
+            metaentry e;
+            ToMeta(d, e);
+            child = *key;
+            if(child[child.size() - 1] != '/')
+                child += '/';
+            child += name;
+            m_cache->Store(child, e);
+        }
+    }
+
+    if(key)
+        m_cache->StoreDir(*key, names);
+    return true;
+}
+
+LIST PosixFTP::SearchDir(TSTR lpszSearchStr)
+{
+    TELEMETRY_SCOPE(TELEMETRY_SEARCHDIR);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return LIST();
+    }
+
+    LIST files;
+
+    // Split "dir/pattern" and list the directory, the server is never trusted with globbing
+    TSTR dir, pattern = lpszSearchStr;
+    size_t slash = lpszSearchStr.rfind('/');
+    if(slash != TSTR::npos)
+    {
+        dir     = lpszSearchStr.substr(0, slash ? slash : 1);
+        pattern = lpszSearchStr.substr(slash + 1);
+    }
+    if(pattern.empty() || pattern == _T("*.*"))
+        pattern = _T("*");
+
+    TSTR key;
+    LIST names;
+    bool cached = CacheKey(dir.empty() ? TSTR(_T(".")) : dir, key);
+    if(cached && m_cache->LookupDir(key, names))
+        m_err = 0;
+    else if(!ListNames(dir, cached ? &key : NULL, names))
+        return files;
+
+    for(size_t i = 0; i < names.size(); i++)
+        if(fnmatch(pattern.c_str(), names[i].c_str(), FNM_PERIOD) == 0)
+            files.push_back(names[i]);
+
+    return files;
+}
+
+bool PosixFTP::ListDir(TSTR lpszDirectory, DIRCALLBACK callback)
+{
+    TELEMETRY_SCOPE(TELEMETRY_LISTDIR);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    bool mlsd = (m_feat & FTP_FEAT_MLST) != 0;
+    int data = OpenTransfer(mlsd ? "MLSD" : "LIST",
+                            lpszDirectory.empty() ? NULL : lpszDirectory.c_str());
+    if(data < 0)
+        return false;
+    datastream s(m_stream = new ftpstream(this, data, true));
+
+    // Lines are parsed in place, a partial one is carried to the front of the buffer
+    std::vector<char> buf(FTP_DATA_BUFSIZE);
+    size_t fill     = 0;
+    bool skipping   = false;    // Inside a line too long for the buffer
+    bool stopped    = false;
+    long long now   = (long long)time(NULL);
+
+    while(!stopped)
+    {
+        long long n = s.Read(&buf[0] + fill, buf.size() - fill);
+        if(n < 0)
+        {
+            int err = s.GetLastError();
+            s.Close();
+            return Fail(err);
+        }
+        if(n == 0)
+        {
+            // The last line may lack its CRLF
+            if(fill && !skipping)
+                buf[fill++] = '\n';
+            else
+                break;
+        }
+        fill += (size_t)n;
+
+        char* line = &buf[0];
+        char* end  = line + fill;
+        for(char* nl; !stopped && (nl = (char*)memchr(line, '\n', (size_t)(end - line))); line = nl + 1)
+        {
+            if(skipping)
+            {
+                skipping = false;
+                continue;
+            }
+
+            size_t len = (size_t)(nl - line);
+            if(len && line[len - 1] == '\r')
+                len--;
+
+            DirEntry e;
+            if(!(mlsd ? ParseMLSD(line, len, e) : ParseUnixList(line, len, e, now)))
+                continue;
+            if((e.namelen == 1 && e.name[0] == '.')
+                || (e.namelen == 2 && e.name[0] == '.' && e.name[1] == '.'))
+                continue;
+
+            // Callers get a terminated name, the byte after it is the CR or LF
+            line[(size_t)(e.name - line) + e.namelen] = '\0';
+            stopped = !callback(e);
+        }
+
+        fill = (size_t)(end - line);
+        if(fill == buf.size())
+        {
+            fill        = 0;
+            skipping    = true;
+        }
+        else if(fill)
+            memmove(&buf[0], line, fill);
+
+        if(n == 0)
+            break;
+    }
+
+    // Closing before the end aborts the listing, which the server answers with 426
+    bool ok = s.Close();
+    if(stopped)
+        return m_ctrl >= 0 ? !(m_err = 0) : false;
+    return ok ? !(m_err = 0) : false;
+}
+
+struct listcollect
+{
+    DirList*    entries;
+    LIST*       names;
+
+    bool operator()(const DirEntry& e)
+    {
+        entries->Add(e);
+        if(names)
+            names->push_back(TSTR(e.name, e.namelen));
+        return true;
+    }
+};
+
+bool PosixFTP::ListDir(TSTR lpszDirectory, DirList& entries)
+{
+    entries.Clear();
+
+    TSTR key;
+    LIST names;
+    bool cached = CacheKey(lpszDirectory.empty() ? TSTR(_T(".")) : lpszDirectory, key);
+
+    listcollect collect;
+    collect.entries = &entries;
+    collect.names   = cached ? &names : NULL;
+    if(!ListDir(lpszDirectory, DIRCALLBACK(collect)))
+        return false;
+
+    if(cached)
+    {
+        TSTR child;
+        for(size_t i = 0; i < entries.Count(); i++)
+        {
+            metaentry e;
+            ToMeta(entries[i], e);
+            child = key;
+            if(child[child.size() - 1] != '/')
+                child += '/';
+            child.append(entries[i].name, entries[i].namelen);
+            m_cache->Store(child, e);
+        }
+        m_cache->StoreDir(key, names);
+    }
+    return true;
+}
+
+
+/// FILE HANDLING METHODS ///
+
+bool PosixFTP::Remove(TSTR lpszFileName)
+{
+    return RemoveView(lpszFileName);
+}
+
+bool PosixFTP::Rename(TSTR lpszOldFileName, TSTR lpszNewFileName)
+{
+    return RenameView(lpszOldFileName, lpszNewFileName);
+}
+
+bool PosixFTP::Exists(TSTR lpszFileName)
+{
+    return ExistsView(lpszFileName);
+}
+
+long long PosixFTP::GetFileSize(TSTR lpszFileName)
+{
+    return GetFileSizeView(lpszFileName);
+}
+
+long long PosixFTP::GetModTime(TSTR lpszFileName)
+{
+    return GetModTimeView(lpszFileName);
+}
+
+
+/// PATH VIEW METHODS ///
+
+bool PosixFTP::ChangeDirView(TSTRVIEW dir)
+{
+    TELEMETRY_SCOPE(TELEMETRY_CHANGEDIR);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    int code = Exec("CWD", m_paths.Copy(FTP_SLOT_ARG, dir).c_str());
+    if(code != 250)
+        return Refused(code);
+
+    // Lexical, a relative CWD from an unknown directory leaves it unknown.
+    // Built aside, @dir may be a view of m_cwd itself
+    if(!m_cwd.empty() || (!dir.empty() && dir[0] == '/'))
+    {
+        TSTR& next = m_paths[FTP_SLOT_SCRATCH];
+        next.clear();
+        patharena::Normalize(next, m_cwd, dir);
+        m_cwd.swap(next);
+    }
+    return !(m_err = 0);
+}
+
+bool PosixFTP::MakeDirView(TSTRVIEW dir)
+{
+    TELEMETRY_SCOPE(TELEMETRY_MAKEDIR);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    TSTR& key = m_paths[FTP_SLOT_KEY];
+    bool cached = CacheKey(dir, key);
+
+    int code = Exec("MKD", m_paths.Copy(FTP_SLOT_ARG, dir).c_str());
+    if(code != 257 && code != 250)
+        return Refused(code);
+
+    if(cached)
+        CacheChanged(key, META_DIR);
+    return !(m_err = 0);
+}
+
+bool PosixFTP::RemoveDirView(TSTRVIEW dir)
+{
+    TELEMETRY_SCOPE(TELEMETRY_REMOVEDIR);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    TSTR& key = m_paths[FTP_SLOT_KEY];
+    bool cached = CacheKey(dir, key);
+
+    int code = Exec("RMD", m_paths.Copy(FTP_SLOT_ARG, dir).c_str());
+    if(code != 250)
+        return Refused(code);
+
+    if(cached)
+        CacheChanged(key, META_MISSING, INVALID_FILE, true);
+    return !(m_err = 0);
+}
+
+TSTRVIEW PosixFTP::CurrentDirView()
+{
+    TELEMETRY_SCOPE(TELEMETRY_CURRENTDIR);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return TSTRVIEW();
+    }
+
+    // Kept from the last PWD and every ChangeDir since, the server is only
+    // asked after a connect or a relative CWD from nowhere known
+    if(!m_cwd.empty())
+    {
+        m_err = 0;
+        return m_cwd;
+    }
+
+    int code = Exec("PWD");
+    if(code != 257)
+    {
+        if(code > 0)
+            Fail(code);
+        return TSTRVIEW();
+    }
+
+    // 257 "/quoted ""path""" is current directory
+    const char* p = strchr(m_text, '"');
+    if(!p)
+    {
+        Fail(EPROTO);
+        return TSTRVIEW();
+    }
+    TSTR& dir = m_paths[FTP_SLOT_SCRATCH];
+    dir.clear();
+    for(p++; *p; p++)
+    {
+        if(*p == '"')
+        {
+            if(p[1] != '"')
+                break;
+            p++;
+        }
+        dir += *p;
+    }
+
+    m_err = 0;
+    if(dir.empty() || dir[0] != '/')
+        return dir;
+    m_cwd.clear();
+    patharena::Normalize(m_cwd, _T("/"), dir);
+    return m_cwd;
+}
+
+bool PosixFTP::RemoveView(TSTRVIEW filename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_REMOVE);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    TSTR& key = m_paths[FTP_SLOT_KEY];
+    bool cached = CacheKey(filename, key);
+
+    int code = Exec("DELE", m_paths.Copy(FTP_SLOT_ARG, filename).c_str());
+    if(code != 250)
+        return Refused(code);
+
+    if(cached)
+        CacheChanged(key, META_MISSING);
+    return !(m_err = 0);
+}
+
+bool PosixFTP::RenameView(TSTRVIEW oldFilename, TSTRVIEW newFilename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_RENAME);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    TSTR& from = m_paths[FTP_SLOT_KEY];
+    TSTR& to   = m_paths[FTP_SLOT_KEY2];
+    bool cached = CacheKey(oldFilename, from) && CacheKey(newFilename, to);
+
+    int code = Exec("RNFR", m_paths.Copy(FTP_SLOT_ARG, oldFilename).c_str());
+    if(code != 350)
+        return Refused(code);
+
+    code = Exec("RNTO", m_paths.Copy(FTP_SLOT_ARG2, newFilename).c_str());
+    if(code != 250)
+        return Refused(code);
+
+    if(cached)
+    {
+        CacheChanged(from, META_MISSING, INVALID_FILE, true);
+        CacheChanged(to, -1, INVALID_FILE, true);
+    }
+    return !(m_err = 0);
+}
+
+bool PosixFTP::ExistsView(TSTRVIEW filename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_EXISTS);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    TSTR& key = m_paths[FTP_SLOT_KEY];
+    metaentry e;
+    bool cached = CacheKey(filename, key);
+    if(cached && CacheLookup(key, e))
+        return e.type != META_MISSING ? !(m_err = 0) : Fail(550);
+
+    const char* arg = m_paths.Copy(FTP_SLOT_ARG, filename).c_str();
+    int code;
+    if(m_feat & FTP_FEAT_MLST)
+    {
+        code = Exec("MLST", arg);
+        if(cached && code == 550)
+        {
+            e.type = META_MISSING;
+            m_cache->Store(key, e);
+        }
+        if(code != 250)
+            return Refused(code);
+
+        // The facts sit on the one line of the reply that starts with a space
+        const char* facts = strchr(m_text, '\n');
+        DirEntry d;
+        if(cached && facts && facts[1] == ' ' && ParseMLSD(facts + 2, strcspn(facts + 2, "\n"), d))
+        {
+            ToMeta(d, e);
+            m_cache->Store(key, e);
+        }
+        return !(m_err = 0);
+    }
+
+    code = Exec("SIZE", arg);
+    if(code == 213)
+    {
+        if(cached)
+        {
+            e.type  = META_FILE;
+            e.size  = ReplyValue("SIZE", m_text);
+            e.mtime = INVALID_FILE;
+            m_cache->Store(key, e);
+        }
+        return !(m_err = 0);
+    }
+    if(code < 0)
+        return false;
+
+    // SIZE refuses directories on most servers, look for the name in its parent instead
+    TSTRVIEW dir, base = filename;
+    size_t slash = filename.rfind('/');
+    if(slash != TSTRVIEW::npos)
+    {
+        dir  = filename.substr(0, slash ? slash : 1);
+        base = filename.substr(slash + 1);
+    }
+
+    std::string listing;
+    if(!ListData("NLST", dir.empty() ? NULL : m_paths.Copy(FTP_SLOT_ARG2, dir).c_str(), listing))
+        return false;
+
+    LIST names;
+    bool found = false;
+    for(size_t pos = 0; pos < listing.size(); )
+    {
+        size_t eol = listing.find('\n', pos);
+        if(eol == std::string::npos)
+            eol = listing.size();
+        size_t end = eol > pos && listing[eol - 1] == '\r' ? eol - 1 : eol;
+        size_t name = listing.rfind('/', end);
+        name = name == std::string::npos || name < pos ? pos : name + 1;
+
+        if(end - name == base.size() && !listing.compare(name, base.size(), base.data(), base.size()))
+            found = true;
+        if(cached && end > name)
+            names.push_back(listing.substr(name, end - name));
+        pos = eol + 1;
+    }
+
+    if(cached)
+    {
+        m_cache->StoreDir(CacheParent(key), names);
+        if(!found)
+        {
+            e.type = META_MISSING;
+            m_cache->Store(key, e);
+        }
+    }
+    return found ? !(m_err = 0) : Fail(550);
+}
+
+long long PosixFTP::GetFileSizeView(TSTRVIEW filename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_GETFILESIZE);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return INVALID_FILE;
+    }
+
+    TSTR& key = m_paths[FTP_SLOT_KEY];
+    metaentry e;
+    bool cached = CacheKey(filename, key);
+    if(cached && CacheLookup(key, e) && e.type == META_FILE && e.size != INVALID_FILE)
+    {
+        m_err = 0;
+        return e.size;
+    }
+
+    int code = Exec("SIZE", m_paths.Copy(FTP_SLOT_ARG, filename).c_str());
+    if(code != 213)
+    {
+        Refused(code);
+        return INVALID_FILE;
+    }
+
+    char* end;
+    long long size = strtoll(m_text, &end, 10);
+    if(end == m_text || size < 0)
+    {
+        Fail(EPROTO);
+        return INVALID_FILE;
+    }
+
+    if(cached)
+    {
+        e.type  = META_FILE;
+        e.size  = size;
+        e.mtime = INVALID_FILE;
+        m_cache->Store(key, e);
+    }
+    m_err = 0;
+    return size;
+}
+
+long long PosixFTP::GetModTimeView(TSTRVIEW filename)
+{
+    TELEMETRY_SCOPE(TELEMETRY_GETMODTIME);
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return INVALID_FILE;
+    }
+
+    TSTR& key = m_paths[FTP_SLOT_KEY];
+    metaentry e;
+    bool cached = CacheKey(filename, key);
+    if(cached && CacheLookup(key, e) && e.type == META_FILE && e.mtime != INVALID_FILE)
+    {
+        m_err = 0;
+        return e.mtime;
+    }
+
+    int code = Exec("MDTM", m_paths.Copy(FTP_SLOT_ARG, filename).c_str());
+    if(code != 213)
+    {
+        Refused(code);
+        return INVALID_FILE;
+    }
+
+    long long t = ModTime(m_text);
+    if(t == INVALID_FILE)
+    {
+        Fail(EPROTO);
+        return INVALID_FILE;
+    }
+
+    if(cached)
+    {
+        e.type  = META_FILE;
+        e.size  = INVALID_FILE;
+        e.mtime = t;
+        m_cache->Store(key, e);
+    }
+    m_err = 0;
+    return t;
+}
+
+
+/// PIPELINED METHODS ///
+
+size_t PosixFTP::PipelineResult(const int* codes, size_t count, bool connected)
+{
+    size_t ok = 0;
+    int first = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(codes[i] >= 200 && codes[i] < 300)
+            ok++;
+        else if(!first)
+            first = codes[i] ? codes[i] : EINVAL;
+    }
+
+    // A lost connection keeps the errno Drop recorded
+    if(connected)
+        m_err = first > 0 ? first : 0;
+    return ok;
+}
+
+size_t PosixFTP::PipelineEach(const char* verb,
+                              const LIST& args,
+                              std::vector<int>* codes,
+                              std::vector<long long>* values)
+{
+    std::vector<pipecmd> cmds(args.size());
+    for(size_t i = 0; i < args.size(); i++)
+    {
+        cmds[i].verb    = verb;
+        cmds[i].arg     = args[i].c_str();
+    }
+
+    std::vector<int> local;
+    if(!codes)
+        codes = &local;
+    codes->assign(args.size(), -1);
+    if(values)
+        values->assign(args.size(), INVALID_FILE);
+
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return 0;
+    }
+    if(args.empty())
+    {
+        m_err = 0;
+        return 0;
+    }
+
+    bool connected = Pipeline(cmds, &(*codes)[0], values ? &(*values)[0] : NULL);
+    return PipelineResult(&(*codes)[0], args.size(), connected);
+}
+
+std::vector<long long> PosixFTP::StatMany(const char* verb, const LIST& files)
+{
+    bool mdtm = verb[0] == 'M';
+    if(!m_cache || !m_connected)
+    {
+        std::vector<long long> values;
+        PipelineEach(verb, files, NULL, &values);
+        return values;
+    }
+
+    // Only the names the cache can't answer go over the wire
+    std::vector<long long> values(files.size(), INVALID_FILE);
+    LIST keys(files.size()), misses;
+    std::vector<size_t> at;
+    for(size_t i = 0; i < files.size(); i++)
+    {
+        metaentry e;
+        if(CacheKey(files[i], keys[i]) && CacheLookup(keys[i], e) && e.type == META_FILE
+            && (mdtm ? e.mtime : e.size) != INVALID_FILE)
+        {
+            values[i] = mdtm ? e.mtime : e.size;
+            continue;
+        }
+        misses.push_back(files[i]);
+        at.push_back(i);
+    }
+    if(misses.empty())
+    {
+        m_err = 0;
+        return values;
+    }
+
+    std::vector<long long> fetched;
+    PipelineEach(verb, misses, NULL, &fetched);
+    for(size_t i = 0; i < at.size(); i++)
+    {
+        values[at[i]] = fetched[i];
+        if(fetched[i] != INVALID_FILE && !keys[at[i]].empty())
+        {
+            metaentry e;
+            e.type  = META_FILE;
+            e.size  = mdtm ? INVALID_FILE : fetched[i];
+            e.mtime = mdtm ? fetched[i] : INVALID_FILE;
+            m_cache->Store(keys[at[i]], e);
+        }
+    }
+    return values;
+}
+
+std::vector<long long> PosixFTP::GetFileSizes(const LIST& files)
+{
+    return StatMany("SIZE", files);
+}
+
+std::vector<long long> PosixFTP::GetModTimes(const LIST& files)
+{
+    return StatMany("MDTM", files);
+}
+
+size_t PosixFTP::RemoveMany(const LIST& files, std::vector<int>* codes)
+{
+    std::vector<int> local;
+    if(!codes)
+        codes = &local;
+
+    LIST keys(files.size());
+    bool cached = m_cache && m_connected;
+    for(size_t i = 0; cached && i < files.size(); i++)
+        CacheKey(files[i], keys[i]);
+
+    size_t n = PipelineEach("DELE", files, codes);
+    for(size_t i = 0; cached && i < files.size(); i++)
+        if((*codes)[i] == 250 && !keys[i].empty())
+            CacheChanged(keys[i], META_MISSING);
+    return n;
+}
+
+size_t PosixFTP::MakeDirs(const LIST& dirs, std::vector<int>* codes)
+{
+    std::vector<int> local;
+    if(!codes)
+        codes = &local;
+
+    LIST keys(dirs.size());
+    bool cached = m_cache && m_connected;
+    for(size_t i = 0; cached && i < dirs.size(); i++)
+        CacheKey(dirs[i], keys[i]);
+
+    size_t n = PipelineEach("MKD", dirs, codes);
+    for(size_t i = 0; cached && i < dirs.size(); i++)
+        if((*codes)[i] >= 200 && (*codes)[i] < 300 && !keys[i].empty())
+            CacheChanged(keys[i], META_DIR);
+    return n;
+}
+
+size_t PosixFTP::RenameMany(const RENAMES& names, std::vector<int>* codes)
+{
+    std::vector<int> local;
+    if(!codes)
+        codes = &local;
+    codes->assign(names.size(), -1);
+
+    if(!m_connected)
+    {
+        Fail(ENOTCONN);
+        return 0;
+    }
+    if(names.empty())
+    {
+        m_err = 0;
+        return 0;
+    }
+
+    // RNFR/RNTO go out as interleaved pairs, a refused RNFR makes its RNTO fail with 503
+    std::vector<pipecmd> cmds(names.size() * 2);
+    for(size_t i = 0; i < names.size(); i++)
+    {
+        cmds[2 * i].verb        = "RNFR";
+        cmds[2 * i].arg         = names[i].first.c_str();
+        cmds[2 * i + 1].verb    = "RNTO";
+        cmds[2 * i + 1].arg     = names[i].second.c_str();
+    }
+
+    LIST from(m_cache ? names.size() : 0), to(from.size());
+    for(size_t i = 0; i < from.size(); i++)
+        if(!CacheKey(names[i].first, from[i]) || !CacheKey(names[i].second, to[i]))
+            from[i].clear();
+
+    std::vector<int> replies(cmds.size());
+    bool connected = Pipeline(cmds, &replies[0]);
+    for(size_t i = 0; i < names.size(); i++)
+    {
+        (*codes)[i] = replies[2 * i] == 350 ? replies[2 * i + 1] : replies[2 * i];
+        if((*codes)[i] == 250 && i < from.size() && !from[i].empty())
+        {
+            CacheChanged(from[i], META_MISSING, INVALID_FILE, true);
+            CacheChanged(to[i], -1, INVALID_FILE, true);
+        }
+    }
+
+    return PipelineResult(&(*codes)[0], names.size(), connected);
+}
+
+
+/// METADATA CACHE ///
+
+bool PosixFTP::CacheKey(TSTRVIEW path, TSTR& key)
+{
+    key.clear();
+    if(!m_cache)
+        return false;
+
+    if((path.empty() || path[0] != '/') && m_cwd.empty())
+    {
+        int reply   = m_reply;
+        int err     = m_err;
+        CurrentDirView();
+        m_reply     = reply;
+        m_err       = err;
+        if(m_cwd.empty())
+            return false;
+    }
+
+    // Assigned, not built, so the key's buffer is reused call to call
+    key.assign(m_site);
+    patharena::Normalize(key, m_cwd, path);
+    return true;
+}
+
+TSTR PosixFTP::CacheParent(const TSTR& key)
+{
+    return m_site + metacache::Parent(key.substr(m_site.size()));
+}
+
+void PosixFTP::CacheChanged(const TSTR& key, int type, long long size, bool tree)
+{
+    if(!m_cache || key.empty())
+        return;
+
+    if(tree)
+        m_cache->InvalidateTree(key);
+    else
+        m_cache->Invalidate(key);
+
+    if(type >= 0)
+    {
+        metaentry e;
+        e.type  = type;
+        e.size  = size;
+        e.mtime = INVALID_FILE;
+        m_cache->Store(key, e);
+    }
+
+    m_cache->InvalidateDir(CacheParent(key));
+}
+
+bool PosixFTP::CacheLookup(const TSTR& key, metaentry& entry)
+{
+    if(m_cache->Lookup(key, entry))
+        return true;
+
+    // A listing of the parent answers whether the name exists, if not what it is
+    bool present;
+    size_t slash = key.rfind('/');
+    if(slash == TSTR::npos || slash < m_site.size())
+        return false;
+
+    TSTR& parent = m_paths[FTP_SLOT_SCRATCH];
+    TSTR& name   = m_paths[FTP_SLOT_SCRATCH + 1];
+    parent.assign(key, 0, slash > m_site.size() ? slash : slash + 1);
+    name.assign(key, slash + 1, TSTR::npos);
+    if(!m_cache->Listed(parent, name, present))
+        return false;
+
+    entry.type  = present ? META_OTHER : META_MISSING;
+    entry.size  = INVALID_FILE;
+    entry.mtime = INVALID_FILE;
+    return true;
+}
+
+
+/// MISCELLANEOUS METHODS ///
+
+int PosixFTP::GetHandle()
+{
+    return m_connected ? m_ctrl : -1;
+}
+
+bool PosixFTP::Command(TSTR lpszCommand)
+{
+    TELEMETRY_SCOPE(TELEMETRY_COMMAND);
+    if(!m_connected)
+        return Fail(ENOTCONN);
+
+    int code = Exec(lpszCommand.c_str());
+    return code > 0 && code < 400 ? !(m_err = 0) : Refused(code);
+}
+
+int PosixFTP::GetLastReply()
+{
+    return m_reply;
+}
+
+int PosixFTP::LastReply()
+{
+    return m_reply;
+}
+
+long long PosixFTP::LastMoved()
+{
+    return m_deltaStats.sent;
+}
+
+const char* PosixFTP::GetLastReplyText()
+{
+    return m_text;
+}
+
+unsigned PosixFTP::GetFeatures()
+{
+    return m_feat;
+}
+
+void PosixFTP::SetZeroCopy(bool enable)
+{
+    m_zeroCopy = enable;
+}
+
+void PosixFTP::SetEngine(std::shared_ptr<uringengine> engine)
+{
+    m_engine = engine;
+}
+
+std::shared_ptr<uringengine> PosixFTP::GetEngine()
+{
+    return m_engine;
+}
+
+void PosixFTP::SetChecksum(int algorithm, bool verify)
+{
+    m_sum.Reset(algorithm);
+    m_sumVerify = verify && m_sum.Algorithm() != CHECKSUM_NONE;
+}
+
+TSTR PosixFTP::GetChecksum()
+{
+    return m_digest;
+}
+
+void PosixFTP::SetCompression(bool enable, int level)
+{
+    m_compress  = enable;
+    m_level     = level;
+}
+
+void PosixFTP::SetDelta(bool enable, TSTR sigDir)
+{
+    m_delta     = enable;
+    m_sigDir    = sigDir;
+}
+
+delta_stats PosixFTP::GetDeltaStats()
+{
+    return m_deltaStats;
+}
+
+void PosixFTP::SetTimeout(int ms)
+{
+    m_timeout = ms > 0 ? ms : FTP_TIMEOUT;
+}
+
+void PosixFTP::SetResume(int retries, TSTR journalDir)
+{
+    m_retries   = retries > 0 ? retries : 0;
+    m_journal   = journalDir;
+
+    // Best effort, a journal that can't be written only costs the restart
+    if(!m_journal.empty())
+        mkdir(m_journal.c_str(), 0700);
+}
+
+#if defined(CONNSTREAM_TLS)
+void PosixFTP::SetTLS(std::shared_ptr<tlscontext> ctx, bool protectData)
+{
+    m_tls       = ctx;
+    m_protect   = protectData;
+}
+
+tls_stats PosixFTP::GetTLSStats()
+{
+    return m_tlsStats;
+}
+#endif
+
+void PosixFTP::SetScheduler(std::shared_ptr<transferscheduler> sched, int cls, long long bytesPerSec)
+{
+    m_sched = sched;
+    m_flow.SetClass(cls);
+    m_flow.SetRate(bytesPerSec);
+}
+
+std::shared_ptr<transferscheduler> PosixFTP::GetScheduler()
+{
+    return m_sched;
+}
+
+int PosixFTP::GetPriority()
+{
+    return m_flow.GetClass();
+}
+
+void PosixFTP::SetCache(std::shared_ptr<metacache> cache)
+{
+    m_cache = cache;
+}
+
+std::shared_ptr<metacache> PosixFTP::GetCache()
+{
+    return m_cache;
+}
+
+int PosixFTP::GetLastError(void)
+{
+    return m_err;
+}
+
+#endif
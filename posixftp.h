@@ -0,0 +1,593 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+#ifndef _POSIXFTP_H_
+#define _POSIXFTP_H_
+
+/* The POSIX backend speaks RFC 959 directly over BSD sockets,
+ * MSVC builds should use the WinInet backend in ftp.h instead */
+#if defined(_MSC_VER)
+#error posixftp.h is not supported by MSVC, use ftp.h
+#endif
+
+#if !defined(_MSC_VER)
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "checksum.h"
+#include "compress.h"
+#include "connstream.h"
+#include "delta.h"
+#include "dirlist.h"
+#include "metacache.h"
+#include "scheduler.h"
+#include "telemetry.h"
+#include "tls.h"
+#include "uring.h"
+
+#if defined(UNICODE) || defined(_UNICODE_)
+#error posixftp.h only supports narrow TSTR
+#endif
+
+#define FTP_DEFAULT_PORT    21
+#define FTP_TIMEOUT         30000   // Milliseconds before a socket wait gives up
+#define FTP_REPLY_BUFSIZE   8192    // Control channel receive buffer
+#define FTP_CMD_BUFSIZE     4096    // Longest command line that can be sent
+#define FTP_ZEROCOPY_CHUNK  (16 << 20)  // Bytes handed to one sendfile call
+#define FTP_PIPE_SIZE       (1 << 20)   // Splice pipe capacity for downloads
+#define FTP_PIPELINE_DEPTH  64          // Commands in flight before waiting on replies
+#define FTP_RESUME_BACKOFF  250         // Milliseconds before the first reconnect, doubling after
+#define FTP_RESUME_BACKOFF_MAX 8000
+
+/* m_paths slots */
+#define FTP_SLOT_ARG        0           // A path as it goes on the wire
+#define FTP_SLOT_ARG2       1           // RNTO's
+#define FTP_SLOT_KEY        2           // Cache key of the first
+#define FTP_SLOT_KEY2       3
+#define FTP_SLOT_SCRATCH    4           // A parent key, the next working directory
+
+/* Server features discovered through FEAT */
+#define FTP_FEAT_EPSV       0x0001
+#define FTP_FEAT_SIZE       0x0002
+#define FTP_FEAT_MDTM       0x0004
+#define FTP_FEAT_REST       0x0008
+#define FTP_FEAT_MLST       0x0010
+#define FTP_FEAT_UTF8       0x0020
+#define FTP_FEAT_HASH       0x0040
+#define FTP_FEAT_MODEZ      0x0080
+#define FTP_FEAT_RANG       0x0100
+
+/** NOTE: Use GetLastError() to examine the @false result from any method */
+
+class ftpstream;
+
+class PosixFTP : public connstream
+{
+    public:
+        /** Sets up local variables, no socket is opened until Connect */
+        PosixFTP(void);
+        /** Disconnects session on scope end if not already disconnected */
+        virtual ~PosixFTP(void);
+
+        /// CONNECTION METHODS ///
+        /** bool Connect(TSTR, TSTR, TSTR, int)
+         *  Connects to FTP server and logs in, the control connection is
+         *  kept open and reused by every following call.
+         *      @lpszServerName : Fully qualified domain name or IP Address
+         *      @lpszUser       : User id, blank for anonymous
+         *      @lpszPassword   : User password
+         *      @port           : Control port
+         *  Returns : @true on connect of @false on failure
+         */
+        /** bool Disconnect(void)
+         *  Sends QUIT and closes the control connection.
+         *
+         *  Returns : @true on successful disconnect or @false if already disconnected
+         */
+        bool Connect(TSTR lpszServerName,
+                     TSTR lpszUser,
+                     TSTR lpszPassword,
+                     int port = FTP_DEFAULT_PORT);
+        bool Disconnect(void);
+
+        /// GET/PUSH METHODS ///
+        /** Uploads a file from client location to server location with STOR.
+         *  The data connection is fed with sendfile(2) unless zero-copy is disabled.
+         *      @lpszLocation   : Client relative file location
+         *      @lpszRemFile    : File name to be saved on server, leave blank for original name
+         *  Returns : @true on successful upload or @false on failed upload
+         */
+        /** Downloads a file from server location to client location with RETR.
+         *  The payload is spliced through a pipe into the file unless zero-copy is disabled.
+         *      @lpszLocation    : Server relative file loaction
+         *      @lpszRemName     : File name to be saved on client, leave blank for original name
+         *  Returns : @true on successful download or @false on failed download
+         */
+        bool Upload(TSTR lpszLocation, TSTR lpszRemFile);
+        bool Download(TSTR lpszLocation, TSTR lpszRemName);
+
+        /// STREAMING METHODS ///
+        /** datastream OpenRead(TSTR, long long)
+         *  RETR as a stream, a non-zero @offset is sent as REST first.
+         *  Closing before end of file drops the data connection and sends ABOR.
+         */
+        /** datastream OpenWrite(TSTR, bool)
+         *  STOR as a stream, or APPE when @append is set.
+         */
+        datastream  OpenRead(TSTR lpszLocation, long long offset = 0);
+        datastream  OpenWrite(TSTR lpszLocation, bool append = false);
+
+        /// DIRECTORY METHODS ///
+        /** bool ChangeDir(TSTR)    - CWD
+         *  bool MakeDir(TSTR)      - MKD
+         *  bool RemoveDir(TSTR)    - RMD
+         *  TSTR CurrentDir(void)   - PWD once per connection, then as tracked
+         *                            through ChangeDir. "ERROR-1" on failure like FTP
+         *  LIST SearchDir(TSTR)
+         *      Lists the directory part of @lpszSearchStr with MLSD (or NLST when
+         *      the server lacks MLST) and filters the names against the wildcard
+         *      part with fnmatch(3). "*.*" matches every name as it does on Windows.
+         */
+        bool    ChangeDir(TSTR lpszDirectory);
+        bool    MakeDir(TSTR lpszDirectory);
+        bool    RemoveDir(TSTR lpszDirectory);
+        TSTR    CurrentDir(void);
+        LIST    SearchDir(TSTR lpszSearchStr);
+
+        /** bool ListDir(TSTR, DirList&)
+         *  Lists @lpszDirectory (blank for the current one) with MLSD, or with
+         *  LIST parsed as UNIX ls output when the server lacks MLST, replacing
+         *  @entries. Refreshes the metadata cache when one is set.
+         */
+        /** bool ListDir(TSTR, std::function<bool(const DirEntry&)>)
+         *  Streams the same entries to @callback as they come off the data
+         *  connection, nothing is kept. An entry's name is only valid during
+         *  the call. Returning @false stops early, the transfer is aborted.
+         */
+        typedef std::function<bool(const DirEntry&)> DIRCALLBACK;
+
+        bool    ListDir(TSTR lpszDirectory, DirList& entries);
+        bool    ListDir(TSTR lpszDirectory, DIRCALLBACK callback);
+
+        /// FILE HANDLING METHODS ///
+        /** bool Remove(TSTR)           - DELE
+         *  bool Rename(TSTR, TSTR)     - RNFR/RNTO
+         *  bool Exists(TSTR)           - MLST, or SIZE then NLST when MLST is missing
+         *  long long GetFileSize(TSTR) - SIZE, no data connection is opened
+         *  long long GetModTime(TSTR)  - MDTM as UTC seconds since the epoch,
+         *                                INVALID_FILE on failure
+         */
+        bool        Remove(TSTR lpszFileName);
+        bool        Rename(TSTR lpszOldFileName, TSTR lpszNewFileName);
+        bool        Exists(TSTR lpszFilename);
+        long long   GetFileSize(TSTR lpszFileName);
+        long long   GetModTime(TSTR lpszFileName);
+
+        /// PATH VIEW METHODS ///
+        /** The calls above without copying their paths, see connstream. The
+         *  command and cache key are built in m_paths and the working
+         *  directory comes from m_cwd, so a call that is answered by the
+         *  metadata cache or by one control round trip costs no allocation.
+         */
+        bool        ChangeDirView(TSTRVIEW dir);
+        bool        MakeDirView(TSTRVIEW dir);
+        bool        RemoveDirView(TSTRVIEW dir);
+        TSTRVIEW    CurrentDirView(void);
+        bool        RemoveView(TSTRVIEW filename);
+        bool        RenameView(TSTRVIEW oldFilename, TSTRVIEW newFilename);
+        bool        ExistsView(TSTRVIEW filename);
+        long long   GetFileSizeView(TSTRVIEW filename);
+        long long   GetModTimeView(TSTRVIEW filename);
+
+        /// PIPELINED METHODS ///
+        /** Bulk forms of the file handling methods. The commands are written
+         *  back-to-back on the control connection and the replies matched in
+         *  order, so N files cost roughly one round trip instead of N.
+         *  Results line up with the input, GetLastError() holds the first
+         *  failure or 0 when every command succeeded.
+         *
+         *  std::vector<long long> GetFileSizes(const LIST&) - SIZE, INVALID_FILE per failure
+         *  std::vector<long long> GetModTimes(const LIST&)  - MDTM, INVALID_FILE per failure
+         *  size_t RemoveMany(const LIST&, std::vector<int>*)    - DELE
+         *  size_t MakeDirs(const LIST&, std::vector<int>*)      - MKD
+         *  size_t RenameMany(const RENAMES&, std::vector<int>*) - RNFR/RNTO pairs
+         *      @codes : Optional, receives each reply code (RNTO's for a rename),
+         *               -1 when the command never got a reply
+         *  Returns : the number of entries that succeeded
+         */
+        typedef std::vector<std::pair<TSTR, TSTR> > RENAMES;
+
+        std::vector<long long>  GetFileSizes(const LIST& files);
+        std::vector<long long>  GetModTimes(const LIST& files);
+        size_t                  RemoveMany(const LIST& files, std::vector<int>* codes = NULL);
+        size_t                  MakeDirs(const LIST& dirs, std::vector<int>* codes = NULL);
+        size_t                  RenameMany(const RENAMES& names, std::vector<int>* codes = NULL);
+
+        /// MISCELLANEOUS METHODS ///
+        /** int GetHandle(void)
+         *  Gets the control connection socket for cross-API use
+         *
+         *  Returns : socket descriptor or -1 if there is no connection
+         */
+        /** bool Command(TSTR)
+         *  Executes a user defined FTP Command on the control connection
+         *
+         *  Returns : @true if the server replied with a 1xx-3xx code or @false if not or
+         *              if there is no active connection.
+         */
+        int     GetHandle(void);
+        bool    Command(TSTR lpszCommand);
+
+        /** int GetLastReply(void) / const char * GetLastReplyText(void)
+         *  Code and text of the last control reply, multi-line replies are joined
+         *  with '\n'. The text is owned by the session and overwritten by the next call.
+         */
+        int         GetLastReply(void);
+        const char* GetLastReplyText(void);
+
+        /** unsigned GetFeatures(void)
+         *  FTP_FEAT_* flags the server advertised through FEAT at login.
+         */
+        unsigned    GetFeatures(void);
+
+        /** void SetZeroCopy(bool)
+         *  Enables sendfile/splice on the data connection (the default). Either
+         *  path drops to a buffered read/write loop when the kernel refuses it.
+         */
+        void        SetZeroCopy(bool enable);
+
+        /** void SetEngine(std::shared_ptr<uringengine>)
+         *  Runs the data side of Upload/Download on an io_uring engine (see
+         *  uring.h), which any number of sessions may share. A transfer the
+         *  engine refuses before moving a byte takes the SetZeroCopy path
+         *  instead. NULL (the default) never uses it.
+         */
+        void                            SetEngine(std::shared_ptr<uringengine> engine);
+        std::shared_ptr<uringengine>    GetEngine(void);
+
+        /** void SetChecksum(int, bool)
+         *  Hashes every Upload/Download with @algorithm (CHECKSUM_*) as the
+         *  bytes pass through, CHECKSUM_NONE (the default) turns it off.
+         *  Hashing bypasses sendfile/splice, the io_uring engine still applies.
+         *      @verify : Check the digest against the server's HASH, or XCRC/XMD5
+         *                for CRC32/MD5. A mismatch fails the transfer with
+         *                EBADMSG, a server with no way to check with EOPNOTSUPP.
+         */
+        /** TSTR GetChecksum(void)
+         *  Hex digest of the last Upload/Download, blank when it failed before
+         *  the data was through or hashing is off.
+         */
+        void        SetChecksum(int algorithm, bool verify = false);
+        TSTR        GetChecksum(void);
+
+        /** void SetCompression(bool, int)
+         *  Sends Upload/Download in MODE Z (deflate) when the server lists it
+         *  in FEAT, plain MODE S otherwise. Deflate runs on a codecpipe thread
+         *  beside the socket loop and a file that doesn't compress goes out
+         *  stored past CODEC_SAMPLE bytes. Replaces the io_uring engine and
+         *  sendfile/splice for those transfers, listings and streams stay MODE S.
+         *      @level : zlib level 1-9, -1 for its default
+         */
+        void        SetCompression(bool enable, int level = -1);
+
+        /** void SetDelta(bool, TSTR)
+         *  Moves only the blocks that changed when the other side already has
+         *  a copy of the file (see delta.h). Download matches the local copy
+         *  against the host's <file>.connsig at any offset when there is one,
+         *  otherwise compares block digests in place through HASH with RANG.
+         *  Missing ranges are fetched with RANG, or REST and an ABOR once they
+         *  are in, into a side file that is renamed in when its digest checks.
+         *  Upload rewrites changed blocks in place with REST + STOR, appends
+         *  the tail and checks the result with HASH, then publishes
+         *  <file>.connsig for the next Download. Whatever the server can't do
+         *  moves the whole file as usual.
+         *      @sigDir : Where signatures of local files are cached, blank for
+         *                <file>.connsig beside each one
+         */
+        /** delta_stats GetDeltaStats(void)
+         *  What the last Upload/Download moved and what it saved.
+         */
+        void        SetDelta(bool enable, TSTR sigDir = _T(""));
+        delta_stats GetDeltaStats(void);
+
+        /** void SetTimeout(int)
+         *  Milliseconds to wait on any single socket operation, FTP_TIMEOUT by default.
+         */
+        void        SetTimeout(int ms);
+
+        /** void SetResume(int, TSTR)
+         *  Lets a plain Upload/Download that loses its data or control
+         *  connection carry on where it stopped rather than fail. Up to
+         *  @retries times it backs off (FTP_RESUME_BACKOFF, doubling),
+         *  reconnects if the session went with it, probes how much arrived
+         *  (local stat or remote SIZE) and continues with REST + RETR or APPE.
+         *  With @journalDir each transfer leaves a checkpoint there until it
+         *  completes, so a later call for the same files, in this process or
+         *  the next, picks up the partial copy when the source hasn't changed.
+         *  0 @retries turns it off. Delta transfers aren't resumed.
+         *  NB: The password is kept in memory until Disconnect to log back in.
+         */
+        void        SetResume(int retries, TSTR journalDir = _T(""));
+
+#if defined(CONNSTREAM_TLS)
+        /** void SetTLS(std::shared_ptr<tlscontext>, bool)
+         *  Makes Connect negotiate explicit FTPS (RFC 4217): AUTH TLS right
+         *  after the greeting so the login and every command go encrypted,
+         *  then PBSZ 0 and PROT P so data connections are too. A server that
+         *  refuses fails the connect, there is no falling back to cleartext.
+         *  Data connections resume the control connection's TLS session.
+         *  Where kernel TLS takes the keys sendfile/splice and the io_uring
+         *  engine carry on as before, otherwise data goes through OpenSSL.
+         *  Takes effect at the next Connect, NULL (the default) turns it off.
+         *      @protectData : @false encrypts the control connection only
+         */
+        /** tls_stats GetTLSStats(void) - How the data connections since Connect were secured */
+        void        SetTLS(std::shared_ptr<tlscontext> ctx, bool protectData = true);
+        tls_stats   GetTLSStats(void);
+#endif
+
+        /** void SetScheduler(std::shared_ptr<transferscheduler>, int, long long)
+         *  Joins the session to @sched (see scheduler.h), which paces the data
+         *  of every Upload, Download and stream in SCHED_QUANTUM chunks against
+         *  the other sessions on it, by class and under its rate limits.
+         *  sendfile/splice move a chunk per grant and the io_uring engine,
+         *  which can't be paced, is passed over. Listings go unpaced.
+         *      @cls         : SCHED_* priority class of this session's transfers
+         *      @bytesPerSec : This session's own cap, 0 for none
+         *  NULL (the default) moves data as fast as the connection allows.
+         */
+        void                                SetScheduler(std::shared_ptr<transferscheduler> sched,
+                                                         int cls = SCHED_NORMAL, long long bytesPerSec = 0);
+        std::shared_ptr<transferscheduler>  GetScheduler(void);
+        int                                 GetPriority(void);
+
+        /** void SetCache(std::shared_ptr<metacache>)
+         *  Serves Exists, GetFileSize(s), GetModTime(s) and SearchDir from @cache
+         *  while its entries are fresh, and keeps it current through this
+         *  session's own changes. The cache may be shared with other sessions,
+         *  entries are keyed by user@host:port. NULL turns caching off.
+         *  NB: Command() is passed through blind, a raw command that changes
+         *      the server should be followed by a cache Invalidate.
+         */
+        void                        SetCache(std::shared_ptr<metacache> cache);
+        std::shared_ptr<metacache>  GetCache(void);
+
+        /** int GetLastError()
+         *  Retrieves the last error (return) value executed by the last method call.
+         *
+         *  Returns : 0x00 on successful last method call, the FTP reply code (400+)
+         *            on a refused command or the errno value on a socket/file failure.
+         */
+        int GetLastError(void);
+
+    protected:
+        friend class ftpstream;
+
+        /** connresult detail, the last reply code and what the last
+         *  Upload/Download put on the data connection */
+        int         LastReply(void);
+        long long   LastMoved(void);
+
+        /// CONTROL CHANNEL ///
+        /** Exec sends "verb arg" and reads the reply, returning the reply code or
+         *  -1 on a socket failure. Arguments holding CR/LF are refused with EINVAL.
+         */
+        int     Exec(const char* verb, const char* arg = NULL);
+        bool    SendCmd(const char* verb, const char* arg);
+        int     ReadReply(void);
+        bool    ReadLine(const char** line, size_t* len);
+
+        /** Pipeline sends every command in @cmds without waiting in between,
+         *  keeping at most FTP_PIPELINE_DEPTH unanswered, and stores each reply
+         *  code in @codes. A 213 reply's value (SIZE bytes, MDTM time) goes to
+         *  @values and every reply's text to @texts when given. Commands that
+         *  can't be sent get code 0.
+         *  Returns @false when the control connection was lost part way, the
+         *  unanswered entries are left at -1.
+         */
+        struct pipecmd
+        {
+            const char* verb;
+            const char* arg;
+        };
+        bool    Pipeline(const std::vector<pipecmd>& cmds, int* codes, long long* values = NULL, TSTR* texts = NULL);
+
+        /** PipelineEach runs "verb arg" for every entry of @args, counting the
+         *  2xx replies and setting m_err from the first failure.
+         */
+        size_t  PipelineEach(const char* verb,
+                             const LIST& args,
+                             std::vector<int>* codes,
+                             std::vector<long long>* values = NULL);
+        size_t  PipelineResult(const int* codes, size_t count, bool connected);
+
+        /// DATA CHANNEL ///
+        /** OpenTransfer connects a passive data connection (EPSV, falling back to
+         *  PASV), sends REST when @offset is set, or RANG @offset @last when
+         *  @last is, then "verb arg" and waits for the 1xx preliminary reply.
+         *  MODE is switched first when @deflate doesn't match what the server is in.
+         *  Returns the connected data socket or -1.
+         *  CloseTransfer closes it and reads the completion reply.
+         *  TransferDone is called once its socket is closed, however that happened.
+         */
+        int     OpenData(void);
+        int     OpenTransfer(const char* verb, const char* arg, long long offset = 0, bool deflate = false,
+                             long long last = -1);
+        bool    CloseTransfer(int data, int err);
+        void    TransferDone(void);
+        bool    ListData(const char* verb, const char* arg, std::string& out);
+
+        /** ListNames lists @dir with MLSD (or NLST) into bare @names, storing
+         *  the listing and any MLSD facts under @key when it is set. */
+        bool    ListNames(const TSTR& dir, const TSTR* key, LIST& names);
+
+        /** SendFromFile/RecvToFile move a whole file over a data socket and
+         *  return 0 or the errno that stopped them. AnnouncedSize reads the
+         *  "(n bytes)" hint of a 150 reply, INVALID_FILE when absent.
+         *  SendDeflated/RecvInflated are the MODE Z versions.
+         */
+        int         SendFromFile(int fd, int data);
+        int         SendFileZeroCopy(int fd, int data);
+        int         RecvToFile(int data, int fd);
+        int         SendDeflated(int fd, int data);
+        int         RecvInflated(int data, int fd);
+        int         WriteAll(int fd, const char* buf, size_t len);
+        long long   AnnouncedSize(void);
+
+        /** RemoteDigest asks the server for its @alg digest of @remote through
+         *  HASH (switching with OPTS HASH first), or XCRC/XMD5. HashOffered says
+         *  whether FEAT listed @alg for HASH. VerifyChecksum compares the
+         *  digest of m_sum's algorithm with m_digest. */
+        bool        HashOffered(int alg);
+        bool        SelectHash(int alg);
+        bool        RemoteDigest(const TSTR& remote, int alg, TSTR& hex);
+        bool        VerifyChecksum(const TSTR& remote);
+
+        /// DELTA TRANSFER ///
+        /** DownloadDelta/UploadDelta return 1 when the file was moved as a
+         *  delta, 0 on a failure that a whole transfer can't get past either
+         *  and -1 when the whole file should be moved instead.
+         *  LocalSig loads the cached signature of @fd or builds and caches
+         *  one, RemoteSig fetches the host's <file>.connsig when it still
+         *  describes the @size bytes there and BlockDigests asks HASH for
+         *  every block of @remote in one pipeline. FetchRange writes @len
+         *  bytes of @remote from @offset into @fd at the same offset.
+         */
+        int         DownloadDelta(const TSTR& remote, const TSTR& local);
+        int         UploadDelta(int fd, const TSTR& local, const TSTR& remote);
+        bool        PublishSig(int fd, const TSTR& local, const TSTR& remote);
+        TSTR        SigPath(const TSTR& local);
+        bool        LocalSig(int fd, const TSTR& local, unsigned block, int alg, deltasig& sig);
+        bool        RemoteSig(const TSTR& remote, long long size, deltasig& sig);
+        bool        BlockDigests(const TSTR& remote, long long size, unsigned block, int alg, LIST& hex);
+        bool        FetchRange(const TSTR& remote, long long offset, long long len, int fd);
+        bool        SendRange(int fd, const TSTR& remote, long long offset, long long len);
+        int         DeltaAlgorithm(void);
+
+        /** EndStream finishes the transfer behind an open ftpstream, DetachStream
+         *  cuts it loose when the session goes away first. */
+        bool        EndStream(ftpstream* s);
+        void        DetachStream(void);
+
+        /// RESUME ///
+        /** Fetch and Push make one attempt at a plain Download/Upload from
+         *  @offset, RETR after REST or APPE. Resumable decides whether the
+         *  failure just seen is worth attempt @attempt + 1, backs off and
+         *  reconnects when the session is gone. Rehash runs the first @offset
+         *  bytes of @fd back through the checksum. Checkpoint compares the
+         *  journal entry at @path against the source's @size and @mtime,
+         *  rewrites it and returns where the transfer can pick up given
+         *  @have bytes at the target, 0 to start over.
+         */
+        bool        Fetch(const TSTR& remote, int fd, long long offset, bool deflate);
+        bool        Push(int fd, const TSTR& remote, long long offset, bool deflate);
+        bool        Resumable(int& attempt);
+        bool        Rehash(int fd, long long offset);
+        long long   Probe(const char* verb, const TSTR& path);
+        TSTR        JournalPath(bool upload, const TSTR& remote, const TSTR& local);
+        long long   Checkpoint(const TSTR& path, long long size, long long mtime, long long have);
+
+        /** Fail records @err in m_err, Drop also closes the control connection
+         *  and Refused maps an Exec result onto either of them.
+         */
+        bool    Fail(int err);
+        bool    Drop(int err);
+        bool    Refused(int code);
+
+        /// METADATA CACHE ///
+        /** CacheKey maps a path onto its cache key, fetching the working
+         *  directory once for relative paths. Returns @false when there is no
+         *  cache. CacheChanged records what a successful change left behind:
+         *  the old entry (or, with @tree, everything under it) is dropped,
+         *  @type is stored when >= 0 and the parent's listing is dropped.
+         */
+        bool    CacheKey(TSTRVIEW path, TSTR& key);
+        TSTR    CacheParent(const TSTR& key);
+        void    CacheChanged(const TSTR& key, int type, long long size = INVALID_FILE, bool tree = false);
+        bool    CacheLookup(const TSTR& key, metaentry& entry);
+        std::vector<long long> StatMany(const char* verb, const LIST& files);
+
+        /// SOCKET HELPERS ///
+        int     ConnectTo(const struct sockaddr* addr, socklen_t len);
+        bool    WaitFd(int fd, short events);
+        bool    SendAll(int fd, const char* buf, size_t len);
+
+        /** Recv/Send are recv/send through the TLS link on @fd when it has
+         *  one. Offload says whether the kernel sees what goes @sending (or
+         *  comes) over data connection @data as it is, in cleartext or under
+         *  kernel TLS, so sendfile/splice can move it. CloseData closes
+         *  @data, ending its TLS with close_notify when @graceful.
+         */
+        ssize_t Recv(int fd, void* buf, size_t len);
+        ssize_t Send(int fd, const void* buf, size_t len);
+        bool    Offload(int data, bool sending);
+        void    CloseData(int data, bool graceful);
+
+        /** Pace charges @bytes a data connection just moved to the scheduler,
+         *  blocking until this session's turn comes round again. */
+        void    Pace(size_t bytes);
+
+        int                     m_ctrl;
+        int                     m_timeout;
+        unsigned                m_feat;
+        bool                    m_noEpsv;
+        bool                    m_zeroCopy;
+        int                     m_pipe[2];
+        ftpstream*              m_stream;
+        struct sockaddr_storage m_peer;
+        socklen_t               m_peerlen;
+        std::shared_ptr<uringengine> m_engine;      // io_uring data path, NULL for sendfile/splice
+        std::shared_ptr<transferscheduler> m_sched; // NULL when unpaced
+        schedflow               m_flow;
+        checksum                m_sum;
+        bool                    m_sumVerify;
+        TSTR                    m_digest;
+        TSTR                    m_hashAlgs;     // FEAT HASH list, "SHA-256*;MD5;CRC32"
+        int                     m_hashSel;      // Algorithm the server's HASH currently uses
+        bool                    m_compress;
+        int                     m_level;
+        bool                    m_modeZ;        // Server is in MODE Z
+        bool                    m_delta;
+        TSTR                    m_sigDir;
+        delta_stats             m_deltaStats;
+        int                     m_retries;
+        TSTR                    m_journal;
+        TSTR                    m_host;         // What Connect was given, to log back in
+        TSTR                    m_user;
+        TSTR                    m_pwd;
+        int                     m_port;
+        TELEMETRY_ONLY(telemetry_session m_telemetry;)
+#if defined(CONNSTREAM_TLS)
+        std::shared_ptr<tlscontext> m_tls;
+        bool                    m_protect;      // Ask for PROT P
+        bool                    m_private;      // PROT P is in effect
+        tlslink                 m_ctrlTls;
+        tlslink                 m_dataTls;      // The one transfer's, like m_stream
+        tls_stats               m_tlsStats;
+#endif
+
+        std::shared_ptr<metacache>  m_cache;
+        TSTR                        m_site;         // user@host:port, prefixes every cache key
+        TSTR                        m_cwd;          // Absolute, empty until known
+        TSTR                        m_streamKey;    // Cache key of the file open for writing
+
+        int     m_reply;
+        char    m_text[FTP_REPLY_BUFSIZE];
+        size_t  m_textlen;
+        char    m_rbuf[FTP_REPLY_BUFSIZE];
+        size_t  m_rhead;
+        size_t  m_rtail;
+        char    m_cmd[FTP_CMD_BUFSIZE];
+};
+
+#endif
+
+#endif
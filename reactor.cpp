@@ -0,0 +1,250 @@
+#include <reactor.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+
+reactor::reactor()
+{
+    m_gen       = 0;
+    m_nextTimer = 0;
+    m_stop      = false;
+    m_thread    = std::this_thread::get_id();
+    m_err       = 0;
+
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    m_wake  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_epoll < 0 || m_wake < 0)
+    {
+        m_err = errno;
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.u64 = (uint64_t)(uint32_t)m_wake;
+    if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &ev) < 0)
+        m_err = errno;
+}
+
+reactor::~reactor()
+{
+    m_watches.clear();
+    m_timers.clear();
+    m_posted.clear();
+    if(m_wake >= 0)
+        close(m_wake);
+    if(m_epoll >= 0)
+        close(m_epoll);
+}
+
+
+/// SOCKETS ///
+
+bool reactor::Add(int fd, unsigned events, iohandler handler)
+{
+    std::shared_ptr<watch> w(new watch);
+    w->handler  = handler;
+    w->gen      = ++m_gen;
+
+    struct epoll_event ev;
+    ev.events   = events;
+    ev.data.u64 = ((uint64_t)w->gen << 32) | (uint32_t)fd;
+    if(epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        m_err = errno;
+        return false;
+    }
+
+    m_watches[fd] = w;
+    return true;
+}
+
+bool reactor::Modify(int fd, unsigned events)
+{
+    std::unordered_map<int, std::shared_ptr<watch> >::iterator it = m_watches.find(fd);
+    if(it == m_watches.end())
+    {
+        m_err = ENOENT;
+        return false;
+    }
+
+    struct epoll_event ev;
+    ev.events   = events;
+    ev.data.u64 = ((uint64_t)it->second->gen << 32) | (uint32_t)fd;
+    if(epoll_ctl(m_epoll, EPOLL_CTL_MOD, fd, &ev) < 0)
+    {
+        m_err = errno;
+        return false;
+    }
+    return true;
+}
+
+void reactor::Remove(int fd)
+{
+    std::unordered_map<int, std::shared_ptr<watch> >::iterator it = m_watches.find(fd);
+    if(it == m_watches.end())
+        return;
+
+    epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, NULL);
+    m_watches.erase(it);
+}
+
+
+/// TIMERS ///
+
+reactor::timerid reactor::After(int ms, task t)
+{
+    timerid id = ++m_nextTimer;
+    clock::time_point at = clock::now() + std::chrono::milliseconds(ms > 0 ? ms : 0);
+    m_timers[std::make_pair(at, id)] = t;
+    m_timerAt[id] = at;
+    return id;
+}
+
+void reactor::CancelTimer(timerid id)
+{
+    std::unordered_map<timerid, clock::time_point>::iterator it = m_timerAt.find(id);
+    if(it == m_timerAt.end())
+        return;
+    m_timers.erase(std::make_pair(it->second, id));
+    m_timerAt.erase(it);
+}
+
+int reactor::RunTimers()
+{
+    int ran = 0;
+    clock::time_point now = clock::now();
+
+    // Each task is unlinked before it runs so it may add or cancel timers freely
+    while(!m_timers.empty() && m_timers.begin()->first.first <= now)
+    {
+        task t;
+        t.swap(m_timers.begin()->second);
+        m_timerAt.erase(m_timers.begin()->first.second);
+        m_timers.erase(m_timers.begin());
+        t();
+        ran++;
+    }
+    return ran;
+}
+
+int reactor::NextTimeout(int timeout)
+{
+    if(m_timers.empty())
+        return timeout;
+
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        m_timers.begin()->first.first - clock::now()).count() + 1;
+    if(ms < 0)
+        ms = 0;
+    return timeout < 0 || ms < timeout ? (int)ms : timeout;
+}
+
+
+/// POSTED TASKS ///
+
+void reactor::Post(task t)
+{
+    {
+        std::lock_guard<std::mutex> g(m_postLock);
+        m_posted.push_back(t);
+    }
+
+    uint64_t one = 1;
+    if(write(m_wake, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        m_err = errno;
+}
+
+int reactor::RunPosted()
+{
+    std::vector<task> run;
+    {
+        std::lock_guard<std::mutex> g(m_postLock);
+        run.swap(m_posted);
+    }
+    for(size_t i = 0; i < run.size(); i++)
+        run[i]();
+    return (int)run.size();
+}
+
+
+/// LOOP ///
+
+int reactor::Poll(int timeout)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    int n;
+    do
+        n = epoll_wait(m_epoll, events, REACTOR_MAX_EVENTS, NextTimeout(timeout));
+    while(n < 0 && errno == EINTR);
+    if(n < 0)
+    {
+        m_err = errno;
+        return -1;
+    }
+
+    int ran = 0;
+    for(int i = 0; i < n; i++)
+    {
+        int fd          = (int)(uint32_t)events[i].data.u64;
+        unsigned gen    = (unsigned)(events[i].data.u64 >> 32);
+
+        if(fd == m_wake)
+        {
+            uint64_t count;
+            while(read(m_wake, &count, sizeof(count)) > 0)
+                ;
+            continue;
+        }
+
+        // A handler earlier in this batch may have removed or replaced the watch
+        std::unordered_map<int, std::shared_ptr<watch> >::iterator it = m_watches.find(fd);
+        if(it == m_watches.end() || it->second->gen != gen)
+            continue;
+
+        std::shared_ptr<watch> w = it->second;
+        w->handler(events[i].events);
+        ran++;
+    }
+
+    ran += RunTimers();
+    ran += RunPosted();
+    return ran;
+}
+
+void reactor::Run()
+{
+    m_thread = std::this_thread::get_id();
+    while(!m_stop)
+        if(Poll(-1) < 0)
+            break;
+}
+
+void reactor::Stop()
+{
+    m_stop = true;
+    Post(task([]() {}));
+}
+
+void reactor::Restart()
+{
+    m_stop = false;
+}
+
+bool reactor::InLoopThread()
+{
+    return std::this_thread::get_id() == m_thread;
+}
+
+size_t reactor::Watched()
+{
+    return m_watches.size();
+}
+
+int reactor::GetLastError()
+{
+    return m_err;
+}
@@ -0,0 +1,139 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Reactor
+  *
+  * A single threaded epoll(7) event loop. Sockets are registered with
+  * a handler that runs on the loop thread whenever they become ready,
+  * timers run a task once after a delay, and Post hands a task to the
+  * loop from any other thread. One reactor thread can drive thousands
+  * of non-blocking sockets, see AsyncFTP.
+  *
+  * Only Post, Stop and InLoopThread may be called off the loop thread,
+  * everything else belongs to handlers and tasks already on it.
+  *
+  * E.G. Usage:
+  *     reactor loop;
+  *     std::thread t([&]() { loop.Run(); });
+  *     loop.Post([&]() { loop.After(1000, [&]() { loop.Stop(); }); });
+  *     t.join();
+  */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+#if defined(_MSC_VER)
+#error reactor.h needs epoll(7), it is not supported by MSVC
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define REACTOR_MAX_EVENTS  256     // epoll_wait batch
+
+/* Readiness flags handed to Add/Modify and back to handlers, same values as EPOLLIN etc */
+#define REACTOR_READ        0x001
+#define REACTOR_WRITE       0x004
+#define REACTOR_ERROR       0x008
+#define REACTOR_HANGUP      0x010
+
+class reactor
+{
+    public:
+        typedef std::function<void(unsigned events)>    iohandler;
+        typedef std::function<void(void)>               task;
+        typedef unsigned long long                      timerid;
+
+        /** Creates the epoll and wake descriptors, check GetLastError() */
+        reactor(void);
+        /** Drops every handler, timer and posted task without running them */
+        virtual ~reactor(void);
+
+        /** bool Add(int, unsigned, iohandler)
+         *  Watches @fd for @events (REACTOR_READ | REACTOR_WRITE), level
+         *  triggered. @handler gets the ready flags, errors and hangups
+         *  are always reported.
+         *  Returns : @false if epoll refused the descriptor
+         */
+        /** bool Modify(int, unsigned) - Changes the events watched on @fd
+         *  void Remove(int)           - Stops watching @fd, call before closing it
+         */
+        bool    Add(int fd, unsigned events, iohandler handler);
+        bool    Modify(int fd, unsigned events);
+        void    Remove(int fd);
+
+        /** timerid After(int, task)
+         *  Runs @t once, @ms milliseconds from now.
+         *  Returns : an id for CancelTimer, never 0
+         */
+        timerid After(int ms, task t);
+        void    CancelTimer(timerid id);
+
+        /** void Post(task)
+         *  Queues @t to run on the loop thread and wakes the loop. Thread-safe.
+         */
+        void    Post(task t);
+
+        /** int Poll(int)
+         *  Runs one round: waits up to @timeout milliseconds (-1 forever) for
+         *  sockets, timers or posted tasks, then runs whatever is due.
+         *  Returns : handlers and tasks run, or -1 on an epoll failure
+         */
+        /** void Run(void)
+         *  Polls until Stop is called, its thread becoming the loop thread
+         *  (until then the one that made the reactor). A Stop from before
+         *  Run started counts, Run returns straight away.
+         */
+        /** void Restart(void) - Clears a Stop so the loop can Run again */
+        int     Poll(int timeout);
+        void    Run(void);
+        void    Stop(void);
+        void    Restart(void);
+
+        bool    InLoopThread(void);
+        size_t  Watched(void);
+        int     GetLastError(void);
+
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct watch
+        {
+            iohandler   handler;
+            unsigned    gen;        // Tells a stale event from a reused descriptor
+        };
+        typedef std::map<std::pair<clock::time_point, timerid>, task> timermap;
+
+        reactor(const reactor&);
+        reactor& operator=(const reactor&);
+
+        int     RunTimers(void);
+        int     RunPosted(void);
+        int     NextTimeout(int timeout);
+
+        int                                         m_epoll;
+        int                                         m_wake;
+        std::unordered_map<int, std::shared_ptr<watch> > m_watches;
+        unsigned                                    m_gen;
+        timermap                                    m_timers;
+        std::unordered_map<timerid, clock::time_point> m_timerAt;
+        timerid                                     m_nextTimer;
+
+        std::mutex                                  m_postLock;
+        std::vector<task>                           m_posted;
+        std::atomic<bool>                           m_stop;
+        std::atomic<std::thread::id>                m_thread;   // Set by Run, read by InLoopThread from anywhere
+        std::atomic<int>                            m_err;      // Post sets it from any thread
+};
+
+#endif // _REACTOR_H_
@@ -0,0 +1,319 @@
+#include <scheduler.h>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+static const char*      g_classNames[SCHED_CLASSES] = { "interactive", "normal", "bulk" };
+static const unsigned   g_weights[SCHED_CLASSES]    = { 16, 4, 1 };
+
+static double Seconds(std::chrono::steady_clock::duration d)
+{
+    return std::chrono::duration<double>(d).count();
+}
+
+double sched_stats::MeanWait() const
+{
+    return grants ? waitSeconds / (double)grants : 0;
+}
+
+
+/// BUCKET ///
+
+schedbucket::schedbucket()
+    : rate(0), depth(0), tokens(0), last(std::chrono::steady_clock::now())
+{
+}
+
+void schedbucket::Set(long long bytesPerSec, long long burst)
+{
+    rate    = bytesPerSec > 0 ? (double)bytesPerSec : 0;
+    depth   = burst > 0 ? (double)burst : rate * SCHED_BURST / 1000;
+    if(depth < SCHED_QUANTUM)
+        depth = SCHED_QUANTUM;
+    tokens  = depth;
+    last    = std::chrono::steady_clock::now();
+}
+
+void schedbucket::Refill(std::chrono::steady_clock::time_point now)
+{
+    if(rate > 0 && now > last)
+        tokens = std::min(depth, tokens + rate * Seconds(now - last));
+    last = now;
+}
+
+double schedbucket::Delay() const
+{
+    return rate > 0 && tokens < 0 ? -tokens / rate : 0;
+}
+
+
+/// FLOW ///
+
+schedflow::schedflow()
+    : m_class(SCHED_NORMAL)
+{
+}
+
+void schedflow::SetClass(int cls)
+{
+    m_class = cls < 0 ? 0 : cls >= SCHED_CLASSES ? SCHED_CLASSES - 1 : cls;
+}
+
+void schedflow::SetHost(const TSTR& host)
+{
+    m_host = host;
+}
+
+void schedflow::SetRate(long long bytesPerSec, long long burst)
+{
+    m_bucket.Set(bytesPerSec, burst);
+}
+
+int schedflow::GetClass() const
+{
+    return m_class;
+}
+
+const TSTR& schedflow::GetHost() const
+{
+    return m_host;
+}
+
+
+/// SCHEDULER ///
+
+transferscheduler::transferscheduler()
+    : m_vtime(0), m_seq(0)
+{
+    clock::time_point now = clock::now();
+    for(int i = 0; i < SCHED_CLASSES; i++)
+    {
+        m_vfinish[i]        = 0;
+        m_stats[i]          = sched_stats();
+        m_stats[i].weight   = g_weights[i];
+        m_rateAt[i]         = now;
+    }
+}
+
+transferscheduler::~transferscheduler()
+{
+}
+
+std::shared_ptr<transferscheduler> transferscheduler::Global()
+{
+    static std::shared_ptr<transferscheduler> global(new transferscheduler());
+    return global;
+}
+
+void transferscheduler::SetRate(long long bytesPerSec, long long burst)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    m_bucket.Set(bytesPerSec, burst);
+    m_wake.notify_all();
+}
+
+void transferscheduler::SetHostRate(const TSTR& host, long long bytesPerSec, long long burst)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    m_hosts[host].Set(bytesPerSec, burst);
+    m_wake.notify_all();
+}
+
+void transferscheduler::SetWeight(int cls, unsigned weight)
+{
+    if(cls < 0 || cls >= SCHED_CLASSES)
+        return;
+    std::lock_guard<std::mutex> g(m_lock);
+    m_stats[cls].weight = weight ? weight : 1;
+}
+
+void transferscheduler::Acquire(schedflow& flow, size_t bytes)
+{
+    std::unique_lock<std::mutex> g(m_lock);
+    clock::time_point since = clock::now();
+
+    // Start-time fair queueing: a class's next chunk starts where its last
+    // one finished, or at the current virtual time if it has been idle
+    waiter w;
+    w.flow      = &flow;
+    w.bytes     = bytes;
+    w.start     = std::max(m_vtime, m_vfinish[flow.m_class]);
+    w.finish    = w.start + (double)bytes / m_stats[flow.m_class].weight;
+    w.seq       = m_seq++;
+    w.granted   = false;
+    m_vfinish[flow.m_class] = w.finish;
+
+    std::vector<waiter*>::iterator at = m_waiting.begin();
+    while(at != m_waiting.end() && (*at)->finish <= w.finish)
+        ++at;
+    m_waiting.insert(at, &w);
+    m_stats[flow.m_class].queued++;
+
+    bool waited = false;
+    for(;;)
+    {
+        double delay = Dispatch(clock::now());
+        if(w.granted)
+            break;
+        waited = true;
+        if(delay > 0)
+            m_wake.wait_for(g, std::chrono::duration<double>(delay));
+        else
+            m_wake.wait(g);
+    }
+
+    sched_stats& st = m_stats[flow.m_class];
+    double wait = Seconds(clock::now() - since);
+    st.queued--;
+    if(waited)
+    {
+        st.waits++;
+        st.waitSeconds += wait;
+        st.maxWait = std::max(st.maxWait, wait);
+    }
+}
+
+double transferscheduler::Delay(waiter& w, clock::time_point now)
+{
+    m_bucket.Refill(now);
+    double delay = m_bucket.Delay();
+
+    w.flow->m_bucket.Refill(now);
+    delay = std::max(delay, w.flow->m_bucket.Delay());
+
+    if(!w.flow->m_host.empty())
+    {
+        std::map<TSTR, schedbucket>::iterator host = m_hosts.find(w.flow->m_host);
+        if(host != m_hosts.end())
+        {
+            host->second.Refill(now);
+            delay = std::max(delay, host->second.Delay());
+        }
+    }
+    return delay;
+}
+
+void transferscheduler::Grant(waiter& w, clock::time_point now)
+{
+    double bytes = (double)w.bytes;
+    if(m_bucket.rate > 0)
+        m_bucket.tokens -= bytes;
+    if(w.flow->m_bucket.rate > 0)
+        w.flow->m_bucket.tokens -= bytes;
+    if(!w.flow->m_host.empty())
+    {
+        std::map<TSTR, schedbucket>::iterator host = m_hosts.find(w.flow->m_host);
+        if(host != m_hosts.end() && host->second.rate > 0)
+            host->second.tokens -= bytes;
+    }
+
+    m_vtime     = std::max(m_vtime, w.start);
+    w.granted   = true;
+
+    int cls = w.flow->m_class;
+    sched_stats& st = m_stats[cls];
+    st.bytes += w.bytes;
+    st.grants++;
+    st.throughput = st.throughput * exp(-Seconds(now - m_rateAt[cls]) / SCHED_RATE_WINDOW)
+                  + bytes / SCHED_RATE_WINDOW;
+    m_rateAt[cls] = now;
+}
+
+double transferscheduler::Dispatch(clock::time_point now)
+{
+    // Earliest finish first among those their buckets let through. One
+    // held back by the global bucket holds back everyone behind it, one
+    // held back by its own or its host's lets the next one by.
+    double next = 0;
+    bool granted = false;
+    for(size_t i = 0; i < m_waiting.size(); )
+    {
+        waiter& w = *m_waiting[i];
+        double delay = Delay(w, now);
+        if(delay > 0)
+        {
+            next = next > 0 ? std::min(next, delay) : delay;
+            if(m_bucket.Delay() > 0)
+                break;
+            i++;
+            continue;
+        }
+
+        Grant(w, now);
+        m_waiting.erase(m_waiting.begin() + i);
+        granted = true;
+    }
+
+    if(granted)
+        m_wake.notify_all();
+    return next;
+}
+
+sched_stats transferscheduler::GetStats(int cls)
+{
+    if(cls < 0 || cls >= SCHED_CLASSES)
+        return sched_stats();
+
+    std::lock_guard<std::mutex> g(m_lock);
+    sched_stats st = m_stats[cls];
+    st.throughput *= exp(-Seconds(clock::now() - m_rateAt[cls]) / SCHED_RATE_WINDOW);
+    return st;
+}
+
+void transferscheduler::ResetStats()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    clock::time_point now = clock::now();
+    for(int i = 0; i < SCHED_CLASSES; i++)
+    {
+        sched_stats& st = m_stats[i];
+        size_t queued   = st.queued;
+        unsigned weight = st.weight;
+        st              = sched_stats();
+        st.queued       = queued;
+        st.weight       = weight;
+        m_rateAt[i]     = now;
+    }
+}
+
+std::string transferscheduler::Prometheus()
+{
+    sched_stats st[SCHED_CLASSES];
+    for(int i = 0; i < SCHED_CLASSES; i++)
+        st[i] = GetStats(i);
+
+    std::string out;
+    char line[256];
+    struct { const char* name; const char* type; const char* help; } metrics[] =
+    {
+        { "connstream_sched_bytes_total",           "counter",  "Bytes granted to the class." },
+        { "connstream_sched_grants_total",          "counter",  "Chunks granted to the class." },
+        { "connstream_sched_wait_seconds_total",    "counter",  "Time the class's chunks spent queued." },
+        { "connstream_sched_wait_seconds_max",      "gauge",    "Longest a single chunk of the class queued." },
+        { "connstream_sched_bytes_per_second",      "gauge",    "Throughput of the class over the last second or so." },
+        { "connstream_sched_queued",                "gauge",    "Transfers of the class waiting for a grant." },
+    };
+
+    for(size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++)
+    {
+        out += std::string("# HELP ") + metrics[m].name + " " + metrics[m].help + "\n";
+        out += std::string("# TYPE ") + metrics[m].name + " " + metrics[m].type + "\n";
+        for(int i = 0; i < SCHED_CLASSES; i++)
+        {
+            double v = m == 0 ? (double)st[i].bytes
+                     : m == 1 ? (double)st[i].grants
+                     : m == 2 ? st[i].waitSeconds
+                     : m == 3 ? st[i].maxWait
+                     : m == 4 ? st[i].throughput
+                     :          (double)st[i].queued;
+            snprintf(line, sizeof(line), "%s{class=\"%s\"} %.9g\n", metrics[m].name, g_classNames[i], v);
+            out += line;
+        }
+    }
+    return out;
+}
+
+const char* transferscheduler::ClassName(int cls)
+{
+    return cls >= 0 && cls < SCHED_CLASSES ? g_classNames[cls] : "";
+}
@@ -0,0 +1,195 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Transfer Scheduler
+  *
+  * Shares bandwidth between every session in a process by priority.
+  * A session joined to a scheduler asks it for each chunk it moves on
+  * a data connection and blocks until the chunk is granted, so a bulk
+  * upload that has the link to itself gives way to an interactive
+  * Download within one chunk of it starting.
+  *
+  * Rates are token buckets at three levels: the whole scheduler, each
+  * host (host:port) and each session. A chunk goes once every bucket
+  * above it is out of debt, then charges all of them, so each level
+  * keeps to its rate on average and bursts by no more than its depth.
+  * An unset rate never holds anything back.
+  *
+  * Transfers waiting on the same buckets are served by weighted fair
+  * queueing over the priority classes: each chunk is stamped with a
+  * virtual finish time of its bytes over the weight of its class and
+  * the earliest goes first. With the default weights a backlogged
+  * interactive transfer gets 16 of every 17 bytes a bulk one competes
+  * for, yet bulk work never stops outright. A transfer held back only
+  * by its own session or host bucket never blocks another.
+  *
+  * Per class the scheduler counts bytes, grants, time spent queued and
+  * a throughput averaged over the last second or so, as a struct or as
+  * Prometheus text. Thread-safe.
+  *
+  * E.G. Usage:
+  *     std::shared_ptr<transferscheduler> sched = transferscheduler::Global();
+  *     sched->SetRate(50 << 20);                   // The uplink, 50 MiB/s
+  *     bulk.SetScheduler(sched, SCHED_BULK);
+  *     ftp.SetScheduler(sched, SCHED_INTERACTIVE);
+  *     ftp.Download(_T("/pub/a.txt"), _T("a.txt"));    // Ahead of bulk's chunks
+  */
+
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "connstream.h"
+
+/* Priority classes */
+#define SCHED_INTERACTIVE   0
+#define SCHED_NORMAL        1
+#define SCHED_BULK          2
+#define SCHED_CLASSES       3
+
+#define SCHED_QUANTUM       (64 << 10)  // Most bytes a data path moves per grant
+#define SCHED_BURST         100         // Milliseconds of rate a bucket holds when no depth is given
+#define SCHED_RATE_WINDOW   1.0         // Seconds the throughput average spans
+
+/** Counters for one priority class since construction (or ResetStats) */
+struct sched_stats
+{
+    unsigned long long  bytes;
+    unsigned long long  grants;
+    unsigned long long  waits;          // Grants that had to queue
+    double              waitSeconds;    // Total time queued
+    double              maxWait;        // Longest single wait, seconds
+    double              throughput;     // Bytes per second, decaying average
+    size_t              queued;         // Transfers waiting right now
+    unsigned            weight;
+
+    /** waitSeconds / grants, 0 before the first grant */
+    double MeanWait(void) const;
+};
+
+/** A token bucket, rate 0 for no limit */
+struct schedbucket
+{
+    double      rate;           // Bytes per second
+    double      depth;          // Most tokens it saves up
+    double      tokens;         // Below zero while in debt
+    std::chrono::steady_clock::time_point last;
+
+    schedbucket(void);
+    void    Set(long long bytesPerSec, long long burst);
+    void    Refill(std::chrono::steady_clock::time_point now);
+    double  Delay(void) const;  // Seconds until out of debt
+};
+
+/** One session's place in a scheduler, owned by the session */
+class schedflow
+{
+    public:
+        schedflow(void);
+
+        /** void SetClass(int) - SCHED_* class its chunks queue in */
+        /** void SetHost(const TSTR&) - Key of the host bucket it draws on, blank for none */
+        /** void SetRate(long long, long long) - Its own limit in bytes per second, 0 for none */
+        void        SetClass(int cls);
+        void        SetHost(const TSTR& host);
+        void        SetRate(long long bytesPerSec, long long burst = 0);
+
+        int         GetClass(void) const;
+        const TSTR& GetHost(void) const;
+
+    private:
+        friend class transferscheduler;
+
+        int         m_class;
+        TSTR        m_host;
+        schedbucket m_bucket;
+};
+
+class transferscheduler
+{
+    public:
+        transferscheduler(void);
+        virtual ~transferscheduler(void);
+
+        /** std::shared_ptr<transferscheduler> Global(void)
+         *  The process-wide scheduler, made on first use with no limits.
+         */
+        static std::shared_ptr<transferscheduler> Global(void);
+
+        /** void SetRate(long long, long long)
+         *  Caps everything the scheduler grants at @bytesPerSec, 0 lifts it.
+         *      @burst : Bytes it may run ahead, SCHED_BURST ms of rate when 0
+         */
+        /** void SetHostRate(const TSTR&, long long, long long)
+         *  Caps every session on @host ("host:port") together.
+         */
+        void    SetRate(long long bytesPerSec, long long burst = 0);
+        void    SetHostRate(const TSTR& host, long long bytesPerSec, long long burst = 0);
+
+        /** void SetWeight(int, unsigned)
+         *  Share of contended bandwidth class @cls gets, relative to the
+         *  others. Defaults 16, 4 and 1 for interactive, normal and bulk.
+         */
+        void    SetWeight(int cls, unsigned weight);
+
+        /** void Acquire(schedflow&, size_t)
+         *  Blocks until @bytes may move for @flow, ahead of or behind other
+         *  flows by class, then charges them to every bucket it draws on.
+         *  Charging after the fact (a recv that came back with @bytes) works
+         *  the same, the next chunk just waits out the debt.
+         */
+        void    Acquire(schedflow& flow, size_t bytes);
+
+        sched_stats GetStats(int cls);
+        void        ResetStats(void);
+
+        /** std::string Prometheus(void)
+         *  The class counters in the Prometheus text format, labelled by class.
+         */
+        std::string Prometheus(void);
+
+        /** const char* ClassName(int) - "interactive", "normal" or "bulk" */
+        static const char* ClassName(int cls);
+
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        struct waiter
+        {
+            schedflow*          flow;
+            size_t              bytes;
+            double              start;      // Virtual times
+            double              finish;
+            unsigned long long  seq;
+            bool                granted;
+        };
+
+        transferscheduler(const transferscheduler&);
+        transferscheduler& operator=(const transferscheduler&);
+
+        double  Dispatch(clock::time_point now);
+        double  Delay(waiter& w, clock::time_point now);
+        void    Grant(waiter& w, clock::time_point now);
+
+        std::mutex                  m_lock;
+        std::condition_variable     m_wake;
+        schedbucket                 m_bucket;
+        std::map<TSTR, schedbucket> m_hosts;
+        std::vector<waiter*>        m_waiting;      // Earliest finish first
+        double                      m_vtime;        // Start tag of the last grant
+        double                      m_vfinish[SCHED_CLASSES];
+        unsigned long long          m_seq;
+        sched_stats                 m_stats[SCHED_CLASSES];
+        clock::time_point           m_rateAt[SCHED_CLASSES];
+};
+
+#endif // _SCHEDULER_H_
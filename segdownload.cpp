@@ -0,0 +1,461 @@
+#include <segdownload.h>
+
+#if !defined(_MSC_VER)
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#define SEG_BUFSIZE     (256 << 10)
+#define SEG_MAX_RETRY   3           // Consecutive failures before a stream gives up
+
+typedef std::chrono::steady_clock segclock;
+
+static double Seconds(segclock::time_point since)
+{
+    return std::chrono::duration<double>(segclock::now() - since).count();
+}
+
+SegmentedDownload::SegmentedDownload(connstream_pool& pool, TSTR host, TSTR user, TSTR pwd, int port)
+    : m_pool(pool)
+{
+    m_host          = host;
+    m_user          = user;
+    m_pwd           = pwd;
+    m_port          = port;
+    m_maxStreams    = SEG_MAX_STREAMS;
+    m_minSize       = SEG_MIN_SIZE;
+    m_maxSize       = SEG_MAX_SIZE;
+    m_segSize       = SEG_FIRST_SIZE;
+    m_bandwidth     = 0;
+    m_total         = 0;
+    m_received      = 0;
+    m_active        = 0;
+    m_journal       = -1;
+    m_failed        = false;
+    m_err           = 0;
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+SegmentedDownload::~SegmentedDownload()
+{
+}
+
+void SegmentedDownload::SetMaxStreams(int streams)
+{
+    m_maxStreams = streams > 0 ? streams : 1;
+}
+
+void SegmentedDownload::SetSegmentLimits(long long minSize, long long maxSize)
+{
+    m_minSize = minSize > 0 ? minSize : SEG_MIN_SIZE;
+    m_maxSize = maxSize >= m_minSize ? maxSize : m_minSize;
+}
+
+segment_stats SegmentedDownload::GetStats()
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    return m_stats;
+}
+
+int SegmentedDownload::GetLastError()
+{
+    return m_err;
+}
+
+
+/// RESUME MAP ///
+
+bool SegmentedDownload::LoadMap(const TSTR& path, long long size)
+{
+    FILE* f = fopen(path.c_str(), "r");
+    if(!f)
+        return false;
+
+    long long mapped = -1;
+    std::vector<range> done;
+    if(fscanf(f, "segmap %lld\n", &mapped) == 1 && mapped == size)
+    {
+        long long a, b;
+        while(fscanf(f, "%lld %lld\n", &a, &b) == 2)
+            if(a >= 0 && a < b && b <= size)
+                done.push_back(range(a, b));
+    }
+    fclose(f);
+
+    if(mapped != size)
+        return false;
+
+    // Everything not journaled as done is still to fetch
+    std::sort(done.begin(), done.end());
+    long long at = 0;
+    m_pending.clear();
+    for(size_t i = 0; i < done.size(); i++)
+    {
+        if(done[i].first > at)
+            m_pending.push_back(range(at, done[i].first));
+        if(done[i].second > at)
+        {
+            m_stats.resumed += done[i].second - std::max(at, done[i].first);
+            at = done[i].second;
+        }
+    }
+    if(at < size)
+        m_pending.push_back(range(at, size));
+
+    return true;
+}
+
+void SegmentedDownload::Journal(const range& done)
+{
+    if(m_journal < 0)
+        return;
+
+    char line[64];
+    int n = snprintf(line, sizeof(line), "%lld %lld\n", done.first, done.second);
+    if(write(m_journal, line, (size_t)n) != n)
+        {}
+}
+
+
+/// SCHEDULING ///
+
+bool SegmentedDownload::Take(range& r)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+    if(m_failed || m_pending.empty())
+        return false;
+
+    range& head = m_pending.front();
+    long long end = head.first + m_segSize;
+
+    // Don't leave a sliver behind that would cost a whole round trip
+    if(end >= head.second || head.second - end < m_minSize)
+    {
+        r = head;
+        m_pending.pop_front();
+    }
+    else
+    {
+        r = range(head.first, end);
+        head.first = end;
+    }
+    return true;
+}
+
+void SegmentedDownload::Finish(const range& done, const range& rest, double seconds)
+{
+    std::lock_guard<std::mutex> g(m_lock);
+
+    long long len = done.second - done.first;
+    if(len > 0)
+    {
+        Journal(done);
+        m_total         += len;
+        m_stats.fetched += len;
+        m_stats.segments++;
+
+        // Size the next ranges so each takes about SEG_TARGET_TIME on one stream
+        if(seconds > 0.001)
+        {
+            double bw   = (double)len / seconds;
+            m_bandwidth = m_bandwidth > 0 ? 0.7 * m_bandwidth + 0.3 * bw : bw;
+            long long next = (long long)(m_bandwidth * SEG_TARGET_TIME / 1000.0);
+            m_segSize = std::min(std::max(next, m_minSize), m_maxSize);
+        }
+    }
+
+    if(rest.second > rest.first)
+    {
+        m_pending.push_front(rest);
+        m_stats.retries++;
+    }
+}
+
+void SegmentedDownload::Worker(TSTR remote, int fd)
+{
+    std::vector<char> buf(SEG_BUFSIZE);
+    long long size  = m_stats.size;
+    int failures    = 0;
+
+    connstream_lease lease = m_pool.Acquire(m_host, m_user, m_pwd, m_port);
+
+    range r;
+    while(lease && Take(r))
+    {
+        segclock::time_point t0 = segclock::now();
+        long long at = r.first;
+        int err = 0;
+
+        datastream s = lease->OpenRead(remote, r.first);
+        if(!s.IsOpen())
+            err = lease->GetLastError();
+
+        while(s.IsOpen() && at < r.second)
+        {
+            size_t want = (size_t)std::min<long long>((long long)buf.size(), r.second - at);
+            long long n = s.Read(&buf[0], want);
+            if(n <= 0)
+            {
+                err = n < 0 ? s.GetLastError() : EPIPE;
+                break;
+            }
+
+            for(long long w = 0; w < n; )
+            {
+                ssize_t k = pwrite(fd, &buf[0] + w, (size_t)(n - w), (off_t)(at + w));
+                if(k < 0 && errno == EINTR)
+                    continue;
+                if(k <= 0)
+                {
+                    err = k < 0 ? errno : EIO;
+                    break;
+                }
+                w += k;
+            }
+            if(err)
+                break;
+            at += n;
+            m_received.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        // The tail segment can run to EOF for a clean 226 instead of an ABOR
+        if(!err && r.second == size && s.IsOpen())
+            s.Read(&buf[0], 1);
+        bool clean = s.IsOpen() ? s.Close() : false;
+
+        Finish(range(r.first, at), range(at, r.second), Seconds(t0));
+
+        if(at == r.second)
+        {
+            failures = 0;
+            if(!clean)
+            {
+                lease.Discard();
+                lease = m_pool.Acquire(m_host, m_user, m_pwd, m_port);
+            }
+            continue;
+        }
+
+        // Retry on a fresh session, a stream that keeps failing takes the job down
+        lease.Discard();
+        if(++failures >= SEG_MAX_RETRY)
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            m_failed = true;
+            m_err    = err ? err : EIO;
+            break;
+        }
+        lease = m_pool.Acquire(m_host, m_user, m_pwd, m_port);
+    }
+
+    std::lock_guard<std::mutex> g(m_lock);
+    if(!lease && !m_failed && m_active == 1 && !m_pending.empty())
+    {
+        // Last stream standing couldn't get a session, nothing else will finish the job
+        m_failed = true;
+        m_err    = lease.GetLastError() ? lease.GetLastError() : EIO;
+    }
+    m_active--;
+    m_changed.notify_all();
+}
+
+
+/// GET/PUSH METHODS ///
+
+bool SegmentedDownload::Download(TSTR lpszLocation, TSTR lpszLocalName)
+{
+    segclock::time_point t0 = segclock::now();
+    const TSTR& local = lpszLocalName.empty() ? lpszLocation : lpszLocalName;
+    TSTR mapPath = local + SEG_MAP_SUFFIX;
+
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_pending.clear();
+    m_segSize   = std::min(std::max((long long)SEG_FIRST_SIZE, m_minSize), m_maxSize);
+    m_bandwidth = 0;
+    m_total     = 0;
+    m_received  = 0;
+    m_active    = 0;
+    m_failed    = false;
+    m_err       = 0;
+
+    connstream_lease lease = m_pool.Acquire(m_host, m_user, m_pwd, m_port);
+    if(!lease)
+    {
+        m_err = lease.GetLastError();
+        return false;
+    }
+
+    long long size = lease->GetFileSize(lpszLocation);
+    if(size == INVALID_FILE)
+    {
+        m_err = lease->GetLastError();
+        return false;
+    }
+    m_stats.size = size;
+
+    // Too small to be worth splitting, or a server without REST: one stream
+    bool split = size >= 2 * m_minSize && m_maxStreams > 1;
+    if(split)
+    {
+        datastream probe = lease->OpenRead(lpszLocation, size - 1);
+        if(!probe.IsOpen())
+        {
+            int e = lease->GetLastError();
+            if(e < 500 || e > 504)
+            {
+                m_err = e;
+                return false;
+            }
+            split = false;
+        }
+        else
+        {
+            char c;
+            probe.Read(&c, 1);
+            probe.Read(&c, 1);
+            if(!probe.Close())
+                lease.Discard();
+        }
+    }
+    if(!split)
+    {
+        if(!lease)
+            lease = m_pool.Acquire(m_host, m_user, m_pwd, m_port);
+        bool ok = lease && lease->Download(lpszLocation, local);
+        m_err = ok ? 0 : (lease ? lease->GetLastError() : lease.GetLastError());
+        m_stats.fetched     = ok ? size : 0;
+        m_stats.segments    = 1;
+        m_stats.streams     = 1;
+        m_stats.seconds     = Seconds(t0);
+        return ok;
+    }
+    lease.Release();
+
+    int fd = open(local.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0)
+    {
+        m_err = errno;
+        return false;
+    }
+
+    struct stat st;
+    bool resume = fstat(fd, &st) == 0 && st.st_size == size && LoadMap(mapPath, size);
+    if(!resume)
+    {
+        m_stats.resumed = 0;
+        m_pending.clear();
+        m_pending.push_back(range(0, size));
+
+        if(ftruncate(fd, 0) < 0 || (fallocate(fd, 0, 0, (off_t)size) < 0 && ftruncate(fd, (off_t)size) < 0))
+        {
+            m_err = errno;
+            close(fd);
+            return false;
+        }
+
+        m_journal = open(mapPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(m_journal >= 0)
+        {
+            char header[64];
+            int n = snprintf(header, sizeof(header), "segmap %lld\n", size);
+            if(write(m_journal, header, (size_t)n) != n)
+                {}
+        }
+    }
+    else
+        m_journal = open(mapPath.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+
+    // Start with two streams and add one per interval while the aggregate
+    // keeps climbing. The rate counts bytes as they are read, a segment can
+    // take far longer than an interval to land on a slow link.
+    std::vector<std::thread> workers;
+    segclock::time_point sampled = segclock::now();
+    double lastRate     = 0;
+    long long lastTotal = 0;
+    bool ramping        = true;
+
+    for(;;)
+    {
+        {
+            std::unique_lock<std::mutex> g(m_lock);
+            if(!workers.empty())
+                m_changed.wait_until(g, sampled + std::chrono::milliseconds(SEG_RAMP_INTERVAL));
+            if(m_failed || (m_pending.empty() && m_active == 0))
+                break;
+
+            int want = workers.empty() ? std::min(2, m_maxStreams) : (int)workers.size() + 1;
+            long long pending = 0;
+            for(std::list<range>::iterator it = m_pending.begin(); it != m_pending.end(); ++it)
+                pending += it->second - it->first;
+
+            bool grow = workers.empty();
+            double elapsed = Seconds(sampled);
+            if(!workers.empty() && elapsed * 1000 >= SEG_RAMP_INTERVAL)
+            {
+                // Nothing read yet says nothing about the link, wait for a sample that does
+                long long total = m_received.load(std::memory_order_relaxed);
+                if(total > lastTotal)
+                {
+                    double rate = (double)(total - lastTotal) / elapsed;
+                    grow = ramping && rate > lastRate * 1.1 && (int)workers.size() < m_maxStreams
+                           && pending > m_minSize * (long long)workers.size();
+                    if(!grow)
+                        ramping = false;
+                    lastRate  = rate;
+                    lastTotal = total;
+                }
+                sampled = segclock::now();
+            }
+            else if(workers.empty())
+                sampled = segclock::now();
+
+            while(grow && (int)workers.size() < want)
+            {
+                m_active++;
+                workers.push_back(std::thread(&SegmentedDownload::Worker, this, lpszLocation, fd));
+            }
+            if((int)workers.size() > m_stats.streams)
+                m_stats.streams = (int)workers.size();
+        }
+    }
+
+    for(size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    bool ok = !m_failed && m_pending.empty();
+    if(ok && fsync(fd) < 0)
+    {
+        ok      = false;
+        m_err   = errno;
+    }
+    if(close(fd) < 0 && ok)
+    {
+        ok      = false;
+        m_err   = errno;
+    }
+    if(m_journal >= 0)
+        close(m_journal);
+    m_journal = -1;
+
+    if(ok)
+    {
+        unlink(mapPath.c_str());
+        m_err = 0;
+    }
+    else if(!m_err)
+        m_err = EIO;
+
+    m_stats.seconds = Seconds(t0);
+    return ok;
+}
+
+#endif
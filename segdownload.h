@@ -0,0 +1,124 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Segmented Download
+  *
+  * Pulls one large file over several sessions at once to get past
+  * single stream TCP throughput on long fat links. The remote size is
+  * split into ranges, each fetched on its own pooled session with
+  * OpenRead(path, offset) (REST + RETR) and abandoned as soon as the
+  * range is complete, then pwrite(2) into a preallocated local file.
+  *
+  * Range size follows each stream's measured bandwidth so a segment
+  * takes roughly SEG_TARGET_TIME, and streams are added one at a time
+  * while the aggregate rate keeps improving.
+  *
+  * Finished ranges are journaled to "<local>.segmap" as they land, an
+  * interrupted transfer resumes by fetching only the missing ranges.
+  * The journal is removed once the file is complete.
+  *
+  * E.G. Usage:
+  *     connstream_pool pool(...);
+  *     SegmentedDownload seg(pool, _T("host"), _T("uid"), _T("pwd"));
+  *     seg.Download(_T("/pub/image.iso"), _T("image.iso"));
+  */
+
+#ifndef _SEGDOWNLOAD_H_
+#define _SEGDOWNLOAD_H_
+
+#if !defined(_MSC_VER)
+
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <utility>
+#include "connpool.h"
+
+#define SEG_MAX_STREAMS     8
+#define SEG_MIN_SIZE        (1LL << 20)     // Never split finer than this
+#define SEG_MAX_SIZE        (256LL << 20)
+#define SEG_FIRST_SIZE      (8LL << 20)     // Before any bandwidth is known
+#define SEG_TARGET_TIME     2000            // Milliseconds one segment should take
+#define SEG_RAMP_INTERVAL   500             // Milliseconds between stream count decisions
+#define SEG_MAP_SUFFIX      _T(".segmap")
+
+/** Outcome of the last Download, byte counts exclude resumed ranges */
+struct segment_stats
+{
+    long long   size;           // Remote file size
+    long long   fetched;        // Bytes pulled over the network this run
+    long long   resumed;        // Bytes already present from an earlier run
+    int         segments;       // Ranges fetched this run
+    int         streams;        // Peak number of concurrent sessions
+    int         retries;        // Ranges that failed and went back in the queue
+    double      seconds;
+};
+
+class SegmentedDownload
+{
+    public:
+        /** SegmentedDownload(connstream_pool&, TSTR, TSTR, TSTR, int)
+         *  Sessions are leased from @pool for every range, the pool's per-host
+         *  limit caps the stream count as well as SetMaxStreams.
+         */
+        SegmentedDownload(connstream_pool& pool,
+                          TSTR host,
+                          TSTR user = _T(""),
+                          TSTR pwd = _T(""),
+                          int port = 0);
+        virtual ~SegmentedDownload(void);
+
+        /** bool Download(TSTR, TSTR)
+         *  Downloads @lpszLocation to @lpszLocalName, resuming from the
+         *  segment map when one from an earlier run matches the remote size.
+         *  Falls back to a plain Download on one session when the file is
+         *  too small to split or the server refuses REST.
+         *  Returns : @true once every byte is on disk
+         */
+        bool    Download(TSTR lpszLocation, TSTR lpszLocalName);
+
+        void    SetMaxStreams(int streams);
+        void    SetSegmentLimits(long long minSize, long long maxSize);
+
+        segment_stats   GetStats(void);
+        int             GetLastError(void);
+
+    private:
+        typedef std::pair<long long, long long> range;     // [offset, end)
+
+        void    Worker(TSTR remote, int fd);
+        bool    Take(range& r);
+        void    Finish(const range& done, const range& rest, double seconds);
+        bool    LoadMap(const TSTR& path, long long size);
+        void    Journal(const range& done);
+
+        connstream_pool&        m_pool;
+        TSTR                    m_host;
+        TSTR                    m_user;
+        TSTR                    m_pwd;
+        int                     m_port;
+        int                     m_maxStreams;
+        long long               m_minSize;
+        long long               m_maxSize;
+
+        std::mutex              m_lock;
+        std::condition_variable m_changed;
+        std::list<range>        m_pending;
+        long long               m_segSize;
+        double                  m_bandwidth;    // Per stream bytes/second, smoothed
+        long long               m_total;        // Bytes landed this run
+        std::atomic<long long>  m_received;     // Bytes read this run, as they arrive
+        int                     m_active;
+        int                     m_journal;
+        bool                    m_failed;
+        int                     m_err;
+        segment_stats           m_stats;
+};
+
+#endif
+
+#endif // _SEGDOWNLOAD_H_
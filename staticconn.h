@@ -0,0 +1,469 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Static Connection Stream
+  *
+  * connstream picks its backend at run time and every call goes through
+  * the virtual table. basic_connstream fixes both at compile time for a
+  * program that only ever runs one configuration: the backend is held by
+  * value and each call names the backend's own method, so it is bound
+  * directly and inlined wherever the compiler can see the body.
+  *
+  * Everything around the backend is a policy, a class the stream derives
+  * from. Apply sets the backend up once when the stream is made, Begin
+  * and End wrap each call (End in reverse order), and a policy that
+  * leaves them out costs nothing. One that asks a backend for something
+  * it has no setting for doesn't compile.
+  *
+  *  Transport       : transport_default, transport_buffered, transport_uring
+  *  Checksumming    : checksum_with<CHECKSUM_*, verify>
+  *  Compression     : compress_deflate<level>
+  *  Instrumentation : instrument_counters, calls, errors and time per CONNOP_*
+  *
+  * connstream_adapter puts the virtual interface back on top of one, for
+  * code that takes a connstream& (connstream_pool, TransferBatch,
+  * contentcache) with the policies still applied.
+  *
+  * The backends are compiled in their own translation units, so without
+  * LTO the gain on them is a direct call for an indirect one; a backend
+  * defined in a header inlines outright. connstream_bench's dispatch
+  * scenario measures both.
+  *
+  * E.G. Usage:
+  *     typedef basic_connstream<PosixFTP, transport_uring, checksum_with<CHECKSUM_SHA256, true>,
+  *                              instrument_counters> ftp_t;
+  *     ftp_t ftp;
+  *     ftp.Connect(_T("host"), _T("uid"), _T("pwd"));
+  *     ftp.Download(_T("/pub/a.iso"), _T("a.iso"));
+  *     printf("%llu\n", ftp.Calls(CONNOP_DOWNLOAD));
+  *
+  *     connstream_adapter<ftp_t> dyn;      // Through a connstream&
+  *     cache.Download(dyn, _T("uid@host:21"), _T("/pub/a.iso"), _T("a.iso"));
+  */
+
+#ifndef _STATICCONN_H_
+#define _STATICCONN_H_
+
+#include <string.h>
+#include <chrono>
+#include <memory>
+#include <utility>
+#include "connstream.h"
+
+#if !defined(_MSC_VER)
+#include "checksum.h"
+#include "uring.h"
+#endif
+
+/* Calls a policy is told about, the View and Ex forms count as the plain one, ListDir as SearchDir */
+#define CONNOP_CONNECT      0
+#define CONNOP_DISCONNECT   1
+#define CONNOP_UPLOAD       2
+#define CONNOP_DOWNLOAD     3
+#define CONNOP_OPENREAD     4
+#define CONNOP_OPENWRITE    5
+#define CONNOP_CHANGEDIR    6
+#define CONNOP_MAKEDIR      7
+#define CONNOP_REMOVEDIR    8
+#define CONNOP_CURRENTDIR   9
+#define CONNOP_SEARCHDIR    10
+#define CONNOP_REMOVE       11
+#define CONNOP_RENAME       12
+#define CONNOP_EXISTS       13
+#define CONNOP_GETFILESIZE  14
+#define CONNOP_GETMODTIME   15
+#define CONNOP_COMMAND      16
+#define CONNOP_COUNT        17
+
+
+/// POLICIES ///
+
+/** What a policy can hook, all of it doing nothing. Derive and hide the
+ *  ones needed, @B is the backend type. */
+struct connpolicy
+{
+    template<class B> void  Apply(B&)           {}
+    void                    Begin(int)          {}
+    template<class B> void  End(int, B&)        {}
+};
+
+/** sendfile(2)/splice(2) where the backend has them, its default */
+struct transport_default : connpolicy
+{
+};
+
+/** Plain read/write through a buffer, see PosixFTP::SetZeroCopy */
+struct transport_buffered : connpolicy
+{
+    template<class B> void  Apply(B& b)         { b.SetZeroCopy(false); }
+};
+
+#if !defined(_MSC_VER)
+
+/** One io_uring engine shared by every stream using this policy, the
+ *  default transport when the kernel refuses a ring */
+struct transport_uring : connpolicy
+{
+    template<class B> void  Apply(B& b)
+    {
+        static std::shared_ptr<uringengine> engine = uringengine::Create();
+        if(engine)
+            b.SetEngine(engine);
+    }
+};
+
+/** Every transfer hashed with @Algorithm, checked against the host when @Verify */
+template<int Algorithm, bool Verify = false>
+struct checksum_with : connpolicy
+{
+    template<class B> void  Apply(B& b)         { b.SetChecksum(Algorithm, Verify); }
+};
+
+#endif // _MSC_VER
+
+/** MODE Z at zlib @Level, -1 for its default */
+template<int Level = -1>
+struct compress_deflate : connpolicy
+{
+    template<class B> void  Apply(B& b)         { b.SetCompression(true, Level); }
+};
+
+/** Calls, failures and time spent per CONNOP_*. Not thread-safe, no
+ *  more than the plain calls it counts. */
+class instrument_counters : public connpolicy
+{
+    public:
+        instrument_counters(void)                   { Reset(); }
+
+        void    Begin(int)
+        {
+            m_start = clock::now();
+        }
+        template<class B>
+        void    End(int op, B& b)
+        {
+            m_nanos[op]     += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - m_start).count();
+            m_calls[op]++;
+            m_errors[op]    += b.B::GetLastError() != 0;
+        }
+
+        unsigned long long  Calls(int op) const     { return m_calls[op]; }
+        unsigned long long  Errors(int op) const    { return m_errors[op]; }
+        double              Seconds(int op) const   { return (double)m_nanos[op] / 1e9; }
+
+        void    Reset(void)
+        {
+            memset(m_calls, 0, sizeof(m_calls));
+            memset(m_errors, 0, sizeof(m_errors));
+            memset(m_nanos, 0, sizeof(m_nanos));
+        }
+
+    private:
+        typedef std::chrono::steady_clock clock;
+
+        clock::time_point   m_start;
+        unsigned long long  m_calls[CONNOP_COUNT];
+        unsigned long long  m_errors[CONNOP_COUNT];
+        long long           m_nanos[CONNOP_COUNT];
+};
+
+/** Runs a hook on each policy in turn, End last to first */
+template<class... Policies>
+struct connpolicies
+{
+    template<class S, class B> static void  Apply(S&, B&)       {}
+    template<class S> static void           Begin(S&, int)      {}
+    template<class S, class B> static void  End(S&, int, B&)    {}
+};
+
+template<class P, class... Rest>
+struct connpolicies<P, Rest...>
+{
+    template<class S, class B> static void Apply(S& s, B& b)
+    {
+        static_cast<P&>(s).Apply(b);
+        connpolicies<Rest...>::Apply(s, b);
+    }
+    template<class S> static void Begin(S& s, int op)
+    {
+        static_cast<P&>(s).Begin(op);
+        connpolicies<Rest...>::Begin(s, op);
+    }
+    template<class S, class B> static void End(S& s, int op, B& b)
+    {
+        connpolicies<Rest...>::End(s, op, b);
+        static_cast<P&>(s).End(op, b);
+    }
+};
+
+
+/// STREAM ///
+
+template<class Backend, class... Policies>
+class basic_connstream : public Policies...
+{
+    public:
+        typedef Backend backend_type;
+
+        basic_connstream(void)                      { connpolicies<Policies...>::Apply(*this, m_backend); }
+
+        /** Backend& Get(void) - The backend, for its own settings and calls */
+        Backend&    Get(void)                       { return m_backend; }
+
+        /// CONNECTION METHODS ///
+        bool    Connect(TSTR url, TSTR uid = _T(""), TSTR pwd = _T(""), int port = 0)
+        {
+            return Run(CONNOP_CONNECT, [&]() { return m_backend.Backend::Connect(std::move(url), std::move(uid), std::move(pwd), port); });
+        }
+        bool    Disconnect(void)
+        {
+            return Run(CONNOP_DISCONNECT, [&]() { return m_backend.Backend::Disconnect(); });
+        }
+
+        /// GET/PUSH METHODS ///
+        bool    Upload(TSTR location, TSTR rename)
+        {
+            return Run(CONNOP_UPLOAD, [&]() { return m_backend.Backend::Upload(std::move(location), std::move(rename)); });
+        }
+        bool    Download(TSTR location, TSTR rename)
+        {
+            return Run(CONNOP_DOWNLOAD, [&]() { return m_backend.Backend::Download(std::move(location), std::move(rename)); });
+        }
+
+        /// STREAMING METHODS ///
+        datastream  OpenRead(TSTR location, long long offset = 0)
+        {
+            return Run(CONNOP_OPENREAD, [&]() { return m_backend.Backend::OpenRead(std::move(location), offset); });
+        }
+        datastream  OpenWrite(TSTR location, bool append = false)
+        {
+            return Run(CONNOP_OPENWRITE, [&]() { return m_backend.Backend::OpenWrite(std::move(location), append); });
+        }
+
+        /// DIRECTORY METHODS ///
+        bool    ChangeDir(TSTR dir)
+        {
+            return Run(CONNOP_CHANGEDIR, [&]() { return m_backend.Backend::ChangeDir(std::move(dir)); });
+        }
+        bool    MakeDir(TSTR dir)
+        {
+            return Run(CONNOP_MAKEDIR, [&]() { return m_backend.Backend::MakeDir(std::move(dir)); });
+        }
+        bool    RemoveDir(TSTR dir)
+        {
+            return Run(CONNOP_REMOVEDIR, [&]() { return m_backend.Backend::RemoveDir(std::move(dir)); });
+        }
+        TSTR    CurrentDir(void)
+        {
+            return Run(CONNOP_CURRENTDIR, [&]() { return m_backend.Backend::CurrentDir(); });
+        }
+        LIST    SearchDir(TSTR searchstr)
+        {
+            return Run(CONNOP_SEARCHDIR, [&]() { return m_backend.Backend::SearchDir(std::move(searchstr)); });
+        }
+        bool    ListDir(TSTR dir, DirList& entries)
+        {
+            return Run(CONNOP_SEARCHDIR, [&]() { return m_backend.Backend::ListDir(std::move(dir), entries); });
+        }
+
+        /// FILE HANDLING METHODS ///
+        bool        Remove(TSTR filename)
+        {
+            return Run(CONNOP_REMOVE, [&]() { return m_backend.Backend::Remove(std::move(filename)); });
+        }
+        bool        Rename(TSTR oldFilename, TSTR newFilename)
+        {
+            return Run(CONNOP_RENAME, [&]() { return m_backend.Backend::Rename(std::move(oldFilename), std::move(newFilename)); });
+        }
+        bool        Exists(TSTR filename)
+        {
+            return Run(CONNOP_EXISTS, [&]() { return m_backend.Backend::Exists(std::move(filename)); });
+        }
+        long long   GetFileSize(TSTR filename)
+        {
+            return Run(CONNOP_GETFILESIZE, [&]() { return m_backend.Backend::GetFileSize(std::move(filename)); });
+        }
+        long long   GetModTime(TSTR filename)
+        {
+            return Run(CONNOP_GETMODTIME, [&]() { return m_backend.Backend::GetModTime(std::move(filename)); });
+        }
+
+        /// MISCELLANEOUS METHODS ///
+        bool    Command(TSTR command)
+        {
+            return Run(CONNOP_COMMAND, [&]() { return m_backend.Backend::Command(std::move(command)); });
+        }
+        int     GetLastError(void)                  { return m_backend.Backend::GetLastError(); }
+
+        /// RESULT METHODS ///
+        connresult  ConnectEx(const TSTR& url, const TSTR& uid = _T(""), const TSTR& pwd = _T(""), int port = 0)
+        {
+            return Run(CONNOP_CONNECT, [&]() { return m_backend.Backend::ConnectEx(url, uid, pwd, port); });
+        }
+        connresult  DisconnectEx(void)
+        {
+            return Run(CONNOP_DISCONNECT, [&]() { return m_backend.Backend::DisconnectEx(); });
+        }
+        connresult  UploadEx(const TSTR& location, const TSTR& rename)
+        {
+            return Run(CONNOP_UPLOAD, [&]() { return m_backend.Backend::UploadEx(location, rename); });
+        }
+        connresult  DownloadEx(const TSTR& location, const TSTR& rename)
+        {
+            return Run(CONNOP_DOWNLOAD, [&]() { return m_backend.Backend::DownloadEx(location, rename); });
+        }
+        connresult  ChangeDirEx(const TSTR& dir)
+        {
+            return Run(CONNOP_CHANGEDIR, [&]() { return m_backend.Backend::ChangeDirEx(dir); });
+        }
+        connresult  MakeDirEx(const TSTR& dir)
+        {
+            return Run(CONNOP_MAKEDIR, [&]() { return m_backend.Backend::MakeDirEx(dir); });
+        }
+        connresult  RemoveDirEx(const TSTR& dir)
+        {
+            return Run(CONNOP_REMOVEDIR, [&]() { return m_backend.Backend::RemoveDirEx(dir); });
+        }
+        connresult  CurrentDirEx(TSTR& out)
+        {
+            return Run(CONNOP_CURRENTDIR, [&]() { return m_backend.Backend::CurrentDirEx(out); });
+        }
+        connresult  SearchDirEx(const TSTR& searchstr, LIST& out)
+        {
+            return Run(CONNOP_SEARCHDIR, [&]() { return m_backend.Backend::SearchDirEx(searchstr, out); });
+        }
+        connresult  RemoveEx(const TSTR& filename)
+        {
+            return Run(CONNOP_REMOVE, [&]() { return m_backend.Backend::RemoveEx(filename); });
+        }
+        connresult  RenameEx(const TSTR& oldFilename, const TSTR& newFilename)
+        {
+            return Run(CONNOP_RENAME, [&]() { return m_backend.Backend::RenameEx(oldFilename, newFilename); });
+        }
+        connresult  ExistsEx(const TSTR& filename)
+        {
+            return Run(CONNOP_EXISTS, [&]() { return m_backend.Backend::ExistsEx(filename); });
+        }
+        connresult  GetFileSizeEx(const TSTR& filename)
+        {
+            return Run(CONNOP_GETFILESIZE, [&]() { return m_backend.Backend::GetFileSizeEx(filename); });
+        }
+        connresult  CommandEx(const TSTR& command)
+        {
+            return Run(CONNOP_COMMAND, [&]() { return m_backend.Backend::CommandEx(command); });
+        }
+
+        /// PATH VIEW METHODS ///
+        bool        ChangeDirView(TSTRVIEW dir)
+        {
+            return Run(CONNOP_CHANGEDIR, [&]() { return m_backend.Backend::ChangeDirView(dir); });
+        }
+        bool        MakeDirView(TSTRVIEW dir)
+        {
+            return Run(CONNOP_MAKEDIR, [&]() { return m_backend.Backend::MakeDirView(dir); });
+        }
+        bool        RemoveDirView(TSTRVIEW dir)
+        {
+            return Run(CONNOP_REMOVEDIR, [&]() { return m_backend.Backend::RemoveDirView(dir); });
+        }
+        TSTRVIEW    CurrentDirView(void)
+        {
+            return Run(CONNOP_CURRENTDIR, [&]() { return m_backend.Backend::CurrentDirView(); });
+        }
+        bool        RemoveView(TSTRVIEW filename)
+        {
+            return Run(CONNOP_REMOVE, [&]() { return m_backend.Backend::RemoveView(filename); });
+        }
+        bool        RenameView(TSTRVIEW oldFilename, TSTRVIEW newFilename)
+        {
+            return Run(CONNOP_RENAME, [&]() { return m_backend.Backend::RenameView(oldFilename, newFilename); });
+        }
+        bool        ExistsView(TSTRVIEW filename)
+        {
+            return Run(CONNOP_EXISTS, [&]() { return m_backend.Backend::ExistsView(filename); });
+        }
+        long long   GetFileSizeView(TSTRVIEW filename)
+        {
+            return Run(CONNOP_GETFILESIZE, [&]() { return m_backend.Backend::GetFileSizeView(filename); });
+        }
+
+    private:
+        basic_connstream(const basic_connstream&);
+        basic_connstream& operator=(const basic_connstream&);
+
+        /** @call between every policy's Begin and End for @op */
+        template<class F>
+        auto    Run(int op, F call) -> decltype(call())
+        {
+            connpolicies<Policies...>::Begin(*this, op);
+            decltype(call()) r = call();
+            connpolicies<Policies...>::End(*this, op, m_backend);
+            return r;
+        }
+
+        Backend     m_backend;
+};
+
+
+/// ADAPTER ///
+
+/** A basic_connstream behind the connstream interface */
+template<class Static>
+class connstream_adapter : public connstream
+{
+    public:
+        /** Static& Get(void) - The static stream, its policies' counters and its backend */
+        Static&     Get(void)                               { return m_static; }
+
+        bool        Connect(TSTR url, TSTR uid, TSTR pwd, int port)     { return m_static.Connect(std::move(url), std::move(uid), std::move(pwd), port); }
+        bool        Disconnect(void)                                    { return m_static.Disconnect(); }
+        bool        Upload(TSTR location, TSTR rename)                  { return m_static.Upload(std::move(location), std::move(rename)); }
+        bool        Download(TSTR location, TSTR rename)                { return m_static.Download(std::move(location), std::move(rename)); }
+        datastream  OpenRead(TSTR location, long long offset)           { return m_static.OpenRead(std::move(location), offset); }
+        datastream  OpenWrite(TSTR location, bool append)               { return m_static.OpenWrite(std::move(location), append); }
+        bool        ChangeDir(TSTR dir)                                 { return m_static.ChangeDir(std::move(dir)); }
+        bool        MakeDir(TSTR dir)                                   { return m_static.MakeDir(std::move(dir)); }
+        bool        RemoveDir(TSTR dir)                                 { return m_static.RemoveDir(std::move(dir)); }
+        TSTR        CurrentDir(void)                                    { return m_static.CurrentDir(); }
+        LIST        SearchDir(TSTR searchstr)                           { return m_static.SearchDir(std::move(searchstr)); }
+        bool        ListDir(TSTR dir, DirList& entries)                 { return m_static.ListDir(std::move(dir), entries); }
+        bool        Remove(TSTR filename)                               { return m_static.Remove(std::move(filename)); }
+        bool        Rename(TSTR oldFilename, TSTR newFilename)          { return m_static.Rename(std::move(oldFilename), std::move(newFilename)); }
+        bool        Exists(TSTR filename)                               { return m_static.Exists(std::move(filename)); }
+        long long   GetFileSize(TSTR filename)                          { return m_static.GetFileSize(std::move(filename)); }
+        long long   GetModTime(TSTR filename)                           { return m_static.GetModTime(std::move(filename)); }
+        bool        Command(TSTR command)                               { return m_static.Command(std::move(command)); }
+        int         GetLastError(void)                                  { return m_static.GetLastError(); }
+
+        connresult  ConnectEx(const TSTR& url, const TSTR& uid, const TSTR& pwd, int port) { return m_static.ConnectEx(url, uid, pwd, port); }
+        connresult  DisconnectEx(void)                                      { return m_static.DisconnectEx(); }
+        connresult  UploadEx(const TSTR& location, const TSTR& rename)      { return m_static.UploadEx(location, rename); }
+        connresult  DownloadEx(const TSTR& location, const TSTR& rename)    { return m_static.DownloadEx(location, rename); }
+        connresult  ChangeDirEx(const TSTR& dir)                            { return m_static.ChangeDirEx(dir); }
+        connresult  MakeDirEx(const TSTR& dir)                              { return m_static.MakeDirEx(dir); }
+        connresult  RemoveDirEx(const TSTR& dir)                            { return m_static.RemoveDirEx(dir); }
+        connresult  CurrentDirEx(TSTR& out)                                 { return m_static.CurrentDirEx(out); }
+        connresult  SearchDirEx(const TSTR& searchstr, LIST& out)           { return m_static.SearchDirEx(searchstr, out); }
+        connresult  RemoveEx(const TSTR& filename)                          { return m_static.RemoveEx(filename); }
+        connresult  RenameEx(const TSTR& oldFilename, const TSTR& newFilename) { return m_static.RenameEx(oldFilename, newFilename); }
+        connresult  ExistsEx(const TSTR& filename)                          { return m_static.ExistsEx(filename); }
+        connresult  GetFileSizeEx(const TSTR& filename)                     { return m_static.GetFileSizeEx(filename); }
+        connresult  CommandEx(const TSTR& command)                          { return m_static.CommandEx(command); }
+
+        bool        ChangeDirView(TSTRVIEW dir)                         { return m_static.ChangeDirView(dir); }
+        bool        MakeDirView(TSTRVIEW dir)                           { return m_static.MakeDirView(dir); }
+        bool        RemoveDirView(TSTRVIEW dir)                         { return m_static.RemoveDirView(dir); }
+        TSTRVIEW    CurrentDirView(void)                                { return m_static.CurrentDirView(); }
+        bool        RemoveView(TSTRVIEW filename)                       { return m_static.RemoveView(filename); }
+        bool        RenameView(TSTRVIEW oldFilename, TSTRVIEW newFilename) { return m_static.RenameView(oldFilename, newFilename); }
+        bool        ExistsView(TSTRVIEW filename)                       { return m_static.ExistsView(filename); }
+        long long   GetFileSizeView(TSTRVIEW filename)                  { return m_static.GetFileSizeView(filename); }
+
+    private:
+        Static      m_static;
+};
+
+#endif // _STATICCONN_H_
@@ -0,0 +1,401 @@
+#include <telemetry.h>
+
+#if defined(CONNSTREAM_TELEMETRY)
+
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#define TELEMETRY_HALF  (1 << (TELEMETRY_SUB_BITS - 1))
+
+static const char* g_opNames[TELEMETRY_OPS] =
+{
+    "connect", "disconnect", "upload", "download", "openread", "openwrite",
+    "changedir", "makedir", "removedir", "currentdir", "searchdir", "listdir",
+    "remove", "rename", "exists", "getfilesize", "getmodtime", "command"
+};
+
+/** One thread's histograms. Only that thread writes, so a count goes up
+ *  with a plain load and store and readers see whole values. */
+struct telemetry_shard
+{
+    std::atomic<unsigned long long> counts[TELEMETRY_OPS][TELEMETRY_BUCKETS];
+    std::atomic<unsigned long long> total[TELEMETRY_OPS];
+    std::atomic<unsigned long long> sum[TELEMETRY_OPS];     // Nanoseconds
+    std::atomic<unsigned long long> max[TELEMETRY_OPS];
+
+    telemetry_shard(void)   { Clear(); }
+    void Clear(void)
+    {
+        for(int op = 0; op < TELEMETRY_OPS; op++)
+        {
+            for(int i = 0; i < TELEMETRY_BUCKETS; i++)
+                counts[op][i].store(0, std::memory_order_relaxed);
+            total[op].store(0, std::memory_order_relaxed);
+            sum[op].store(0, std::memory_order_relaxed);
+            max[op].store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+/** Live shards and sessions, plus what exited threads left behind */
+struct telemetry_registry
+{
+    std::mutex                      lock;
+    std::set<telemetry_shard*>      shards;
+    std::set<telemetry_session*>    sessions;
+    telemetry_shard                 retired;
+    std::atomic<long long>          bytes;          // Every session ever, for the totals
+    std::atomic<long long>          transfers;
+    std::shared_ptr<TRACECALLBACK>  trace;          // Swapped whole, under lock
+    std::atomic<bool>               tracing;
+
+    telemetry_registry(void) : bytes(0), transfers(0), tracing(false) {}
+};
+
+static telemetry_registry& Registry(void)
+{
+    // Never destroyed, thread_local shards may hand back after static teardown
+    static telemetry_registry* r = new telemetry_registry;
+    return *r;
+}
+
+static void Bump(std::atomic<unsigned long long>& c, unsigned long long by)
+{
+    c.store(c.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+/** Owns the calling thread's shard, merged into the retired one at thread exit */
+class shardholder
+{
+    public:
+        shardholder(void)
+        {
+            telemetry_registry& r = Registry();
+            std::lock_guard<std::mutex> guard(r.lock);
+            r.shards.insert(&m_shard);
+        }
+        ~shardholder(void)
+        {
+            telemetry_registry& r = Registry();
+            std::lock_guard<std::mutex> guard(r.lock);
+            for(int op = 0; op < TELEMETRY_OPS; op++)
+            {
+                for(int i = 0; i < TELEMETRY_BUCKETS; i++)
+                    Bump(r.retired.counts[op][i], m_shard.counts[op][i].load(std::memory_order_relaxed));
+                Bump(r.retired.total[op], m_shard.total[op].load(std::memory_order_relaxed));
+                Bump(r.retired.sum[op], m_shard.sum[op].load(std::memory_order_relaxed));
+                unsigned long long mx = m_shard.max[op].load(std::memory_order_relaxed);
+                if(mx > r.retired.max[op].load(std::memory_order_relaxed))
+                    r.retired.max[op].store(mx, std::memory_order_relaxed);
+            }
+            r.shards.erase(&m_shard);
+        }
+
+        telemetry_shard m_shard;
+};
+
+static telemetry_shard& Shard(void)
+{
+    static thread_local shardholder holder;
+    return holder.m_shard;
+}
+
+/** Log-linear bucket of @v: itself below 2^SUB_BITS, then HALF per doubling */
+static int Bucket(unsigned long long v)
+{
+    if(v < (1ULL << TELEMETRY_SUB_BITS))
+        return (int)v;
+    int msb     = 63 - __builtin_clzll(v);
+    int shift   = msb - (TELEMETRY_SUB_BITS - 1);
+    int i       = (1 << TELEMETRY_SUB_BITS) + (shift - 1) * TELEMETRY_HALF
+                + (int)(v >> shift) - TELEMETRY_HALF;
+    return i < TELEMETRY_BUCKETS ? i : TELEMETRY_BUCKETS - 1;
+}
+
+/** Middle of the values bucket @i holds */
+static double Middle(int i)
+{
+    if(i < (1 << TELEMETRY_SUB_BITS))
+        return (double)i;
+    int k       = i - (1 << TELEMETRY_SUB_BITS);
+    int shift   = k / TELEMETRY_HALF + 1;
+    double low  = (double)((unsigned long long)(k % TELEMETRY_HALF + TELEMETRY_HALF) << shift);
+    return low + (double)(1ULL << shift) / 2;
+}
+
+void telemetry::Record(int op, long long nanos)
+{
+    if(op < 0 || op >= TELEMETRY_OPS)
+        return;
+    unsigned long long v = nanos > 0 ? (unsigned long long)nanos : 0;
+
+    telemetry_shard& s = Shard();
+    Bump(s.counts[op][Bucket(v)], 1);
+    Bump(s.total[op], 1);
+    Bump(s.sum[op], v);
+    if(v > s.max[op].load(std::memory_order_relaxed))
+        s.max[op].store(v, std::memory_order_relaxed);
+}
+
+telemetry_stats telemetry::Snapshot(int op)
+{
+    telemetry_stats st;
+    memset(&st, 0, sizeof(st));
+    if(op < 0 || op >= TELEMETRY_OPS)
+        return st;
+
+    std::vector<unsigned long long> counts(TELEMETRY_BUCKETS, 0);
+    unsigned long long sum = 0, mx = 0;
+    {
+        telemetry_registry& r = Registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+
+        std::vector<const telemetry_shard*> all(r.shards.begin(), r.shards.end());
+        all.push_back(&r.retired);
+        for(size_t s = 0; s < all.size(); s++)
+        {
+            for(int i = 0; i < TELEMETRY_BUCKETS; i++)
+                counts[i] += all[s]->counts[op][i].load(std::memory_order_relaxed);
+            sum += all[s]->sum[op].load(std::memory_order_relaxed);
+            unsigned long long m = all[s]->max[op].load(std::memory_order_relaxed);
+            mx = m > mx ? m : mx;
+        }
+    }
+
+    // Count from the buckets so the quantiles agree with each other even
+    // when a thread records while they're being read
+    for(int i = 0; i < TELEMETRY_BUCKETS; i++)
+        st.count += counts[i];
+    if(!st.count)
+        return st;
+
+    const double quantiles[4] = { 0.5, 0.9, 0.99, 0.999 };
+    double* out[4] = { &st.p50, &st.p90, &st.p99, &st.p999 };
+    unsigned long long seen = 0;
+    int q = 0;
+    for(int i = 0; i < TELEMETRY_BUCKETS && q < 4; i++)
+    {
+        seen += counts[i];
+        while(q < 4 && seen && (double)seen >= quantiles[q] * (double)st.count)
+        {
+            double v = Middle(i);
+            *out[q++] = (v < (double)mx ? v : (double)mx) / 1e9;
+        }
+    }
+
+    st.mean = (double)sum / (double)st.count / 1e9;
+    st.max  = (double)mx / 1e9;
+    return st;
+}
+
+void telemetry::Reset()
+{
+    telemetry_registry& r = Registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    for(std::set<telemetry_shard*>::iterator it = r.shards.begin(); it != r.shards.end(); ++it)
+        (*it)->Clear();
+    r.retired.Clear();
+}
+
+// Session names go out as label values, which quote '\', '"' and newlines
+static void Label(std::string& out, const TSTR& value)
+{
+    for(size_t i = 0; i < value.size(); i++)
+    {
+        char c = (char)value[i];
+        if(c == '\\' || c == '"')
+            out += '\\';
+        if(c == '\n')
+        {
+            out += "\\n";
+            continue;
+        }
+        out += c;
+    }
+}
+
+std::string telemetry::Prometheus()
+{
+    std::string out;
+    char line[256];
+
+    out += "# HELP connstream_call_seconds Latency of connstream calls by method.\n";
+    out += "# TYPE connstream_call_seconds summary\n";
+    for(int op = 0; op < TELEMETRY_OPS; op++)
+    {
+        telemetry_stats st = Snapshot(op);
+        if(!st.count)
+            continue;
+
+        const char* q[4] = { "0.5", "0.9", "0.99", "0.999" };
+        double v[4] = { st.p50, st.p90, st.p99, st.p999 };
+        for(int i = 0; i < 4; i++)
+        {
+            snprintf(line, sizeof(line), "connstream_call_seconds{op=\"%s\",quantile=\"%s\"} %.9g\n",
+                     g_opNames[op], q[i], v[i]);
+            out += line;
+        }
+        snprintf(line, sizeof(line), "connstream_call_seconds_sum{op=\"%s\"} %.9g\n",
+                 g_opNames[op], st.mean * (double)st.count);
+        out += line;
+        snprintf(line, sizeof(line), "connstream_call_seconds_count{op=\"%s\"} %llu\n", g_opNames[op], st.count);
+        out += line;
+    }
+
+    telemetry_registry& r = Registry();
+    out += "# HELP connstream_bytes_total Payload moved on data connections.\n";
+    out += "# TYPE connstream_bytes_total counter\n";
+    snprintf(line, sizeof(line), "connstream_bytes_total %lld\n", r.bytes.load());
+    out += line;
+    out += "# HELP connstream_transfers_total Data connections completed.\n";
+    out += "# TYPE connstream_transfers_total counter\n";
+    snprintf(line, sizeof(line), "connstream_transfers_total %lld\n", r.transfers.load());
+    out += line;
+
+    std::string inflight, bytes, rate;
+    {
+        std::lock_guard<std::mutex> guard(r.lock);
+        long long now = Now();
+        for(std::set<telemetry_session*>::iterator it = r.sessions.begin(); it != r.sessions.end(); ++it)
+        {
+            telemetry_session* s = *it;
+            if(s->m_name.empty())
+                continue;
+
+            std::string label = "{session=\"";
+            Label(label, s->m_name);
+            label += "\"} ";
+
+            long long busy  = s->m_busyNanos.load();
+            long long since = s->m_busySince.load();
+            if(s->m_inflight.load() > 0 && since)
+                busy += now - since;
+            long long moved = s->m_bytes.load();
+
+            snprintf(line, sizeof(line), "%d\n", s->m_inflight.load());
+            inflight += "connstream_session_inflight" + label + line;
+            snprintf(line, sizeof(line), "%lld\n", moved);
+            bytes += "connstream_session_bytes_total" + label + line;
+            snprintf(line, sizeof(line), "%.9g\n", busy > 0 ? (double)moved * 1e9 / (double)busy : 0.0);
+            rate += "connstream_session_bytes_per_second" + label + line;
+        }
+    }
+
+    out += "# HELP connstream_session_inflight Data connections open on the session.\n";
+    out += "# TYPE connstream_session_inflight gauge\n";
+    out += inflight;
+    out += "# HELP connstream_session_bytes_total Payload the session has moved.\n";
+    out += "# TYPE connstream_session_bytes_total counter\n";
+    out += bytes;
+    out += "# HELP connstream_session_bytes_per_second Payload over the time the session had data connections open.\n";
+    out += "# TYPE connstream_session_bytes_per_second gauge\n";
+    out += rate;
+    return out;
+}
+
+void telemetry::SetTrace(TRACECALLBACK callback)
+{
+    telemetry_registry& r = Registry();
+    std::shared_ptr<TRACECALLBACK> next;
+    if(callback)
+        next.reset(new TRACECALLBACK(callback));
+
+    std::lock_guard<std::mutex> guard(r.lock);
+    r.trace.swap(next);
+    r.tracing.store(r.trace != NULL);
+}
+
+bool telemetry::Tracing()
+{
+    return Registry().tracing.load(std::memory_order_relaxed);
+}
+
+void telemetry::Trace(int kind, int phase, const void* session, const char* name, int code)
+{
+    telemetry_registry& r = Registry();
+    std::shared_ptr<TRACECALLBACK> cb;
+    {
+        std::lock_guard<std::mutex> guard(r.lock);
+        cb = r.trace;
+    }
+    if(!cb)
+        return;
+
+    trace_event e;
+    e.kind      = kind;
+    e.phase     = phase;
+    e.session   = session;
+    e.name      = name;
+    e.code      = code;
+    e.nanos     = Now();
+    (*cb)(e);
+}
+
+const char* telemetry::OpName(int op)
+{
+    return op >= 0 && op < TELEMETRY_OPS ? g_opNames[op] : "unknown";
+}
+
+long long telemetry::Now()
+{
+    return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/// SESSIONS ///
+
+telemetry_session::telemetry_session()
+    : m_inflight(0), m_bytes(0), m_transfers(0), m_busyNanos(0), m_busySince(0)
+{
+    telemetry_registry& r = Registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    r.sessions.insert(this);
+}
+
+telemetry_session::~telemetry_session()
+{
+    telemetry_registry& r = Registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    r.sessions.erase(this);
+}
+
+void telemetry_session::Begin()
+{
+    if(m_inflight.fetch_add(1) == 0)
+        m_busySince.store(telemetry::Now());
+}
+
+void telemetry_session::End()
+{
+    if(m_inflight.load() <= 0)
+        return;
+    if(m_inflight.fetch_sub(1) == 1)
+    {
+        m_busyNanos.fetch_add(telemetry::Now() - m_busySince.load());
+        m_busySince.store(0);
+    }
+    m_transfers.fetch_add(1, std::memory_order_relaxed);
+    Registry().transfers.fetch_add(1, std::memory_order_relaxed);
+}
+
+void telemetry_session::Bytes(long long n)
+{
+    if(n <= 0)
+        return;
+    m_bytes.fetch_add(n, std::memory_order_relaxed);
+    Registry().bytes.fetch_add(n, std::memory_order_relaxed);
+}
+
+void telemetry_session::SetName(const TSTR& name)
+{
+    telemetry_registry& r = Registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    m_name = name;
+}
+
+#endif // CONNSTREAM_TELEMETRY
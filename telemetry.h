@@ -0,0 +1,231 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Telemetry
+  *
+  * Where a session spends its time. Every connstream call made through
+  * PosixFTP, LocalFS or InMemoryStream lands in a latency histogram for
+  * its method, PosixFTP sessions also count bytes, busy time and data
+  * connections in flight, and a trace callback sees each call, connect,
+  * control command and the first/last byte of every data connection.
+  *
+  * Histograms are log-linear the way HdrHistogram's are: exact below 32ns,
+  * then 16 buckets per power of two, so any value is known to within 3%
+  * from 32ns to over an hour. Each thread records into its own set, with no
+  * locks and no shared cache lines, and a snapshot adds them up.
+  *
+  * All of it is built only with CONNSTREAM_TELEMETRY defined. Without it
+  * the TELEMETRY_* macros expand to nothing and none of this exists.
+  *
+  * E.G. Usage:
+  *     telemetry::SetTrace([](const trace_event& e) { .... });
+  *     ....
+  *     fputs(telemetry::Prometheus().c_str(), out);
+  */
+
+#ifndef _TELEMETRY_H_
+#define _TELEMETRY_H_
+
+#if defined(CONNSTREAM_TELEMETRY)
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include "connstream.h"
+
+/* Methods a latency is recorded against */
+#define TELEMETRY_CONNECT       0
+#define TELEMETRY_DISCONNECT    1
+#define TELEMETRY_UPLOAD        2
+#define TELEMETRY_DOWNLOAD      3
+#define TELEMETRY_OPENREAD      4
+#define TELEMETRY_OPENWRITE     5
+#define TELEMETRY_CHANGEDIR     6
+#define TELEMETRY_MAKEDIR       7
+#define TELEMETRY_REMOVEDIR     8
+#define TELEMETRY_CURRENTDIR    9
+#define TELEMETRY_SEARCHDIR     10
+#define TELEMETRY_LISTDIR       11
+#define TELEMETRY_REMOVE        12
+#define TELEMETRY_RENAME        13
+#define TELEMETRY_EXISTS        14
+#define TELEMETRY_GETFILESIZE   15
+#define TELEMETRY_GETMODTIME    16
+#define TELEMETRY_COMMAND       17
+#define TELEMETRY_OPS           18
+
+#define TELEMETRY_SUB_BITS      5       // 2^5 exact values, then 2^4 buckets per doubling
+#define TELEMETRY_BUCKETS       640     // Reaches 2^42ns, longer calls land in the last bucket
+
+/* trace_event kinds */
+#define TRACE_CALL              1       // A connstream method, name is the method
+#define TRACE_CONNECT           2       // Connecting and logging in
+#define TRACE_COMMAND           3       // One control round trip, name is the verb
+#define TRACE_FIRST_BYTE        4       // Data connection ready to move its first byte
+#define TRACE_LAST_BYTE         5       // Data connection closed after its last byte
+
+/* trace_event phases */
+#define TRACE_BEGIN             1
+#define TRACE_END               2
+#define TRACE_MARK              3       // An instant, FIRST/LAST_BYTE
+
+struct trace_event
+{
+    int         kind;           // TRACE_*
+    int         phase;
+    const void* session;        // The connstream it happened on
+    const char* name;           // Only valid during the callback, NULL when there's nothing to name
+    int         code;           // At TRACE_END, the session's GetLastError() or the reply
+    long long   nanos;          // steady_clock, since its epoch
+};
+typedef std::function<void(const trace_event&)> TRACECALLBACK;
+
+struct telemetry_stats
+{
+    unsigned long long  count;
+    double              mean;   // Seconds, as are the rest
+    double              p50;
+    double              p90;
+    double              p99;
+    double              p999;
+    double              max;
+};
+
+class telemetry
+{
+    public:
+        /** void Record(int, long long)
+         *  Adds a call of @op taking @nanos to this thread's histogram.
+         */
+        static void     Record(int op, long long nanos);
+
+        /** telemetry_stats Snapshot(int)
+         *  Latency of @op summed over every thread that has recorded one,
+         *  including threads that have since exited.
+         */
+        static telemetry_stats  Snapshot(int op);
+
+        /** std::string Prometheus(void)
+         *  Every method with a call on record as a summary, every live
+         *  session's counters and the process totals, in the Prometheus text
+         *  exposition format.
+         */
+        static std::string      Prometheus(void);
+
+        /** void Reset(void) - Zeroes every histogram, sessions keep their counters */
+        static void     Reset(void);
+
+        /** void SetTrace(TRACECALLBACK)
+         *  Calls @callback for every trace_event, on the thread that caused it
+         *  and with no lock held. Empty to stop. Costs one relaxed load per
+         *  event while unset.
+         *  NB: With a callback set a download's data connection is polled
+         *      for its first byte before it is read.
+         */
+        static void     SetTrace(TRACECALLBACK callback);
+        static bool     Tracing(void);
+        static void     Trace(int kind, int phase, const void* session, const char* name, int code = 0);
+
+        static const char*  OpName(int op);
+        static long long    Now(void);
+};
+
+/** Counters one session keeps while it's alive, listed by Prometheus() */
+class telemetry_session
+{
+    public:
+        telemetry_session(void);
+        ~telemetry_session(void);
+
+        /** Begin/End bracket one data connection, Bytes counts its payload */
+        void    Begin(void);
+        void    End(void);
+        void    Bytes(long long n);
+        void    SetName(const TSTR& name);
+
+    private:
+        friend class telemetry;
+        telemetry_session(const telemetry_session&);
+        telemetry_session& operator=(const telemetry_session&);
+
+        TSTR                        m_name;         // Under the registry lock
+        std::atomic<int>            m_inflight;
+        std::atomic<long long>      m_bytes;
+        std::atomic<long long>      m_transfers;
+        std::atomic<long long>      m_busyNanos;    // Time with a data connection open
+        std::atomic<long long>      m_busySince;
+};
+
+/** Records the time from construction to scope end against @op */
+class telemetry_scope
+{
+    public:
+        telemetry_scope(int op, const void* session, const int* err)
+        {
+            m_op        = op;
+            m_session   = session;
+            m_err       = err;
+            m_start     = telemetry::Now();
+            if(telemetry::Tracing())
+                telemetry::Trace(TRACE_CALL, TRACE_BEGIN, m_session, telemetry::OpName(m_op));
+        }
+        ~telemetry_scope(void)
+        {
+            telemetry::Record(m_op, telemetry::Now() - m_start);
+            if(telemetry::Tracing())
+                telemetry::Trace(TRACE_CALL, TRACE_END, m_session, telemetry::OpName(m_op), *m_err);
+        }
+
+    private:
+        int         m_op;
+        const void* m_session;
+        const int*  m_err;
+        long long   m_start;
+};
+
+/** Traces @kind from construction to scope end, ending on *@err */
+class telemetry_span
+{
+    public:
+        telemetry_span(int kind, const void* session, const char* name, const int* err)
+        {
+            m_kind      = kind;
+            m_session   = session;
+            m_name      = name;
+            m_err       = err;
+            if(telemetry::Tracing())
+                telemetry::Trace(m_kind, TRACE_BEGIN, m_session, m_name);
+        }
+        ~telemetry_span(void)
+        {
+            if(telemetry::Tracing())
+                telemetry::Trace(m_kind, TRACE_END, m_session, m_name, *m_err);
+        }
+
+    private:
+        int         m_kind;
+        const void* m_session;
+        const char* m_name;
+        const int*  m_err;
+};
+
+/** Inside a backend method: times the call, which must keep its error in m_err */
+#define TELEMETRY_SCOPE(op)                 telemetry_scope _telemetry_scope(op, this, &m_err)
+#define TELEMETRY_SPAN(kind, name)          telemetry_span _telemetry_span(kind, this, name, &m_err)
+#define TELEMETRY_TRACE(kind, phase, ...)   do { if(telemetry::Tracing()) telemetry::Trace(kind, phase, this, __VA_ARGS__); } while(0)
+#define TELEMETRY_ONLY(...)                 __VA_ARGS__
+
+#else
+
+#define TELEMETRY_SCOPE(op)
+#define TELEMETRY_SPAN(kind, name)
+#define TELEMETRY_TRACE(kind, phase, ...)   do { } while(0)
+#define TELEMETRY_ONLY(...)
+
+#endif // CONNSTREAM_TELEMETRY
+
+#endif // _TELEMETRY_H_
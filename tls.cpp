@@ -0,0 +1,505 @@
+#include <tls.h>
+
+#if defined(CONNSTREAM_TLS)
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#define TLS_SESSION_CONTEXT "connstream"
+#define TLS_CERT_LIFETIME   86400       // Seconds a SelfSigned certificate is good for
+#define TLS_DRAIN_BUFSIZE   4096
+
+// OpenSSL 1.1.1 reports a missing close_notify as SSL_ERROR_SYSCALL instead
+#if !defined(SSL_R_UNEXPECTED_EOF_WHILE_READING)
+#define SSL_R_UNEXPECTED_EOF_WHILE_READING  -1
+#endif
+
+// OpenSSL writes with send(2)/write(2) and no MSG_NOSIGNAL, hold SIGPIPE on
+// this thread while it runs and swallow the one a vanished peer raises
+// rather than touching the process handler
+class sigpipeguard
+{
+    public:
+        sigpipeguard(void)
+        {
+            sigemptyset(&m_pipe);
+            sigaddset(&m_pipe, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &m_pipe, &m_old);
+        }
+        ~sigpipeguard(void)
+        {
+            if(sigismember(&m_old, SIGPIPE))
+                return;
+
+            int e = errno;
+            if(e == EPIPE)
+            {
+                struct timespec zero = { 0, 0 };
+                while(sigtimedwait(&m_pipe, NULL, &zero) < 0 && errno == EINTR)
+                    ;
+            }
+            pthread_sigmask(SIG_SETMASK, &m_old, NULL);
+            errno = e;
+        }
+
+    private:
+        sigset_t    m_pipe;
+        sigset_t    m_old;
+};
+
+// Handshakes and closes wait in poll so they can time out, a blocking
+// socket is switched over for as long as they run
+class nonblocking
+{
+    public:
+        nonblocking(int fd)
+        {
+            m_fd    = fd;
+            m_flags = fcntl(fd, F_GETFL);
+            if(m_flags >= 0 && !(m_flags & O_NONBLOCK))
+                fcntl(fd, F_SETFL, m_flags | O_NONBLOCK);
+            else
+                m_flags = -1;
+        }
+        ~nonblocking(void)
+        {
+            int e = errno;
+            if(m_flags >= 0)
+                fcntl(m_fd, F_SETFL, m_flags);
+            errno = e;
+        }
+
+    private:
+        int m_fd;
+        int m_flags;
+};
+
+
+/// CONTEXT ///
+
+tlscontext::tlscontext(SSL_CTX* ctx, bool server)
+{
+    m_ctx       = ctx;
+    m_server    = server;
+    m_ktls      = false;
+
+    // Partial writes let Send behave like send(2), and a retried write may
+    // come from a buffer that has been compacted or grown in between
+    SSL_CTX_set_min_proto_version(m_ctx, TLS_MIN_VERSION);
+    SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_options(m_ctx, SSL_OP_NO_RENEGOTIATION);
+    if(m_server)
+        SSL_CTX_set_session_id_context(m_ctx, (const unsigned char*)TLS_SESSION_CONTEXT,
+                                       sizeof(TLS_SESSION_CONTEXT) - 1);
+    SetKTLS(true);
+}
+
+tlscontext::~tlscontext()
+{
+    SSL_CTX_free(m_ctx);
+}
+
+std::shared_ptr<tlscontext> tlscontext::Client(bool verify, TSTR caFile)
+{
+    SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+    if(!ctx)
+        return std::shared_ptr<tlscontext>();
+    std::shared_ptr<tlscontext> c(new tlscontext(ctx, false));
+
+    if(verify)
+    {
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+        SSL_CTX_set_default_verify_paths(ctx);
+        if(!caFile.empty() && !SSL_CTX_load_verify_locations(ctx, caFile.c_str(), NULL))
+            return std::shared_ptr<tlscontext>();
+    }
+    return c;
+}
+
+std::shared_ptr<tlscontext> tlscontext::Server(TSTR certFile, TSTR keyFile)
+{
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if(!ctx)
+        return std::shared_ptr<tlscontext>();
+    std::shared_ptr<tlscontext> c(new tlscontext(ctx, true));
+
+    if(!SSL_CTX_use_certificate_chain_file(ctx, certFile.c_str())
+        || !SSL_CTX_use_PrivateKey_file(ctx, keyFile.c_str(), SSL_FILETYPE_PEM)
+        || !SSL_CTX_check_private_key(ctx))
+        return std::shared_ptr<tlscontext>();
+    return c;
+}
+
+std::shared_ptr<tlscontext> tlscontext::SelfSigned(TSTR commonName, std::string* certPem)
+{
+    std::shared_ptr<tlscontext> c;
+    EVP_PKEY* key = NULL;
+    X509* cert    = NULL;
+
+    EVP_PKEY_CTX* kc = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    bool ok = kc && EVP_PKEY_keygen_init(kc) > 0
+                 && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kc, NID_X9_62_prime256v1) > 0
+                 && EVP_PKEY_keygen(kc, &key) > 0;
+    EVP_PKEY_CTX_free(kc);
+
+    if(ok)
+        ok = (cert = X509_new()) != NULL;
+    if(ok)
+    {
+        unsigned int serial = 0;
+        RAND_bytes((unsigned char*)&serial, sizeof(serial));
+
+        X509_set_version(cert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), (long)(serial >> 1));
+        X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+        X509_gmtime_adj(X509_getm_notAfter(cert), TLS_CERT_LIFETIME);
+        X509_set_pubkey(cert, key);
+
+        X509_NAME* name = X509_get_subject_name(cert);
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_UTF8,
+                                   (const unsigned char*)commonName.c_str(), -1, -1, 0);
+        X509_set_issuer_name(cert, name);
+
+        // Clients check names against the SAN, the CN alone isn't enough
+        std::string san = "DNS:" + commonName + ",IP:127.0.0.1,IP:::1";
+        X509V3_CTX v3;
+        X509V3_set_ctx_nodb(&v3);
+        X509V3_set_ctx(&v3, cert, cert, NULL, NULL, 0);
+        X509_EXTENSION* ext = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name, san.c_str());
+        ok = ext && X509_add_ext(cert, ext, -1) && X509_sign(cert, key, EVP_sha256()) > 0;
+        X509_EXTENSION_free(ext);
+    }
+
+    SSL_CTX* ctx = ok ? SSL_CTX_new(TLS_server_method()) : NULL;
+    if(ctx)
+    {
+        c.reset(new tlscontext(ctx, true));
+        if(!SSL_CTX_use_certificate(ctx, cert) || !SSL_CTX_use_PrivateKey(ctx, key))
+            c.reset();
+    }
+
+    if(c && certPem)
+    {
+        BIO* out = BIO_new(BIO_s_mem());
+        char* pem;
+        long len;
+        if(out && PEM_write_bio_X509(out, cert) && (len = BIO_get_mem_data(out, &pem)) > 0)
+            certPem->assign(pem, (size_t)len);
+        else
+            c.reset();
+        BIO_free(out);
+    }
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return c;
+}
+
+bool tlscontext::Trust(const std::string& pem)
+{
+    BIO* in = BIO_new_mem_buf(pem.data(), (int)pem.size());
+    if(!in)
+        return false;
+
+    X509_STORE* store = SSL_CTX_get_cert_store(m_ctx);
+    int added = 0;
+    for(X509* cert; (cert = PEM_read_bio_X509(in, NULL, NULL, NULL)) != NULL; X509_free(cert))
+        if(X509_STORE_add_cert(store, cert))
+            added++;
+    BIO_free(in);
+
+    // Running out of certificates leaves a "no start line" behind
+    if(added)
+        ERR_clear_error();
+    return added > 0;
+}
+
+void tlscontext::SetKTLS(bool enable)
+{
+#if defined(SSL_OP_ENABLE_KTLS)
+    if(enable)
+        SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+    else
+        SSL_CTX_clear_options(m_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    m_ktls = enable;
+}
+
+bool tlscontext::GetKTLS()
+{
+    return m_ktls;
+}
+
+bool tlscontext::IsServer()
+{
+    return m_server;
+}
+
+SSL_CTX* tlscontext::GetHandle()
+{
+    return m_ctx;
+}
+
+std::string tlscontext::ErrorText()
+{
+    unsigned long e = ERR_peek_last_error();
+    if(!e)
+        return std::string();
+
+    char text[256];
+    ERR_error_string_n(e, text, sizeof(text));
+    ERR_clear_error();
+    return text;
+}
+
+
+/// LINK ///
+
+tlslink::tlslink()
+{
+    m_ssl   = NULL;
+    m_fd    = -1;
+}
+
+tlslink::~tlslink()
+{
+    Close(false, 0);
+}
+
+bool tlslink::Handshake(std::shared_ptr<tlscontext> ctx, int fd, int timeout,
+                        const tlslink* resume, const char* host)
+{
+    Close(false, 0);
+    if(!ctx || fd < 0)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    ERR_clear_error();
+    m_ssl = SSL_new(ctx->GetHandle());
+    if(!m_ssl || !SSL_set_fd(m_ssl, fd))
+    {
+        Close(false, 0);
+        errno = ENOMEM;
+        return false;
+    }
+    m_ctx   = ctx;
+    m_fd    = fd;
+
+    if(ctx->IsServer())
+        SSL_set_accept_state(m_ssl);
+    else
+    {
+        SSL_set_connect_state(m_ssl);
+
+        // SSL_get1_session hands over the newest session the other link
+        // has, under TLS 1.3 that's the last ticket it was sent
+        SSL_SESSION* session = resume && resume->m_ssl ? SSL_get1_session(resume->m_ssl) : NULL;
+        if(session)
+        {
+            SSL_set_session(m_ssl, session);
+            SSL_SESSION_free(session);
+        }
+
+        unsigned char addr[16];
+        if(host && *host)
+        {
+            if(inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1)
+                X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(m_ssl), host);
+            else
+            {
+                SSL_set_tlsext_host_name(m_ssl, host);
+                SSL_set1_host(m_ssl, host);
+            }
+        }
+    }
+
+    int err = 0;
+    {
+        sigpipeguard guard;
+        nonblocking nb(fd);
+        for(;;)
+        {
+            ERR_clear_error();
+            int r = SSL_do_handshake(m_ssl);
+            if(r == 1)
+                break;
+            if(!Wait(r, timeout))
+            {
+                err = errno;
+                break;
+            }
+        }
+    }
+
+    if(err)
+    {
+        if(!ctx->IsServer() && SSL_get_verify_result(m_ssl) != X509_V_OK)
+            err = EKEYREJECTED;
+        Close(false, 0);
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
+// Maps a failed SSL call onto errno the way the socket call would have
+ssize_t tlslink::Result(int r)
+{
+    if(r > 0)
+        return r;
+
+    int e = errno;
+    switch(SSL_get_error(m_ssl, r))
+    {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            break;
+        case SSL_ERROR_SYSCALL:
+            errno = e ? e : ECONNRESET;
+            break;
+        default:
+            // A peer gone without close_notify may have cut the data short
+            errno = ERR_GET_REASON(ERR_peek_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING
+                  ? ECONNRESET : EPROTO;
+            break;
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+bool tlslink::Wait(int r, int timeout)
+{
+    struct pollfd p;
+    p.fd        = m_fd;
+    p.revents   = 0;
+
+    int e = SSL_get_error(m_ssl, r);
+    if(e == SSL_ERROR_WANT_READ)
+        p.events = POLLIN;
+    else if(e == SSL_ERROR_WANT_WRITE)
+        p.events = POLLOUT;
+    else
+    {
+        if(Result(r) == 0)
+            errno = ECONNRESET;
+        return false;
+    }
+
+    int n;
+    do
+        n = poll(&p, 1, timeout);
+    while(n < 0 && errno == EINTR);
+
+    if(n == 0)
+        errno = ETIMEDOUT;
+    return n > 0;
+}
+
+ssize_t tlslink::Recv(void* buf, size_t len)
+{
+    ERR_clear_error();
+    return Result(SSL_read(m_ssl, buf, len > INT_MAX ? INT_MAX : (int)len));
+}
+
+ssize_t tlslink::Send(const void* buf, size_t len)
+{
+    sigpipeguard guard;
+    ERR_clear_error();
+    return Result(SSL_write(m_ssl, buf, len > INT_MAX ? INT_MAX : (int)len));
+}
+
+bool tlslink::Pending()
+{
+    return m_ssl && SSL_pending(m_ssl) > 0;
+}
+
+void tlslink::Close(bool notify, int timeout)
+{
+    if(!m_ssl)
+        return;
+
+    int e = errno;
+    if(notify)
+    {
+        sigpipeguard guard;
+        nonblocking nb(m_fd);
+
+        // 0 once ours is out, 1 when the peer's had already arrived
+        int r;
+        for(;;)
+        {
+            ERR_clear_error();
+            if((r = SSL_shutdown(m_ssl)) >= 0 || !Wait(r, timeout))
+                break;
+        }
+
+        char drain[TLS_DRAIN_BUFSIZE];
+        while(r == 0)
+        {
+            ERR_clear_error();
+            int n = SSL_read(m_ssl, drain, sizeof(drain));
+            if(n > 0)
+                continue;
+            if(SSL_get_error(m_ssl, n) == SSL_ERROR_ZERO_RETURN || !Wait(n, timeout))
+                break;
+        }
+        ERR_clear_error();
+    }
+
+    SSL_free(m_ssl);
+    m_ssl   = NULL;
+    m_fd    = -1;
+    m_ctx.reset();
+    errno   = e;
+}
+
+bool tlslink::Active() const
+{
+    return m_ssl != NULL;
+}
+
+int tlslink::GetHandle() const
+{
+    return m_fd;
+}
+
+bool tlslink::KernelSend()
+{
+#if defined(BIO_get_ktls_send)
+    return m_ssl && BIO_get_ktls_send(SSL_get_wbio(m_ssl));
+#else
+    return false;
+#endif
+}
+
+bool tlslink::KernelRecv()
+{
+#if defined(BIO_get_ktls_recv)
+    return m_ssl && BIO_get_ktls_recv(SSL_get_rbio(m_ssl));
+#else
+    return false;
+#endif
+}
+
+bool tlslink::Resumed()
+{
+    return m_ssl && SSL_session_reused(m_ssl);
+}
+
+#endif
@@ -0,0 +1,183 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** TLS
+  *
+  * Explicit FTPS (RFC 4217) on top of OpenSSL. A tlscontext holds the
+  * certificates and settings every connection of a session shares, a
+  * tlslink runs TLS over one connected socket with the same blocking
+  * and EAGAIN rules the socket itself has, so PosixFTP and FTPServer
+  * only swap send/recv for Send/Recv.
+  *
+  * Contexts ask OpenSSL to hand the symmetric keys to kernel TLS
+  * (SOL_TLS) once a handshake is done. Where the kernel takes them the
+  * socket encrypts and decrypts by itself and sendfile/splice carry on
+  * as they do in cleartext, KernelSend/KernelRecv say whether it did.
+  * It needs OpenSSL 3 built with KTLS and the kernel's "tls" module,
+  * without either every byte goes through SSL_write/SSL_read instead.
+  *
+  * Data connections resume the control connection's session, so each
+  * one costs an abbreviated handshake rather than a full key exchange.
+  *
+  * All of it is built only with CONNSTREAM_TLS defined, which needs
+  * OpenSSL 1.1.1 or later to link against.
+  *
+  * E.G. Usage:
+  *     std::string pem;
+  *     srv.SetTLS(tlscontext::SelfSigned(_T("localhost"), &pem));
+  *
+  *     std::shared_ptr<tlscontext> tls = tlscontext::Client();
+  *     tls->Trust(pem);
+  *     ftp.SetTLS(tls);
+  *     ftp.Connect("127.0.0.1", "", "", srv.GetPort());
+  */
+
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#if defined(CONNSTREAM_TLS)
+
+#if defined(_MSC_VER)
+#error tls.h is not supported by MSVC, WinInet negotiates TLS itself
+#endif
+
+#include <sys/types.h>
+#include <memory>
+#include <string>
+#include "connstream.h"
+
+#define TLS_MIN_VERSION     0x0303      // TLS 1.2, the oldest protocol either side accepts
+
+typedef struct ssl_ctx_st       SSL_CTX;
+typedef struct ssl_st           SSL;
+
+/** Data connections a session has secured since Connect */
+struct tls_stats
+{
+    unsigned long long  handshakes;
+    unsigned long long  resumed;        // Abbreviated, on the control connection's session
+    unsigned long long  kernelSend;     // Encrypting in the kernel
+    unsigned long long  kernelRecv;     // Decrypting in the kernel
+};
+
+class tlscontext
+{
+    public:
+        /** std::shared_ptr<tlscontext> Client(bool, TSTR)
+         *  Settings for the client end of a connection.
+         *      @verify : Check the server's certificate and name, against the
+         *                system's trust store and any Trust() adds
+         *      @caFile : PEM file of further certificates to trust
+         *  Returns : the context, NULL on failure (see ErrorText)
+         */
+        /** std::shared_ptr<tlscontext> Server(TSTR, TSTR)
+         *  Settings for the server end, @certFile a PEM chain leaf first and
+         *  @keyFile its private key.
+         */
+        /** std::shared_ptr<tlscontext> SelfSigned(TSTR, std::string*)
+         *  A server context with a fresh P-256 key and a self-signed
+         *  certificate for @commonName, 127.0.0.1 and ::1, good for a day.
+         *  The certificate goes to @certPem as PEM for a client to Trust.
+         */
+        static std::shared_ptr<tlscontext> Client(bool verify = true, TSTR caFile = _T(""));
+        static std::shared_ptr<tlscontext> Server(TSTR certFile, TSTR keyFile);
+        static std::shared_ptr<tlscontext> SelfSigned(TSTR commonName = _T("localhost"),
+                                                      std::string* certPem = NULL);
+
+        /** bool Trust(const std::string&) - Adds every certificate in @pem to those verified against */
+        bool        Trust(const std::string& pem);
+
+        /** void SetKTLS(bool)
+         *  Offers links made from here on to kernel TLS (the default), off
+         *  keeps every record in user space.
+         */
+        void        SetKTLS(bool enable);
+        bool        GetKTLS(void);
+        bool        IsServer(void);
+
+        SSL_CTX*    GetHandle(void);
+
+        /** std::string ErrorText(void) - This thread's latest OpenSSL error, blank for none */
+        static std::string  ErrorText(void);
+
+        ~tlscontext(void);
+
+    private:
+        tlscontext(SSL_CTX* ctx, bool server);
+        tlscontext(const tlscontext&);
+        tlscontext& operator=(const tlscontext&);
+
+        SSL_CTX*    m_ctx;
+        bool        m_server;
+        bool        m_ktls;
+};
+
+class tlslink
+{
+    public:
+        tlslink(void);
+        /** Frees the session without a close_notify, the socket is the caller's */
+        ~tlslink(void);
+
+        /** bool Handshake(std::shared_ptr<tlscontext>, int, int, const tlslink*, const char*)
+         *  Runs the handshake on connected socket @fd, blocking or not, for
+         *  up to @timeout ms. The socket is left as it was found.
+         *      @resume : Link whose session a client offers to resume
+         *      @host   : Name or address a verifying client checks the
+         *                certificate against, also sent as SNI when a name
+         *  Returns : @true once secured, @false with errno set, EKEYREJECTED
+         *            for a certificate that failed verification
+         */
+        bool        Handshake(std::shared_ptr<tlscontext> ctx, int fd, int timeout,
+                              const tlslink* resume = NULL, const char* host = NULL);
+
+        /** ssize_t Recv(void*, size_t) / ssize_t Send(const void*, size_t)
+         *  recv/send over the link: bytes moved, 0 at the peer's close_notify,
+         *  or -1 with errno, EAGAIN when a non-blocking socket has to wait.
+         *  A peer that closes without close_notify reads as ECONNRESET.
+         *  A Send that gave EAGAIN must be repeated with the same bytes.
+         */
+        ssize_t     Recv(void* buf, size_t len);
+        ssize_t     Send(const void* buf, size_t len);
+
+        /** bool Pending(void) - Decrypted bytes are waiting, don't poll before the next Recv */
+        bool        Pending(void);
+
+        /** void Close(bool, int)
+         *  Ends the link, the socket is left open. With @notify sends
+         *  close_notify and reads to the peer's for up to @timeout ms, so
+         *  nothing the peer sent late is left to turn the close into a reset.
+         */
+        void        Close(bool notify, int timeout);
+
+        bool        Active(void) const;
+        int         GetHandle(void) const;
+        bool        KernelSend(void);
+        bool        KernelRecv(void);
+        bool        Resumed(void);
+
+    private:
+        tlslink(const tlslink&);
+        tlslink& operator=(const tlslink&);
+
+        ssize_t     Result(int r);
+        bool        Wait(int r, int timeout);
+
+        std::shared_ptr<tlscontext> m_ctx;
+        SSL*        m_ssl;
+        int         m_fd;
+};
+
+/** Inside a class with TLS members, compiled away without CONNSTREAM_TLS */
+#define TLS_ONLY(...)       __VA_ARGS__
+
+#else
+
+#define TLS_ONLY(...)
+
+#endif // CONNSTREAM_TLS
+
+#endif // _TLS_H_
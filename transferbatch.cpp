@@ -0,0 +1,290 @@
+#include <transferbatch.h>
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#if !defined(_MSC_VER)
+#include <posixftp.h>
+#endif
+
+typedef std::chrono::steady_clock batchclock;
+
+struct LargestFirst
+{
+    const std::vector<transfer_job>* jobs;
+    bool operator()(size_t a, size_t b) const
+    {
+        // Unknown sizes go last, ties keep insertion order
+        long long sa = (*jobs)[a].size, sb = (*jobs)[b].size;
+        return sa != sb ? sa > sb : a < b;
+    }
+};
+
+TransferBatch::TransferBatch(connstream_pool& pool, TSTR host, TSTR user, TSTR pwd, int port)
+    : m_pool(pool)
+{
+    m_host  = host;
+    m_user  = user;
+    m_pwd   = pwd;
+    m_port  = port;
+    m_class = SCHED_BULK;
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+TransferBatch::~TransferBatch()
+{
+    for(size_t i = 0; i < m_queues.size(); i++)
+        delete m_queues[i];
+}
+
+void TransferBatch::Add(int direction, TSTR source, TSTR target, long long size)
+{
+    transfer_job job;
+    job.direction   = direction;
+    job.source      = source;
+    job.target      = target.empty() ? source : target;
+    job.size        = size;
+
+    struct stat st;
+    if(size == INVALID_FILE && direction == TRANSFER_UPLOAD && stat(source.c_str(), &st) == 0)
+        job.size = (long long)st.st_size;
+
+    m_jobs.push_back(job);
+}
+
+void TransferBatch::SetScheduler(std::shared_ptr<transferscheduler> sched, int cls)
+{
+    m_sched = sched;
+    m_class = cls;
+}
+
+void TransferBatch::Clear()
+{
+    m_jobs.clear();
+    m_results.clear();
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+size_t TransferBatch::Count() const
+{
+    return m_jobs.size();
+}
+
+const transfer_job& TransferBatch::Job(size_t i) const
+{
+    return m_jobs[i];
+}
+
+const transfer_result& TransferBatch::Result(size_t i) const
+{
+    return m_results[i];
+}
+
+transfer_batch_stats TransferBatch::GetStats() const
+{
+    return m_stats;
+}
+
+bool TransferBatch::Next(size_t self, size_t& job)
+{
+    workqueue* own = m_queues[self];
+    {
+        std::lock_guard<std::mutex> g(own->lock);
+        if(!own->jobs.empty())
+        {
+            job = own->jobs.front();
+            own->jobs.pop_front();
+            own->bytes -= std::max(m_jobs[job].size, 0LL);
+            return true;
+        }
+    }
+
+    // Steal the biggest job left on whichever queue still holds the most bytes
+    for(;;)
+    {
+        workqueue* victim = NULL;
+        long long most = -1;
+        for(size_t i = 0; i < m_queues.size(); i++)
+        {
+            if(i == self)
+                continue;
+            std::lock_guard<std::mutex> g(m_queues[i]->lock);
+            if(m_queues[i]->jobs.empty())
+                continue;
+            long long weight = m_queues[i]->bytes + (long long)m_queues[i]->jobs.size();
+            if(weight > most)
+            {
+                most    = weight;
+                victim  = m_queues[i];
+            }
+        }
+        if(!victim)
+            return false;
+
+        std::lock_guard<std::mutex> g(victim->lock);
+        if(victim->jobs.empty())
+            continue;
+        job = victim->jobs.front();
+        victim->jobs.pop_front();
+        victim->bytes -= std::max(m_jobs[job].size, 0LL);
+
+        std::lock_guard<std::mutex> s(m_statLock);
+        m_stats.steals++;
+        return true;
+    }
+}
+
+void TransferBatch::SizeDownloads()
+{
+#if !defined(_MSC_VER)
+    std::vector<size_t> unknown;
+    LIST names;
+    for(size_t i = 0; i < m_jobs.size(); i++)
+    {
+        if(m_jobs[i].direction == TRANSFER_DOWNLOAD && m_jobs[i].size == INVALID_FILE)
+        {
+            unknown.push_back(i);
+            names.push_back(m_jobs[i].source);
+        }
+    }
+    if(unknown.empty())
+        return;
+
+    // Only a scheduling hint, anything that fails here just stays unsized
+    connstream_lease lease = m_pool.Acquire(m_host, m_user, m_pwd, m_port);
+    PosixFTP* ftp = lease ? dynamic_cast<PosixFTP*>(lease.Get()) : NULL;
+    if(!ftp)
+        return;
+
+    std::vector<long long> sizes = ftp->GetFileSizes(names);
+    for(size_t i = 0; i < sizes.size(); i++)
+        m_jobs[unknown[i]].size = sizes[i];
+#endif
+}
+
+void TransferBatch::Worker(size_t self)
+{
+    connstream_lease lease;
+    size_t job;
+
+    while(Next(self, job))
+    {
+        transfer_result& r = m_results[job];
+        const transfer_job& j = m_jobs[job];
+
+        if(!lease)
+        {
+            lease = m_pool.Acquire(m_host, m_user, m_pwd, m_port);
+            if(!lease)
+            {
+                r.ok    = false;
+                r.err   = lease.GetLastError();
+                continue;
+            }
+        }
+
+#if !defined(_MSC_VER)
+        // The session goes back to the pool unscheduled, as it came
+        PosixFTP* paced = m_sched ? dynamic_cast<PosixFTP*>(lease.Get()) : NULL;
+        if(paced && paced->GetScheduler())
+            paced = NULL;
+        if(paced)
+            paced->SetScheduler(m_sched, m_class);
+#endif
+
+        r = j.direction == TRANSFER_UPLOAD ? lease->UploadEx(j.source, j.target)
+                                           : lease->DownloadEx(j.source, j.target);
+
+#if !defined(_MSC_VER)
+        if(paced)
+            paced->SetScheduler(NULL);
+#endif
+
+        if(r.ok)
+        {
+            if(!r.bytes)
+            {
+                struct stat st;
+                const TSTR& local = j.direction == TRANSFER_UPLOAD ? j.source : j.target;
+                r.bytes = stat(local.c_str(), &st) == 0 ? (long long)st.st_size : std::max(j.size, 0LL);
+            }
+        }
+        else if(!lease->Command(_T("NOOP")))
+        {
+            // The failure took the connection with it, start the next job fresh
+            lease.Discard();
+        }
+    }
+}
+
+bool TransferBatch::Run(int sessions)
+{
+    batchclock::time_point t0 = batchclock::now();
+
+    for(size_t i = 0; i < m_queues.size(); i++)
+        delete m_queues[i];
+    m_queues.clear();
+    memset(&m_stats, 0, sizeof(m_stats));
+
+    transfer_result blank;
+    blank.ok        = false;
+    blank.err       = 0;
+    blank.reply     = 0;
+    blank.bytes     = 0;
+    blank.seconds   = 0;
+    m_results.assign(m_jobs.size(), blank);
+
+    if(sessions < 1)
+        sessions = 1;
+    if((size_t)sessions > m_jobs.size())
+        sessions = (int)std::max<size_t>(m_jobs.size(), 1);
+
+    SizeDownloads();
+
+    // Largest first, dealt round robin so every queue starts with a fair share
+    std::vector<size_t> order(m_jobs.size());
+    for(size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    LargestFirst cmp;
+    cmp.jobs = &m_jobs;
+    std::sort(order.begin(), order.end(), cmp);
+
+    for(int i = 0; i < sessions; i++)
+    {
+        m_queues.push_back(new workqueue());
+        m_queues.back()->bytes = 0;
+    }
+    for(size_t i = 0; i < order.size(); i++)
+    {
+        workqueue* q = m_queues[i % sessions];
+        q->jobs.push_back(order[i]);
+        q->bytes += std::max(m_jobs[order[i]].size, 0LL);
+    }
+
+    std::vector<std::thread> workers;
+    for(int i = 0; i < sessions; i++)
+        workers.push_back(std::thread(&TransferBatch::Worker, this, (size_t)i));
+    for(size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    m_stats.jobs        = m_jobs.size();
+    m_stats.sessions    = sessions;
+    m_stats.seconds     = std::chrono::duration<double>(batchclock::now() - t0).count();
+    for(size_t i = 0; i < m_results.size(); i++)
+    {
+        if(!m_results[i].ok)
+            m_stats.failed++;
+        m_stats.bytes += m_results[i].bytes;
+    }
+    if(m_stats.seconds > 0)
+    {
+        m_stats.throughput  = (double)m_stats.bytes / m_stats.seconds;
+        m_stats.filesPerSec = (double)m_stats.jobs / m_stats.seconds;
+    }
+
+    return m_stats.failed == 0;
+}
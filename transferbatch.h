@@ -0,0 +1,132 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Transfer Batch
+  *
+  * Runs thousands of Upload/Download jobs across a set of pooled
+  * sessions instead of a serial loop. Jobs are ordered largest first
+  * and dealt round robin onto one queue per worker. A worker drains
+  * its own queue, and once empty steals the largest job left on the
+  * fullest queue, so one slow session never holds up the makespan.
+  * Downloads queued without a size are sized first with one pipelined
+  * SIZE batch when the backend is PosixFTP.
+  *
+  * Every job gets its own transfer_result, nothing is reported through
+  * a shared GetLastError.
+  *
+  * E.G. Usage:
+  *     TransferBatch batch(pool, _T("host"), _T("uid"), _T("pwd"));
+  *     for(...)
+  *         batch.Add(TRANSFER_UPLOAD, local, remote);
+  *     batch.Run(8);
+  *     for(size_t i = 0; i < batch.Count(); i++)
+  *         if(!batch.Result(i).ok) ....
+  */
+
+#ifndef _TRANSFERBATCH_H_
+#define _TRANSFERBATCH_H_
+
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "connpool.h"
+#include "scheduler.h"
+
+#define TRANSFER_UPLOAD     0
+#define TRANSFER_DOWNLOAD   1
+#define BATCH_SESSIONS      4
+
+struct transfer_job
+{
+    int         direction;      // TRANSFER_UPLOAD or TRANSFER_DOWNLOAD
+    TSTR        source;         // Client file for uploads, host file for downloads
+    TSTR        target;
+    long long   size;           // Scheduling hint, INVALID_FILE when unknown
+};
+
+/** A job's connresult from UploadEx/DownloadEx. Where the backend can't
+ *  say what it moved, bytes is the size of the file on the client. */
+typedef connresult transfer_result;
+
+struct transfer_batch_stats
+{
+    size_t      jobs;
+    size_t      failed;
+    long long   bytes;
+    double      seconds;        // Wall clock for the whole Run
+    double      throughput;     // Bytes per second over the run
+    double      filesPerSec;
+    size_t      steals;         // Jobs run by a worker other than the one dealt them
+    int         sessions;
+};
+
+class TransferBatch
+{
+    public:
+        TransferBatch(connstream_pool& pool,
+                      TSTR host,
+                      TSTR user = _T(""),
+                      TSTR pwd = _T(""),
+                      int port = 0);
+        virtual ~TransferBatch(void);
+
+        /** void Add(int, TSTR, TSTR, long long)
+         *  Queues a job.
+         *      @direction  : TRANSFER_UPLOAD or TRANSFER_DOWNLOAD
+         *      @source     : File to send (client side) or fetch (host side)
+         *      @target     : Name to save it as, blank for the source name
+         *      @size       : Size hint for scheduling, uploads are stat'ed when omitted
+         */
+        void    Add(int direction, TSTR source, TSTR target = _T(""), long long size = INVALID_FILE);
+        void    Clear(void);
+
+        /** void SetScheduler(std::shared_ptr<transferscheduler>, int)
+         *  Paces the jobs on @sched in class @cls (SCHED_BULK by default), so
+         *  interactive sessions on the same scheduler go first. Applies to
+         *  pooled PosixFTP sessions that aren't on a scheduler already, and
+         *  only for the batch's own jobs. NULL (the default) leaves them be.
+         */
+        void    SetScheduler(std::shared_ptr<transferscheduler> sched, int cls = SCHED_BULK);
+
+        /** bool Run(int)
+         *  Runs every queued job on up to @sessions pooled sessions.
+         *  Returns : @true if every job succeeded, see Result() for each one
+         */
+        bool    Run(int sessions = BATCH_SESSIONS);
+
+        size_t                  Count(void) const;
+        const transfer_job&     Job(size_t i) const;
+        const transfer_result&  Result(size_t i) const;
+        transfer_batch_stats    GetStats(void) const;
+
+    private:
+        struct workqueue
+        {
+            std::mutex          lock;
+            std::deque<size_t>  jobs;       // Indices, largest first
+            long long           bytes;      // Size hints still queued
+        };
+
+        void    SizeDownloads(void);
+        void    Worker(size_t self);
+        bool    Next(size_t self, size_t& job);
+
+        connstream_pool&                m_pool;
+        TSTR                            m_host;
+        TSTR                            m_user;
+        TSTR                            m_pwd;
+        int                             m_port;
+        std::shared_ptr<transferscheduler> m_sched;
+        int                             m_class;
+
+        std::vector<transfer_job>       m_jobs;
+        std::vector<transfer_result>    m_results;
+        std::vector<workqueue*>         m_queues;
+        std::mutex                      m_statLock;
+        transfer_batch_stats            m_stats;
+};
+
+#endif // _TRANSFERBATCH_H_
@@ -0,0 +1,631 @@
+#include <treesync.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#define SYNC_MANIFEST_MAGIC "connsync 1"
+
+typedef std::chrono::steady_clock syncclock;
+
+TreeSync::TreeSync(connstream_pool& pool, TSTR host, TSTR user, TSTR pwd, int port)
+    : m_pool(pool)
+{
+    m_host      = host;
+    m_user      = user;
+    m_pwd       = pwd;
+    m_port      = port;
+    m_dir       = TRANSFER_DOWNLOAD;
+    m_opts      = 0;
+    m_err       = 0;
+    m_listing   = 0;
+    m_partial   = false;
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+TreeSync::~TreeSync()
+{
+}
+
+void TreeSync::SetManifest(TSTR path)
+{
+    m_manifestPath = path;
+}
+
+size_t TreeSync::Count() const
+{
+    return m_actions.size();
+}
+
+const sync_action& TreeSync::Action(size_t i) const
+{
+    return m_actions[i];
+}
+
+sync_stats TreeSync::GetStats() const
+{
+    return m_stats;
+}
+
+int TreeSync::GetLastError() const
+{
+    return m_err;
+}
+
+TSTR TreeSync::Local(const TSTR& rel) const
+{
+    return rel.empty() ? m_localRoot : m_localRoot + _T("/") + rel;
+}
+
+TSTR TreeSync::Remote(const TSTR& rel) const
+{
+    if(rel.empty())
+        return m_remoteRoot;
+    return m_remoteRoot == _T("/") ? _T("/") + rel : m_remoteRoot + _T("/") + rel;
+}
+
+static TSTR Join(const TSTR& rel, const TSTR& name)
+{
+    return rel.empty() ? name : rel + _T("/") + name;
+}
+
+static bool EndsWith(const TSTR& s, const TSTR& tail)
+{
+    return s.size() >= tail.size() && !s.compare(s.size() - tail.size(), tail.size(), tail);
+}
+
+// mkdir -p for everything above @path
+static void MakeParents(const TSTR& path)
+{
+    for(size_t at = path.find('/', 1); at != TSTR::npos; at = path.find('/', at + 1))
+        mkdir(path.substr(0, at).c_str(), 0755);
+}
+
+
+/// MANIFEST ///
+
+bool TreeSync::LoadManifest(const TSTR& path)
+{
+    FILE* f = fopen(path.c_str(), "r");
+    if(!f)
+        return false;
+
+    // The header pins the manifest to one remote root
+    char line[8192];
+    char head[sizeof(line)];
+    snprintf(head, sizeof(head), "%s %s\n", SYNC_MANIFEST_MAGIC, m_remoteRoot.c_str());
+    if(!fgets(line, sizeof(line), f) || strcmp(line, head))
+    {
+        fclose(f);
+        return false;
+    }
+
+    while(fgets(line, sizeof(line), f))
+    {
+        syncentry e;
+        char type;
+        int used = 0;
+        if(sscanf(line, "%c %lld %lld %lld %n", &type, &e.size, &e.mtime, &e.local, &used) != 4 || !used)
+            continue;
+        size_t len = strlen(line + used);
+        if(!len || line[used + len - 1] != '\n')
+            continue;
+        e.type = type == 'd' ? DIRENT_DIR : DIRENT_FILE;
+        m_manifest[TSTR(line + used, len - 1)] = e;
+    }
+    fclose(f);
+    return true;
+}
+
+bool TreeSync::SaveManifest(const TSTR& path)
+{
+    // What failed this run is left out so the next one tries it again
+    std::map<TSTR, int> failed;
+    for(size_t i = 0; i < m_actions.size(); i++)
+        if(!m_actions[i].ok && (m_actions[i].kind == SYNC_COPY || m_actions[i].kind == SYNC_MKDIR))
+            failed[m_actions[i].path] = 1;
+
+    TSTR tmp = path + _T(".tmp");
+    FILE* f = fopen(tmp.c_str(), "w");
+    if(!f)
+        return false;
+
+    fprintf(f, "%s %s\n", SYNC_MANIFEST_MAGIC, m_remoteRoot.c_str());
+    for(syncmap::const_iterator it = m_local.begin(); it != m_local.end(); ++it)
+    {
+        if(failed.count(it->first) || it->first.find('\n') != TSTR::npos)
+            continue;
+
+        // The host time is only still known for files that weren't replaced
+        syncentry e = it->second;
+        syncmap::const_iterator r = m_remote.find(it->first);
+        e.mtime = r != m_remote.end() && r->second.size == e.size ? r->second.mtime : -1;
+        fprintf(f, "%c %lld %lld %lld %s\n", e.type == DIRENT_DIR ? 'd' : 'f',
+                e.size, e.mtime, e.local, it->first.c_str());
+    }
+
+    bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if(!ok || rename(tmp.c_str(), path.c_str()) < 0)
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+/// WALKING ///
+
+void TreeSync::WalkLocal(const TSTR& rel, syncmap& out)
+{
+    DIR* d = opendir(Local(rel).c_str());
+    if(!d)
+        return;
+
+    std::vector<TSTR> subdirs;
+    struct dirent* de;
+    while((de = readdir(d)) != NULL)
+    {
+        TSTR name = de->d_name;
+        if(name == _T(".") || name == _T("..") || EndsWith(name, SYNC_PART))
+            continue;
+        if(rel.empty() && (name == SYNC_MANIFEST || name == TSTR(SYNC_MANIFEST) + _T(".tmp")))
+            continue;
+
+        TSTR path = Join(rel, name);
+        struct stat st;
+        if(lstat(Local(path).c_str(), &st) < 0)
+            continue;
+
+        syncentry e;
+        e.size  = S_ISREG(st.st_mode) ? (long long)st.st_size : 0;
+        e.mtime = -1;
+        e.local = (long long)st.st_mtime;
+        if(S_ISDIR(st.st_mode))
+        {
+            e.type = DIRENT_DIR;
+            subdirs.push_back(path);
+        }
+        else if(S_ISREG(st.st_mode))
+            e.type = DIRENT_FILE;
+        else
+            continue;
+        out[path] = e;
+    }
+    closedir(d);
+
+    for(size_t i = 0; i < subdirs.size(); i++)
+        WalkLocal(subdirs[i], out);
+}
+
+bool TreeSync::ListRemote(connstream* c, const TSTR& rel, syncmap& out)
+{
+    TSTR dir = Remote(rel);
+
+    // One listing with sizes and times where the backend has it, probes
+    // by name where it doesn't (see connstream::ListDir)
+    DirList list;
+    if(!c->ListDir(dir, list))
+        return false;
+    for(DirList::const_iterator it = list.begin(); it != list.end(); ++it)
+    {
+        TSTR name(it->name, it->namelen);
+        if(name == _T(".") || name == _T("..") || name.find('/') != TSTR::npos
+            || (it->type != DIRENT_FILE && it->type != DIRENT_DIR))
+            continue;
+
+        syncentry e;
+        e.type  = it->type;
+        e.size  = it->type == DIRENT_FILE ? it->size : 0;
+        e.mtime = it->mtime;
+        e.local = -1;
+        out[Join(rel, name)] = e;
+    }
+    return true;
+}
+
+bool TreeSync::Changed(const TSTR& rel, const syncentry& src)
+{
+    bool sizeOnly = (m_opts & SYNC_SIZEONLY) != 0;
+
+    if(m_dir == TRANSFER_DOWNLOAD)
+    {
+        // Downloads are stamped with the host time, so equal means untouched
+        struct stat st;
+        if(stat(Local(rel).c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+            return true;
+        if((long long)st.st_size != src.size)
+            return true;
+        return !sizeOnly && src.mtime >= 0 && (long long)st.st_mtime != src.mtime;
+    }
+
+    syncmap::const_iterator r = m_remote.find(rel);
+    if(r == m_remote.end() || r->second.type != DIRENT_FILE || r->second.size != src.size)
+        return true;
+    if(sizeOnly)
+        return false;
+
+    // The manifest remembers which client version was sent last time
+    syncmap::const_iterator m = m_manifest.find(rel);
+    if(m != m_manifest.end() && m->second.size == src.size && m->second.local >= 0)
+        return m->second.local != src.local;
+    return r->second.mtime >= 0 && src.local > r->second.mtime;
+}
+
+void TreeSync::Diff(const syncmap& listed, syncfound& found)
+{
+    for(syncmap::const_iterator it = listed.begin(); it != listed.end(); ++it)
+    {
+        found.entries.insert(*it);
+        if(m_dir == TRANSFER_UPLOAD)
+        {
+            if(it->second.type == DIRENT_DIR)
+                found.dirs.push_back(it->first);
+            continue;
+        }
+
+        if(it->second.type == DIRENT_FILE)
+        {
+            if(Changed(it->first, it->second))
+                found.copies.push_back(it->first);
+            continue;
+        }
+
+        struct stat st;
+        if(stat(Local(it->first).c_str(), &st) < 0)
+            found.mkdirs.push_back(it->first);
+        found.dirs.push_back(it->first);
+    }
+}
+
+size_t TreeSync::Plan(int kind, const TSTR& rel, const syncentry* e)
+{
+    sync_action a;
+    a.kind  = kind;
+    a.path  = rel;
+    a.size  = e && e->type == DIRENT_FILE ? e->size : 0;
+    a.mtime = e ? e->mtime : -1;
+    a.ok    = false;
+    a.err   = 0;
+    m_actions.push_back(a);
+    return m_actions.size() - 1;
+}
+
+
+/// WORKERS ///
+
+void TreeSync::Worker()
+{
+    connstream_lease lease;
+    std::unique_lock<std::mutex> g(m_lock);
+    for(;;)
+    {
+        // Listings may still turn up work, so only quit once none are running
+        while(m_dirs.empty() && m_jobs.empty() && m_listing)
+            m_wake.wait(g);
+        if(m_dirs.empty() && m_jobs.empty())
+            break;
+
+        bool listing = !m_dirs.empty();
+        TSTR dir;
+        size_t job = 0;
+        if(listing)
+        {
+            dir = m_dirs.front();
+            m_dirs.pop_front();
+            m_listing++;
+        }
+        else
+        {
+            job = m_jobs.front();
+            m_jobs.pop_front();
+        }
+        sync_action a = listing ? sync_action() : m_actions[job];
+        g.unlock();
+
+        if(!listing)
+        {
+            RunAction(lease, a);
+            g.lock();
+            m_actions[job] = a;
+            if(a.ok && a.kind == SYNC_COPY)
+            {
+                m_stats.copied++;
+                m_stats.bytes += a.size;
+            }
+            else if(!a.ok)
+            {
+                m_stats.failed++;
+                m_err = a.err;
+            }
+            continue;
+        }
+
+        if(!lease)
+            lease = m_pool.Acquire(m_host, m_user, m_pwd, m_port);
+
+        syncmap listed;
+        syncfound found;
+        bool ok = lease && ListRemote(lease.Get(), dir, listed);
+        int err = !lease ? lease.GetLastError() : ok ? 0 : lease->GetLastError();
+        if(ok)
+            Diff(listed, found);
+        else if(lease && !lease->Command(_T("NOOP")))
+            lease.Discard();
+
+        g.lock();
+        m_listing--;
+        if(!ok)
+        {
+            m_partial = true;
+            m_stats.failed++;
+            m_err = err ? err : EIO;
+        }
+        else
+        {
+            m_stats.dirsListed++;
+            m_remote.insert(found.entries.begin(), found.entries.end());
+            m_dirs.insert(m_dirs.end(), found.dirs.begin(), found.dirs.end());
+            for(syncmap::const_iterator it = found.entries.begin(); it != found.entries.end(); ++it)
+                if(it->second.type == DIRENT_FILE && m_dir == TRANSFER_DOWNLOAD)
+                    m_stats.files++;
+
+            // Dry runs only collect the plan
+            bool run = !(m_opts & SYNC_DRYRUN);
+            for(size_t i = 0; i < found.mkdirs.size(); i++)
+            {
+                size_t n = Plan(SYNC_MKDIR, found.mkdirs[i], &found.entries[found.mkdirs[i]]);
+                if(run)
+                    m_jobs.push_back(n);
+            }
+            for(size_t i = 0; i < found.copies.size(); i++)
+            {
+                size_t n = Plan(SYNC_COPY, found.copies[i], &found.entries[found.copies[i]]);
+                if(run)
+                    m_jobs.push_back(n);
+            }
+        }
+        m_wake.notify_all();
+    }
+    m_wake.notify_all();
+}
+
+bool TreeSync::RunAction(connstream_lease& lease, sync_action& a)
+{
+    TSTR local = Local(a.path);
+    bool remote = m_dir == TRANSFER_UPLOAD || a.kind == SYNC_COPY;
+
+    if(remote && !lease)
+    {
+        lease = m_pool.Acquire(m_host, m_user, m_pwd, m_port);
+        if(!lease)
+        {
+            a.ok    = false;
+            a.err   = lease.GetLastError();
+            return false;
+        }
+    }
+
+    if(m_dir == TRANSFER_DOWNLOAD)
+    {
+        switch(a.kind)
+        {
+            case SYNC_COPY:
+            {
+                // Land it under a temporary name so a cut transfer never
+                // passes for a synced file, then stamp it with the host time
+                TSTR part = local + SYNC_PART;
+                MakeParents(local);
+                a.ok = lease->Download(Remote(a.path), part);
+                if(!a.ok)
+                {
+                    a.err = lease->GetLastError();
+                    unlink(part.c_str());
+                    if(!lease->Command(_T("NOOP")))
+                        lease.Discard();
+                    return false;
+                }
+                if(a.mtime >= 0)
+                {
+                    struct timespec ts[2];
+                    ts[0].tv_sec    = 0;
+                    ts[0].tv_nsec   = UTIME_OMIT;
+                    ts[1].tv_sec    = (time_t)a.mtime;
+                    ts[1].tv_nsec   = 0;
+                    utimensat(AT_FDCWD, part.c_str(), ts, 0);
+                }
+                a.ok = rename(part.c_str(), local.c_str()) == 0;
+                break;
+            }
+            case SYNC_MKDIR:
+                MakeParents(local);
+                a.ok = mkdir(local.c_str(), 0755) == 0 || errno == EEXIST;
+                break;
+            case SYNC_REMOVE:
+                a.ok = unlink(local.c_str()) == 0;
+                break;
+            case SYNC_RMDIR:
+                a.ok = rmdir(local.c_str()) == 0;
+                break;
+        }
+        a.err = a.ok ? 0 : errno;
+        return a.ok;
+    }
+
+    TSTR target = Remote(a.path);
+    switch(a.kind)
+    {
+        case SYNC_COPY:     a.ok = lease->Upload(local, target);    break;
+        case SYNC_MKDIR:    a.ok = lease->MakeDir(target);          break;
+        case SYNC_REMOVE:   a.ok = lease->Remove(target);           break;
+        case SYNC_RMDIR:    a.ok = lease->RemoveDir(target);        break;
+    }
+    a.err = a.ok ? 0 : lease->GetLastError();
+    if(!a.ok && !lease->Command(_T("NOOP")))
+        lease.Discard();
+    return a.ok;
+}
+
+void TreeSync::RunSerial(size_t from)
+{
+    connstream_lease lease;
+    for(size_t i = from; i < m_actions.size(); i++)
+    {
+        if(m_opts & SYNC_DRYRUN)
+            continue;
+        if(!RunAction(lease, m_actions[i]))
+        {
+            m_stats.failed++;
+            m_err = m_actions[i].err;
+        }
+        else if(m_actions[i].kind == SYNC_REMOVE || m_actions[i].kind == SYNC_RMDIR)
+            m_stats.removed++;
+    }
+}
+
+void TreeSync::Walk(int sessions)
+{
+    std::vector<std::thread> workers;
+    for(int i = 0; i < sessions; i++)
+        workers.push_back(std::thread(&TreeSync::Worker, this));
+    for(size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+void TreeSync::Deletions()
+{
+    const syncmap& source = m_dir == TRANSFER_DOWNLOAD ? m_remote : m_local;
+    const syncmap& target = m_dir == TRANSFER_DOWNLOAD ? m_local : m_remote;
+
+    // Files first, then directories deepest first, which is reverse path order
+    size_t from = m_actions.size();
+    std::vector<TSTR> dirs;
+    for(syncmap::const_iterator it = target.begin(); it != target.end(); ++it)
+    {
+        syncmap::const_iterator s = source.find(it->first);
+        if(s != source.end() && s->second.type == it->second.type)
+            continue;
+        if(it->second.type == DIRENT_DIR)
+            dirs.push_back(it->first);
+        else
+            Plan(SYNC_REMOVE, it->first, &it->second);
+    }
+    for(size_t i = dirs.size(); i-- > 0; )
+        Plan(SYNC_RMDIR, dirs[i], NULL);
+
+    RunSerial(from);
+}
+
+
+/// SYNC ///
+
+bool TreeSync::Sync(TSTR localRoot, TSTR remoteRoot, int direction, int options, int sessions)
+{
+    syncclock::time_point t0 = syncclock::now();
+
+    while(localRoot.size() > 1 && localRoot[localRoot.size() - 1] == '/')
+        localRoot.erase(localRoot.size() - 1);
+    while(remoteRoot.size() > 1 && remoteRoot[remoteRoot.size() - 1] == '/')
+        remoteRoot.erase(remoteRoot.size() - 1);
+
+    m_localRoot     = localRoot;
+    m_remoteRoot    = remoteRoot.empty() ? TSTR(_T("/")) : remoteRoot;
+    m_dir           = direction == TRANSFER_UPLOAD ? TRANSFER_UPLOAD : TRANSFER_DOWNLOAD;
+    m_opts          = options;
+    m_err           = 0;
+    m_partial       = false;
+    m_listing       = 0;
+    m_manifest.clear();
+    m_remote.clear();
+    m_local.clear();
+    m_actions.clear();
+    m_dirs.clear();
+    m_jobs.clear();
+    memset(&m_stats, 0, sizeof(m_stats));
+    if(sessions < 1)
+        sessions = 1;
+
+    struct stat st;
+    if(stat(m_localRoot.c_str(), &st) < 0)
+    {
+        if(m_dir == TRANSFER_UPLOAD || (!(options & SYNC_DRYRUN) && mkdir(m_localRoot.c_str(), 0755) < 0))
+        {
+            m_err = errno;
+            return false;
+        }
+    }
+    else if(!S_ISDIR(st.st_mode))
+    {
+        m_err = ENOTDIR;
+        return false;
+    }
+
+    TSTR manifest = m_manifestPath.empty() ? m_localRoot + _T("/") + SYNC_MANIFEST : m_manifestPath;
+    bool known = m_dir == TRANSFER_UPLOAD && !(options & SYNC_REWALK) && LoadManifest(manifest);
+
+    if(m_dir == TRANSFER_DOWNLOAD)
+    {
+        // Listings feed the transfer queue as they arrive
+        m_dirs.push_back(_T(""));
+        Walk(sessions);
+        if(options & SYNC_DELETE)
+            WalkLocal(_T(""), m_local);
+    }
+    else
+    {
+        WalkLocal(_T(""), m_local);
+        if(known)
+        {
+            m_remote = m_manifest;
+            m_stats.fromManifest = true;
+        }
+        else
+        {
+            m_dirs.push_back(_T(""));
+            Walk(sessions);
+        }
+
+        // Directories in path order so parents exist first, then the files in parallel
+        for(syncmap::const_iterator it = m_local.begin(); it != m_local.end(); ++it)
+        {
+            syncmap::const_iterator r = m_remote.find(it->first);
+            if(it->second.type == DIRENT_DIR && (r == m_remote.end() || r->second.type != DIRENT_DIR))
+                Plan(SYNC_MKDIR, it->first, &it->second);
+        }
+        RunSerial(0);
+
+        size_t from = m_actions.size();
+        for(syncmap::const_iterator it = m_local.begin(); it != m_local.end(); ++it)
+        {
+            if(it->second.type != DIRENT_FILE)
+                continue;
+            m_stats.files++;
+            if(Changed(it->first, it->second))
+                Plan(SYNC_COPY, it->first, &it->second);
+        }
+        if(!(options & SYNC_DRYRUN))
+        {
+            for(size_t i = from; i < m_actions.size(); i++)
+                m_jobs.push_back(i);
+            Walk(std::min<int>(sessions, (int)std::max<size_t>(m_jobs.size(), 1)));
+        }
+    }
+
+    if((options & SYNC_DELETE) && !m_partial)
+        Deletions();
+
+    if(m_dir == TRANSFER_UPLOAD && !(options & SYNC_DRYRUN) && !m_partial)
+        SaveManifest(manifest);
+
+    m_stats.seconds = std::chrono::duration<double>(syncclock::now() - t0).count();
+    return m_stats.failed == 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** Tree Sync
+  *
+  * Mirrors a remote tree into a local directory or the other way round
+  * across a set of pooled sessions. Workers list remote directories in
+  * parallel and every listing is diffed the moment it arrives, so
+  * downloads start while the rest of the tree is still being walked.
+  * Files are compared by size and modification time. Downloaded files
+  * get the remote time stamped on them, so the client tree is its own
+  * index and the next run compares equal without a second look.
+  *
+  * Uploads keep a manifest of what the last run left on the host next
+  * to the local tree and diff against it straight away, with no remote
+  * walk at all. Use SYNC_REWALK when something else changes the host.
+  *
+  * The host is walked with connstream::ListDir. PosixFTP, LocalFS and
+  * InMemoryStream list with full facts, other backends fall back to
+  * SearchDir plus GetFileSize and compare sizes only.
+  *
+  * E.G. Usage:
+  *     TreeSync sync(pool, _T("host"), _T("uid"), _T("pwd"));
+  *     sync.Sync(_T("/srv/mirror"), _T("/pub"), TRANSFER_DOWNLOAD, SYNC_DELETE);
+  *     for(size_t i = 0; i < sync.Count(); i++)
+  *         if(!sync.Action(i).ok) ....
+  */
+
+#ifndef _TREESYNC_H_
+#define _TREESYNC_H_
+
+#if defined(_MSC_VER)
+#error treesync.h walks the client tree with POSIX calls, it is not supported by MSVC
+#endif
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "dirlist.h"
+#include "transferbatch.h"
+
+/* Sync options */
+#define SYNC_DELETE         0x0001  // Remove what the source side no longer has
+#define SYNC_DRYRUN         0x0002  // Work out the actions without running them
+#define SYNC_SIZEONLY       0x0004  // Ignore modification times
+#define SYNC_REWALK         0x0008  // Ignore the manifest and walk the host
+
+/* sync_action kinds */
+#define SYNC_COPY           1
+#define SYNC_MKDIR          2
+#define SYNC_REMOVE         3
+#define SYNC_RMDIR          4
+
+#define SYNC_MANIFEST       _T(".connsync")         // Under the local root unless SetManifest says otherwise
+#define SYNC_PART           _T(".connsync-part")    // Suffix of a download in progress
+
+struct sync_action
+{
+    int         kind;           // SYNC_*
+    TSTR        path;           // Relative to both roots, '/' separated
+    long long   size;
+    long long   mtime;          // Host side modification time, -1 when unknown
+    bool        ok;             // Always @false on a dry run
+    int         err;
+};
+
+struct sync_stats
+{
+    size_t      dirsListed;
+    size_t      files;          // Source side files seen
+    size_t      copied;
+    size_t      removed;
+    size_t      failed;         // Actions and listings
+    long long   bytes;
+    double      seconds;
+    bool        fromManifest;   // The remote side came entirely from the manifest
+};
+
+class TreeSync
+{
+    public:
+        TreeSync(connstream_pool& pool,
+                 TSTR host,
+                 TSTR user = _T(""),
+                 TSTR pwd = _T(""),
+                 int port = 0);
+        virtual ~TreeSync(void);
+
+        /** bool Sync(TSTR, TSTR, int, int, int)
+         *  Makes the target side match the source side.
+         *      @localRoot  : Client directory, created when missing
+         *      @remoteRoot : Host directory, absolute
+         *      @direction  : TRANSFER_DOWNLOAD mirrors host into client,
+         *                    TRANSFER_UPLOAD client into host
+         *      @options    : SYNC_* flags
+         *      @sessions   : Pooled sessions to walk and transfer with
+         *  Returns : @true when every listing and action succeeded, see Action()
+         *
+         *  NB: Nothing is deleted when any listing failed, a partial view of
+         *      the source can't tell missing from unreadable.
+         */
+        bool    Sync(TSTR localRoot,
+                     TSTR remoteRoot,
+                     int direction = TRANSFER_DOWNLOAD,
+                     int options = 0,
+                     int sessions = BATCH_SESSIONS);
+
+        /** void SetManifest(TSTR)
+         *  Where the upload manifest is kept, blank for SYNC_MANIFEST under the local root.
+         */
+        void    SetManifest(TSTR path);
+
+        size_t              Count(void) const;
+        const sync_action&  Action(size_t i) const;
+        sync_stats          GetStats(void) const;
+        int                 GetLastError(void) const;
+
+    private:
+        struct syncentry
+        {
+            int         type;       // DIRENT_FILE or DIRENT_DIR
+            long long   size;
+            long long   mtime;      // Host side, -1 when unknown
+            long long   local;      // Client side mtime when last synced, -1 when unknown
+        };
+        typedef std::map<TSTR, syncentry> syncmap;
+
+        /** What one listing adds, worked out before taking m_lock */
+        struct syncfound
+        {
+            syncmap                 entries;
+            std::vector<TSTR>       dirs;       // To be listed
+            std::vector<TSTR>       copies;     // Changed files
+            std::vector<TSTR>       mkdirs;     // Directories missing on the client
+        };
+
+        bool    LoadManifest(const TSTR& path);
+        bool    SaveManifest(const TSTR& path);
+        void    WalkLocal(const TSTR& rel, syncmap& out);
+        bool    ListRemote(connstream* c, const TSTR& rel, syncmap& out);
+        void    Diff(const syncmap& listed, syncfound& found);
+        bool    Changed(const TSTR& rel, const syncentry& src);
+        size_t  Plan(int kind, const TSTR& rel, const syncentry* e);
+
+        void    Walk(int sessions);
+        void    Worker(void);
+        bool    RunAction(connstream_lease& lease, sync_action& a);
+        void    RunSerial(size_t from);
+        void    Deletions(void);
+        TSTR    Local(const TSTR& rel) const;
+        TSTR    Remote(const TSTR& rel) const;
+
+        connstream_pool&            m_pool;
+        TSTR                        m_host;
+        TSTR                        m_user;
+        TSTR                        m_pwd;
+        int                         m_port;
+        TSTR                        m_manifestPath;
+
+        TSTR                        m_localRoot;
+        TSTR                        m_remoteRoot;
+        int                         m_dir;
+        int                         m_opts;
+        int                         m_err;
+
+        syncmap                     m_manifest;     // What the last upload left on the host
+        syncmap                     m_remote;       // Host side as walked this run
+        syncmap                     m_local;        // Client side, walked for uploads and deletes
+        std::deque<sync_action>     m_actions;      // Deque so workers may hold references while it grows
+
+        std::mutex                  m_lock;
+        std::condition_variable     m_wake;
+        std::deque<TSTR>            m_dirs;         // Host directories waiting to be listed
+        std::deque<size_t>          m_jobs;         // m_actions waiting for a worker
+        int                         m_listing;      // Listings in progress
+        bool                        m_partial;      // A listing failed
+        sync_stats                  m_stats;
+};
+
+#endif // _TREESYNC_H_
@@ -0,0 +1,808 @@
+#include <uring.h>
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <chrono>
+
+#define URING_WAKE          1ULL    // user_data of the eventfd read
+#define URING_TICK          2ULL    // user_data of the timeout check
+#define URING_TICK_MS       250
+
+/* io_uring has no glibc wrappers, liburing is deliberately not a dependency */
+static int uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned op, const void* arg, unsigned n)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+typedef std::chrono::steady_clock uringclock;
+
+struct uringring
+{
+    int                     fd;
+    void*                   sqmap;
+    size_t                  sqlen;
+    void*                   cqmap;
+    size_t                  cqlen;
+    struct io_uring_sqe*    sqes;
+    size_t                  sqeslen;
+
+    unsigned*               sqHead;
+    unsigned*               sqTail;
+    unsigned*               sqArray;
+    unsigned                sqMask;
+    unsigned                sqEntries;
+    unsigned                sqLocal;        // Tail including SQEs not yet published
+    unsigned                pending;        // Published, not yet handed to io_uring_enter
+
+    unsigned*               cqHead;
+    unsigned*               cqTail;
+    unsigned                cqMask;
+    struct io_uring_cqe*    cqes;
+
+    uringring() : fd(-1), sqmap(MAP_FAILED), sqlen(0), cqmap(MAP_FAILED), cqlen(0),
+                  sqes((struct io_uring_sqe*)MAP_FAILED), sqeslen(0), pending(0) {}
+    ~uringring()
+    {
+        if(sqes != MAP_FAILED)
+            munmap(sqes, sqeslen);
+        if(cqmap != MAP_FAILED && cqmap != sqmap)
+            munmap(cqmap, cqlen);
+        if(sqmap != MAP_FAILED)
+            munmap(sqmap, sqlen);
+        if(fd >= 0)
+            close(fd);
+    }
+
+    bool Open(unsigned entries)
+    {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        fd = uring_setup(entries, &p);
+        if(fd < 0)
+            return false;
+
+        sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if(p.features & IORING_FEAT_SINGLE_MMAP)
+            sqlen = cqlen = sqlen > cqlen ? sqlen : cqlen;
+
+        sqmap = mmap(NULL, sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if(sqmap == MAP_FAILED)
+            return false;
+        if(p.features & IORING_FEAT_SINGLE_MMAP)
+            cqmap = sqmap;
+        else
+        {
+            cqmap = mmap(NULL, cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if(cqmap == MAP_FAILED)
+                return false;
+        }
+
+        sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*)mmap(NULL, sqeslen, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED)
+            return false;
+
+        char* sq    = (char*)sqmap;
+        char* cq    = (char*)cqmap;
+        sqHead      = (unsigned*)(sq + p.sq_off.head);
+        sqTail      = (unsigned*)(sq + p.sq_off.tail);
+        sqArray     = (unsigned*)(sq + p.sq_off.array);
+        sqMask      = *(unsigned*)(sq + p.sq_off.ring_mask);
+        sqEntries   = p.sq_entries;
+        sqLocal     = *sqTail;
+        cqHead      = (unsigned*)(cq + p.cq_off.head);
+        cqTail      = (unsigned*)(cq + p.cq_off.tail);
+        cqMask      = *(unsigned*)(cq + p.cq_off.ring_mask);
+        cqes        = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    struct io_uring_sqe* Get()
+    {
+        if(sqLocal - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+            return NULL;
+        unsigned idx = sqLocal & sqMask;
+        sqArray[idx] = idx;
+        sqLocal++;
+        memset(&sqes[idx], 0, sizeof(sqes[idx]));
+        return &sqes[idx];
+    }
+
+    void Publish()
+    {
+        pending += sqLocal - *sqTail;
+        __atomic_store_n(sqTail, sqLocal, __ATOMIC_RELEASE);
+    }
+};
+
+/** One buffer's worth of work, its address is the SQE user_data */
+struct uringop
+{
+    uringjob*   job;
+    int         kind;       // URING_READ, URING_SEND, URING_RECV or URING_WRITE
+    unsigned    buf;        // Registered buffer index
+    unsigned    skip;       // Bytes of the buffer already written (short writes)
+    long long   off;        // File offset
+    unsigned    len;
+};
+
+#define URING_READ          0
+#define URING_SEND          1
+#define URING_RECV          2
+#define URING_WRITE         3
+
+struct uringjob
+{
+    bool                    upload;
+    int                     file;
+    int                     sock;
+    int                     timeout;
+    checksum*               sum;
+
+    unsigned                group;
+    int                     fileFd;         // What SQEs name: the fixed slot or the raw descriptor
+    int                     sockFd;
+    std::vector<uringop>    ops;            // Upload: read/send pairs, download: one per buffer
+    std::vector<unsigned>   idle;           // Download buffers free for the next RECV
+
+    long long               start;
+    long long               end;            // Upload: size at the start
+    long long               pos;            // Next offset to read into or recv for
+    long long               done;           // Offset confirmed sent or written
+    unsigned                inflight;
+    bool                    receiving;
+    bool                    broken;         // A link chain was cut short
+    bool                    eof;
+    int                     err;
+    uringclock::time_point  last;
+    bool                    finished;
+};
+
+
+/// SETUP ///
+
+uringengine::uringengine()
+{
+    m_ring          = NULL;
+    m_mem           = NULL;
+    m_memlen        = 0;
+    m_chunk         = 0;
+    m_groups        = 0;
+    m_fixedBufs     = false;
+    m_fixedFiles    = false;
+    m_wakeVal       = 0;
+    m_tickArmed     = false;
+    m_wake          = -1;
+    m_stop          = false;
+    m_transfers     = 0;
+    m_bytes         = 0;
+    m_enters        = 0;
+    m_sqes          = 0;
+}
+
+uringengine::~uringengine()
+{
+    if(m_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            m_stop = true;
+        }
+        unsigned long long one = 1;
+        if(write(m_wake, &one, sizeof(one)) < 0)
+            {}
+        m_thread.join();
+    }
+
+    delete m_ring;
+    if(m_mem)
+        munmap(m_mem, m_memlen);
+    if(m_wake >= 0)
+        close(m_wake);
+}
+
+bool uringengine::Supported()
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = uring_setup(1, &p);
+    if(fd < 0)
+        return false;
+    close(fd);
+    return true;
+}
+
+std::shared_ptr<uringengine> uringengine::Create(unsigned buffers, unsigned chunk)
+{
+    std::shared_ptr<uringengine> e(new uringengine);
+    if(!e->Setup(buffers, chunk))
+        return std::shared_ptr<uringengine>();
+    return e;
+}
+
+bool uringengine::Setup(unsigned buffers, unsigned chunk)
+{
+    if(buffers < URING_DEPTH || !chunk)
+        return false;
+
+    m_ring = new uringring;
+    if(!m_ring->Open(URING_ENTRIES))
+        return false;
+
+    m_wake = eventfd(0, EFD_CLOEXEC);
+    if(m_wake < 0)
+        return false;
+
+    m_chunk     = chunk;
+    m_groups    = buffers / URING_DEPTH;
+    m_memlen    = (size_t)m_groups * URING_DEPTH * chunk;
+    m_mem       = (char*)mmap(NULL, m_memlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(m_mem == MAP_FAILED)
+    {
+        m_mem = NULL;
+        return false;
+    }
+
+    // Pinning can trip RLIMIT_MEMLOCK on older kernels, plain READ/WRITE still work
+    std::vector<struct iovec> iov(m_groups * URING_DEPTH);
+    for(size_t i = 0; i < iov.size(); i++)
+    {
+        iov[i].iov_base = m_mem + i * chunk;
+        iov[i].iov_len  = chunk;
+    }
+    m_fixedBufs = uring_register(m_ring->fd, IORING_REGISTER_BUFFERS, &iov[0], (unsigned)iov.size()) == 0;
+
+    // Two slots per set, filled in as transfers start
+    std::vector<int> slots(m_groups * 2, -1);
+    m_fixedFiles = uring_register(m_ring->fd, IORING_REGISTER_FILES, &slots[0], (unsigned)slots.size()) == 0;
+
+    for(unsigned g = m_groups; g > 0; g--)
+        m_freeGroups.push_back(g - 1);
+
+    m_thread = std::thread(&uringengine::Run, this);
+    return true;
+}
+
+
+/// CALLER SIDE ///
+
+int uringengine::SendFile(int fd, int sock, int timeout, long long* bytes, checksum* sum)
+{
+    uringjob job;
+    job.upload  = true;
+    job.file    = fd;
+    job.sock    = sock;
+    job.timeout = timeout;
+    job.sum     = sum;
+    int err = Transfer(job);
+    if(bytes)
+        *bytes = job.done - job.start;
+    return err;
+}
+
+int uringengine::RecvFile(int sock, int fd, int timeout, long long* bytes, checksum* sum)
+{
+    uringjob job;
+    job.upload  = false;
+    job.file    = fd;
+    job.sock    = sock;
+    job.timeout = timeout;
+    job.sum     = sum;
+    int err = Transfer(job);
+    if(bytes)
+        *bytes = job.done - job.start;
+    return err;
+}
+
+int uringengine::Transfer(uringjob& job)
+{
+    job.start = job.pos = job.done = lseek(job.file, 0, SEEK_CUR);
+    job.end         = -1;
+    job.inflight    = 0;
+    job.receiving   = false;
+    job.broken      = false;
+    job.eof         = false;
+    job.err         = 0;
+    job.finished    = false;
+    if(job.start < 0)
+        return errno;
+
+    if(job.upload)
+    {
+        struct stat st;
+        if(fstat(job.file, &st) < 0)
+            return errno;
+        job.end = (long long)st.st_size;
+    }
+
+    // A blocking socket lets io_uring park the operation on its own poll
+    // wait, O_NONBLOCK would hand every EAGAIN straight back to us
+    int flags = fcntl(job.sock, F_GETFL);
+    if(flags < 0)
+        return errno;
+    if(flags & O_NONBLOCK)
+        fcntl(job.sock, F_SETFL, flags & ~O_NONBLOCK);
+
+    {
+        std::unique_lock<std::mutex> g(m_lock);
+        if(m_stop || !m_thread.joinable())
+        {
+            g.unlock();
+            fcntl(job.sock, F_SETFL, flags);
+            return ENOSYS;
+        }
+        m_queue.push_back(&job);
+    }
+    unsigned long long one = 1;
+    if(write(m_wake, &one, sizeof(one)) < 0)
+        {}
+
+    {
+        std::unique_lock<std::mutex> g(m_lock);
+        m_done.wait(g, [&job]() { return job.finished; });
+    }
+
+    if(flags & O_NONBLOCK)
+        fcntl(job.sock, F_SETFL, flags);
+    lseek(job.file, (off_t)job.done, SEEK_SET);
+    return job.err;
+}
+
+bool uringengine::FixedBuffers()
+{
+    return m_fixedBufs;
+}
+
+bool uringengine::FixedFiles()
+{
+    return m_fixedFiles;
+}
+
+uring_stats uringengine::GetStats()
+{
+    uring_stats s;
+    s.transfers = m_transfers;
+    s.bytes     = m_bytes;
+    s.enters    = m_enters;
+    s.sqes      = m_sqes;
+    return s;
+}
+
+
+/// ENGINE THREAD ///
+
+void uringengine::Run()
+{
+    ArmWake();
+
+    for(;;)
+    {
+        {
+            std::lock_guard<std::mutex> g(m_lock);
+            if(m_stop)
+                break;
+        }
+        Admit();
+        if(!m_active.empty() && !m_tickArmed)
+            ArmTick();
+        if(!Enter(1))
+            break;
+
+        // Reap everything the kernel has posted
+        unsigned head = *m_ring->cqHead;
+        unsigned tail = __atomic_load_n(m_ring->cqTail, __ATOMIC_ACQUIRE);
+        while(head != tail)
+        {
+            struct io_uring_cqe* cqe = &m_ring->cqes[head & m_ring->cqMask];
+            unsigned long long tag  = cqe->user_data;
+            int res                 = cqe->res;
+            head++;
+            __atomic_store_n(m_ring->cqHead, head, __ATOMIC_RELEASE);
+
+            if(tag == URING_WAKE)
+                ArmWake();
+            else if(tag == URING_TICK)
+                m_tickArmed = false;
+            else
+                Complete((uringop*)(uintptr_t)tag, res);
+
+            if(head == tail)
+                tail = __atomic_load_n(m_ring->cqTail, __ATOMIC_ACQUIRE);
+        }
+        CheckTimeouts();
+    }
+
+    // Only reachable from the destructor, which no transfer can outlive,
+    // or when io_uring_enter itself fails
+    std::lock_guard<std::mutex> g(m_lock);
+    m_stop = true;
+    for(size_t i = 0; i < m_active.size(); i++)
+    {
+        m_active[i]->err = m_active[i]->err ? m_active[i]->err : EIO;
+        m_active[i]->finished = true;
+    }
+    for(size_t i = 0; i < m_waiting.size(); i++)
+    {
+        m_waiting[i]->err = ENOSYS;
+        m_waiting[i]->finished = true;
+    }
+    for(size_t i = 0; i < m_queue.size(); i++)
+    {
+        m_queue[i]->err = ENOSYS;
+        m_queue[i]->finished = true;
+    }
+    m_done.notify_all();
+}
+
+bool uringengine::Enter(unsigned wait)
+{
+    m_ring->Publish();
+    for(;;)
+    {
+        unsigned submit = m_ring->pending;
+        int n = uring_enter(m_ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+        m_enters++;
+        if(n >= 0)
+        {
+            m_ring->pending -= (unsigned)n < submit ? (unsigned)n : submit;
+            m_sqes += (unsigned)n;
+            return true;
+        }
+        if(errno == EINTR)
+            continue;
+        // A full completion queue pushes back on submissions until it is reaped
+        if(errno == EBUSY || errno == EAGAIN)
+            return true;
+        return false;
+    }
+}
+
+struct io_uring_sqe* uringengine::Sqe()
+{
+    struct io_uring_sqe* sqe = m_ring->Get();
+    if(!sqe)
+    {
+        Enter(0);
+        sqe = m_ring->Get();
+    }
+    return sqe;
+}
+
+void uringengine::ArmWake()
+{
+    struct io_uring_sqe* sqe = Sqe();
+    sqe->opcode     = IORING_OP_READ;
+    sqe->fd         = m_wake;
+    sqe->addr       = (unsigned long long)(uintptr_t)&m_wakeVal;
+    sqe->len        = sizeof(m_wakeVal);
+    sqe->off        = (unsigned long long)-1;
+    sqe->user_data  = URING_WAKE;
+}
+
+void uringengine::ArmTick()
+{
+    static struct __kernel_timespec tick = { 0, URING_TICK_MS * 1000000LL };
+    struct io_uring_sqe* sqe = Sqe();
+    sqe->opcode     = IORING_OP_TIMEOUT;
+    sqe->fd         = -1;
+    sqe->addr       = (unsigned long long)(uintptr_t)&tick;
+    sqe->len        = 1;
+    sqe->user_data  = URING_TICK;
+    m_tickArmed     = true;
+}
+
+void uringengine::Admit()
+{
+    {
+        std::lock_guard<std::mutex> g(m_lock);
+        m_waiting.insert(m_waiting.end(), m_queue.begin(), m_queue.end());
+        m_queue.clear();
+    }
+
+    while(!m_waiting.empty() && !m_freeGroups.empty())
+    {
+        uringjob* job = m_waiting.front();
+        m_waiting.pop_front();
+        if(Start(job))
+            Pump(job);
+    }
+}
+
+bool uringengine::Start(uringjob* job)
+{
+    job->group  = m_freeGroups.back();
+    m_freeGroups.pop_back();
+    job->fileFd = job->file;
+    job->sockFd = job->sock;
+    job->last   = uringclock::now();
+
+    if(m_fixedFiles)
+    {
+        int fds[2] = { job->file, job->sock };
+        struct io_uring_files_update up;
+        memset(&up, 0, sizeof(up));
+        up.offset   = job->group * 2;
+        up.fds      = (unsigned long long)(uintptr_t)fds;
+        if(uring_register(m_ring->fd, IORING_REGISTER_FILES_UPDATE, &up, 2) == 2)
+        {
+            job->fileFd = (int)up.offset;
+            job->sockFd = (int)up.offset + 1;
+        }
+    }
+
+    job->ops.resize(job->upload ? URING_DEPTH * 2 : URING_DEPTH);
+    for(unsigned i = 0; i < URING_DEPTH; i++)
+        job->idle.push_back(job->group * URING_DEPTH + i);
+
+    m_active.push_back(job);
+    return true;
+}
+
+void uringengine::Pump(uringjob* job)
+{
+    if(job->upload)
+        PumpUpload(job);
+    else
+        PumpDownload(job);
+}
+
+void uringengine::PumpUpload(uringjob* job)
+{
+    if(job->inflight)
+        return;
+    if(job->err || job->eof || job->done >= job->end)
+    {
+        Finish(job);
+        return;
+    }
+
+    // Restart from the last byte the socket took, a cut chain lost the rest
+    job->pos    = job->done;
+    job->broken = false;
+
+    long long left  = job->end - job->pos;
+    unsigned pairs  = (unsigned)((left + m_chunk - 1) / m_chunk);
+    if(pairs > URING_DEPTH)
+        pairs = URING_DEPTH;
+
+    // read(0) -> send(0) -> read(1) -> send(1) ... one chain, in order on the socket
+    unsigned char fixed = m_fixedFiles && job->fileFd != job->file ? IOSQE_FIXED_FILE : 0;
+    for(unsigned i = 0; i < pairs; i++)
+    {
+        unsigned buf    = job->group * URING_DEPTH + i;
+        unsigned len    = left < (long long)m_chunk ? (unsigned)left : m_chunk;
+        char* addr      = m_mem + (size_t)buf * m_chunk;
+
+        uringop* rd = &job->ops[i * 2];
+        rd->job     = job;
+        rd->kind    = URING_READ;
+        rd->buf     = buf;
+        rd->skip    = 0;
+        rd->off     = job->pos;
+        rd->len     = len;
+        uringop* sd = &job->ops[i * 2 + 1];
+        *sd         = *rd;
+        sd->kind    = URING_SEND;
+
+        struct io_uring_sqe* sqe = Sqe();
+        sqe->opcode     = m_fixedBufs ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->flags      = fixed | IOSQE_IO_LINK;
+        sqe->fd         = job->fileFd;
+        sqe->addr       = (unsigned long long)(uintptr_t)addr;
+        sqe->len        = len;
+        sqe->off        = (unsigned long long)job->pos;
+        sqe->buf_index  = (unsigned short)buf;
+        sqe->user_data  = (unsigned long long)(uintptr_t)rd;
+
+        sqe = Sqe();
+        sqe->opcode     = IORING_OP_SEND;
+        sqe->flags      = fixed | (i + 1 < pairs ? IOSQE_IO_LINK : 0);
+        sqe->fd         = job->sockFd;
+        sqe->addr       = (unsigned long long)(uintptr_t)addr;
+        sqe->len        = len;
+        sqe->msg_flags  = MSG_NOSIGNAL | MSG_WAITALL;
+        sqe->user_data  = (unsigned long long)(uintptr_t)sd;
+
+        job->inflight += 2;
+        job->pos += len;
+        left -= len;
+    }
+}
+
+void uringengine::PumpDownload(uringjob* job)
+{
+    // One RECV at a time keeps the stream in order, WRITEs overlap freely
+    if(!job->err && !job->eof && !job->receiving && !job->idle.empty())
+    {
+        unsigned buf = job->idle.back();
+        job->idle.pop_back();
+        Recv(job, buf);
+    }
+    if((job->err || job->eof) && !job->inflight)
+        Finish(job);
+}
+
+void uringengine::Recv(uringjob* job, int buf)
+{
+    uringop* op = &job->ops[buf - job->group * URING_DEPTH];
+    op->job     = job;
+    op->kind    = URING_RECV;
+    op->buf     = (unsigned)buf;
+    op->skip    = 0;
+    op->off     = job->pos;
+    op->len     = m_chunk;
+
+    struct io_uring_sqe* sqe = Sqe();
+    sqe->opcode     = IORING_OP_RECV;
+    sqe->flags      = m_fixedFiles && job->sockFd != job->sock ? IOSQE_FIXED_FILE : 0;
+    sqe->fd         = job->sockFd;
+    sqe->addr       = (unsigned long long)(uintptr_t)(m_mem + (size_t)buf * m_chunk);
+    sqe->len        = m_chunk;
+    sqe->msg_flags  = MSG_WAITALL;
+    sqe->user_data  = (unsigned long long)(uintptr_t)op;
+
+    job->receiving = true;
+    job->inflight++;
+}
+
+void uringengine::Write(uringop* op)
+{
+    uringjob* job = op->job;
+    struct io_uring_sqe* sqe = Sqe();
+    sqe->opcode     = m_fixedBufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->flags      = m_fixedFiles && job->fileFd != job->file ? IOSQE_FIXED_FILE : 0;
+    sqe->fd         = job->fileFd;
+    sqe->addr       = (unsigned long long)(uintptr_t)(m_mem + (size_t)op->buf * m_chunk + op->skip);
+    sqe->len        = op->len;
+    sqe->off        = (unsigned long long)op->off;
+    sqe->buf_index  = (unsigned short)op->buf;
+    sqe->user_data  = (unsigned long long)(uintptr_t)op;
+    job->inflight++;
+}
+
+void uringengine::Complete(uringop* op, int res)
+{
+    uringjob* job = op->job;
+    job->inflight--;
+
+    switch(op->kind)
+    {
+        case URING_READ:
+            if(res < 0 && res != -ECANCELED && !job->err)
+                job->err = -res;
+            else if(res == 0)
+                job->eof = true;        // Shrank under us, send what was there
+            else if(res != (int)op->len)
+                job->broken = true;
+            break;
+
+        case URING_SEND:
+            // Sends land in file order, each from the start of its buffer
+            if(res > 0 && job->sum)
+                job->sum->Update(m_mem + (size_t)op->buf * m_chunk, (size_t)res);
+            if(res == (int)op->len)
+            {
+                job->done += res;
+                job->last = uringclock::now();
+                m_bytes += (unsigned long long)res;
+            }
+            else if(res >= 0)
+            {
+                job->done += res;
+                job->broken = true;
+                m_bytes += (unsigned long long)res;
+            }
+            else if(res != -ECANCELED && !job->err)
+                job->err = -res;
+            break;
+
+        case URING_RECV:
+            job->receiving = false;
+            if(res > 0)
+            {
+                if(job->sum)
+                    job->sum->Update(m_mem + (size_t)op->buf * m_chunk, (size_t)res);
+                op->kind    = URING_WRITE;
+                op->len     = (unsigned)res;
+                job->pos   += res;
+                job->last   = uringclock::now();
+                Write(op);
+                break;
+            }
+            job->idle.push_back(op->buf);
+            if(res == 0)
+                job->eof = true;
+            else if(res != -EINTR && res != -EAGAIN && !job->err)
+                job->err = -res;
+            break;
+
+        case URING_WRITE:
+            if(res > 0 && res < (int)op->len)
+            {
+                op->skip   += (unsigned)res;
+                op->off    += res;
+                op->len    -= (unsigned)res;
+                job->done  += res;
+                m_bytes    += (unsigned long long)res;
+                Write(op);
+                break;
+            }
+            job->idle.push_back(op->buf);
+            if(res == (int)op->len)
+            {
+                job->done += res;
+                m_bytes += (unsigned long long)res;
+            }
+            else if(!job->err)
+                job->err = res < 0 ? -res : EIO;
+            break;
+    }
+
+    Pump(job);
+}
+
+void uringengine::Finish(uringjob* job)
+{
+    for(size_t i = 0; i < m_active.size(); i++)
+    {
+        if(m_active[i] == job)
+        {
+            m_active[i] = m_active.back();
+            m_active.pop_back();
+            break;
+        }
+    }
+
+    if(job->fileFd != job->file)
+    {
+        int fds[2] = { -1, -1 };
+        struct io_uring_files_update up;
+        memset(&up, 0, sizeof(up));
+        up.offset   = job->group * 2;
+        up.fds      = (unsigned long long)(uintptr_t)fds;
+        uring_register(m_ring->fd, IORING_REGISTER_FILES_UPDATE, &up, 2);
+    }
+    m_freeGroups.push_back(job->group);
+    m_transfers++;
+
+    std::lock_guard<std::mutex> g(m_lock);
+    job->finished = true;
+    m_done.notify_all();
+}
+
+void uringengine::CheckTimeouts()
+{
+    uringclock::time_point now = uringclock::now();
+    for(size_t i = 0; i < m_active.size(); i++)
+    {
+        uringjob* job = m_active[i];
+        if(job->timeout < 0 || job->err
+            || now - job->last < std::chrono::milliseconds(job->timeout))
+            continue;
+
+        // Shutting the socket down completes whatever is parked on it
+        job->err = ETIMEDOUT;
+        shutdown(job->sock, SHUT_RDWR);
+    }
+}
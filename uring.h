@@ -0,0 +1,151 @@
+/*
+ * Author   : Mark Zammit
+ * Contact  : iimarco@me.com
+ * Version  : 1.13.11.21
+ */
+
+ /** io_uring Engine
+  *
+  * Moves whole files between disk and data sockets through one io_uring
+  * instance run by its own thread. Uploads go out as linked READ_FIXED ->
+  * SEND chains, downloads as a RECV feeding WRITE_FIXEDs, all through
+  * registered buffers and fixed file slots. Many sessions can share one
+  * engine, and its single thread keeps dozens of transfers busy at a
+  * handful of syscalls per megabyte. Callers block in SendFile/RecvFile
+  * the same way they would on the sendfile/splice paths.
+  *
+  * The ring is set up with the raw syscalls, no liburing needed. Create
+  * returns NULL when the kernel lacks io_uring or has it disabled, so the
+  * caller keeps its epoll/blocking path. Registered buffers and fixed
+  * files are used when the kernel allows them, plain buffers otherwise.
+  *
+  * Each transfer takes URING_DEPTH of the registered buffers, transfers
+  * past URING_BUFFERS / URING_DEPTH at once wait for a free set.
+  *
+  * E.G. Usage:
+  *     std::shared_ptr<uringengine> io = uringengine::Create();
+  *     if(io)
+  *         ftp.SetEngine(io);
+  *     ftp.Download(_T("/pub/big.iso"), _T("big.iso"));
+  */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#if defined(_MSC_VER)
+#error uring.h needs Linux io_uring, it is not supported by MSVC
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "checksum.h"
+
+#define URING_ENTRIES       256             // Submission queue entries
+#define URING_CHUNK         (128 << 10)     // Bytes per registered buffer
+#define URING_BUFFERS       128             // Registered buffers shared by every transfer
+#define URING_DEPTH         4               // Buffers each transfer keeps in flight
+
+struct uring_stats
+{
+    unsigned long long  transfers;
+    unsigned long long  bytes;
+    unsigned long long  enters;     // io_uring_enter calls
+    unsigned long long  sqes;       // Operations submitted
+};
+
+struct uringring;
+struct uringjob;
+struct uringop;
+
+class uringengine
+{
+    public:
+        /** std::shared_ptr<uringengine> Create(unsigned, unsigned)
+         *  Sets up a ring with @buffers registered buffers of @chunk bytes
+         *  and starts its thread.
+         *  Returns : the engine, NULL when io_uring is unavailable
+         */
+        static std::shared_ptr<uringengine> Create(unsigned buffers = URING_BUFFERS,
+                                                   unsigned chunk = URING_CHUNK);
+        /** bool Supported(void) - Whether this kernel will set up a ring at all */
+        static bool Supported(void);
+
+        /** Stops the thread, only once no transfer is running */
+        virtual ~uringengine(void);
+
+        /** int SendFile(int, int, int, long long*, checksum*)
+         *  Sends @fd from its current offset to its end over socket @sock.
+         *      @timeout : Milliseconds without progress before giving up, -1 for never
+         *      @bytes   : Optional, receives the count moved even on failure
+         *      @sum     : Optional, fed every byte moved, in order
+         *  Returns : 0, or the errno that stopped the transfer
+         */
+        /** int RecvFile(int, int, int, long long*, checksum*)
+         *  Writes @sock into @fd from its current offset until the peer closes.
+         *  Both leave the file offset after the last byte moved.
+         */
+        int     SendFile(int fd, int sock, int timeout = -1, long long* bytes = NULL, checksum* sum = NULL);
+        int     RecvFile(int sock, int fd, int timeout = -1, long long* bytes = NULL, checksum* sum = NULL);
+
+        bool        FixedBuffers(void);
+        bool        FixedFiles(void);
+        uring_stats GetStats(void);
+
+    private:
+        uringengine(void);
+        uringengine(const uringengine&);
+        uringengine& operator=(const uringengine&);
+
+        bool    Setup(unsigned buffers, unsigned chunk);
+        int     Transfer(uringjob& job);
+
+        /// ENGINE THREAD ///
+        void    Run(void);
+        bool    Enter(unsigned wait);
+        struct io_uring_sqe* Sqe(void);
+        void    ArmWake(void);
+        void    ArmTick(void);
+        void    Admit(void);
+        bool    Start(uringjob* job);
+        void    Pump(uringjob* job);
+        void    PumpUpload(uringjob* job);
+        void    PumpDownload(uringjob* job);
+        void    Complete(uringop* op, int res);
+        void    Finish(uringjob* job);
+        void    CheckTimeouts(void);
+        void    Recv(uringjob* job, int buf);
+        void    Write(uringop* op);
+
+        uringring*              m_ring;
+        char*                   m_mem;
+        size_t                  m_memlen;
+        unsigned                m_chunk;
+        unsigned                m_groups;       // Sets of URING_DEPTH buffers
+        bool                    m_fixedBufs;
+        bool                    m_fixedFiles;
+        std::vector<unsigned>   m_freeGroups;
+
+        std::deque<uringjob*>   m_waiting;      // Admitted, waiting for a free set
+        std::vector<uringjob*>  m_active;
+        unsigned long long      m_wakeVal;
+        bool                    m_tickArmed;
+
+        std::mutex              m_lock;
+        std::condition_variable m_done;
+        std::deque<uringjob*>   m_queue;        // Submitted by callers, not yet seen
+        int                     m_wake;
+        bool                    m_stop;
+        std::thread             m_thread;
+
+        std::atomic<unsigned long long> m_transfers;
+        std::atomic<unsigned long long> m_bytes;
+        std::atomic<unsigned long long> m_enters;
+        std::atomic<unsigned long long> m_sqes;
+};
+
+#endif // _URING_H_